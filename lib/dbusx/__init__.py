@@ -12,3 +12,5 @@ from dbusx.proxy import Proxy, MethodStub, SignalStub
 from dbusx.object import Object, Method, Signal
 from dbusx.message import Message
 from dbusx.connection import Connection
+from dbusx.server import Server
+from dbusx.broadcast import Broadcaster
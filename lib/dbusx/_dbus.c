@@ -14,6 +14,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
 
 #include <dbus/dbus.h>
 
@@ -174,6 +179,9 @@ error:
 #ifndef DBUS_ERROR_INCONSISTENT_MESSAGE
 #  define DBUS_ERROR_INCONSISTENT_MESSAGE "org.freedesktop.DBus.Error.InconsistentMessage"
 #endif
+#ifndef DBUS_INTERFACE_MONITORING
+#  define DBUS_INTERFACE_MONITORING "org.freedesktop.DBus.Monitoring"
+#endif
 
 
 /************************************************************************
@@ -456,6 +464,8 @@ typedef struct
     DBusWatch *watch;
     PyObject *reader;
     PyObject *writer;
+    void (*written)(void *owner);  /* called after the watch was writable */
+    void *owner;
 } WatchObject;
 
 static PyTypeObject WatchType =
@@ -500,8 +510,7 @@ watch_clear(WatchObject *self)
 static void
 watch_dealloc(WatchObject *self)
 {
-    if (self->reader != NULL)
-        watch_clear(self);
+    watch_clear(self);
     Py_TYPE(self)->tp_free(self);
 }
 
@@ -521,6 +530,8 @@ watch_handle(WatchObject *self, PyObject *args)
 
     if (dbus_watch_handle(self->watch, flags) == FALSE)
         RAISE_MEMORY_ERROR();
+    if ((flags & DBUS_WATCH_WRITABLE) && self->written != NULL)
+        self->written(self->owner);
 
     Py_RETURN_NONE;
 
@@ -645,6 +656,362 @@ timeout_type_init()
 }
 
 
+/**********************************************************************
+ * Timer queue. A connection keeps its D-BUS timeouts in a binary heap
+ * ordered by deadline, and only has a single timer in the event loop for
+ * the first deadline. A timer per timeout does not scale to the tens of
+ * thousands of timeouts that outstanding method calls can create.
+ */
+
+typedef struct
+{
+    DBusTimeout *timeout;
+    double deadline;
+    Py_ssize_t index;  /* position in the heap, -1 if not in it */
+} TimerEntry;
+
+typedef struct
+{
+    TimerEntry **heap;
+    Py_ssize_t size;
+    Py_ssize_t allocated;
+    PyObject *timer;  /* event loop timer for the first deadline */
+    double scheduled;  /* when the timer expires */
+    int running;  /* running expired timeouts */
+} TimerQueue;
+
+static double
+_timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+_timer_swap(TimerQueue *queue, Py_ssize_t i, Py_ssize_t j)
+{
+    TimerEntry *tmp = queue->heap[i];
+
+    queue->heap[i] = queue->heap[j];
+    queue->heap[j] = tmp;
+    queue->heap[i]->index = i;
+    queue->heap[j]->index = j;
+}
+
+static void
+_timer_sift_up(TimerQueue *queue, Py_ssize_t i)
+{
+    Py_ssize_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (queue->heap[parent]->deadline <= queue->heap[i]->deadline)
+            break;
+        _timer_swap(queue, i, parent);
+        i = parent;
+    }
+}
+
+static void
+_timer_sift_down(TimerQueue *queue, Py_ssize_t i)
+{
+    Py_ssize_t child;
+
+    while ((child = 2*i + 1) < queue->size) {
+        if (child + 1 < queue->size && queue->heap[child+1]->deadline
+                    < queue->heap[child]->deadline)
+            child++;
+        if (queue->heap[i]->deadline <= queue->heap[child]->deadline)
+            break;
+        _timer_swap(queue, i, child);
+        i = child;
+    }
+}
+
+static int
+_timer_push(TimerQueue *queue, TimerEntry *entry)
+{
+    Py_ssize_t allocated;
+    TimerEntry **heap;
+
+    if (queue->size == queue->allocated) {
+        allocated = queue->allocated ? 2 * queue->allocated : 16;
+        heap = realloc(queue->heap, allocated * sizeof(TimerEntry *));
+        if (heap == NULL)
+            return -1;
+        queue->heap = heap;
+        queue->allocated = allocated;
+    }
+    entry->index = queue->size;
+    queue->heap[queue->size++] = entry;
+    _timer_sift_up(queue, entry->index);
+    return 0;
+}
+
+static void
+_timer_remove(TimerQueue *queue, TimerEntry *entry)
+{
+    Py_ssize_t i = entry->index;
+
+    if (i == -1)
+        return;
+    entry->index = -1;
+    if (i == --queue->size)
+        return;
+    queue->heap[i] = queue->heap[queue->size];
+    queue->heap[i]->index = i;
+    _timer_sift_down(queue, i);
+    _timer_sift_up(queue, queue->heap[i]->index);
+}
+
+
+/**********************************************************************
+ * Message queue. A FIFO of message references, used to hold back incoming
+ * messages of a lower priority.
+ */
+
+#define PRIORITY_HIGH 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_LOW 2
+#define NUM_PRIORITIES 3
+
+#define CONFLATE_SIGNAL 1
+#define CONFLATE_ARG0 2
+
+typedef struct
+{
+    DBusMessage **items;
+    Py_ssize_t head;
+    Py_ssize_t count;
+    Py_ssize_t allocated;
+    Py_ssize_t popped;
+} MessageQueue;
+
+static int
+_queue_push(MessageQueue *queue, DBusMessage *message)
+{
+    Py_ssize_t i, allocated;
+    DBusMessage **items;
+
+    if (queue->count == queue->allocated) {
+        allocated = queue->allocated ? 2 * queue->allocated : 64;
+        if ((items = malloc(allocated * sizeof(DBusMessage *))) == NULL)
+            return -1;
+        for (i=0; i<queue->count; i++)
+            items[i] = queue->items[(queue->head + i) % queue->allocated];
+        free(queue->items);
+        queue->items = items;
+        queue->head = 0;
+        queue->allocated = allocated;
+    }
+    i = (queue->head + queue->count) % queue->allocated;
+    queue->items[i] = dbus_message_ref(message);
+    queue->count++;
+    return 0;
+}
+
+/* Return a reference to the first message, or NULL if the queue is empty. */
+
+static DBusMessage *
+_queue_pop(MessageQueue *queue)
+{
+    DBusMessage *message;
+
+    if (queue->count == 0)
+        return NULL;
+    message = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->allocated;
+    queue->count--;
+    queue->popped++;
+    return message;
+}
+
+/* Replace the message that was pushed as the *index*-th message ever.
+ * Return 1 if it was replaced, and 0 if it is no longer in the queue. */
+
+static int
+_queue_replace(MessageQueue *queue, Py_ssize_t index, DBusMessage *message)
+{
+    Py_ssize_t i;
+
+    index -= queue->popped;
+    if (index < 0 || index >= queue->count)
+        return 0;
+    i = (queue->head + index) % queue->allocated;
+    dbus_message_unref(queue->items[i]);
+    queue->items[i] = dbus_message_ref(message);
+    return 1;
+}
+
+static void
+_queue_clear(MessageQueue *queue)
+{
+    DBusMessage *message;
+
+    while ((message = _queue_pop(queue)) != NULL)
+        dbus_message_unref(message);
+    free(queue->items);
+    queue->items = NULL;
+    queue->head = queue->allocated = 0;
+}
+
+
+/**********************************************************************
+ * UnixFD object. Owns a file descriptor that is sent or received as a
+ * "h" argument.
+ */
+
+typedef struct
+{
+    PyObject_HEAD
+    int fd;
+} UnixFDObject;
+
+static PyTypeObject UnixFDType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "UnixFD",
+    sizeof(UnixFDObject)
+};
+
+PyDoc_STRVAR(unixfd_doc,
+    "UnixFD(fd)\n\n"
+    "A file descriptor that is passed in a message using the \"h\" format.\n"
+    "The constructor takes an integer file descriptor, or an object with a\n"
+    "fileno() method, and stores a duplicate of it. File descriptors that\n"
+    "are received are returned as UnixFD instances. The file descriptor is\n"
+    "closed when the object is garbage collected, unless it was taken with\n"
+    "take().\n");
+
+static PyObject *
+_unixfd_new(int fd)
+{
+    UnixFDObject *self;
+
+    if ((self = (UnixFDObject *) UnixFDType.tp_alloc(&UnixFDType, 0)) == NULL)
+        return NULL;
+    self->fd = fd;
+    return (PyObject *) self;
+}
+
+static PyObject *
+unixfd_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    int fd;
+    PyObject *Pfd;
+    UnixFDObject *self = NULL;
+    static char *kwlist[] = { "fd", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:UnixFD", kwlist, &Pfd))
+        return NULL;
+    if ((fd = PyObject_AsFileDescriptor(Pfd)) < 0)
+        return NULL;
+    if ((self = (UnixFDObject *) type->tp_alloc(type, 0)) == NULL)
+        return NULL;
+    if ((self->fd = fcntl(fd, F_DUPFD_CLOEXEC, 3)) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *) self;
+}
+
+static void
+unixfd_dealloc(UnixFDObject *self)
+{
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject *
+unixfd_repr(UnixFDObject *self)
+{
+    return PyUnicode_FromFormat("<UnixFD fd=%d>", self->fd);
+}
+
+PyDoc_STRVAR(unixfd_fileno_doc,
+    "fileno()\n\n"
+    "Return the file descriptor. It stays owned by this object.\n");
+
+static PyObject *
+unixfd_fileno(UnixFDObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ":fileno"))
+        return NULL;
+    if (self->fd < 0)
+        RAISE_VALUE_ERROR("file descriptor was closed or taken");
+    return PyLong_FromLong(self->fd);
+
+error:
+    return NULL;
+}
+
+PyDoc_STRVAR(unixfd_take_doc,
+    "take()\n\n"
+    "Return the file descriptor and transfer ownership to the caller, who\n"
+    "becomes responsible for closing it.\n");
+
+static PyObject *
+unixfd_take(UnixFDObject *self, PyObject *args)
+{
+    int fd;
+
+    if (!PyArg_ParseTuple(args, ":take"))
+        return NULL;
+    if (self->fd < 0)
+        RAISE_VALUE_ERROR("file descriptor was closed or taken");
+    fd = self->fd; self->fd = -1;
+    return PyLong_FromLong(fd);
+
+error:
+    return NULL;
+}
+
+PyDoc_STRVAR(unixfd_close_doc,
+    "close()\n\n"
+    "Close the file descriptor.\n");
+
+static PyObject *
+unixfd_close(UnixFDObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ":close"))
+        return NULL;
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef unixfd_methods[] = \
+{
+    { "fileno", (PyCFunction) unixfd_fileno, METH_VARARGS,
+            unixfd_fileno_doc },
+    { "take", (PyCFunction) unixfd_take, METH_VARARGS, unixfd_take_doc },
+    { "close", (PyCFunction) unixfd_close, METH_VARARGS, unixfd_close_doc },
+    { NULL }
+};
+
+static PyObject *
+unixfd_type_init()
+{
+    UnixFDType.tp_doc = unixfd_doc;
+    UnixFDType.tp_flags = Py_TPFLAGS_DEFAULT;
+    UnixFDType.tp_new = unixfd_new;
+    UnixFDType.tp_dealloc = (destructor) unixfd_dealloc;
+    UnixFDType.tp_repr = (reprfunc) unixfd_repr;
+    UnixFDType.tp_methods = unixfd_methods;
+    if (PyType_Ready(&UnixFDType) < 0)
+        return NULL;
+    return (PyObject *) &UnixFDType;
+}
+
+
 /**********************************************************************
  * Message object. This is one of the key objects (the other is Connection).
  * A message corresponds to a D-BUS message sent over a D-BUS connection.
@@ -680,6 +1047,8 @@ message_init(MessageObject *self, PyObject *args, PyObject *kwargs)
 
     if (type <= DBUS_MESSAGE_TYPE_INVALID || type >= DBUS_NUM_MESSAGE_TYPES)
         RAISE_VALUE_ERROR("illegal message type: %d", type);
+    if (self->message != NULL)
+        dbus_message_unref(self->message);
     if ((self->message = dbus_message_new(type)) == NULL)
         RAISE_MEMORY_ERROR();
     return 0;
@@ -1093,6 +1462,7 @@ typedef union
     dbus_uint64_t u64;
     char *str;
     double dbl;
+    int fd;
 } basic_value;
 
 
@@ -1173,6 +1543,16 @@ message_read_arg(DBusMessageIter *iter, int depth)
         if ((Parg = PyUnicode_FromString(value.str)) == NULL)
             RETURN_ERROR();
         break;
+    case DBUS_TYPE_UNIX_FD:
+        /* libdbus returns a duplicate that we own. */
+        dbus_message_iter_get_basic(iter, &value);
+        if (value.fd < 0)
+            RAISE_ERROR("could not read file descriptor");
+        if ((Parg = _unixfd_new(value.fd)) == NULL) {
+            close(value.fd);
+            RETURN_ERROR();
+        }
+        break;
     case DBUS_TYPE_STRUCT:
         dbus_message_iter_recurse(iter, &subiter);
         if ((Parg = message_read_args(&subiter, depth+1)) == NULL)
@@ -1201,8 +1581,8 @@ message_read_arg(DBusMessageIter *iter, int depth)
                     if (PyDict_SetItem(Parg, PyTuple_GET_ITEM(Pitem, 0),
                                        PyTuple_GET_ITEM(Pitem, 1)) < 0)
                         RETURN_ERROR();
-                } else
-                    PyList_Append(Parg, Pitem);
+                } else if (PyList_Append(Parg, Pitem) < 0)
+                    RETURN_ERROR();
                 Py_DECREF(Pitem); Pitem = NULL;
                 dbus_message_iter_next(&subiter);
             }
@@ -1253,7 +1633,8 @@ message_read_args(DBusMessageIter *iter, int depth)
 {
     PyObject *Plist = NULL, *Pargs = NULL, *Parg = NULL;
 
-    Plist = PyList_New(0);
+    if ((Plist = PyList_New(0)) == NULL)
+        RETURN_ERROR();
     while (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_INVALID) {
         if ((Parg = message_read_arg(iter, depth)) == NULL)
             RETURN_ERROR();
@@ -1441,6 +1822,17 @@ message_append_arg(DBusMessageIter *iter, char *signature,
         if (!dbus_message_iter_append_basic(iter, *signature, &value))
             RAISE_MEMORY_ERROR();
         break;
+    case DBUS_TYPE_UNIX_FD:
+        /* libdbus stores a duplicate, the caller keeps the original. */
+        if (PyObject_TypeCheck(arg, &UnixFDType)) {
+            value.fd = ((UnixFDObject *) arg)->fd;
+            if (value.fd < 0)
+                RAISE_VALUE_ERROR("file descriptor was closed or taken");
+        } else if ((value.fd = PyObject_AsFileDescriptor(arg)) < 0)
+            RETURN_ERROR();
+        if (!dbus_message_iter_append_basic(iter, *signature, &value))
+            RAISE_ERROR("could not append file descriptor %d", value.fd);
+        break;
     case DBUS_STRUCT_BEGIN_CHAR:
         if (!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT,
                     NULL, &subiter))
@@ -1609,100 +2001,388 @@ error:
     return NULL;
 }
 
-PyMethodDef message_methods[] = \
-{
-    { "set_args", (PyCFunction ) message_set_args, METH_VARARGS,
-            message_set_args_doc },
-    { NULL }
-};
-
-static PyObject *
-message_type_init()
-{
-    MessageType.tp_doc = message_doc;
-    MessageType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
-    MessageType.tp_new = PyType_GenericNew;
-    MessageType.tp_init = (initproc) message_init;
-    MessageType.tp_dealloc = (destructor) message_dealloc;
-    MessageType.tp_methods = message_methods;
-    MessageType.tp_getset = message_properties;
-    if (PyType_Ready(&MessageType) < 0)
-        return NULL; 
-    return (PyObject *) &MessageType;
-}
-
 
-/**********************************************************************
- * Connection object. It wraps a DBusConnection structure, and
- * corresponds to a single (possibly shared) connection to the D-BUS.
- */
+PyDoc_STRVAR(message_marshal_doc,
+    "marshal()\n\n"
+    "Return the message in its D-BUS wire format as a bytes instance.\n"
+    "Marshalling locks the message. No header fields or arguments can\n"
+    "be changed afterwards.\n");
 
-typedef struct
+static PyObject *
+message_marshal(MessageObject *self, PyObject *args)
 {
-    PyObject_HEAD
-    DBusConnection *connection;
-    int shared;
-    int skip_connect;
-    PyObject *address;
-    PyObject *loop;
-    PyObject *filters;
-    PyObject *object_paths;
-    PyObject *dispatch;
-} ConnectionObject;
+    int size;
+    char *buffer = NULL;
+    PyObject *Pbytes;
 
-PyTypeObject ConnectionType =
-{
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "ConnectionBase",
-    sizeof(ConnectionObject)
-};
+    if (!PyArg_ParseTuple(args, ":marshal"))
+        return NULL;
+    if (self->message == NULL)
+        RAISE_ERROR("uninitialized object");
 
+    if (!dbus_message_marshal(self->message, &buffer, &size))
+        RAISE_MEMORY_ERROR();
+    Pbytes = PyBytes_FromStringAndSize(buffer, size);
+    dbus_free(buffer);
+    return Pbytes;
 
-/* Forward declarations */
-static DBusConnection *_open_connection(PyObject *bus, int shared);
-static int _close_connection(ConnectionObject *conn);
+error:
+    return NULL;
+}
 
 
-PyDoc_STRVAR(connection_doc,
-        "Base functionality for creating Connenection classes.\n\n"
-        "This class wraps a DBusConnection structure from libdbus and\n"
-        "various functions that operate on it. Its purpose is to serve\n"
-        "as a base class for creating Python-level Connection classes.\n");
+PyDoc_STRVAR(message_demarshal_doc,
+    "demarshal(data)\n\n"
+    "Create a new message from *data*, which must be a bytes-like object\n"
+    "containing exactly one message in D-BUS wire format, as returned by\n"
+    ":meth:`marshal`. The message is returned as an instance of the class\n"
+    "this method is called on. Its constructor is not called.\n");
 
 static PyObject *
-connection_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+message_demarshal(PyTypeObject *cls, PyObject *args)
 {
-    ConnectionObject *Pconnection;
+    Py_buffer buffer;
+    PyObject *Pargs = NULL;
+    MessageObject *Pmessage = NULL;
+    DBusError error = DBUS_ERROR_INIT;
 
-    if ((Pconnection = (ConnectionObject *)
-                PyType_GenericNew(type, args, kwargs)) == NULL)
-        RETURN_ERROR();
-    if ((Pconnection->filters = PySet_New(NULL)) == NULL)
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTuple(args, "y*:demarshal", &buffer))
+#else
+    if (!PyArg_ParseTuple(args, "s*:demarshal", &buffer))
+#endif
+        return NULL;
+
+    if ((Pargs = PyTuple_New(0)) == NULL)
         RETURN_ERROR();
-    if ((Pconnection->object_paths = PyDict_New()) == NULL)
+    if ((Pmessage = (MessageObject *) cls->tp_new(cls, Pargs, NULL)) == NULL)
         RETURN_ERROR();
-    return (PyObject *) Pconnection;
+    Py_DECREF(Pargs); Pargs = NULL;
+    Pmessage->message = dbus_message_demarshal(buffer.buf, (int) buffer.len,
+                                               &error);
+    if (Pmessage->message == NULL) {
+        if (dbus_error_is_set(&error))
+            RAISE_VALUE_ERROR("dbus: %s", error.message);
+        else
+            RAISE_MEMORY_ERROR();
+    }
+    PyBuffer_Release(&buffer);
+    return (PyObject *) Pmessage;
 
 error:
+    PyBuffer_Release(&buffer);
+    Py_XDECREF(Pargs);
+    Py_XDECREF(Pmessage);
+    if (dbus_error_is_set(&error))
+        dbus_error_free(&error);
     return NULL;
 }
 
+PyDoc_STRVAR(message_marshal_many_doc,
+    "marshal_many(messages)\n\n"
+    "Marshal the messages in the sequence *messages* and return them\n"
+    "concatenated as a single bytes instance. All messages must have a\n"
+    "serial. Marshalling locks the messages.\n");
 
-static int
-connection_init(ConnectionObject *self, PyObject *args, PyObject *kwargs)
+static PyObject *
+message_marshal_many(PyTypeObject *cls, PyObject *args)
+{
+    int *sizes = NULL;
+    char **buffers = NULL;
+    Py_ssize_t i, count = 0, nbuffers = 0, total = 0;
+    PyObject *Pmessages, *Pseq = NULL, *Pitem, *Pdata = NULL;
+    char *data;
+    DBusMessage *message;
+
+    if (!PyArg_ParseTuple(args, "O:marshal_many", &Pmessages))
+        return NULL;
+    if ((Pseq = PySequence_Fast(Pmessages, "expecting a sequence")) == NULL)
+        RETURN_ERROR();
+    count = PySequence_Fast_GET_SIZE(Pseq);
+    /* Marshal all messages first so that the result is allocated once. */
+    buffers = malloc((count ? count : 1) * sizeof(char *));
+    sizes = malloc((count ? count : 1) * sizeof(int));
+    if (buffers == NULL || sizes == NULL)
+        RAISE_MEMORY_ERROR();
+    for (i=0; i<count; i++) {
+        Pitem = PySequence_Fast_GET_ITEM(Pseq, i);
+        if (!PyObject_TypeCheck(Pitem, &MessageType))
+            RAISE_TYPE_ERROR("expecting a sequence of messages");
+        if ((message = ((MessageObject *) Pitem)->message) == NULL)
+            RAISE_ERROR("uninitialized message");
+        if (dbus_message_get_serial(message) == 0)
+            RAISE_VALUE_ERROR("message does not have a serial");
+        if (!dbus_message_marshal(message, &buffers[i], &sizes[i]))
+            RAISE_MEMORY_ERROR();
+        nbuffers++;
+        total += sizes[i];
+    }
+    if ((Pdata = PyBytes_FromStringAndSize(NULL, total)) == NULL)
+        RETURN_ERROR();
+    data = PyBytes_AS_STRING(Pdata);
+    for (i=0; i<nbuffers; i++) {
+        memcpy(data, buffers[i], sizes[i]);
+        data += sizes[i];
+        dbus_free(buffers[i]);
+    }
+    free(buffers);
+    free(sizes);
+    Py_DECREF(Pseq);
+    return Pdata;
+
+error:
+    for (i=0; i<nbuffers; i++)
+        dbus_free(buffers[i]);
+    free(buffers);
+    free(sizes);
+    Py_XDECREF(Pdata);
+    Py_XDECREF(Pseq);
+    return NULL;
+}
+
+PyDoc_STRVAR(message_demarshal_many_doc,
+    "demarshal_many(data)\n\n"
+    "Create messages from the bytes-like object *data*, which contains\n"
+    "zero or more messages in D-BUS wire format, possibly followed by an\n"
+    "incomplete message. The return value is a tuple (messages, size),\n"
+    "with *messages* a list of instances of the class this method is\n"
+    "called on, and *size* the number of bytes that were used.\n");
+
+static PyObject *
+message_demarshal_many(PyTypeObject *cls, PyObject *args)
+{
+    int needed;
+    char *data;
+    Py_buffer buffer;
+    Py_ssize_t offset = 0, remaining;
+    PyObject *Pargs = NULL, *Plist = NULL;
+    MessageObject *Pmessage = NULL;
+    DBusError error = DBUS_ERROR_INIT;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTuple(args, "y*:demarshal_many", &buffer))
+#else
+    if (!PyArg_ParseTuple(args, "s*:demarshal_many", &buffer))
+#endif
+        return NULL;
+
+    if ((Pargs = PyTuple_New(0)) == NULL)
+        RETURN_ERROR();
+    if ((Plist = PyList_New(0)) == NULL)
+        RETURN_ERROR();
+    while (1) {
+        data = (char *) buffer.buf + offset;
+        remaining = buffer.len - offset;
+        /* The fixed part of the header is 16 bytes. */
+        if (remaining < 16)
+            break;
+        needed = dbus_message_demarshal_bytes_needed(data,
+                        remaining > INT_MAX ? INT_MAX : (int) remaining);
+        if (needed < 0)
+            RAISE_VALUE_ERROR("invalid message header");
+        if (needed == 0 || needed > remaining)
+            break;
+        if ((Pmessage = (MessageObject *) cls->tp_new(cls, Pargs, NULL)) == NULL)
+            RETURN_ERROR();
+        Pmessage->message = dbus_message_demarshal(data, needed, &error);
+        if (Pmessage->message == NULL) {
+            if (dbus_error_is_set(&error))
+                RAISE_VALUE_ERROR("dbus: %s", error.message);
+            else
+                RAISE_MEMORY_ERROR();
+        }
+        if (PyList_Append(Plist, (PyObject *) Pmessage) < 0)
+            RETURN_ERROR();
+        Py_DECREF(Pmessage); Pmessage = NULL;
+        offset += needed;
+    }
+    PyBuffer_Release(&buffer);
+    Py_DECREF(Pargs);
+    return Py_BuildValue("(Nn)", Plist, offset);
+
+error:
+    PyBuffer_Release(&buffer);
+    Py_XDECREF(Pargs);
+    Py_XDECREF(Plist);
+    Py_XDECREF(Pmessage);
+    if (dbus_error_is_set(&error))
+        dbus_error_free(&error);
+    return NULL;
+}
+
+PyDoc_STRVAR(message_copy_doc,
+    "copy()\n\n"
+    "Return a copy of this message. The copy has the same header fields\n"
+    "and arguments, except that its serial is unset. The copy can be\n"
+    "modified even if this message has already been sent.\n");
+
+static PyObject *
+message_copy(MessageObject *self, PyObject *args)
+{
+    PyObject *Pargs = NULL;
+    MessageObject *Pmessage = NULL;
+
+    if (!PyArg_ParseTuple(args, ":copy"))
+        return NULL;
+    if (self->message == NULL)
+        RAISE_ERROR("uninitialized object");
+
+    if ((Pargs = PyTuple_New(0)) == NULL)
+        RETURN_ERROR();
+    Pmessage = (MessageObject *) Py_TYPE(self)->tp_new(Py_TYPE(self), Pargs, NULL);
+    if (Pmessage == NULL)
+        RETURN_ERROR();
+    Py_DECREF(Pargs); Pargs = NULL;
+    if ((Pmessage->message = dbus_message_copy(self->message)) == NULL)
+        RAISE_MEMORY_ERROR();
+    return (PyObject *) Pmessage;
+
+error:
+    Py_XDECREF(Pargs);
+    Py_XDECREF(Pmessage);
+    return NULL;
+}
+
+PyMethodDef message_methods[] = \
+{
+    { "set_args", (PyCFunction ) message_set_args, METH_VARARGS,
+            message_set_args_doc },
+    { "copy", (PyCFunction) message_copy, METH_VARARGS, message_copy_doc },
+    { "marshal", (PyCFunction) message_marshal, METH_VARARGS,
+            message_marshal_doc },
+    { "demarshal", (PyCFunction) message_demarshal, METH_VARARGS|METH_CLASS,
+            message_demarshal_doc },
+    { "marshal_many", (PyCFunction) message_marshal_many,
+            METH_VARARGS|METH_CLASS, message_marshal_many_doc },
+    { "demarshal_many", (PyCFunction) message_demarshal_many,
+            METH_VARARGS|METH_CLASS, message_demarshal_many_doc },
+    { NULL }
+};
+
+static PyObject *
+message_type_init()
+{
+    MessageType.tp_doc = message_doc;
+    MessageType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+    MessageType.tp_new = PyType_GenericNew;
+    MessageType.tp_init = (initproc) message_init;
+    MessageType.tp_dealloc = (destructor) message_dealloc;
+    MessageType.tp_methods = message_methods;
+    MessageType.tp_getset = message_properties;
+    if (PyType_Ready(&MessageType) < 0)
+        return NULL; 
+    return (PyObject *) &MessageType;
+}
+
+
+/**********************************************************************
+ * Connection object. It wraps a DBusConnection structure, and
+ * corresponds to a single (possibly shared) connection to the D-BUS.
+ */
+
+typedef struct
+{
+    PyObject_HEAD
+    DBusConnection *connection;
+    int shared;
+    int skip_connect;
+    int have_filter;
+    PyObject *address;
+    PyObject *loop;
+    PyObject *filters;
+    PyObject *object_paths;
+    PyObject *pending;
+    PyObject *dispatch;
+    TimerQueue timers;
+    long dispatch_budget;
+    double dispatch_time;
+    int prioritize;
+    PyObject *priorities;
+    MessageQueue deferred[NUM_PRIORITIES];
+    Py_ssize_t ndeferred;
+    PyObject *conflation;
+    PyObject *latest;
+    PyObject *held;
+    PyObject *epochs;
+    Py_ssize_t nconflated;
+    long outgoing_limit;
+    MessageQueue staged[NUM_PRIORITIES];
+    Py_ssize_t nstaged;
+} ConnectionObject;
+
+PyTypeObject ConnectionType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ConnectionBase",
+    sizeof(ConnectionObject)
+};
+
+
+/* Forward declarations */
+static DBusConnection *_open_connection(PyObject *bus, int shared,
+                                        int do_register);
+static int _close_connection(ConnectionObject *conn);
+static PyObject *_connection_wrap(PyTypeObject *cls,
+                DBusConnection *connection, PyObject *bus, int shared);
+static int _add_builtin_filters(ConnectionObject *conn);
+static int _connection_cancel_timer(ConnectionObject *conn);
+static int _connection_feed_staged(ConnectionObject *conn, int all);
+
+
+PyDoc_STRVAR(connection_doc,
+        "Base functionality for creating Connenection classes.\n\n"
+        "This class wraps a DBusConnection structure from libdbus and\n"
+        "various functions that operate on it. Its purpose is to serve\n"
+        "as a base class for creating Python-level Connection classes.\n");
+
+static PyObject *
+connection_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    ConnectionObject *Pconnection;
+
+    if ((Pconnection = (ConnectionObject *)
+                PyType_GenericNew(type, args, kwargs)) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->filters = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->object_paths = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->pending = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->priorities = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->conflation = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->latest = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->held = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    if ((Pconnection->epochs = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    return (PyObject *) Pconnection;
+
+error:
+    return NULL;
+}
+
+
+static int
+connection_init(ConnectionObject *self, PyObject *args, PyObject *kwargs)
 {
+    int do_register = 1;
     PyObject *bus;
-    static char *kwlist[] = { "address", NULL };
+    static char *kwlist[] = { "address", "register", NULL };
     DBusConnection *connection;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &bus))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &bus,
+                                     &do_register))
         RETURN_ERROR();
 
     /* See note in connection_get() */
     if (self->skip_connect)
         return 0;
 
-    if ((connection = _open_connection(bus, 0)) == NULL)
+    if ((connection = _open_connection(bus, 0, do_register)) == NULL)
         RETURN_ERROR();
     if (!dbus_connection_set_data(connection, slot_self, self, decref))
         RAISE_ERROR("dbus_connection_set_data() failed");
@@ -1720,6 +2400,8 @@ connection_init(ConnectionObject *self, PyObject *args, PyObject *kwargs)
     self->shared = 0;
     Py_INCREF(bus);
     self->address = bus;
+    if (_add_builtin_filters(self) < 0)
+        RETURN_ERROR();
 
     return 0;
 
@@ -1737,8 +2419,16 @@ connection_traverse(ConnectionObject *self, visitproc visit, void *arg)
         Py_VISIT(self->filters);
     if (self->object_paths != NULL)
         Py_VISIT(self->object_paths);
+    if (self->pending != NULL)
+        Py_VISIT(self->pending);
     if (self->dispatch != NULL)
         Py_VISIT(self->dispatch);
+    if (self->timers.timer != NULL)
+        Py_VISIT(self->timers.timer);
+    if (self->priorities != NULL)
+        Py_VISIT(self->priorities);
+    if (self->conflation != NULL)
+        Py_VISIT(self->conflation);
     return 0;
 }
 
@@ -1760,6 +2450,36 @@ connection_clear(ConnectionObject *self)
         self->object_paths = NULL;
         Py_DECREF(Ptmp);
     }
+    Ptmp = self->pending;
+    if (Ptmp != NULL) {
+        self->pending = NULL;
+        Py_DECREF(Ptmp);
+    }
+    Ptmp = self->priorities;
+    if (Ptmp != NULL) {
+        self->priorities = NULL;
+        Py_DECREF(Ptmp);
+    }
+    Ptmp = self->conflation;
+    if (Ptmp != NULL) {
+        self->conflation = NULL;
+        Py_DECREF(Ptmp);
+    }
+    Ptmp = self->latest;
+    if (Ptmp != NULL) {
+        self->latest = NULL;
+        Py_DECREF(Ptmp);
+    }
+    Ptmp = self->held;
+    if (Ptmp != NULL) {
+        self->held = NULL;
+        Py_DECREF(Ptmp);
+    }
+    Ptmp = self->epochs;
+    if (Ptmp != NULL) {
+        self->epochs = NULL;
+        Py_DECREF(Ptmp);
+    }
     Ptmp = self->dispatch;
     if (Ptmp != NULL) {
         self->dispatch = NULL;
@@ -1824,7 +2544,19 @@ connection_get_loop(ConnectionObject *self, void *context)
 PyDoc_STRVAR(connection_dispatch_status_doc,
     "The current dispatch status. This can be one of\n"
     "DBUS_DISPATCH_DATA_REMAINS, DBUS_DISPATCH_COMPLETE, or\n"
-    "DBUS_DISPATCH_NEED_MEMORY.\n");
+    "DBUS_DISPATCH_NEED_MEMORY. Messages that are held back because\n"
+    "of their priority count as data that remains.\n");
+
+static int
+_connection_dispatch_status(ConnectionObject *conn)
+{
+    int status;
+
+    status = dbus_connection_get_dispatch_status(conn->connection);
+    if (status == DBUS_DISPATCH_COMPLETE && conn->ndeferred > 0)
+        status = DBUS_DISPATCH_DATA_REMAINS;
+    return status;
+}
 
 static PyObject *
 connection_get_dispatch_status(ConnectionObject *self, void *context)
@@ -1834,7 +2566,7 @@ connection_get_dispatch_status(ConnectionObject *self, void *context)
     if (self->connection == NULL)
         Py_RETURN_NONE;
 
-    status = dbus_connection_get_dispatch_status(self->connection);
+    status = _connection_dispatch_status(self);
     return PyLong_FromLong(status);
 }
 
@@ -1842,7 +2574,8 @@ connection_get_dispatch_status(ConnectionObject *self, void *context)
 PyDoc_STRVAR(connection_unique_name_doc,
     "The unique name for this connection. Unique names\n"
     "start with a colon (\":\") and are automaticallly allocated\n"
-    "by the message bus.\n");
+    "by the message bus. Peer-to-peer connections do not have a\n"
+    "unique name, and this property is None for them.\n");
 
 static PyObject *
 connection_get_unique_name(ConnectionObject *self, PyObject *args)
@@ -1853,84 +2586,336 @@ connection_get_unique_name(ConnectionObject *self, PyObject *args)
         Py_RETURN_NONE;
 
     if ((name = dbus_bus_get_unique_name(self->connection)) == NULL)
-        RAISE_ERROR("dbus_bus_get_unique_name() failed");
+        Py_RETURN_NONE;
     return PyUnicode_FromString(name);
+}
 
-error:
-    return NULL;
+
+PyDoc_STRVAR(connection_outgoing_size_doc,
+    "The approximate number of bytes in the outgoing message queue. This\n"
+    "grows when the peer does not read fast enough.\n");
+
+static PyObject *
+connection_get_outgoing_size(ConnectionObject *self, void *context)
+{
+    if (self->connection == NULL)
+        return PyLong_FromLong(0);
+    return PyLong_FromLong(dbus_connection_get_outgoing_size(self->connection));
 }
 
 
-static PyGetSetDef connection_properties[] = \
+PyDoc_STRVAR(connection_can_send_fds_doc,
+    "Whether file descriptors (the \"h\" format) can be sent on this\n"
+    "connection.\n");
+
+static PyObject *
+connection_get_can_send_fds(ConnectionObject *self, void *context)
 {
-    { "address", (getter) connection_get_address, NULL,
-                connection_address_doc },
-    { "shared", (getter) connection_get_shared, NULL, connection_shared_doc },
-    { "loop", (getter) connection_get_loop, NULL, connection_loop_doc },
-    { "dispatch_status", (getter) connection_get_dispatch_status, NULL,
-                connection_dispatch_status_doc },
-    { "unique_name", (getter) connection_get_unique_name, NULL,
-                connection_unique_name_doc },
-    { NULL }
-};
+    if (self->connection == NULL)
+        Py_RETURN_FALSE;
+    return PyBool_FromLong(dbus_connection_can_send_type(self->connection,
+                                                         DBUS_TYPE_UNIX_FD));
+}
 
 
-static DBusHandlerResult
-handler_callback(DBusConnection *connection, DBusMessage *message,
-                 void *data)
+PyDoc_STRVAR(connection_unix_process_id_doc,
+    "The process ID of the peer, or None if it is not known.\n");
+
+static PyObject *
+connection_get_unix_process_id(ConnectionObject *self, void *context)
 {
-    int ret;
-    PyObject *Presult, *Pconnection;
-    MessageObject *Pmessage;
+    unsigned long pid;
 
-    Pconnection = (PyObject *) \
-            dbus_connection_get_data(connection, slot_self);
-    if (Pconnection == NULL)
-        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-    Pmessage = (MessageObject *) \
-            MessageType.tp_new(&MessageType, NULL, NULL);
-    if (Pmessage == NULL)
-        return DBUS_HANDLER_RESULT_NEED_MEMORY;
-    Pmessage->message = dbus_message_ref(message);
+    if (self->connection == NULL ||
+                !dbus_connection_get_unix_process_id(self->connection, &pid))
+        Py_RETURN_NONE;
+    return PyLong_FromUnsignedLong(pid);
+}
 
-    Presult = PyObject_CallFunction((PyObject *) data, "OO", Pconnection,
-                                    Pmessage);
-    Py_DECREF(Pmessage);
-    if (Presult == NULL) {
-        PyErr_Clear();
-        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-    }
-    ret = PyObject_IsTrue(Presult) ? DBUS_HANDLER_RESULT_HANDLED 
-                : DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-    Py_DECREF(Presult);
-    return ret;
+
+PyDoc_STRVAR(connection_unix_user_doc,
+    "The user ID of the peer, or None if it is not known.\n");
+
+static PyObject *
+connection_get_unix_user(ConnectionObject *self, void *context)
+{
+    unsigned long uid;
+
+    if (self->connection == NULL ||
+                !dbus_connection_get_unix_user(self->connection, &uid))
+        Py_RETURN_NONE;
+    return PyLong_FromUnsignedLong(uid);
 }
 
 
-static DBusConnection *
-_open_connection(PyObject *bus, int shared)
+PyDoc_STRVAR(connection_timeouts_doc,
+    "The number of D-BUS timeouts that are active. This is only\n"
+    "maintained when an event loop is installed.\n");
+
+static PyObject *
+connection_get_timeouts(ConnectionObject *self, void *context)
 {
-    int id;
-    char *address;
-    DBusConnection *connection;
-    DBusError error = DBUS_ERROR_INIT;
+    return PyLong_FromSsize_t(self->timers.size);
+}
 
-    /* Allow threads here because dbus_bus_register() will block until the
-     * connection is established, authenticated, and registered. In case
-     * of dbus_bus_get(), it calls dbus_bus_register() under the cover.
-     *
-     * The consequence is that if you're using an event loop, you need to
-     * create your Connection instaces before entering the loop.
-     */
 
-    if (PyLong_Check(bus)) {
-        id = (int) PyLong_AsLong(bus);
-        Py_BEGIN_ALLOW_THREADS
-        if (shared)
-            connection = dbus_bus_get(id, &error);
-        else
-            connection = dbus_bus_get_private(id, &error);
-        Py_END_ALLOW_THREADS
+PyDoc_STRVAR(connection_dispatch_budget_doc,
+    "The maximum number of messages that :meth:`dispatch_all` dispatches\n"
+    "before it yields to the event loop. Zero, the default, means no\n"
+    "limit.\n");
+
+static PyObject *
+connection_get_dispatch_budget(ConnectionObject *self, void *context)
+{
+    return PyLong_FromLong(self->dispatch_budget);
+}
+
+static int
+connection_set_dispatch_budget(ConnectionObject *self, PyObject *value,
+                               void *context)
+{
+    long budget;
+
+    if (value == NULL || !PyLong_Check(value))
+        RAISE_TYPE_ERROR("expecting an integer");
+    if ((budget = PyLong_AsLong(value)) == -1 && PyErr_Occurred())
+        RETURN_ERROR();
+    if (budget < 0)
+        RAISE_VALUE_ERROR("dispatch_budget must be >= 0");
+    self->dispatch_budget = budget;
+    return 0;
+error:
+    return -1;
+}
+
+
+PyDoc_STRVAR(connection_dispatch_time_doc,
+    "The maximum time in seconds that :meth:`dispatch_all` dispatches\n"
+    "before it yields to the event loop. Zero, the default, means no\n"
+    "limit.\n");
+
+static PyObject *
+connection_get_dispatch_time(ConnectionObject *self, void *context)
+{
+    return PyFloat_FromDouble(self->dispatch_time);
+}
+
+static int
+connection_set_dispatch_time(ConnectionObject *self, PyObject *value,
+                             void *context)
+{
+    double secs;
+
+    if (value == NULL || !(PyLong_Check(value) || PyFloat_Check(value)))
+        RAISE_TYPE_ERROR("expecting an int or a float");
+    if ((secs = PyFloat_AsDouble(value)) == -1.0 && PyErr_Occurred())
+        RETURN_ERROR();
+    if (secs < 0.0)
+        RAISE_VALUE_ERROR("dispatch_time must be >= 0");
+    self->dispatch_time = secs;
+    return 0;
+error:
+    return -1;
+}
+
+
+PyDoc_STRVAR(connection_prioritize_doc,
+    "Whether incoming signals are dispatched after method calls and\n"
+    "replies. When this is set, signals are held back in a queue per\n"
+    "priority when libdbus dispatches them, and are passed to the filters\n"
+    "once libdbus has no more messages, highest priority first. See\n"
+    ":meth:`set_priority`. Held back signals are not passed to object path\n"
+    "handlers. The default is False.\n");
+
+static PyObject *
+connection_get_prioritize(ConnectionObject *self, void *context)
+{
+    return PyBool_FromLong(self->prioritize);
+}
+
+static int
+connection_set_prioritize(ConnectionObject *self, PyObject *value,
+                          void *context)
+{
+    int prioritize;
+
+    if (value == NULL)
+        RAISE_TYPE_ERROR("cannot delete attribute");
+    if ((prioritize = PyObject_IsTrue(value)) < 0)
+        RETURN_ERROR();
+    self->prioritize = prioritize;
+    return 0;
+error:
+    return -1;
+}
+
+
+PyDoc_STRVAR(connection_deferred_doc,
+    "The number of incoming signals that are held back because of their\n"
+    "priority.\n");
+
+static PyObject *
+connection_get_deferred(ConnectionObject *self, void *context)
+{
+    return PyLong_FromSsize_t(self->ndeferred);
+}
+
+
+PyDoc_STRVAR(connection_conflated_doc,
+    "The number of incoming signals that were dropped because a newer\n"
+    "signal replaced them. See :meth:`set_conflation`.\n");
+
+static PyObject *
+connection_get_conflated(ConnectionObject *self, void *context)
+{
+    return PyLong_FromSsize_t(self->nconflated);
+}
+
+
+PyDoc_STRVAR(connection_outgoing_limit_doc,
+    "The size in bytes of the outgoing queue above which messages that are\n"
+    "not high priority are staged. See :meth:`send`. Zero, the default,\n"
+    "disables staging.\n");
+
+static PyObject *
+connection_get_outgoing_limit(ConnectionObject *self, void *context)
+{
+    return PyLong_FromLong(self->outgoing_limit);
+}
+
+static int
+connection_set_outgoing_limit(ConnectionObject *self, PyObject *value,
+                              void *context)
+{
+    long limit;
+
+    if (value == NULL || !PyLong_Check(value))
+        RAISE_TYPE_ERROR("expecting an integer");
+    if ((limit = PyLong_AsLong(value)) == -1 && PyErr_Occurred())
+        RETURN_ERROR();
+    if (limit < 0)
+        RAISE_VALUE_ERROR("outgoing_limit must be >= 0");
+    self->outgoing_limit = limit;
+    if (self->connection != NULL && _connection_feed_staged(self,
+                limit == 0) < 0)
+        RETURN_ERROR();
+    return 0;
+error:
+    return -1;
+}
+
+
+PyDoc_STRVAR(connection_staged_doc,
+    "The number of messages that are staged. See :meth:`send`.\n");
+
+static PyObject *
+connection_get_staged(ConnectionObject *self, void *context)
+{
+    return PyLong_FromSsize_t(self->nstaged);
+}
+
+
+static PyGetSetDef connection_properties[] = \
+{
+    { "address", (getter) connection_get_address, NULL,
+                connection_address_doc },
+    { "shared", (getter) connection_get_shared, NULL, connection_shared_doc },
+    { "loop", (getter) connection_get_loop, NULL, connection_loop_doc },
+    { "dispatch_status", (getter) connection_get_dispatch_status, NULL,
+                connection_dispatch_status_doc },
+    { "unique_name", (getter) connection_get_unique_name, NULL,
+                connection_unique_name_doc },
+    { "outgoing_size", (getter) connection_get_outgoing_size, NULL,
+                connection_outgoing_size_doc },
+    { "can_send_fds", (getter) connection_get_can_send_fds, NULL,
+                connection_can_send_fds_doc },
+    { "unix_process_id", (getter) connection_get_unix_process_id, NULL,
+                connection_unix_process_id_doc },
+    { "unix_user", (getter) connection_get_unix_user, NULL,
+                connection_unix_user_doc },
+    { "timeouts", (getter) connection_get_timeouts, NULL,
+                connection_timeouts_doc },
+    { "dispatch_budget", (getter) connection_get_dispatch_budget,
+                (setter) connection_set_dispatch_budget,
+                connection_dispatch_budget_doc },
+    { "dispatch_time", (getter) connection_get_dispatch_time,
+                (setter) connection_set_dispatch_time,
+                connection_dispatch_time_doc },
+    { "prioritize", (getter) connection_get_prioritize,
+                (setter) connection_set_prioritize, connection_prioritize_doc },
+    { "deferred", (getter) connection_get_deferred, NULL,
+                connection_deferred_doc },
+    { "conflated", (getter) connection_get_conflated, NULL,
+                connection_conflated_doc },
+    { "outgoing_limit", (getter) connection_get_outgoing_limit,
+                (setter) connection_set_outgoing_limit,
+                connection_outgoing_limit_doc },
+    { "staged", (getter) connection_get_staged, NULL,
+                connection_staged_doc },
+    { NULL }
+};
+
+
+static DBusHandlerResult
+handler_callback(DBusConnection *connection, DBusMessage *message,
+                 void *data)
+{
+    int ret;
+    PyObject *Presult, *Pconnection;
+    MessageObject *Pmessage;
+
+    Pconnection = (PyObject *) \
+            dbus_connection_get_data(connection, slot_self);
+    if (Pconnection == NULL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    Pmessage = (MessageObject *) \
+            MessageType.tp_new(&MessageType, NULL, NULL);
+    if (Pmessage == NULL)
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    Pmessage->message = dbus_message_ref(message);
+
+    /* Hold a reference to the handler while it runs. A filter may remove
+     * itself, which drops the reference that libdbus holds. */
+    Py_INCREF((PyObject *) data);
+    Presult = PyObject_CallFunction((PyObject *) data, "OO", Pconnection,
+                                    Pmessage);
+    Py_DECREF((PyObject *) data);
+    Py_DECREF(Pmessage);
+    if (Presult == NULL) {
+        PyErr_Clear();
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    ret = PyObject_IsTrue(Presult) ? DBUS_HANDLER_RESULT_HANDLED 
+                : DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    Py_DECREF(Presult);
+    return ret;
+}
+
+
+static DBusConnection *
+_open_connection(PyObject *bus, int shared, int do_register)
+{
+    int id;
+    char *address;
+    DBusConnection *connection;
+    DBusError error = DBUS_ERROR_INIT;
+
+    /* Allow threads here because dbus_bus_register() will block until the
+     * connection is established, authenticated, and registered. In case
+     * of dbus_bus_get(), it calls dbus_bus_register() under the cover.
+     *
+     * The consequence is that if you're using an event loop, you need to
+     * create your Connection instaces before entering the loop.
+     */
+
+    if (PyLong_Check(bus)) {
+        id = (int) PyLong_AsLong(bus);
+        Py_BEGIN_ALLOW_THREADS
+        if (shared)
+            connection = dbus_bus_get(id, &error);
+        else
+            connection = dbus_bus_get_private(id, &error);
+        Py_END_ALLOW_THREADS
     } else if (PyUnicode_Check(bus)) {
         address = PyUnicode_AsUTF8(bus);
         Py_BEGIN_ALLOW_THREADS
@@ -1938,7 +2923,8 @@ _open_connection(PyObject *bus, int shared)
             connection = dbus_connection_open(address, &error);
         else
             connection = dbus_connection_open_private(address, &error);
-        if (connection != NULL && !dbus_bus_register(connection, &error)) {
+        if (connection != NULL && do_register &&
+                    !dbus_bus_register(connection, &error)) {
             if (!shared)
                 dbus_connection_close(connection);
             dbus_connection_unref(connection);
@@ -1966,980 +2952,3776 @@ error:
 }
 
 
+/* Complete all outstanding pending calls with an error reply. */
+
 static int
-_close_connection(ConnectionObject *conn)
+_fail_pending_calls(ConnectionObject *conn, const char *error_name,
+                    const char *error_message)
 {
-    PyObject *Piter = NULL, *Pitem = NULL;
-
-    ASSERT(conn->filters != NULL);
-    ASSERT(conn->object_paths != NULL);
-    if (conn->connection == NULL) {
-        ASSERT(conn->loop == NULL);
-        ASSERT(PySet_Size(conn->filters) == 0);
-        ASSERT(PyDict_Size(conn->object_paths) == 0);
-        return 0;
-    }
-    ASSERT(conn->address != NULL);
-
-    /* Remove any callback that was installed by us (event loop, filters,
-     * and object path handlers). */
-
-    if (conn->loop != NULL) {
-        dbus_connection_set_watch_functions(conn->connection,
-                        NULL, NULL, NULL, NULL, NULL);
-        dbus_connection_set_timeout_functions(conn->connection,
-                        NULL, NULL, NULL, NULL, NULL);
-        dbus_connection_set_dispatch_status_function(conn->connection,
-                        NULL, NULL, NULL);
-        Py_DECREF(conn->loop);
-        conn->loop = NULL;
-    }
-
-    if ((Piter = PyObject_GetIter(conn->filters)) == NULL)
-        RETURN_ERROR();
-    while ((Pitem = PyIter_Next(Piter)) != NULL) {
-        dbus_connection_remove_filter(conn->connection, handler_callback,
-                                      Pitem);
-        Py_DECREF(Pitem);
-        Pitem = NULL;
-    }
-    PySet_Clear(conn->filters);
+    Py_ssize_t i;
+    unsigned long serial;
+    PyObject *Pitems, *Pcallback, *Pret;
+    MessageObject *Pmessage = NULL;
+    DBusPendingCall *pending;
+    DBusMessage *reply;
 
-    if ((Piter = PyObject_GetIter(conn->object_paths)) == NULL)
+    if ((Pitems = PyDict_Items(conn->pending)) == NULL)
         RETURN_ERROR();
-    while ((Pitem = PyIter_Next(Piter)) != NULL) {
-        if (!dbus_connection_unregister_object_path(conn->connection,
-                            PyUnicode_AsUTF8(Pitem)))
-            RAISE_ERROR("dbus_connection_unregister_object_path() failed");
-        Py_DECREF(Pitem);
-        Pitem = NULL;
+    PyDict_Clear(conn->pending);
+    for (i = 0; i < PyList_GET_SIZE(Pitems); i++) {
+        pending = PyLong_AsVoidPtr(PyTuple_GET_ITEM(
+                        PyList_GET_ITEM(Pitems, i), 0));
+        if (!PyArg_ParseTuple(PyTuple_GET_ITEM(PyList_GET_ITEM(Pitems, i), 1),
+                              "Ok", &Pcallback, &serial))
+            RETURN_ERROR();
+        dbus_pending_call_cancel(pending);
+        dbus_pending_call_unref(pending);
+        if ((reply = dbus_message_new(DBUS_MESSAGE_TYPE_ERROR)) == NULL ||
+                    !dbus_message_set_error_name(reply, error_name) ||
+                    !dbus_message_set_reply_serial(reply, serial) ||
+                    !dbus_message_append_args(reply, DBUS_TYPE_STRING,
+                                &error_message, DBUS_TYPE_INVALID)) {
+            if (reply != NULL)
+                dbus_message_unref(reply);
+            RAISE_MEMORY_ERROR();
+        }
+        Pmessage = (MessageObject *) MessageType.tp_new(&MessageType,
+                                                        NULL, NULL);
+        if (Pmessage == NULL) {
+            dbus_message_unref(reply);
+            RETURN_ERROR();
+        }
+        Pmessage->message = reply;
+        Pret = PyObject_CallFunction(Pcallback, "O", Pmessage);
+        Py_XDECREF(Pret);
+        PRINT_AND_CLEAR_ERROR("pending call callback");
+        Py_DECREF(Pmessage);
+        Pmessage = NULL;
     }
-    PyDict_Clear(conn->object_paths);
-
-    /* Now we can close the connection. Do not close the underlying connection
-     * if it is shared though. */
-
-    /* The next line will drop the D-BUS reference to our connection object.
-     * After this, the connection may be garbage collected if it becomes
-     * unaccessible. */
-    dbus_connection_set_data(conn->connection, slot_self, NULL, NULL);
-    if (!conn->shared)
-        dbus_connection_close(conn->connection);
-    dbus_connection_unref(conn->connection);
-    conn->connection = NULL;
-    Py_DECREF(conn->address);
-    conn->address = NULL;
-    conn->shared = 0;
+    Py_DECREF(Pitems);
     return 0;
 
 error:
-    Py_XDECREF(Piter);
-    Py_XDECREF(Pitem);
+    Py_XDECREF(Pitems);
     return -1;
 }
 
 
-PyDoc_STRVAR(connection_get_doc,
-    "get(address, shared=True)\n\n"
-    "Return a D-BUS connection that is connected to *address*. The address\n"
-    "may be one of BUS_SYSTEM, BUS_SESSION or BUS_STARTER\n"
-    "to connect to one of the well known bus instances, or a string with\n"
-    "a D-BUS connection address. The *shared* argument, if provided,\n"
-    "specifies if this may be a shared connection or not.\n");
+/* Return the key under which a signal is conflated, or NULL without an
+ * exception if it is not conflated. The key is the sender, path, interface
+ * and member, and for CONFLATE_ARG0 also the first argument if that is a
+ * string. */
 
 static PyObject *
-connection_get(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
+_conflation_key(ConnectionObject *conn, DBusMessage *message)
 {
-    int shared = 1;
-    PyObject *bus, *Pargs = NULL;
-    ConnectionObject *self;
-    DBusConnection *connection;
-    static char *kwlist[] = { "bus", "shared", NULL };
+    int type;
+    long mode;
+    const char *arg0 = NULL;
+    PyObject *Prule, *Pmode;
+    DBusMessageIter iter;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i:get", kwlist,
-                                     &bus, &shared))
-        RETURN_ERROR();
+    Prule = Py_BuildValue("(zz)", dbus_message_get_interface(message),
+                          dbus_message_get_member(message));
+    if (Prule == NULL)
+        return NULL;
+    Pmode = PyDict_GetItem(conn->conflation, Prule);
+    Py_DECREF(Prule);
+    if (Pmode == NULL)
+        return NULL;
+    mode = PyLong_AsLong(Pmode);
+    if (mode == CONFLATE_ARG0 && dbus_message_iter_init(message, &iter)) {
+        type = dbus_message_iter_get_arg_type(&iter);
+        if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH
+                    || type == DBUS_TYPE_SIGNATURE)
+            dbus_message_iter_get_basic(&iter, &arg0);
+    }
+    return Py_BuildValue("(zzzzz)", dbus_message_get_sender(message),
+                         dbus_message_get_path(message),
+                         dbus_message_get_interface(message),
+                         dbus_message_get_member(message), arg0);
+}
 
-    if ((connection = _open_connection(bus, shared)) == NULL)
-        RETURN_ERROR();
 
-    self = dbus_connection_get_data(connection, slot_self);
-    if (self == NULL) {
-         /* Create new python object, by calling tp_new and tp_init. */
-        if ((Pargs = PyTuple_New(0)) == NULL)
-            RETURN_ERROR();
-        if ((self = (ConnectionObject *) cls->tp_new(cls, Pargs, NULL)) == NULL)
-            RETURN_ERROR();
-        Py_DECREF(Pargs);
-        Pargs = NULL;
-        /* We want to call the constructor here to allow derived classes to
-         * do initialization, but we don't want our base constructor to connect
-         * as we are already connected. The small hack below prevents that. */
-        self->connection = connection;  /* hand over D-BUS reference */
-        self->shared = shared;
-        Py_INCREF(bus);
-        self->address = bus;
-        self->skip_connect = 1;
-        if ((Pargs = PyTuple_New(1)) == NULL)
-            RETURN_ERROR();
-        Py_INCREF(bus);
-        PyTuple_SET_ITEM(Pargs, 0, bus);
-        if (cls->tp_init((PyObject *) self, Pargs, NULL) < 0)
-            RETURN_ERROR();
-        Py_DECREF(Pargs);
-        Pargs = NULL;
-        /* Hand off the tp_new() reference to the D-BUS connection.
-         * Also see note in connection_init() */
-        if (!dbus_connection_set_data(connection, slot_self, self, decref))
-            RAISE_ERROR("dbus_connection_set_data() failed");
-    }
+/* Add *delta* to the number of held back signals from the sender of
+ * *message*. */
 
-    /* Need a new reference because even if the connection was just created,
-     * the tp_new() reference is now owned by the D-BUS connection. */
-    Py_INCREF(self);
-    return (PyObject *) self;
+static int
+_connection_count_held(ConnectionObject *conn, DBusMessage *message,
+                       long delta)
+{
+    long count = 0;
+    PyObject *Psender, *Pcount;
+
+    Psender = Py_BuildValue("z", dbus_message_get_sender(message));
+    if (Psender == NULL)
+        return -1;
+    if ((Pcount = PyDict_GetItem(conn->held, Psender)) != NULL)
+        count = PyLong_AsLong(Pcount);
+    count += delta;
+    if (count <= 0) {
+        if (Pcount != NULL && PyDict_DelItem(conn->held, Psender) < 0)
+            RETURN_ERROR();
+    } else {
+        if ((Pcount = PyLong_FromLong(count)) == NULL)
+            RETURN_ERROR();
+        if (PyDict_SetItem(conn->held, Psender, Pcount) < 0) {
+            Py_DECREF(Pcount);
+            RETURN_ERROR();
+        }
+        Py_DECREF(Pcount);
+    }
+    Py_DECREF(Psender);
+    return 0;
 
 error:
-    Py_XDECREF(Pargs);
-    return NULL;
+    Py_DECREF(Psender);
+    return -1;
 }
 
+/* Return whether signals from the sender of *message* are held back. */
 
-PyDoc_STRVAR(connection_close_doc,
-    "close()\n\n"
-    "Close a connection.");
-
-static PyObject *
-connection_close(ConnectionObject *self, PyObject *args)
+static int
+_connection_is_held(ConnectionObject *conn, DBusMessage *message)
 {
-    if (!PyArg_ParseTuple(args, ":close"))
-        return NULL;
-    if (_close_connection(self) < 0)
-        return NULL;
-    Py_RETURN_NONE;
-}
+    int held;
+    PyObject *Psender;
 
+    if (PyDict_Size(conn->held) == 0)
+        return 0;
+    Psender = Py_BuildValue("z", dbus_message_get_sender(message));
+    if (Psender == NULL)
+        return -1;
+    held = PyDict_GetItem(conn->held, Psender) != NULL;
+    Py_DECREF(Psender);
+    return held;
+}
 
-PyDoc_STRVAR(connection_send_doc,
-    "send(message)\n\n"
-    "Send a message on this connection. The *message* parameter must be a\n"
-    ":class:`dbusx.Message` instance. This method only queues the message\n"
-    "and does not perform any actual IO. The message will be sent out at a\n"
-    "later time either by the event loop. If no event loop is installed,\n"
-    "the message may be sent out manually by calling :meth:`flush` or\n"
-    ":meth:`read_write_dispatch`.\n");
+/* Hold back a signal at the end of the queue for *priority*. */
 
-static PyObject *
-connection_send(ConnectionObject *self, PyObject *args)
+static int
+_connection_hold(ConnectionObject *conn, DBusMessage *message, long priority)
 {
-    MessageObject *message;
-
-    if (!PyArg_ParseTuple(args, "O!:send", &MessageType, &message))
-        return NULL;
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-
-    if (!dbus_connection_send(self->connection, message->message, NULL))
-        RAISE_ERROR("dbus_connection_send() failed");
-
-    Py_RETURN_NONE;
-
-error:
-    return NULL;
+    if (_connection_count_held(conn, message, 1) < 0)
+        return -1;
+    if (_queue_push(&conn->deferred[priority], message) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    conn->ndeferred++;
+    return 0;
 }
 
+/* Return the epoch of the conflated signals of *Psender*. */
 
-PyDoc_STRVAR(connection_send_with_reply_doc,
-    "send_with_reply(message, callback, timeout=None)\n\n"
-    "Send a message on this connnection.\n\n"
-    "The *message* parameter must be a :class:`dbusx.Message` instance.\n"
-    "The *callback* parameter is a callback that will be called when a\n"
-    "reply is received. It will be called with a :class:`dbusx.Message`\n"
-    "instance as its only argument containing the reply message. The\n"
-    "*timeout* parameter specifies a timeout in seconds to wait for a reply.\n"
-    "If no reply a received within the timeout, the callback will be called\n"
-    "with a locally generated error reply message. The timeout may be an int\n"
-    "or float. If no timeout is provided a sensible default value will be\n"
-    "used.\n\n");
-
-static void
-pending_call_notify_callback(DBusPendingCall *pending, void *data)
+static long
+_connection_epoch(ConnectionObject *conn, PyObject *Psender)
 {
-    MessageObject *Pmessage;
+    PyObject *Pepoch;
 
-    Pmessage = (MessageObject *) MessageType.tp_new(&MessageType, NULL, NULL);
-    if (Pmessage == NULL)
-        return;
-    Pmessage->message = dbus_pending_call_steal_reply(pending);
-    if (Pmessage->message == NULL)
-        return;
-    PyObject_CallFunction((PyObject *) data, "O", Pmessage);
-    if (PyErr_Occurred())
-        PyErr_Clear();
-    Py_DECREF(Pmessage);
-    dbus_pending_call_unref(pending);
+    Pepoch = PyDict_GetItem(conn->epochs, Psender);
+    return Pepoch != NULL ? PyLong_AsLong(Pepoch) : 0;
 }
 
+/* A conflated signal may not overtake a signal from the same sender that
+ * was held back after the signal it would replace. Start a new epoch for
+ * the sender of *message*. The positions of its conflated signals that were
+ * stored in an earlier epoch are then ignored, so that new ones go to the
+ * end of the queue. */
 
-static PyObject *
-connection_send_with_reply(ConnectionObject *self, PyObject *args)
+static int
+_connection_forget_sender(ConnectionObject *conn, DBusMessage *message)
 {
-    int msecs, type;
-    PyObject *timeout = NULL, *callback = NULL;
-    MessageObject *message;
-    DBusPendingCall *pending = NULL;
-
-    if (!PyArg_ParseTuple(args, "O!O|O:send_with_reply", &MessageType,
-                          &message, &callback, &timeout))
-        return NULL;
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-
-    type = dbus_message_get_type(message->message);
-    if ((type != DBUS_MESSAGE_TYPE_METHOD_CALL) && (callback != NULL))
-        RAISE_ERROR("expecting a METHOD_CALL message");
-
-    if (!PyCallable_Check(callback))
-        RAISE_ERROR("expecting a callable for 'callback'");
-
-    if (timeout == NULL || timeout == Py_None)
-        msecs = -1;
-    else if (PyLong_Check(timeout))
-        msecs = (int) (1000 * PyLong_AsLong(timeout));
-    else if (PyFloat_Check(timeout))
-        msecs = (int) (1000.0 * PyFloat_AsDouble(timeout));
-    else
-        RAISE_ERROR("expecing int, float or None for 'timeout'");
-    if (msecs < 0) msecs = -1;
-
-    if (!dbus_connection_send_with_reply(self->connection,
-                message->message, &pending, msecs) || (pending == NULL))
-        RAISE_ERROR("dbus_connection_send_with_reply() failed");
-    if (!dbus_pending_call_set_notify(pending, pending_call_notify_callback,
-                                      callback, decref))
-        RAISE_MEMORY_ERROR();
-    Py_INCREF(callback);
+    PyObject *Psender = NULL, *Pepoch = NULL;
 
-    Py_RETURN_NONE;
+    if (PyDict_Size(conn->latest) == 0)
+        return 0;
+    if ((Psender = Py_BuildValue("z", dbus_message_get_sender(message)))
+                == NULL)
+        RETURN_ERROR();
+    if ((Pepoch = PyLong_FromLong(_connection_epoch(conn, Psender) + 1))
+                == NULL)
+        RETURN_ERROR();
+    if (PyDict_SetItem(conn->epochs, Psender, Pepoch) < 0)
+        RETURN_ERROR();
+    Py_DECREF(Pepoch);
+    Py_DECREF(Psender);
+    return 0;
 
 error:
-    if (pending != NULL) dbus_pending_call_unref(pending);
-    return NULL;
+    Py_XDECREF(Pepoch);
+    Py_XDECREF(Psender);
+    return -1;
 }
 
 
-PyDoc_STRVAR(connection_flush_doc,
-    "flush()\n\n"
-    "Flush any messages that were queued but not yet sent out.\n"
-    "This method will block until all output has been sent out.\n");
+/* Hold back a conflated signal. If an older signal with the same key is
+ * still held back, the new signal takes its place in the queue. */
 
-static PyObject *
-connection_flush(ConnectionObject *self, PyObject *args)
+static int
+_connection_conflate(ConnectionObject *conn, PyObject *Pkey,
+                     DBusMessage *message, long priority)
 {
-    if (!PyArg_ParseTuple(args, ":flush"))
-        return NULL;
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-    dbus_connection_flush(self->connection);
-    Py_RETURN_NONE;
+    long epoch;
+    Py_ssize_t position;
+    PyObject *Pposition;
+    MessageQueue *queue;
+
+    /* The position is stored together with the epoch of the sender. */
+    epoch = _connection_epoch(conn, PyTuple_GET_ITEM(Pkey, 0));
+    Pposition = PyDict_GetItem(conn->latest, Pkey);
+    if (Pposition != NULL
+            && PyLong_AsLong(PyTuple_GET_ITEM(Pposition, 1)) == epoch) {
+        position = PyLong_AsSsize_t(PyTuple_GET_ITEM(Pposition, 0));
+        queue = &conn->deferred[position % NUM_PRIORITIES];
+        if (_queue_replace(queue, position / NUM_PRIORITIES, message)) {
+            conn->nconflated++;
+            return 0;
+        }
+    }
+    queue = &conn->deferred[priority];
+    position = (queue->popped + queue->count) * NUM_PRIORITIES + priority;
+    if ((Pposition = Py_BuildValue("(nl)", position, epoch)) == NULL)
+        RETURN_ERROR();
+    if (PyDict_SetItem(conn->latest, Pkey, Pposition) < 0) {
+        Py_DECREF(Pposition);
+        RETURN_ERROR();
+    }
+    Py_DECREF(Pposition);
+    if (_connection_hold(conn, message, priority) < 0)
+        RETURN_ERROR();
+    return 0;
 
 error:
-    return NULL;
+    return -1;
 }
 
 
-PyDoc_STRVAR(connection_dispatch_doc,
-    "dispatch()\n\n"
-    "Dispatch one incoming message, if available. Messages are dispatched\n"
-    "in three steps. First, method call responses are dispatched to\n"
-    "callbacks that were registered with send(). Second, messages of any\n"
-    "type are passed to the installed message filters, in the order the\n"
-    "filters were added. Finally, for method calls, if there is a registered\n"
-    "object path handler that matches the message's path, the message is\n"
-    "dispatched there. The first callback that accepts a message completes\n"
-    "the dispatch.\n\n"
-    "This method returns the new dispatch status of the connection.\n");
+/* Hold back signals of a lower priority than method calls and replies, and
+ * signals that are conflated. Without priorities, the signals that follow a
+ * held back signal from the same sender are held back as well, so that the
+ * signals of a sender are delivered in order. This filter is installed
+ * before any Python filter. */
 
-static PyObject *
-connection_dispatch(ConnectionObject *self, PyObject *args)
+static DBusHandlerResult
+priority_filter(DBusConnection *connection, DBusMessage *message, void *data)
 {
-    int status;
-
-    if (!PyArg_ParseTuple(args, ":dispatch"))
-        return NULL;
-    ASSERT(self->connection != NULL);
-
-    status = dbus_connection_dispatch(self->connection);
-    return PyLong_FromLong(status);
+    int held = 0;
+    long priority = PRIORITY_NORMAL;
+    const char *interface;
+    ConnectionObject *self;
+    PyObject *Ppriority, *Pkey = NULL;
 
-error:
-    return NULL;
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    self = dbus_connection_get_data(connection, slot_self);
+    if (self == NULL || (!self->prioritize && self->ndeferred == 0
+                         && PyDict_Size(self->conflation) == 0))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    interface = dbus_message_get_interface(message);
+    if (interface == NULL || strcmp(interface, DBUS_INTERFACE_LOCAL) == 0)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    if (self->prioritize && PyDict_Size(self->priorities) > 0) {
+        Ppriority = PyDict_GetItemString(self->priorities, interface);
+        if (Ppriority != NULL)
+            priority = PyLong_AsLong(Ppriority);
+    }
+    if (PyDict_Size(self->conflation) > 0)
+        Pkey = _conflation_key(self, message);
+    if (Pkey != NULL) {
+        if (_connection_conflate(self, Pkey, message, priority) < 0) {
+            Py_DECREF(Pkey);
+            PRINT_AND_CLEAR_ERROR("priority_filter()");
+            return DBUS_HANDLER_RESULT_NEED_MEMORY;
+        }
+        Py_DECREF(Pkey);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+    PRINT_AND_CLEAR_ERROR("priority_filter()");
+    if (self->prioritize ? priority == PRIORITY_HIGH
+                : (held = _connection_is_held(self, message)) == 0)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    if ((!self->prioritize && held < 0)
+                || _connection_forget_sender(self, message) < 0
+                || _connection_hold(self, message, priority) < 0) {
+        PRINT_AND_CLEAR_ERROR("priority_filter()");
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+    return DBUS_HANDLER_RESULT_HANDLED;
 }
 
 
-PyDoc_STRVAR(connection_dispatch_all_doc,
-    "dispatch_all()\n\n"
-    "Call dispatch() until no more dispatch data remains.\n");
+/* Pass the first held back message of the highest priority to the Python
+ * filters. Return 1 if a message was delivered, and 0 if there was none. */
 
-static PyObject *
-connection_dispatch_all(ConnectionObject *self, PyObject *args)
+static int
+_connection_dispatch_deferred(ConnectionObject *conn)
 {
-    int status;
-    PyObject *Pret;
+    int i;
+    Py_ssize_t j;
+    DBusMessage *message = NULL;
+    PyObject *Pfilters;
 
-    if (!PyArg_ParseTuple(args, ":dispatch_all"))
-        return NULL;
-    ASSERT(self->connection != NULL);
+    Py_ssize_t position;
+    PyObject *Pkey, *Pposition;
 
-    while (1) {
-        status = dbus_connection_dispatch(self->connection);
-        if (status != DBUS_DISPATCH_DATA_REMAINS)
+    for (i=0; i<NUM_PRIORITIES && message == NULL; i++)
+        message = _queue_pop(&conn->deferred[i]);
+    if (message == NULL)
+        return 0;
+    conn->ndeferred--;
+    /* Forget the position of a conflated signal once it is dispatched. */
+    if (conn->ndeferred == 0) {
+        PyDict_Clear(conn->latest);
+        PyDict_Clear(conn->held);
+        PyDict_Clear(conn->epochs);
+    } else if (_connection_count_held(conn, message, -1) == 0
+                && PyDict_Size(conn->latest) > 0
+                && (Pkey = _conflation_key(conn, message)) != NULL) {
+        position = (conn->deferred[i-1].popped - 1) * NUM_PRIORITIES + i - 1;
+        Pposition = PyDict_GetItem(conn->latest, Pkey);
+        if (Pposition != NULL && PyLong_AsSsize_t(
+                    PyTuple_GET_ITEM(Pposition, 0)) == position)
+            PyDict_DelItem(conn->latest, Pkey);
+        Py_DECREF(Pkey);
+    }
+    if (PyErr_Occurred()) {
+        dbus_message_unref(message);
+        return -1;
+    }
+    /* A filter may add or remove filters. */
+    if ((Pfilters = PyDict_Values(conn->filters)) == NULL) {
+        dbus_message_unref(message);
+        return -1;
+    }
+    for (j=0; j<PyList_GET_SIZE(Pfilters); j++) {
+        if (conn->connection == NULL)
+            break;
+        if (handler_callback(conn->connection, message,
+                    PyList_GET_ITEM(Pfilters, j)) == DBUS_HANDLER_RESULT_HANDLED)
             break;
-        else if (status == DBUS_DISPATCH_NEED_MEMORY)
-            RAISE_MEMORY_ERROR();
     }
+    Py_DECREF(Pfilters);
+    dbus_message_unref(message);
+    return 1;
+}
 
-    if (self->dispatch != NULL) {
-        Pret = PyObject_CallMethod(self->dispatch, "cancel", NULL);
-        if (PyErr_Occurred())
-            PyErr_Clear();
-        Py_XDECREF(Pret);
-        Py_DECREF(self->dispatch);
-        self->dispatch = NULL;
-    }
 
-    Py_RETURN_NONE;
+static void
+_connection_clear_deferred(ConnectionObject *conn)
+{
+    int i;
 
-error:
-    return NULL;
+    for (i=0; i<NUM_PRIORITIES; i++)
+        _queue_clear(&conn->deferred[i]);
+    conn->ndeferred = 0;
+    PyDict_Clear(conn->latest);
+    PyDict_Clear(conn->held);
+    PyDict_Clear(conn->epochs);
 }
 
 
-PyDoc_STRVAR(connection_read_write_dispatch_doc,
-    "read_write_dispatch(timeout)\n\n"
-    "Run one iteration of the built-in, blocking event loop, and then\n"
-    "dispatch one message.\n\n"
-    "The *timeout* argument specifies the timeout for the built-in event\n"
-    "loop. Note that if this built-in loop blocks, it cannot be pre-empted,\n"
-    "not even by e.g sending a signal to the current process. Therefore,\n"
-    "the built-in loop should only be used in simple applications that do\n"
-    "not need to multiplex multple things.\n\n");
+/* libdbus synthesizes error replies for pending calls when a connection is
+ * disconnected, but does not deliver them to the pending call. This filter
+ * fails the outstanding calls when the "Disconnected" signal is dispatched,
+ * so that callers do not wait for a reply that will never come. */
 
-static PyObject *
-connection_read_write_dispatch(ConnectionObject *self, PyObject *args)
+static DBusHandlerResult
+disconnect_filter(DBusConnection *connection, DBusMessage *message,
+                  void *data)
 {
-    int status, msecs;
-    PyObject *timeout = NULL;
+    ConnectionObject *self;
 
-    if (!PyArg_ParseTuple(args, "|O:read_write_dispatch", &timeout))
-        return NULL;
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
+    if (!dbus_message_is_signal(message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    self = dbus_connection_get_data(connection, slot_self);
+    if (self == NULL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    Py_INCREF(self);
+    if (_fail_pending_calls(self, DBUS_ERROR_DISCONNECTED,
+                "Connection was disconnected before a reply was received") < 0)
+        PRINT_AND_CLEAR_ERROR("disconnect_filter()");
+    Py_DECREF(self);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
 
-    if (timeout == NULL || timeout == Py_None)
-        msecs = 0;
-    else if (PyLong_Check(timeout))
-        msecs = (int) (1000 * PyLong_AsLong(timeout));
-    else if (PyFloat_Check(timeout))
-        msecs = (int) (1000.0 * PyFloat_AsDouble(timeout));
-    else
-        RAISE_ERROR("expecing int, float or None for 'timeout'");
-    if (msecs < 0) msecs = -1;
 
-    status = dbus_connection_read_write_dispatch(self->connection, msecs);
-    return PyBool_FromLong(status);
+static int
+_add_builtin_filters(ConnectionObject *conn)
+{
+    if (!dbus_connection_add_filter(conn->connection, disconnect_filter,
+                                    NULL, NULL))
+        RAISE_MEMORY_ERROR();
+    if (!dbus_connection_add_filter(conn->connection, priority_filter,
+                                    NULL, NULL)) {
+        dbus_connection_remove_filter(conn->connection, disconnect_filter,
+                                      NULL);
+        RAISE_MEMORY_ERROR();
+    }
+    conn->have_filter = 1;
+    return 0;
 
 error:
-    return NULL;
+    return -1;
 }
 
 
-static dbus_bool_t
-add_watch_callback(DBusWatch *watch, void *data)
+static int
+_close_connection(ConnectionObject *conn)
 {
-    int fd, flags, enabled;
-    WatchObject *Pwatch = NULL;
-    PyObject *Pcallback = NULL, *Phandler, *loop = (PyObject *) data;
+    Py_ssize_t i;
+    PyObject *Piter = NULL, *Pitem = NULL, *Pret;
+    DBusPendingCall *pending;
 
-    ASSERT(dbus_watch_get_data(watch) == NULL);
+    ASSERT(conn->filters != NULL);
+    ASSERT(conn->object_paths != NULL);
+    if (conn->connection == NULL) {
+        ASSERT(conn->loop == NULL);
+        ASSERT(PyDict_Size(conn->filters) == 0);
+        ASSERT(PyDict_Size(conn->object_paths) == 0);
+        return 0;
+    }
+    ASSERT(conn->address != NULL);
 
-    Pwatch = (WatchObject *) WatchType.tp_new(&WatchType, NULL, NULL);
-    if (Pwatch == NULL)
-        RETURN_ERROR();
-    Pwatch->watch = watch;
-    dbus_watch_set_data(watch, Pwatch, decref);  /* hand off ref to dbus */
+    /* Remove any callback that was installed by us (event loop, filters,
+     * and object path handlers). */
 
-    fd = dbus_watch_get_unix_fd(watch);
-    if (fd == -1)
-        fd = dbus_watch_get_socket(watch);
-    flags = dbus_watch_get_flags(watch);
-    enabled = dbus_watch_get_enabled(watch);
+    if (conn->loop != NULL) {
+        dbus_connection_set_watch_functions(conn->connection,
+                        NULL, NULL, NULL, NULL, NULL);
+        dbus_connection_set_timeout_functions(conn->connection,
+                        NULL, NULL, NULL, NULL, NULL);
+        if (_connection_cancel_timer(conn) < 0)
+            PyErr_Clear();
+        free(conn->timers.heap);
+        conn->timers.heap = NULL;
+        conn->timers.size = conn->timers.allocated = 0;
+        dbus_connection_set_dispatch_status_function(conn->connection,
+                        NULL, NULL, NULL);
+        if (conn->dispatch != NULL) {
+            Pret = PyObject_CallMethod(conn->dispatch, "cancel", NULL);
+            if (Pret == NULL)
+                PyErr_Clear();
+            Py_XDECREF(Pret);
+            Py_DECREF(conn->dispatch);
+            conn->dispatch = NULL;
+        }
+        Py_DECREF(conn->loop);
+        conn->loop = NULL;
+    }
 
-    Pcallback = PyObject_GetAttrString((PyObject *) Pwatch, "handle");
-    if (Pcallback == NULL)
+    if (conn->have_filter) {
+        dbus_connection_remove_filter(conn->connection, disconnect_filter,
+                                      NULL);
+        dbus_connection_remove_filter(conn->connection, priority_filter,
+                                      NULL);
+        conn->have_filter = 0;
+    }
+    _connection_clear_deferred(conn);
+    for (i=0; i<NUM_PRIORITIES; i++)
+        _queue_clear(&conn->staged[i]);
+    conn->nstaged = 0;
+    if ((Piter = PyObject_GetIter(conn->filters)) == NULL)
+        RETURN_ERROR();
+    while ((Pitem = PyIter_Next(Piter)) != NULL) {
+        dbus_connection_remove_filter(conn->connection, handler_callback,
+                                      Pitem);
+        Py_DECREF(Pitem);
+        Pitem = NULL;
+    }
+    Py_DECREF(Piter);
+    Piter = NULL;
+    if (PyErr_Occurred())
         RETURN_ERROR();
+    PyDict_Clear(conn->filters);
 
-    if (enabled && (flags & DBUS_WATCH_READABLE)) {
-        Phandler = PyObject_CallMethod(loop, "add_reader", "iOi", fd, Pcallback,
-                                     DBUS_WATCH_READABLE);
-        if (Phandler == NULL)
-            RETURN_ERROR();
-        Pwatch->reader = Phandler;  /* hand off reference */
+    if ((Piter = PyObject_GetIter(conn->object_paths)) == NULL)
+        RETURN_ERROR();
+    while ((Pitem = PyIter_Next(Piter)) != NULL) {
+        if (!dbus_connection_unregister_object_path(conn->connection,
+                            PyUnicode_AsUTF8(Pitem)))
+            RAISE_ERROR("dbus_connection_unregister_object_path() failed");
+        Py_DECREF(Pitem);
+        Pitem = NULL;
     }
-    if ((flags & DBUS_WATCH_WRITABLE) && enabled) {
-        Phandler = PyObject_CallMethod(loop, "add_writer", "iOi", fd, Pcallback,
-                                     DBUS_WATCH_WRITABLE);
-        if (Phandler == NULL)
-            RETURN_ERROR();
-        Pwatch->writer = Phandler;  /* hand off reference */
+    Py_DECREF(Piter);
+    Piter = NULL;
+    if (PyErr_Occurred())
+        RETURN_ERROR();
+    PyDict_Clear(conn->object_paths);
+
+    /* Cancel outstanding pending calls. libdbus does not notify pending
+     * calls when a connection is closed, and the reference that we hold
+     * would keep both the callback and the connection alive. */
+    if ((Piter = PySequence_List(conn->pending)) == NULL)
+        RETURN_ERROR();
+    PyDict_Clear(conn->pending);
+    for (i = 0; i < PyList_GET_SIZE(Piter); i++) {
+        pending = PyLong_AsVoidPtr(PyList_GET_ITEM(Piter, i));
+        dbus_pending_call_cancel(pending);
+        dbus_pending_call_unref(pending);
     }
+    Py_DECREF(Piter);
+    Piter = NULL;
 
-    Py_DECREF(Pcallback);
-    return TRUE;
+    /* Now we can close the connection. Do not close the underlying connection
+     * if it is shared though. */
+
+    /* The next line will drop the D-BUS reference to our connection object.
+     * After this, the connection may be garbage collected if it becomes
+     * unaccessible. */
+    dbus_connection_set_data(conn->connection, slot_self, NULL, NULL);
+    if (!conn->shared)
+        dbus_connection_close(conn->connection);
+    dbus_connection_unref(conn->connection);
+    conn->connection = NULL;
+    Py_DECREF(conn->address);
+    conn->address = NULL;
+    conn->shared = 0;
+    return 0;
 
 error:
-    Py_XDECREF(Pcallback);
-    PRINT_AND_CLEAR_ERROR("add_watch_callback()");
-    return FALSE;
+    Py_XDECREF(Piter);
+    Py_XDECREF(Pitem);
+    return -1;
 }
 
 
-static void
-remove_watch_callback(DBusWatch *watch, void *data)
+PyDoc_STRVAR(connection_get_doc,
+    "get(address, shared=True, register=True)\n\n"
+    "Return a D-BUS connection that is connected to *address*. The address\n"
+    "may be one of BUS_SYSTEM, BUS_SESSION or BUS_STARTER\n"
+    "to connect to one of the well known bus instances, or a string with\n"
+    "a D-BUS connection address. The *shared* argument, if provided,\n"
+    "specifies if this may be a shared connection or not. If *register*\n"
+    "is False, the connection is not registered with a message bus. This\n"
+    "is required for peer-to-peer connections.\n");
+
+static PyObject *
+connection_get(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
 {
-    int fd;
-    WatchObject *Pwatch;
-    PyObject *Pret, *loop = (PyObject *) data;
+    int shared = 1, do_register = 1;
+    PyObject *bus;
+    DBusConnection *connection;
+    static char *kwlist[] = { "bus", "shared", "register", NULL };
 
-    Pwatch = dbus_watch_get_data(watch);
-    ASSERT(Pwatch != NULL);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ii:get", kwlist,
+                                     &bus, &shared, &do_register))
+        return NULL;
 
-    fd = dbus_watch_get_unix_fd(watch);
-    if (fd == -1)
-        fd = dbus_watch_get_socket(watch);
+    if ((connection = _open_connection(bus, shared, do_register)) == NULL)
+        return NULL;
+    return _connection_wrap(cls, connection, bus, shared);
+}
 
-    if (Pwatch->reader != NULL) {
-        Pret = PyObject_CallMethod(loop, "remove_reader", "i", fd);
-        Py_XDECREF(Pret);  /* print error on Pret == NULL below */
-        Py_DECREF(Pwatch->reader);
-        Pwatch->reader = NULL;
+
+/* Return the Python object for *connection*, creating one of type *cls* if
+ * it does not exist yet. This steals the reference to *connection*. */
+
+static PyObject *
+_connection_wrap(PyTypeObject *cls, DBusConnection *connection,
+                 PyObject *bus, int shared)
+{
+    PyObject *Pargs = NULL;
+    ConnectionObject *self = NULL;
+
+    if ((self = dbus_connection_get_data(connection, slot_self)) != NULL) {
+        dbus_connection_unref(connection);
+        Py_INCREF(self);
+        return (PyObject *) self;
     }
-    if (Pwatch->writer != NULL) {
-        Pret = PyObject_CallMethod(loop, "remove_writer", "i", fd);
-        Py_XDECREF(Pret);  /* print error on Pret == NULL below */
-        Py_DECREF(Pwatch->writer);
-        Pwatch->writer = NULL;
+
+    /* Create new python object, by calling tp_new and tp_init. */
+    if ((Pargs = PyTuple_New(0)) == NULL)
+        RETURN_ERROR();
+    if ((self = (ConnectionObject *) cls->tp_new(cls, Pargs, NULL)) == NULL)
+        RETURN_ERROR();
+    Py_DECREF(Pargs);
+    Pargs = NULL;
+    /* We want to call the constructor here to allow derived classes to
+     * do initialization, but we don't want our base constructor to connect
+     * as we are already connected. The small hack below prevents that. */
+    self->connection = connection;  /* hand over D-BUS reference */
+    connection = NULL;
+    self->shared = shared;
+    Py_INCREF(bus);
+    self->address = bus;
+    self->skip_connect = 1;
+    if ((Pargs = PyTuple_New(1)) == NULL)
+        RETURN_ERROR();
+    Py_INCREF(bus);
+    PyTuple_SET_ITEM(Pargs, 0, bus);
+    if (Py_TYPE(self)->tp_init((PyObject *) self, Pargs, NULL) < 0)
+        RETURN_ERROR();
+    Py_DECREF(Pargs);
+    Pargs = NULL;
+    /* Hand off the tp_new() reference to the D-BUS connection.
+     * Also see note in connection_init() */
+    if (!dbus_connection_set_data(self->connection, slot_self, self, decref))
+        RAISE_ERROR("dbus_connection_set_data() failed");
+    if (_add_builtin_filters(self) < 0) {
+        /* The tp_new() reference is owned by the D-BUS connection now.
+         * Clearing the slot releases it. */
+        dbus_connection_set_data(self->connection, slot_self, NULL, NULL);
+        self = NULL;
+        RETURN_ERROR();
     }
 
-    dbus_watch_set_data(watch, NULL, NULL);  /* drops ref to Pwatch */
-    /* fall through */
+    /* Need a new reference because even if the connection was just created,
+     * the tp_new() reference is now owned by the D-BUS connection. */
+    Py_INCREF(self);
+    return (PyObject *) self;
 
 error:
-    PRINT_AND_CLEAR_ERROR("remove_watch_callback()");
+    Py_XDECREF(Pargs);
+    if (connection != NULL) {
+        if (!shared)
+            dbus_connection_close(connection);
+        dbus_connection_unref(connection);
+    }
+    Py_XDECREF(self);  /* closes the connection, if any */
+    return NULL;
 }
 
 
-static void
-watch_toggled_callback(DBusWatch *watch, void *data)
+PyDoc_STRVAR(connection_close_doc,
+    "close()\n\n"
+    "Close a connection. Outstanding method calls that were sent with\n"
+    ":meth:`send_with_reply` are cancelled. Their callbacks are not called.");
+
+static PyObject *
+connection_close(ConnectionObject *self, PyObject *args)
 {
-    int fd, flags, enabled;
-    WatchObject *Pwatch;
-    PyObject *Pcallback = NULL, *Phandler, *Pret, *loop = (PyObject *) data;
+    if (!PyArg_ParseTuple(args, ":close"))
+        return NULL;
+    if (_close_connection(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
 
-    Pwatch = dbus_watch_get_data(watch);
-    ASSERT(Pwatch != NULL);
 
-    fd = dbus_watch_get_unix_fd(watch);
-    if (fd == -1)
-        fd = dbus_watch_get_socket(watch);
-    flags = dbus_watch_get_flags(watch);
-    enabled = dbus_watch_get_enabled(watch);
+PyDoc_STRVAR(connection_send_doc,
+    "send(message, priority=None)\n\n"
+    "Send a message on this connection. The *message* parameter must be a\n"
+    ":class:`dbusx.Message` instance. This method only queues the message\n"
+    "and does not perform any actual IO. The message will be sent out at a\n"
+    "later time either by the event loop. If no event loop is installed,\n"
+    "the message may be sent out manually by calling :meth:`flush` or\n"
+    ":meth:`read_write_dispatch`.\n\n"
+    "If :attr:`outgoing_limit` is set, messages with a *priority* other\n"
+    "than ``PRIORITY_HIGH`` are staged once the outgoing queue reaches the\n"
+    "limit, and are queued as it drains, highest priority first. If no\n"
+    "*priority* is given, signals are ``PRIORITY_NORMAL`` and other\n"
+    "messages are ``PRIORITY_HIGH``. The serial of a staged message is\n"
+    "assigned when it is queued.\n");
 
-    Pcallback = PyObject_GetAttrString((PyObject *) Pwatch, "handle");
-    if (Pcallback == NULL)
-        RETURN_ERROR();
+/* Queue staged messages while the outgoing queue is below the limit. */
 
-    if (enabled && (flags & DBUS_WATCH_READABLE)) {
-        if (Pwatch->reader == NULL) {
-            Phandler = PyObject_CallMethod(loop, "add_reader", "iOi", fd,
-                                         Pcallback, DBUS_WATCH_READABLE);
-            if (Phandler == NULL)
-                RETURN_ERROR();
-            Pwatch->reader = Phandler;  /* hand over reference */
-        }
-    } else  {
-        if (Pwatch->reader != NULL) {
-            Pret = PyObject_CallMethod(loop, "remove_reader", "i", fd);
-            if (Pret == NULL)
-                RETURN_ERROR();
-            Py_DECREF(Pwatch->reader);
-            Pwatch->reader = NULL;
+static int
+_connection_feed_staged(ConnectionObject *conn, int all)
+{
+    int i;
+    DBusMessage *message;
+
+    for (i=0; i<NUM_PRIORITIES && conn->nstaged > 0; i++) {
+        while (conn->connection != NULL && (all
+                    || dbus_connection_get_outgoing_size(conn->connection)
+                        < conn->outgoing_limit)) {
+            if ((message = _queue_pop(&conn->staged[i])) == NULL)
+                break;
+            conn->nstaged--;
+            if (!dbus_connection_send(conn->connection, message, NULL)) {
+                dbus_message_unref(message);
+                RAISE_ERROR("dbus_connection_send() failed");
+            }
+            dbus_message_unref(message);
         }
     }
-    if (enabled && (flags & DBUS_WATCH_WRITABLE)) {
-        if (Pwatch->writer == NULL) {
-            Phandler = PyObject_CallMethod(loop, "add_writer", "iOi", fd,
-                                         Pcallback, DBUS_WATCH_WRITABLE);
-            if (Phandler == NULL)
-                RETURN_ERROR();
-            Pwatch->writer = Phandler;  /* hand off reference */
-        }
-    } else  {
-        if (Pwatch->writer != NULL) {
-            Pret = PyObject_CallMethod(loop, "remove_writer", "i", fd);
-            if (Pret == NULL)
-                RETURN_ERROR();
-            Py_DECREF(Pwatch->writer);
-            Pwatch->writer = NULL;
+    return 0;
+
+error:
+    return -1;
+}
+
+static void
+_connection_written(void *owner)
+{
+    if (_connection_feed_staged((ConnectionObject *) owner, 0) < 0)
+        PRINT_AND_CLEAR_ERROR("_connection_written()");
+}
+
+/* Return the default priority of *message*. See send(). */
+
+static long
+_message_priority(DBusMessage *message)
+{
+    if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL)
+        return PRIORITY_NORMAL;
+    return PRIORITY_HIGH;
+}
+
+/* Queue or stage *message*. See send(). */
+
+static int
+_connection_send(ConnectionObject *conn, DBusMessage *message, long priority)
+{
+    if (conn->connection == NULL)
+        RAISE_ERROR("not connected");
+
+    if (conn->outgoing_limit > 0 && priority != PRIORITY_HIGH) {
+        /* Staged messages go first, so this only stages if it must. */
+        if (_connection_feed_staged(conn, 0) < 0)
+            RETURN_ERROR();
+        if (dbus_connection_get_outgoing_size(conn->connection)
+                    >= conn->outgoing_limit) {
+            if (_queue_push(&conn->staged[priority], message) < 0)
+                RAISE_MEMORY_ERROR();
+            conn->nstaged++;
+            return 0;
         }
     }
 
-    Py_DECREF(Pcallback);
-    return;
+    if (!dbus_connection_send(conn->connection, message, NULL))
+        RAISE_ERROR("dbus_connection_send() failed");
+    return 0;
+
+error:
+    return -1;
+}
+
+static PyObject *
+connection_send(ConnectionObject *self, PyObject *args)
+{
+    long priority = PRIORITY_HIGH;
+    MessageObject *message;
+    PyObject *Ppriority = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O!|O:send", &MessageType, &message,
+                          &Ppriority))
+        return NULL;
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+
+    if (Ppriority != Py_None) {
+        if (!PyLong_Check(Ppriority))
+            RAISE_TYPE_ERROR("expecting an integer or None");
+        priority = PyLong_AsLong(Ppriority);
+        if (priority < 0 || priority >= NUM_PRIORITIES)
+            RAISE_VALUE_ERROR("no such priority: %ld", priority);
+    } else
+        priority = _message_priority(message->message);
+
+    if (_connection_send(self, message->message, priority) < 0)
+        RETURN_ERROR();
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_send_with_reply_doc,
+    "send_with_reply(message, callback, timeout=None)\n\n"
+    "Send a message on this connnection.\n\n"
+    "The *message* parameter must be a :class:`dbusx.Message` instance.\n"
+    "The *callback* parameter is a callback that will be called when a\n"
+    "reply is received. It will be called with a :class:`dbusx.Message`\n"
+    "instance as its only argument containing the reply message. The\n"
+    "*timeout* parameter specifies a timeout in seconds to wait for a reply.\n"
+    "If no reply a received within the timeout, the callback will be called\n"
+    "with a locally generated error reply message. The timeout may be an int\n"
+    "or float. If no timeout is provided a sensible default value will be\n"
+    "used.\n\n");
+
+static void
+pending_call_notify_callback(DBusPendingCall *pending, void *data)
+{
+    MessageObject *Pmessage;
+    PyObject *Presult, *Pcallback, *Ppending, *Pkey;
+
+    /* The data is a (callback, pending, key) tuple. See send_with_reply().
+     * The reference to *pending* was handed to us by send_with_reply(). It
+     * must be dropped on all paths, otherwise the pending call and the
+     * callback that it references are never freed. */
+    Pcallback = PyTuple_GET_ITEM((PyObject *) data, 0);
+    Ppending = PyTuple_GET_ITEM((PyObject *) data, 1);
+    Pkey = PyTuple_GET_ITEM((PyObject *) data, 2);
+    if (PyDict_DelItem(Ppending, Pkey) < 0)
+        PyErr_Clear();
+    Pmessage = (MessageObject *) MessageType.tp_new(&MessageType, NULL, NULL);
+    if (Pmessage == NULL) {
+        PyErr_Clear();
+        dbus_pending_call_unref(pending);
+        return;
+    }
+    Pmessage->message = dbus_pending_call_steal_reply(pending);
+    if (Pmessage->message != NULL) {
+        Presult = PyObject_CallFunction(Pcallback, "O", Pmessage);
+        Py_XDECREF(Presult);
+        if (PyErr_Occurred())
+            PyErr_Clear();
+    }
+    Py_DECREF(Pmessage);
+    dbus_pending_call_unref(pending);
+}
+
+
+static PyObject *
+connection_send_with_reply(ConnectionObject *self, PyObject *args)
+{
+    int msecs, type;
+    PyObject *timeout = NULL, *callback = NULL, *Pkey = NULL, *Pdata = NULL;
+    PyObject *Pvalue = NULL;
+    MessageObject *message;
+    DBusPendingCall *pending = NULL;
+
+    if (!PyArg_ParseTuple(args, "O!O|O:send_with_reply", &MessageType,
+                          &message, &callback, &timeout))
+        return NULL;
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+
+    type = dbus_message_get_type(message->message);
+    if ((type != DBUS_MESSAGE_TYPE_METHOD_CALL) && (callback != NULL))
+        RAISE_ERROR("expecting a METHOD_CALL message");
+
+    if (!PyCallable_Check(callback))
+        RAISE_ERROR("expecting a callable for 'callback'");
+
+    if (timeout == NULL || timeout == Py_None)
+        msecs = -1;
+    else if (PyLong_Check(timeout))
+        msecs = (int) (1000 * PyLong_AsLong(timeout));
+    else if (PyFloat_Check(timeout))
+        msecs = (int) (1000.0 * PyFloat_AsDouble(timeout));
+    else
+        RAISE_ERROR("expecing int, float or None for 'timeout'");
+    if (msecs < 0) msecs = -1;
+
+    if (!dbus_connection_send_with_reply(self->connection,
+                message->message, &pending, msecs) || (pending == NULL))
+        RAISE_ERROR("dbus_connection_send_with_reply() failed");
+
+    /* Keep track of outstanding pending calls so that they can be cancelled
+     * in close(), or failed when the connection is disconnected. */
+    if ((Pkey = PyLong_FromVoidPtr(pending)) == NULL)
+        RETURN_ERROR();
+    if ((Pdata = PyTuple_Pack(3, callback, self->pending, Pkey)) == NULL)
+        RETURN_ERROR();
+    if ((Pvalue = Py_BuildValue("(Ok)", callback, (unsigned long)
+                    dbus_message_get_serial(message->message))) == NULL)
+        RETURN_ERROR();
+    if (PyDict_SetItem(self->pending, Pkey, Pvalue) < 0)
+        RETURN_ERROR();
+    Py_DECREF(Pvalue);
+    Pvalue = NULL;
+    if (!dbus_pending_call_set_notify(pending, pending_call_notify_callback,
+                                      Pdata, decref)) {
+        PyDict_DelItem(self->pending, Pkey);
+        RAISE_MEMORY_ERROR();
+    }
+    Py_DECREF(Pkey);  /* Pdata reference is handed off to libdbus */
+
+    Py_RETURN_NONE;
+
+error:
+    Py_XDECREF(Pkey);
+    Py_XDECREF(Pdata);
+    Py_XDECREF(Pvalue);
+    if (pending != NULL) dbus_pending_call_unref(pending);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_flush_doc,
+    "flush()\n\n"
+    "Flush any messages that were queued but not yet sent out, including\n"
+    "staged messages. This method will block until all output has been\n"
+    "sent out.\n");
+
+static PyObject *
+connection_flush(ConnectionObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ":flush"))
+        return NULL;
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    if (_connection_feed_staged(self, 1) < 0)
+        RETURN_ERROR();
+    /* Without an event loop, libdbus does not call back into Python while
+     * flushing. Release the GIL so that other threads, e.g. an in-process
+     * dbusx.router.Router, can run while we block. */
+    if (self->loop == NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        dbus_connection_flush(self->connection);
+        Py_END_ALLOW_THREADS
+    } else
+        dbus_connection_flush(self->connection);
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_fileno_doc,
+    "fileno()\n\n"
+    "Return the file descriptor of the connection's socket, or -1 if it is\n"
+    "not known.\n");
+
+static PyObject *
+connection_fileno(ConnectionObject *self, PyObject *args)
+{
+    int fd;
+
+    if (!PyArg_ParseTuple(args, ":fileno"))
+        return NULL;
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    if (!dbus_connection_get_socket(self->connection, &fd))
+        fd = -1;
+    return PyLong_FromLong(fd);
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_dispatch_doc,
+    "dispatch()\n\n"
+    "Dispatch one incoming message, if available. Messages are dispatched\n"
+    "in three steps. First, method call responses are dispatched to\n"
+    "callbacks that were registered with send(). Second, messages of any\n"
+    "type are passed to the installed message filters, in the order the\n"
+    "filters were added. Finally, for method calls, if there is a registered\n"
+    "object path handler that matches the message's path, the message is\n"
+    "dispatched there. The first callback that accepts a message completes\n"
+    "the dispatch.\n\n"
+    "This method returns the new dispatch status of the connection.\n");
+
+static PyObject *
+connection_dispatch(ConnectionObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ":dispatch"))
+        return NULL;
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+
+    if (dbus_connection_get_dispatch_status(self->connection)
+                == DBUS_DISPATCH_DATA_REMAINS) {
+        if (dbus_connection_dispatch(self->connection)
+                    == DBUS_DISPATCH_NEED_MEMORY)
+            RAISE_MEMORY_ERROR();
+    } else if (_connection_dispatch_deferred(self) < 0)
+        return NULL;
+    if (self->connection == NULL)
+        return PyLong_FromLong(DBUS_DISPATCH_COMPLETE);
+    return PyLong_FromLong(_connection_dispatch_status(self));
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_dispatch_all_doc,
+    "dispatch_all()\n\n"
+    "Call dispatch() until no more dispatch data remains, or until the\n"
+    "dispatch budget is used up. See :attr:`dispatch_budget` and\n"
+    ":attr:`dispatch_time`. If data remains and an event loop is installed,\n"
+    "another call is scheduled with ``call_soon()``.\n");
+
+static PyObject *
+connection_dispatch_all(ConnectionObject *self, PyObject *args)
+{
+    int status = DBUS_DISPATCH_COMPLETE, ret;
+    long count = 0;
+    double deadline = 0.0;
+    Py_ssize_t ndeferred;
+    PyObject *Pret, *Pcb = NULL;
+
+    if (!PyArg_ParseTuple(args, ":dispatch_all"))
+        return NULL;
+
+    if (self->dispatch_time > 0.0)
+        deadline = _timer_now() + self->dispatch_time;
+
+    /* A handler may close the connection while we are dispatching. Messages
+     * that libdbus has queued go first, so that method calls and replies
+     * overtake the signals that were held back by priority_filter(). Holding
+     * back a message is cheap, so it does not count against the budget. */
+    while (self->connection != NULL) {
+        ndeferred = self->ndeferred;
+        if (dbus_connection_get_dispatch_status(self->connection)
+                    == DBUS_DISPATCH_DATA_REMAINS) {
+            if (dbus_connection_dispatch(self->connection)
+                        == DBUS_DISPATCH_NEED_MEMORY)
+                RAISE_MEMORY_ERROR();
+        } else if ((ret = _connection_dispatch_deferred(self)) < 0)
+            RETURN_ERROR();
+        else if (ret == 0)
+            break;
+        if (self->ndeferred > ndeferred)
+            continue;
+        count++;
+        if ((self->dispatch_budget > 0 && count >= self->dispatch_budget)
+                    || (deadline > 0.0 && _timer_now() >= deadline))
+            break;
+    }
+    if (self->connection != NULL)
+        status = _connection_dispatch_status(self);
+
+    if (self->dispatch != NULL) {
+        Pret = PyObject_CallMethod(self->dispatch, "cancel", NULL);
+        if (PyErr_Occurred())
+            PyErr_Clear();
+        Py_XDECREF(Pret);
+        Py_DECREF(self->dispatch);
+        self->dispatch = NULL;
+    }
+
+    /* Give the other event sources a chance before dispatching the rest. */
+    if (status == DBUS_DISPATCH_DATA_REMAINS && self->connection != NULL
+                && self->loop != NULL) {
+        Pcb = PyObject_GetAttrString((PyObject *) self, "dispatch_all");
+        if (Pcb == NULL)
+            RETURN_ERROR();
+        self->dispatch = PyObject_CallMethod(self->loop, "call_soon", "O", Pcb);
+        if (self->dispatch == NULL)
+            RETURN_ERROR();
+        Py_DECREF(Pcb);
+    }
+
+    Py_RETURN_NONE;
+
+error:
+    Py_XDECREF(Pcb);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_read_write_dispatch_doc,
+    "read_write_dispatch(timeout)\n\n"
+    "Run one iteration of the built-in, blocking event loop, and then\n"
+    "dispatch one message.\n\n"
+    "The *timeout* argument specifies the timeout for the built-in event\n"
+    "loop. Note that if this built-in loop blocks, it cannot be pre-empted,\n"
+    "not even by e.g sending a signal to the current process. Therefore,\n"
+    "the built-in loop should only be used in simple applications that do\n"
+    "not need to multiplex multple things.\n\n");
+
+static PyObject *
+connection_read_write_dispatch(ConnectionObject *self, PyObject *args)
+{
+    int status, msecs;
+    PyObject *timeout = NULL;
+
+    if (!PyArg_ParseTuple(args, "|O:read_write_dispatch", &timeout))
+        return NULL;
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+
+    if (timeout == NULL || timeout == Py_None)
+        msecs = 0;
+    else if (PyLong_Check(timeout))
+        msecs = (int) (1000 * PyLong_AsLong(timeout));
+    else if (PyFloat_Check(timeout))
+        msecs = (int) (1000.0 * PyFloat_AsDouble(timeout));
+    else
+        RAISE_ERROR("expecing int, float or None for 'timeout'");
+    if (msecs < 0) msecs = -1;
+
+    /* Dispatching calls back into Python, but reading and writing does
+     * not if there is no event loop. In that case do the blocking part
+     * without the GIL. This does what dbus_connection_read_write_dispatch()
+     * does: dispatch a message if there is one, otherwise block. */
+    if (dbus_connection_get_dispatch_status(self->connection)
+                != DBUS_DISPATCH_DATA_REMAINS && self->ndeferred > 0) {
+        /* Read what is available first, so that new method calls and
+         * replies overtake the signals that are held back. */
+        dbus_connection_read_write(self->connection, 0);
+        if (dbus_connection_get_dispatch_status(self->connection)
+                    == DBUS_DISPATCH_DATA_REMAINS)
+            dbus_connection_dispatch(self->connection);
+        else if (_connection_dispatch_deferred(self) < 0)
+            return NULL;
+        status = self->connection != NULL;
+    } else if (self->loop == NULL && dbus_connection_get_dispatch_status(
+                self->connection) != DBUS_DISPATCH_DATA_REMAINS) {
+        Py_BEGIN_ALLOW_THREADS
+        status = dbus_connection_read_write(self->connection, msecs);
+        Py_END_ALLOW_THREADS
+    } else
+        status = dbus_connection_read_write_dispatch(self->connection, msecs);
+    if (self->nstaged > 0 && _connection_feed_staged(self, 0) < 0)
+        return NULL;
+    return PyBool_FromLong(status);
+
+error:
+    return NULL;
+}
+
+
+static dbus_bool_t
+add_watch_callback(DBusWatch *watch, void *data)
+{
+    int fd, flags, enabled;
+    WatchObject *Pwatch = NULL;
+    PyObject *Pcallback = NULL, *Phandler, *loop = (PyObject *) data;
+
+    ASSERT(dbus_watch_get_data(watch) == NULL);
+
+    Pwatch = (WatchObject *) WatchType.tp_new(&WatchType, NULL, NULL);
+    if (Pwatch == NULL)
+        RETURN_ERROR();
+    Pwatch->watch = watch;
+    dbus_watch_set_data(watch, Pwatch, decref);  /* hand off ref to dbus */
+
+    fd = dbus_watch_get_unix_fd(watch);
+    if (fd == -1)
+        fd = dbus_watch_get_socket(watch);
+    flags = dbus_watch_get_flags(watch);
+    enabled = dbus_watch_get_enabled(watch);
+
+    Pcallback = PyObject_GetAttrString((PyObject *) Pwatch, "handle");
+    if (Pcallback == NULL)
+        RETURN_ERROR();
+
+    if (enabled && (flags & DBUS_WATCH_READABLE)) {
+        Phandler = PyObject_CallMethod(loop, "add_reader", "iOi", fd, Pcallback,
+                                     DBUS_WATCH_READABLE);
+        if (Phandler == NULL)
+            RETURN_ERROR();
+        Pwatch->reader = Phandler;  /* hand off reference */
+    }
+    if ((flags & DBUS_WATCH_WRITABLE) && enabled) {
+        Phandler = PyObject_CallMethod(loop, "add_writer", "iOi", fd, Pcallback,
+                                     DBUS_WATCH_WRITABLE);
+        if (Phandler == NULL)
+            RETURN_ERROR();
+        Pwatch->writer = Phandler;  /* hand off reference */
+    }
+
+    Py_DECREF(Pcallback);
+    return TRUE;
+
+error:
+    Py_XDECREF(Pcallback);
+    PRINT_AND_CLEAR_ERROR("add_watch_callback()");
+    return FALSE;
+}
+
+
+static void
+remove_watch_callback(DBusWatch *watch, void *data)
+{
+    int fd;
+    WatchObject *Pwatch;
+    PyObject *Pret, *loop = (PyObject *) data;
+
+    Pwatch = dbus_watch_get_data(watch);
+    ASSERT(Pwatch != NULL);
+
+    fd = dbus_watch_get_unix_fd(watch);
+    if (fd == -1)
+        fd = dbus_watch_get_socket(watch);
+
+    if (Pwatch->reader != NULL) {
+        Pret = PyObject_CallMethod(loop, "remove_reader", "i", fd);
+        Py_XDECREF(Pret);  /* print error on Pret == NULL below */
+        Py_DECREF(Pwatch->reader);
+        Pwatch->reader = NULL;
+    }
+    if (Pwatch->writer != NULL) {
+        Pret = PyObject_CallMethod(loop, "remove_writer", "i", fd);
+        Py_XDECREF(Pret);  /* print error on Pret == NULL below */
+        Py_DECREF(Pwatch->writer);
+        Pwatch->writer = NULL;
+    }
+
+    dbus_watch_set_data(watch, NULL, NULL);  /* drops ref to Pwatch */
+    /* fall through */
+
+error:
+    PRINT_AND_CLEAR_ERROR("remove_watch_callback()");
+}
+
+
+static void
+watch_toggled_callback(DBusWatch *watch, void *data)
+{
+    int fd, flags, enabled;
+    WatchObject *Pwatch;
+    PyObject *Pcallback = NULL, *Phandler, *Pret, *loop = (PyObject *) data;
+
+    Pwatch = dbus_watch_get_data(watch);
+    ASSERT(Pwatch != NULL);
+
+    fd = dbus_watch_get_unix_fd(watch);
+    if (fd == -1)
+        fd = dbus_watch_get_socket(watch);
+    flags = dbus_watch_get_flags(watch);
+    enabled = dbus_watch_get_enabled(watch);
+
+    Pcallback = PyObject_GetAttrString((PyObject *) Pwatch, "handle");
+    if (Pcallback == NULL)
+        RETURN_ERROR();
+
+    if (enabled && (flags & DBUS_WATCH_READABLE)) {
+        if (Pwatch->reader == NULL) {
+            Phandler = PyObject_CallMethod(loop, "add_reader", "iOi", fd,
+                                         Pcallback, DBUS_WATCH_READABLE);
+            if (Phandler == NULL)
+                RETURN_ERROR();
+            Pwatch->reader = Phandler;  /* hand over reference */
+        }
+    } else  {
+        if (Pwatch->reader != NULL) {
+            Pret = PyObject_CallMethod(loop, "remove_reader", "i", fd);
+            if (Pret == NULL)
+                RETURN_ERROR();
+            Py_DECREF(Pwatch->reader);
+            Pwatch->reader = NULL;
+        }
+    }
+    if (enabled && (flags & DBUS_WATCH_WRITABLE)) {
+        if (Pwatch->writer == NULL) {
+            Phandler = PyObject_CallMethod(loop, "add_writer", "iOi", fd,
+                                         Pcallback, DBUS_WATCH_WRITABLE);
+            if (Phandler == NULL)
+                RETURN_ERROR();
+            Pwatch->writer = Phandler;  /* hand off reference */
+        }
+    } else  {
+        if (Pwatch->writer != NULL) {
+            Pret = PyObject_CallMethod(loop, "remove_writer", "i", fd);
+            if (Pret == NULL)
+                RETURN_ERROR();
+            Py_DECREF(Pwatch->writer);
+            Pwatch->writer = NULL;
+        }
+    }
+
+    Py_DECREF(Pcallback);
+    return;
+
+error:
+    Py_XDECREF(Pcallback);
+    PRINT_AND_CLEAR_ERROR("watch_toggled_callback()");
+}
+
+
+static dbus_bool_t
+add_timeout_callback(DBusTimeout *timeout, void *data)
+{
+    int enabled;
+    float interval;
+    TimeoutObject *Ptimeout;
+    PyObject *Pcallback = NULL, *Ptimer, *loop = (PyObject *) data;
+
+    ASSERT(dbus_timeout_get_data(timeout) == NULL);
+
+    Ptimeout = (TimeoutObject *) TimeoutType.tp_new(&TimeoutType, NULL, NULL);
+    if (Ptimeout == NULL)
+        RETURN_ERROR();
+    Ptimeout->timeout = timeout;
+    /* Hand off Ptimeout reference to dbus. */
+    dbus_timeout_set_data(timeout, Ptimeout, decref);
+
+    enabled = dbus_timeout_get_enabled(timeout);
+    if (enabled) {
+        Pcallback = PyObject_GetAttrString((PyObject *) Ptimeout, "handle");
+        if (Pcallback == NULL)
+            RETURN_ERROR();
+        interval = (float) dbus_timeout_get_interval(timeout) / 1000.0;
+        Ptimer = PyObject_CallMethod(loop, "call_repeatedly", "fO", interval,
+                                     Pcallback);
+        if (Ptimer == NULL)
+            RETURN_ERROR();
+        Ptimeout->timer = Ptimer;
+        Py_DECREF(Pcallback);
+        Pcallback = NULL;
+    }
+
+    return TRUE;
+
+error:
+    Py_XDECREF(Pcallback);
+    PRINT_AND_CLEAR_ERROR("add_timeout_callback()");
+    return FALSE;
+}
+
+
+static void
+remove_timeout_callback(DBusTimeout *timeout, void *data)
+{
+    TimeoutObject *Ptimeout;
+    PyObject *Pret = NULL;
+
+    Ptimeout = dbus_timeout_get_data(timeout);
+    ASSERT(Ptimeout != NULL);
+    Pret = PyObject_CallMethod(Ptimeout->timer, "cancel", NULL);
+    Py_XDECREF(Pret);  /* print error Pret == NULL below */
+    dbus_timeout_set_data(timeout, NULL, NULL);  /* drops ref to Ptimeout */
+    /* fallthrough */
+
+error:
+    PRINT_AND_CLEAR_ERROR("remove_timeout_callback()");
+}
+
+
+static void
+timeout_toggled_callback(DBusTimeout *timeout, void *data)
+{
+    int enabled;
+    float interval;
+    TimeoutObject *Ptimeout;
+    PyObject *Ptimer, *Pret = NULL, *Pcallback = NULL;
+    PyObject *loop = (PyObject *) data;
+
+    Ptimeout = dbus_timeout_get_data(timeout);
+    ASSERT(Ptimeout != NULL);
+    ASSERT(Ptimeout->timer != NULL);
+
+    /* First disable the current timer... */
+    Pret = PyObject_CallMethod(Ptimeout->timer, "cancel", NULL);
+    if (Pret == NULL)
+        RETURN_ERROR();
+    Py_DECREF(Pret);
+    Pret = NULL;
+    Py_DECREF(Ptimeout->timer);
+    Ptimeout->timer = NULL;
+
+    /* And conditonally create a new one... */
+    enabled = dbus_timeout_get_enabled(timeout);
+    if (enabled) {
+        Pcallback = PyObject_GetAttrString((PyObject *) Ptimeout, "handle");
+        if (Pcallback == NULL)
+            RETURN_ERROR();
+        interval = (float) dbus_timeout_get_interval(timeout) / 1000.0;
+        Ptimer = PyObject_CallMethod(loop, "call_repeatedly", "fO",
+                                     interval, Pcallback);
+        if (Ptimer == NULL)
+            RETURN_ERROR();
+        Ptimeout->timer = Ptimer;  /* hand off reference */
+        Py_DECREF(Pcallback);
+        Pcallback = NULL;
+    }
+
+    return;
+
+error:
+    Py_XDECREF(Pcallback);
+    Py_XDECREF(Pret);
+    PRINT_AND_CLEAR_ERROR("timeout_toggled_callback()");
+}
+
+
+static int
+_connection_cancel_timer(ConnectionObject *conn)
+{
+    PyObject *Pret;
+
+    if (conn->timers.timer == NULL)
+        return 0;
+    Pret = PyObject_CallMethod(conn->timers.timer, "cancel", NULL);
+    Py_CLEAR(conn->timers.timer);
+    if (Pret == NULL)
+        return -1;
+    Py_DECREF(Pret);
+    return 0;
+}
+
+
+/* Make sure the event loop timer expires no later than the first deadline.
+ * A timer that expires too early finds nothing to do and is re-armed. */
+
+static int
+_connection_schedule_timer(ConnectionObject *conn)
+{
+    double deadline, delay;
+    TimerQueue *queue = &conn->timers;
+    PyObject *Pcallback = NULL;
+
+    if (queue->running || conn->loop == NULL || queue->size == 0)
+        return 0;
+    deadline = queue->heap[0]->deadline;
+    if (queue->timer != NULL && queue->scheduled <= deadline)
+        return 0;
+    if (_connection_cancel_timer(conn) < 0)
+        RETURN_ERROR();
+    Pcallback = PyObject_GetAttrString((PyObject *) conn, "handle_timeouts");
+    if (Pcallback == NULL)
+        RETURN_ERROR();
+    delay = deadline - _timer_now();
+    if (delay < 0)
+        delay = 0;
+    queue->timer = PyObject_CallMethod(conn->loop, "call_later", "dO", delay,
+                                       Pcallback);
+    if (queue->timer == NULL)
+        RETURN_ERROR();
+    queue->scheduled = deadline;
+    Py_DECREF(Pcallback);
+    return 0;
+
+error:
+    Py_XDECREF(Pcallback);
+    return -1;
+}
+
+
+static void
+_connection_start_timeout(ConnectionObject *conn, DBusTimeout *timeout)
+{
+    TimerEntry *entry = dbus_timeout_get_data(timeout);
+
+    entry->deadline = _timer_now() + dbus_timeout_get_interval(timeout)/1000.0;
+    if (_timer_push(&conn->timers, entry) < 0)
+        RAISE_MEMORY_ERROR();
+    if (_connection_schedule_timer(conn) < 0)
+        RETURN_ERROR();
+    return;
+
+error:
+    PRINT_AND_CLEAR_ERROR("_connection_start_timeout()");
+}
+
+
+static dbus_bool_t
+connection_add_timeout_callback(DBusTimeout *timeout, void *data)
+{
+    TimerEntry *entry;
+    ConnectionObject *conn = (ConnectionObject *) data;
+
+    ASSERT(dbus_timeout_get_data(timeout) == NULL);
+    if ((entry = malloc(sizeof(TimerEntry))) == NULL)
+        return FALSE;
+    entry->timeout = timeout;
+    entry->index = -1;
+    dbus_timeout_set_data(timeout, entry, free);
+    if (dbus_timeout_get_enabled(timeout))
+        _connection_start_timeout(conn, timeout);
+    return TRUE;
+
+error:
+    PRINT_AND_CLEAR_ERROR("connection_add_timeout_callback()");
+    return FALSE;
+}
+
+
+static void
+connection_remove_timeout_callback(DBusTimeout *timeout, void *data)
+{
+    TimerEntry *entry;
+    ConnectionObject *conn = (ConnectionObject *) data;
+
+    entry = dbus_timeout_get_data(timeout);
+    ASSERT(entry != NULL);
+    _timer_remove(&conn->timers, entry);
+    dbus_timeout_set_data(timeout, NULL, NULL);  /* frees entry */
+    /* fallthrough */
+
+error:
+    PRINT_AND_CLEAR_ERROR("connection_remove_timeout_callback()");
+}
+
+
+static void
+connection_timeout_toggled_callback(DBusTimeout *timeout, void *data)
+{
+    TimerEntry *entry;
+    ConnectionObject *conn = (ConnectionObject *) data;
+
+    entry = dbus_timeout_get_data(timeout);
+    ASSERT(entry != NULL);
+    _timer_remove(&conn->timers, entry);
+    if (dbus_timeout_get_enabled(timeout))
+        _connection_start_timeout(conn, timeout);
+    /* fallthrough */
+
+error:
+    PRINT_AND_CLEAR_ERROR("connection_timeout_toggled_callback()");
+}
+
+
+PyDoc_STRVAR(connection_handle_timeouts_doc,
+    "handle_timeouts()\n\n"
+    "Handle the D-BUS timeouts that have expired. This is called by the\n"
+    "event loop. All timeouts of a connection share a single event loop\n"
+    "timer, which is set for the first deadline.\n");
+
+static PyObject *
+connection_handle_timeouts(ConnectionObject *self, PyObject *args)
+{
+    double now;
+    TimerEntry *entry;
+    TimerQueue *queue = &self->timers;
+
+    if (!PyArg_ParseTuple(args, ":handle_timeouts"))
+        return NULL;
+    if (_connection_cancel_timer(self) < 0)
+        return NULL;
+
+    now = _timer_now();
+    queue->running = 1;
+    while (queue->size > 0 && queue->heap[0]->deadline <= now) {
+        /* D-BUS timeouts repeat until they are disabled or removed, which
+         * handling one may do. So re-arm it first. */
+        entry = queue->heap[0];
+        entry->deadline = now + dbus_timeout_get_interval(entry->timeout)
+                    / 1000.0;
+        _timer_sift_down(queue, 0);
+        if (!dbus_timeout_handle(entry->timeout)) {
+            queue->running = 0;
+            RAISE_MEMORY_ERROR();
+        }
+    }
+    queue->running = 0;
+
+    if (_connection_schedule_timer(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+static void
+dispatch_status_callback(DBusConnection *connection, DBusDispatchStatus status,
+                         void *data)
+{
+    ConnectionObject *Pconn;
+    PyObject *Pcb = NULL;
+
+    Pconn = (ConnectionObject *) dbus_connection_get_data(connection, slot_self);
+    ASSERT(Pconn != NULL);
+    ASSERT(Pconn->loop != NULL);
+    if (Pconn->dispatch != NULL)
+        return;  /* Already dispatching. */
+
+    Pcb = PyObject_GetAttrString((PyObject *) Pconn, "dispatch_all");
+    if (Pcb == NULL)
+        RETURN_ERROR();
+    Pconn->dispatch = PyObject_CallMethod(Pconn->loop, "call_soon", "O", Pcb);
+    /* Reference to Pcb will be dropped by dispatch_all(). */
+
+error:
+    Py_XDECREF(Pcb);
+    PRINT_AND_CLEAR_ERROR("dispatch_status_callback()");
+}
+
+
+PyDoc_STRVAR(connection_set_route_peer_messages_doc,
+    "set_route_peer_messages(value)\n\n"
+    "By default, libdbus replies to messages on the org.freedesktop.DBus.Peer\n"
+    "interface itself. If *value* is True, such messages that have a\n"
+    "destination are dispatched like any other message instead. A message\n"
+    "bus needs this to forward them.\n");
+
+static PyObject *
+connection_set_route_peer_messages(ConnectionObject *self, PyObject *args)
+{
+    int value;
+
+    if (!PyArg_ParseTuple(args, "i:set_route_peer_messages", &value))
+        return NULL;
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    dbus_connection_set_route_peer_messages(self->connection, value);
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+/* The watch functions of a connection also feed staged messages once the
+ * connection was writable. */
+
+static dbus_bool_t
+connection_add_watch_callback(DBusWatch *watch, void *data)
+{
+    WatchObject *Pwatch;
+    ConnectionObject *conn = (ConnectionObject *) data;
+
+    if (!add_watch_callback(watch, conn->loop))
+        return FALSE;
+    Pwatch = dbus_watch_get_data(watch);
+    if (Pwatch != NULL) {
+        Pwatch->written = _connection_written;
+        Pwatch->owner = conn;
+    }
+    return TRUE;
+}
+
+static void
+connection_remove_watch_callback(DBusWatch *watch, void *data)
+{
+    WatchObject *Pwatch;
+    ConnectionObject *conn = (ConnectionObject *) data;
+
+    /* The loop may still hold a reference to the watch. */
+    if ((Pwatch = dbus_watch_get_data(watch)) != NULL) {
+        Pwatch->written = NULL;
+        Pwatch->owner = NULL;
+    }
+    remove_watch_callback(watch, conn->loop);
+}
+
+static void
+connection_watch_toggled_callback(DBusWatch *watch, void *data)
+{
+    ConnectionObject *conn = (ConnectionObject *) data;
+
+    watch_toggled_callback(watch, conn->loop);
+}
+
+
+PyDoc_STRVAR(connection_set_priority_doc,
+    "set_priority(interface, priority)\n\n"
+    "Set the priority of incoming signals on *interface*. The priority is\n"
+    "one of ``PRIORITY_HIGH``, ``PRIORITY_NORMAL`` or ``PRIORITY_LOW``.\n"
+    "High priority signals are dispatched in order with method calls and\n"
+    "replies. Other signals are held back when :attr:`prioritize` is set.\n"
+    "Signals on interfaces without a priority are normal priority. A\n"
+    "*priority* of None removes the priority of *interface*.\n");
+
+static PyObject *
+connection_set_priority(ConnectionObject *self, PyObject *args)
+{
+    long priority;
+    PyObject *Pinterface, *Ppriority;
+
+    if (!PyArg_ParseTuple(args, "UO:set_priority", &Pinterface, &Ppriority))
+        return NULL;
+    if (Ppriority == Py_None) {
+        if (PyDict_DelItem(self->priorities, Pinterface) < 0) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                return NULL;
+            PyErr_Clear();
+        }
+        Py_RETURN_NONE;
+    }
+    if (!PyLong_Check(Ppriority))
+        RAISE_TYPE_ERROR("expecting an integer or None");
+    priority = PyLong_AsLong(Ppriority);
+    if (priority < 0 || priority >= NUM_PRIORITIES)
+        RAISE_VALUE_ERROR("no such priority: %ld", priority);
+    if (PyDict_SetItem(self->priorities, Pinterface, Ppriority) < 0)
+        RETURN_ERROR();
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_set_conflation_doc,
+    "set_conflation(interface, member, mode)\n\n"
+    "Conflate incoming signals *member* on *interface*. Conflated signals\n"
+    "are held back like low priority signals, and a signal replaces an\n"
+    "older one that has the same key and that was not dispatched yet, so\n"
+    "that only the newest one is passed to the filters. With\n"
+    "``CONFLATE_SIGNAL`` the key is the sender, the path and the signal.\n"
+    "With ``CONFLATE_ARG0`` the first argument is part of the key as well,\n"
+    "if it is a string. A *mode* of None stops conflating the signal.\n"
+    "Conflation applies to all filters on the connection.\n");
+
+static PyObject *
+connection_set_conflation(ConnectionObject *self, PyObject *args)
+{
+    long mode;
+    PyObject *Pinterface, *Pmember, *Pmode, *Prule = NULL;
+
+    if (!PyArg_ParseTuple(args, "UUO:set_conflation", &Pinterface,
+                          &Pmember, &Pmode))
+        return NULL;
+    if ((Prule = PyTuple_Pack(2, Pinterface, Pmember)) == NULL)
+        RETURN_ERROR();
+    if (Pmode == Py_None) {
+        if (PyDict_DelItem(self->conflation, Prule) < 0) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                RETURN_ERROR();
+            PyErr_Clear();
+        }
+        Py_DECREF(Prule);
+        Py_RETURN_NONE;
+    }
+    if (!PyLong_Check(Pmode))
+        RAISE_TYPE_ERROR("expecting an integer or None");
+    mode = PyLong_AsLong(Pmode);
+    if (mode != CONFLATE_SIGNAL && mode != CONFLATE_ARG0)
+        RAISE_VALUE_ERROR("no such conflation mode: %ld", mode);
+    if (PyDict_SetItem(self->conflation, Prule, Pmode) < 0)
+        RETURN_ERROR();
+    Py_DECREF(Prule);
+    Py_RETURN_NONE;
+
+error:
+    Py_XDECREF(Prule);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_set_loop_doc,
+    "set_loop(loop)\n\n"
+    "Enable event loop integration for this connection. The *loop*\n"
+    "parameter must be an :class:`looping.EventLoop` instance.\n");
+
+static PyObject *
+connection_set_loop(ConnectionObject *self, PyObject *args)
+{
+    PyObject *loop, *Pcb = NULL;
+
+    if (!PyArg_ParseTuple(args, "O:set_loop", &loop))
+        RETURN_ERROR();
+
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    if (self->loop != NULL)
+        RAISE_ERROR("an event loop is already installed");
+    ASSERT(self->dispatch == NULL);
+
+    if (!PyObject_HasAttrString(loop, "add_reader") ||
+                !PyObject_HasAttrString(loop, "remove_reader") ||
+                !PyObject_HasAttrString(loop, "add_writer") ||
+                !PyObject_HasAttrString(loop, "remove_writer") ||
+                !PyObject_HasAttrString(loop, "call_soon") ||
+                !PyObject_HasAttrString(loop, "call_later"))
+        RAISE_ERROR("expecting a looping.EventLoop like object");
+
+    Py_INCREF(loop);
+    self->loop = loop;
+
+    if (!dbus_connection_set_watch_functions(self->connection,
+            connection_add_watch_callback, connection_remove_watch_callback,
+            connection_watch_toggled_callback, self, NULL))
+        RAISE_ERROR("dbus_connection_set_watch_functions() failed");
+
+    /* The timer queue is part of this object, and _close_connection()
+     * removes the timeout functions, so they do not need a reference. */
+    if (!dbus_connection_set_timeout_functions(self->connection,
+            connection_add_timeout_callback,
+            connection_remove_timeout_callback,
+            connection_timeout_toggled_callback, self, NULL))
+        RAISE_ERROR("dbus_connection_set_timeout_functions() failed");
+
+    dbus_connection_set_dispatch_status_function(self->connection,
+                dispatch_status_callback, NULL, NULL);
+    
+    /* Schedule a call to dispatch_all() now if the current dispatch status
+     * is DBUS_DISPATCH_DATA_REMAINS. The DBUS dispatch status function API
+     * is edge trigered so it only fires on status changes. */
+
+    if (dbus_connection_get_dispatch_status(self->connection)
+                == DBUS_DISPATCH_DATA_REMAINS) {
+        Pcb = PyObject_GetAttrString((PyObject *) self, "dispatch_all");
+        if (Pcb == NULL)
+            RETURN_ERROR();
+        self->dispatch = PyObject_CallMethod(self->loop, "call_soon",
+                                             "O", Pcb);
+        /* Reference to Pcb will be dropped by dispatch_all(). */
+    }
+
+    Py_RETURN_NONE;
+
+error:
+    Py_XDECREF(Pcb);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_add_filter_doc,
+    "add_filter(filter)\n\n"
+    "Add a filter handler. The *filter* argument must be a Python callable.\n"
+    "The handler will be called with two arguments: the Connection and a\n"
+    "Message. It must return a boolean that indicates wether or not the\n"
+    "message was accepted.\n\n"
+    "Filter handlers are run in the order they were added, and the handler\n"
+    "that first accepts a message stops further dispatching.\n\n"
+    "Filter handlers are run after method replies are dispatched via the\n"
+    "PendingCall mechanism, but before object path handlers.\n");
+
+static PyObject *
+connection_add_filter(ConnectionObject *self, PyObject *args)
+{
+    int found;
+    PyObject *filter;
+
+    if (!PyArg_ParseTuple(args, "O:add_filter", &filter))
+        RETURN_ERROR();
+    if (!PyCallable_Check(filter))
+        RAISE_ERROR("expecting a Python callable");
+
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    if ((found = PyDict_Contains(self->filters, filter)) < 0)
+        RETURN_ERROR();
+    if (!found) {
+        if (!dbus_connection_add_filter(self->connection, handler_callback,
+                                        filter, decref))
+            RAISE_ERROR("dbus_connection_add_filter() failed");
+        Py_INCREF(filter);
+        if (PyDict_SetItem(self->filters, filter, filter) < 0)
+            RETURN_ERROR();
+    }
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_remove_filter_doc,
+    "remove_filter(filter)\n\n"
+    "Remove a filter that was previously added with :meth:`add_filter`.\n"
+    "It is an error to remove a filter that was not added.\n");
+
+static PyObject *
+connection_remove_filter(ConnectionObject *self, PyObject *args)
+{
+    PyObject *filter, *Pstored;
+
+    if (!PyArg_ParseTuple(args, "O:remove_filter", &filter))
+        RETURN_ERROR();
+    if (!PyCallable_Check(filter))
+        RAISE_ERROR("expecting a Python callable");
+
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    /* The filter may compare equal to the one that was added without being
+     * the same object (e.g. a bound method). libdbus looks up filters by
+     * identity, so use the object that was added. */
+    if ((Pstored = PyDict_GetItem(self->filters, filter)) == NULL) {
+        if (PyErr_Occurred())
+            RETURN_ERROR();
+        RAISE_ERROR("no such filter");
+    }
+    dbus_connection_remove_filter(self->connection, handler_callback,
+                                  Pstored);
+    if (PyDict_DelItem(self->filters, filter) < 0)
+        RETURN_ERROR();
+
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_register_object_path_doc,
+    "register_object_path(path, handler, fallback=False)\n\n"
+    "Register an object path handler. The *path* argument specifies the\n"
+    "path, and *handler* must be a Python callable. If *fallback* is true,\n"
+    "any path below the given path will also be handled by the handler\n"
+    "It is an error to register an object path handler for a path that\n"
+    "was already previously registered.\n\n"
+    "The handler will be called with two arguments: the Connection\n"
+    "and a Message. It must return a boolean whether or not the message\n"
+    "was accepted.\n\n"
+    "Object path handlers handle only method calls. Messages will be\n"
+    "dispatched to object path handlers after all registered filters\n"
+    "have been run. Once a filter or object path handler accepts a message,\n"
+    "the message is considered handled and dispatching will stop.\n");
+
+static void
+decref_vtable(DBusConnection *connection, void *data)
+{
+    Py_DECREF((PyObject *) data);
+}
+
+static PyObject *
+connection_register_object_path(ConnectionObject *self,
+                                      PyObject *args)
+{
+    char *path;
+    int ret, fallback = 0;
+    PyObject *handler, *Ppath = NULL;
+    DBusError error = DBUS_ERROR_INIT;
+    DBusObjectPathVTable *vtable = NULL;
+
+    if (!PyArg_ParseTuple(args, "sO|i:register_object_path", &path, &handler,
+                          &fallback))
+        return NULL;
+    if (!_check_path(path))
+        RAISE_ERROR("invalid path");
+    if (!PyCallable_Check(handler))
+        RAISE_ERROR("expecting a Python callable");
+
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    if ((vtable = calloc(1, sizeof (DBusObjectPathVTable))) == NULL)
+        RAISE_MEMORY_ERROR();
+    vtable->message_function = handler_callback;
+    vtable->unregister_function = decref_vtable;
+    if (fallback)
+        ret = dbus_connection_try_register_fallback(self->connection, path,
+                            vtable, handler, &error);
+    else
+        ret = dbus_connection_try_register_object_path(self->connection, path,
+                            vtable, handler, &error);
+    if (!ret) {
+        if (dbus_error_is_set(&error))
+            RAISE_ERROR("dbus: %s", error.message);
+        else
+            RAISE_ERROR("Unknown error");
+    }
+    Py_INCREF(handler);
+    free(vtable); vtable = NULL;
+    if ((Ppath = PyUnicode_FromString(path)) == NULL)
+        RETURN_ERROR();
+    if (PyDict_SetItem(self->object_paths, Ppath, handler) < 0)
+        RETURN_ERROR();
+    Py_DECREF(Ppath); Ppath = NULL;
+
+    Py_RETURN_NONE;
+
+error:
+    if (vtable != NULL) free(vtable);
+    if (Ppath != NULL) Py_DECREF(Ppath);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(connection_unregister_object_path_doc,
+    "unregister_object_path(path)\n\n"
+    "Unregister an object path handler. The *path* argument specifies\n"
+    "the path that will be removed. Both regular as well as fallback\n"
+    "handlers can be removed with this call.\n");
+
+static PyObject *
+connection_unregister_object_path(ConnectionObject *self,
+                                        PyObject *args)
+{
+    char *path;
+    int found;
+    PyObject *Ppath = NULL;
+
+    if (!PyArg_ParseTuple(args, "s:unregister_object_path", &path))
+        return NULL;
+    if (!_check_path(path))
+        RAISE_ERROR("invalid path");
+
+    if (self->connection == NULL)
+        RAISE_ERROR("not connected");
+    if ((Ppath = PyUnicode_FromString(path)) == NULL)
+        RETURN_ERROR();
+    if ((found = PyDict_Contains(self->object_paths, Ppath)) < 0)
+        RETURN_ERROR();
+    if (!found)
+        RAISE_ERROR("no such object path");
+    if (!dbus_connection_unregister_object_path(self->connection, path))
+        RAISE_ERROR("dbus_connection_unregister_object_path() failed");
+    if (PyDict_DelItem(self->object_paths, Ppath) < 0)
+        RETURN_ERROR();
+    Py_DECREF(Ppath);
+
+    Py_RETURN_NONE;
+
+error:
+    if (Ppath != NULL) Py_DECREF(Ppath);
+    return NULL;
+}
+
+
+static PyMethodDef connection_methods[] = \
+{
+    { "get", (PyCFunction) connection_get,
+            METH_VARARGS|METH_KEYWORDS|METH_CLASS, connection_get_doc },
+    { "close", (PyCFunction) connection_close, METH_VARARGS,
+            connection_close_doc },
+    { "send", (PyCFunction) connection_send, METH_VARARGS,
+            connection_send_doc },
+    { "send_with_reply", (PyCFunction) connection_send_with_reply,
+            METH_VARARGS, connection_send_with_reply_doc },
+    { "flush", (PyCFunction) connection_flush, METH_VARARGS,
+            connection_flush_doc },
+    { "fileno", (PyCFunction) connection_fileno, METH_VARARGS,
+            connection_fileno_doc },
+    { "dispatch", (PyCFunction) connection_dispatch, METH_VARARGS,
+            connection_dispatch_doc },
+    { "dispatch_all", (PyCFunction) connection_dispatch_all, METH_VARARGS,
+            connection_dispatch_all_doc },
+    { "handle_timeouts", (PyCFunction) connection_handle_timeouts,
+            METH_VARARGS, connection_handle_timeouts_doc },
+    { "read_write_dispatch", (PyCFunction) connection_read_write_dispatch,
+            METH_VARARGS, connection_read_write_dispatch_doc },
+    { "set_loop", (PyCFunction) connection_set_loop, METH_VARARGS,
+            connection_set_loop_doc },
+    { "set_priority", (PyCFunction) connection_set_priority, METH_VARARGS,
+            connection_set_priority_doc },
+    { "set_conflation", (PyCFunction) connection_set_conflation, METH_VARARGS,
+            connection_set_conflation_doc },
+    { "set_route_peer_messages", (PyCFunction)
+            connection_set_route_peer_messages, METH_VARARGS,
+            connection_set_route_peer_messages_doc },
+    { "add_filter", (PyCFunction) connection_add_filter, METH_VARARGS,
+            connection_add_filter_doc },
+    { "remove_filter", (PyCFunction) connection_remove_filter,
+            METH_VARARGS, connection_remove_filter_doc },
+    { "register_object_path", (PyCFunction)
+            connection_register_object_path, METH_VARARGS,
+            connection_register_object_path_doc },
+    { "unregister_object_path", (PyCFunction)
+            connection_unregister_object_path, METH_VARARGS,
+            connection_unregister_object_path_doc },
+    { NULL }
+};
+
+
+static PyObject *
+connection_type_init()
+{
+    ConnectionType.tp_doc = connection_doc;
+    ConnectionType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE \
+                                    | Py_TPFLAGS_HAVE_GC ;
+    ConnectionType.tp_new = connection_new;
+    ConnectionType.tp_init = (initproc) connection_init;
+    ConnectionType.tp_dealloc = (destructor) connection_dealloc;
+    ConnectionType.tp_traverse = (traverseproc) connection_traverse;
+    ConnectionType.tp_clear = (inquiry) connection_clear;
+    ConnectionType.tp_methods = connection_methods;
+    ConnectionType.tp_getset = connection_properties;
+    if (PyType_Ready(&ConnectionType) < 0)
+        return NULL; 
+    return (PyObject *) &ConnectionType;
+}
+
+
+/**********************************************************************
+ * Server type
+ */
+
+typedef struct
+{
+    PyObject_HEAD
+    DBusServer *server;
+    PyObject *loop;
+} ServerObject;
+
+PyTypeObject ServerType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ServerBase",
+    sizeof(ServerObject)
+};
+
+
+/* Forward declarations */
+static void new_connection_callback(DBusServer *server,
+                DBusConnection *connection, void *data);
+
+
+PyDoc_STRVAR(server_doc,
+        "Base functionality for creating Server classes.\n\n"
+        "This class wraps a DBusServer structure from libdbus. A server\n"
+        "listens on an address and accepts peer-to-peer connections from\n"
+        "clients. A server needs an event loop to accept connections, see\n"
+        ":meth:`set_loop`. For every new connection, a connection object of\n"
+        "type :attr:`connection_class` is created and passed to\n"
+        ":meth:`handle_connection`.\n");
+
+static int
+server_init(ServerObject *self, PyObject *args, PyObject *kwargs)
+{
+    char *address;
+    static char *kwlist[] = { "address", NULL };
+    DBusServer *server;
+    DBusError error = DBUS_ERROR_INIT;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", kwlist, &address))
+        RETURN_ERROR();
+    if (self->server != NULL)
+        RAISE_ERROR("already listening");
+
+    if ((server = dbus_server_listen(address, &error)) == NULL) {
+        if (dbus_error_is_set(&error)) {
+            PyErr_Format(Error, "dbus: %s", error.message);
+            dbus_error_free(&error);
+            RETURN_ERROR();
+        } else
+            RAISE_ERROR("Unknown error");
+    }
+
+    /* The server does not hold a reference to us. It is disconnected when
+     * we are deallocated. */
+    dbus_server_set_new_connection_function(server, new_connection_callback,
+                                            self, NULL);
+    self->server = server;
+    return 0;
+
+error:
+    return -1;
+}
+
+
+static int
+_close_server(ServerObject *self)
+{
+    if (self->server == NULL)
+        return 0;
+
+    dbus_server_set_new_connection_function(self->server, NULL, NULL, NULL);
+    if (self->loop != NULL) {
+        dbus_server_set_watch_functions(self->server,
+                        NULL, NULL, NULL, NULL, NULL);
+        dbus_server_set_timeout_functions(self->server,
+                        NULL, NULL, NULL, NULL, NULL);
+        Py_DECREF(self->loop);
+        self->loop = NULL;
+    }
+    dbus_server_disconnect(self->server);
+    dbus_server_unref(self->server);
+    self->server = NULL;
+    return 0;
+}
+
+
+static void
+new_connection_callback(DBusServer *server, DBusConnection *connection,
+                        void *data)
+{
+    char *address = NULL;
+    ServerObject *self = (ServerObject *) data;
+    PyObject *Pcls = NULL, *Paddress = NULL, *Pconnection = NULL, *Pret;
+
+    if ((Pcls = PyObject_GetAttrString((PyObject *) self,
+                                       "connection_class")) == NULL)
+        RETURN_ERROR();
+    if (!PyType_Check(Pcls) ||
+                !PyType_IsSubtype((PyTypeObject *) Pcls, &ConnectionType))
+        RAISE_TYPE_ERROR("connection_class must be a ConnectionBase subclass");
+
+    if ((address = dbus_server_get_address(server)) == NULL)
+        RAISE_MEMORY_ERROR();
+    if ((Paddress = PyUnicode_FromString(address)) == NULL)
+        RETURN_ERROR();
+
+    dbus_connection_set_exit_on_disconnect(connection, FALSE);
+    /* If we do not keep a reference, libdbus drops the connection. */
+    dbus_connection_ref(connection);
+    Pconnection = _connection_wrap((PyTypeObject *) Pcls, connection,
+                                   Paddress, 0);
+    if (Pconnection == NULL)
+        RETURN_ERROR();
+
+    if (self->loop != NULL) {
+        Pret = PyObject_CallMethod(Pconnection, "set_loop", "O", self->loop);
+        if (Pret == NULL)
+            RETURN_ERROR();
+        Py_DECREF(Pret);
+    }
+    Pret = PyObject_CallMethod((PyObject *) self, "handle_connection", "O",
+                               Pconnection);
+    if (Pret == NULL)
+        RETURN_ERROR();
+    Py_DECREF(Pret);
+
+error:
+    if (PyErr_Occurred() && Pconnection != NULL)
+        _close_connection((ConnectionObject *) Pconnection);
+    PRINT_AND_CLEAR_ERROR("new_connection_callback()");
+    if (address != NULL)
+        dbus_free(address);
+    Py_XDECREF(Pcls);
+    Py_XDECREF(Paddress);
+    Py_XDECREF(Pconnection);
+}
+
+
+static int
+server_traverse(ServerObject *self, visitproc visit, void *arg)
+{
+    if (self->loop != NULL)
+        Py_VISIT(self->loop);
+    return 0;
+}
+
+
+static int
+server_clear(ServerObject *self)
+{
+    _close_server(self);
+    return 0;
+}
+
+
+static void
+server_dealloc(ServerObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    _close_server(self);
+    Py_TYPE(self)->tp_free(self);
+}
+
+
+PyDoc_STRVAR(server_address_doc,
+    "The address the server is listening on. This is None if the server\n"
+    "is not listening.\n");
+
+static PyObject *
+server_get_address(ServerObject *self, void *context)
+{
+    char *address;
+    PyObject *Paddress;
+
+    if (self->server == NULL)
+        Py_RETURN_NONE;
+    if ((address = dbus_server_get_address(self->server)) == NULL)
+        return PyErr_NoMemory();
+    Paddress = PyUnicode_FromString(address);
+    dbus_free(address);
+    return Paddress;
+}
+
+
+PyDoc_STRVAR(server_id_doc,
+    "The unique ID of the server, or None if the server is not listening.\n");
+
+static PyObject *
+server_get_id(ServerObject *self, void *context)
+{
+    char *id;
+    PyObject *Pid;
+
+    if (self->server == NULL)
+        Py_RETURN_NONE;
+    if ((id = dbus_server_get_id(self->server)) == NULL)
+        return PyErr_NoMemory();
+    Pid = PyUnicode_FromString(id);
+    dbus_free(id);
+    return Pid;
+}
+
+
+PyDoc_STRVAR(server_connected_doc,
+    "Whether the server is listening for new connections.\n");
+
+static PyObject *
+server_get_connected(ServerObject *self, void *context)
+{
+    if (self->server == NULL)
+        Py_RETURN_FALSE;
+    return PyBool_FromLong(dbus_server_get_is_connected(self->server));
+}
+
+
+PyDoc_STRVAR(server_loop_doc,
+    "The currently installed event loop, if any.\n");
+
+static PyObject *
+server_get_loop(ServerObject *self, void *context)
+{
+    if (self->loop == NULL)
+        Py_RETURN_NONE;
+
+    Py_INCREF(self->loop);
+    return self->loop;
+}
+
+
+static PyGetSetDef server_properties[] = \
+{
+    { "address", (getter) server_get_address, NULL, server_address_doc },
+    { "id", (getter) server_get_id, NULL, server_id_doc },
+    { "connected", (getter) server_get_connected, NULL,
+                server_connected_doc },
+    { "loop", (getter) server_get_loop, NULL, server_loop_doc },
+    { NULL }
+};
+
+
+PyDoc_STRVAR(server_set_loop_doc,
+    "set_loop(loop)\n\n"
+    "Enable event loop integration for this server. The *loop* parameter\n"
+    "must be an :class:`looping.EventLoop` instance. New connections are\n"
+    "integrated with the same event loop.\n");
+
+static PyObject *
+server_set_loop(ServerObject *self, PyObject *args)
+{
+    PyObject *loop;
+
+    if (!PyArg_ParseTuple(args, "O:set_loop", &loop))
+        return NULL;
+
+    if (self->server == NULL)
+        RAISE_ERROR("not listening");
+    if (self->loop != NULL)
+        RAISE_ERROR("an event loop is already installed");
+
+    if (!PyObject_HasAttrString(loop, "add_reader") ||
+                !PyObject_HasAttrString(loop, "remove_reader") ||
+                !PyObject_HasAttrString(loop, "add_writer") ||
+                !PyObject_HasAttrString(loop, "remove_writer") ||
+                !PyObject_HasAttrString(loop, "call_soon") ||
+                !PyObject_HasAttrString(loop, "call_repeatedly"))
+        RAISE_ERROR("expecting a looping.EventLoop like object");
+
+    Py_INCREF(loop);
+    self->loop = loop;
+
+    if (!dbus_server_set_watch_functions(self->server,
+            add_watch_callback, remove_watch_callback,
+            watch_toggled_callback, self->loop, decref))
+        RAISE_ERROR("dbus_server_set_watch_functions() failed");
+    Py_INCREF(self->loop);
+
+    if (!dbus_server_set_timeout_functions(self->server,
+            add_timeout_callback, remove_timeout_callback,
+            timeout_toggled_callback, self->loop, decref))
+        RAISE_ERROR("dbus_server_set_timeout_functions() failed");
+    Py_INCREF(self->loop);
+
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+
+PyDoc_STRVAR(server_handle_connection_doc,
+    "handle_connection(connection)\n\n"
+    "Called when a new connection is accepted. The default implementation\n"
+    "does nothing. The connection stays open until it is closed with\n"
+    ":meth:`ConnectionBase.close`.\n");
+
+static PyObject *
+server_handle_connection(ServerObject *self, PyObject *args)
+{
+    PyObject *connection;
+
+    if (!PyArg_ParseTuple(args, "O!:handle_connection", &ConnectionType,
+                          &connection))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(server_disconnect_doc,
+    "disconnect()\n\n"
+    "Stop listening for new connections. Connections that were already\n"
+    "accepted are not closed.\n");
+
+static PyObject *
+server_disconnect(ServerObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ":disconnect"))
+        return NULL;
+    _close_server(self);
+    Py_RETURN_NONE;
+}
+
+
+static PyMethodDef server_methods[] = \
+{
+    { "set_loop", (PyCFunction) server_set_loop, METH_VARARGS,
+            server_set_loop_doc },
+    { "handle_connection", (PyCFunction) server_handle_connection,
+            METH_VARARGS, server_handle_connection_doc },
+    { "disconnect", (PyCFunction) server_disconnect, METH_VARARGS,
+            server_disconnect_doc },
+    { NULL }
+};
+
+
+static PyObject *
+server_type_init()
+{
+    PyObject *Pdict;
+
+    ServerType.tp_doc = server_doc;
+    ServerType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE \
+                                | Py_TPFLAGS_HAVE_GC;
+    ServerType.tp_new = PyType_GenericNew;
+    ServerType.tp_init = (initproc) server_init;
+    ServerType.tp_dealloc = (destructor) server_dealloc;
+    ServerType.tp_traverse = (traverseproc) server_traverse;
+    ServerType.tp_clear = (inquiry) server_clear;
+    ServerType.tp_methods = server_methods;
+    ServerType.tp_getset = server_properties;
+    if (PyType_Ready(&ServerType) < 0)
+        return NULL;
+    /* The default connection class. Override this in a subclass. */
+    Pdict = ServerType.tp_dict;
+    if (PyDict_SetItemString(Pdict, "connection_class",
+                             (PyObject *) &ConnectionType) < 0)
+        return NULL;
+    return (PyObject *) &ServerType;
+}
+
+
+/**********************************************************************
+ * Ring object. A single producer, single consumer ring buffer that holds
+ * marshalled messages. The buffer is typically a shared memory mapping
+ * that is shared with another process. See dbusx.channel.
+ *
+ * The buffer starts with a header containing the head (write position),
+ * the tail (read position) and a flag that is set by the producer when it
+ * is waiting for space. Each is on its own cache line. The positions only
+ * ever increase, and are taken modulo the capacity. Every record starts
+ * with a 32-bit length, followed by 4 bytes of padding and the message,
+ * and is padded to a multiple of 8 bytes. A record that does not fit at the
+ * end of the buffer is preceded by a wrap marker.
+ */
+
+#define RING_HEAD 0
+#define RING_TAIL 64
+#define RING_WAITING 128
+#define RING_DATA 192
+#define RING_WRAP 0xffffffffU
+#define RING_ALIGN(n) (((uint64_t) (n) + 7) & ~((uint64_t) 7))
+
+#define RING_PTR(self, offset) ((uint64_t *) ((self)->base + (offset)))
+
+typedef struct
+{
+    PyObject_HEAD
+    Py_buffer buffer;
+    char *base;
+    uint64_t capacity;
+    int data_fd;
+    int space_fd;
+    dbus_uint32_t serial;
+} RingObject;
+
+static PyTypeObject RingType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "Ring",
+    sizeof(RingObject)
+};
+
+PyDoc_STRVAR(ring_doc,
+    "Ring(buffer, data_fd=-1, space_fd=-1)\n\n"
+    "A single producer, single consumer ring buffer of messages in\n"
+    "*buffer*, which must be a writable buffer of at least 256 bytes that\n"
+    "is initially zero, e.g. a shared memory mapping. One process puts\n"
+    "messages in the ring and another one gets them out.\n\n"
+    "If *data_fd* is provided, it must be an eventfd that is signalled when\n"
+    "messages are put, and cleared when they are taken. The *space_fd*\n"
+    "eventfd is signalled when messages are taken while the producer is\n"
+    "waiting for space. The file descriptors are not owned by the ring.\n");
+
+static int
+ring_init(RingObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *Pbuffer;
+    static char *kwlist[] = { "buffer", "data_fd", "space_fd", NULL };
+
+    self->data_fd = self->space_fd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ii:Ring", kwlist,
+                &Pbuffer, &self->data_fd, &self->space_fd))
+        return -1;
+    if (self->buffer.obj != NULL) {
+        PyBuffer_Release(&self->buffer);
+        self->base = NULL;
+    }
+    if (PyObject_GetBuffer(Pbuffer, &self->buffer, PyBUF_WRITABLE) < 0)
+        return -1;
+    if (self->buffer.len < RING_DATA + 64)
+        RAISE_VALUE_ERROR("buffer must be at least %d bytes", RING_DATA + 64);
+    if (((uintptr_t) self->buffer.buf) & 7)
+        RAISE_VALUE_ERROR("buffer must be aligned to 8 bytes");
+    self->base = self->buffer.buf;
+    self->capacity = (self->buffer.len - RING_DATA) & ~((uint64_t) 7);
+    return 0;
+
+error:
+    PyBuffer_Release(&self->buffer);
+    return -1;
+}
+
+static void
+ring_dealloc(RingObject *self)
+{
+    if (self->buffer.obj != NULL)
+        PyBuffer_Release(&self->buffer);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static void
+_ring_notify(int fd)
+{
+    uint64_t one = 1;
+    ssize_t ret;
+
+    if (fd < 0)
+        return;
+    do {
+        ret = write(fd, &one, sizeof(one));
+    } while (ret < 0 && errno == EINTR);
+}
+
+/* Return whether *length* bytes are free after *head*. If not, ask the
+ * consumer for a wakeup, and check again in case it made room before it saw
+ * the flag. */
+
+static int
+_ring_reserve(RingObject *self, uint64_t head, uint64_t length, uint64_t *tail)
+{
+    if (head + length - *tail <= self->capacity)
+        return 1;
+    *tail = __atomic_load_n(RING_PTR(self, RING_TAIL), __ATOMIC_ACQUIRE);
+    if (head + length - *tail <= self->capacity)
+        return 1;
+    __atomic_store_n(RING_PTR(self, RING_WAITING), 1, __ATOMIC_SEQ_CST);
+    *tail = __atomic_load_n(RING_PTR(self, RING_TAIL), __ATOMIC_SEQ_CST);
+    return head + length - *tail <= self->capacity;
+}
+
+PyDoc_STRVAR(ring_put_doc,
+    "put(messages)\n\n"
+    "Put as many messages from the sequence *messages* in the ring as\n"
+    "will fit, and return how many were put. A message that has no serial\n"
+    "yet is put with one, but the message itself is not changed. If not\n"
+    "all messages fit, the consumer is asked to signal *space_fd* once it\n"
+    "has made room.\n");
+
+static PyObject *
+ring_put(RingObject *self, PyObject *args)
+{
+    int size;
+    char *data = NULL, *record;
+    int wrapped = 0, ok;
+    uint64_t head, tail, offset, skip, length;
+    Py_ssize_t i, count = 0;
+    PyObject *Pmessages, *Pseq = NULL, *Pitem;
+    DBusMessage *message, *copy;
+
+    if (!PyArg_ParseTuple(args, "O:put", &Pmessages))
+        return NULL;
+    if (self->base == NULL)
+        RAISE_ERROR("uninitialized object");
+    if ((Pseq = PySequence_Fast(Pmessages, "expecting a sequence")) == NULL)
+        RETURN_ERROR();
+
+    head = __atomic_load_n(RING_PTR(self, RING_HEAD), __ATOMIC_RELAXED);
+    tail = __atomic_load_n(RING_PTR(self, RING_TAIL), __ATOMIC_ACQUIRE);
+    for (i=0; i<PySequence_Fast_GET_SIZE(Pseq); i++) {
+        Pitem = PySequence_Fast_GET_ITEM(Pseq, i);
+        if (!PyObject_TypeCheck(Pitem, &MessageType))
+            RAISE_TYPE_ERROR("expecting a sequence of messages");
+        if ((message = ((MessageObject *) Pitem)->message) == NULL)
+            RAISE_ERROR("uninitialized message");
+        if (dbus_message_contains_unix_fds(message))
+            RAISE_VALUE_ERROR("cannot put file descriptors in a ring");
+        /* A message can not be demarshalled without a serial. Give one to
+         * a copy, so the caller's message can still be sent later. */
+        if (dbus_message_get_serial(message) == 0) {
+            if ((copy = dbus_message_copy(message)) == NULL)
+                RAISE_MEMORY_ERROR();
+            if (++self->serial == 0)
+                self->serial = 1;
+            dbus_message_set_serial(copy, self->serial);
+            ok = dbus_message_marshal(copy, &data, &size);
+            dbus_message_unref(copy);
+        } else
+            ok = dbus_message_marshal(message, &data, &size);
+        if (!ok)
+            RAISE_MEMORY_ERROR();
+        length = 8 + RING_ALIGN(size);
+        if (length > self->capacity)
+            RAISE_VALUE_ERROR("message of %d bytes is too large for ring", size);
+        offset = head % self->capacity;
+        if (self->capacity - offset < length) {
+            /* Wrap first and publish it, so that the consumer can move
+             * past the marker if the record does not fit after it yet. */
+            skip = self->capacity - offset;
+            if (!_ring_reserve(self, head, skip, &tail)) {
+                dbus_free(data); data = NULL;
+                break;
+            }
+            *(uint32_t *) (self->base + RING_DATA + offset) = RING_WRAP;
+            head += skip; offset = 0;
+            __atomic_store_n(RING_PTR(self, RING_HEAD), head, __ATOMIC_RELEASE);
+            wrapped = 1;
+        }
+        if (!_ring_reserve(self, head, length, &tail)) {
+            dbus_free(data); data = NULL;
+            break;
+        }
+        record = self->base + RING_DATA + offset;
+        *(uint32_t *) record = (uint32_t) size;
+        memcpy(record + 8, data, size);
+        head += length;
+        count++;
+        dbus_free(data); data = NULL;
+    }
+    Py_DECREF(Pseq);
+    if (count > 0 || wrapped) {
+        __atomic_store_n(RING_PTR(self, RING_HEAD), head, __ATOMIC_RELEASE);
+        _ring_notify(self->data_fd);
+    }
+    return PyLong_FromSsize_t(count);
+
+error:
+    /* Publish what was put before the error. */
+    if (count > 0 || wrapped) {
+        __atomic_store_n(RING_PTR(self, RING_HEAD), head, __ATOMIC_RELEASE);
+        _ring_notify(self->data_fd);
+    }
+    if (data != NULL) dbus_free(data);
+    Py_XDECREF(Pseq);
+    return NULL;
+}
+
+PyDoc_STRVAR(ring_get_doc,
+    "get(max=-1, cls=MessageBase)\n\n"
+    "Take up to *max* messages from the ring, or all messages if *max* is\n"
+    "negative, and return them as a list of *cls* instances.\n");
+
+static PyObject *
+ring_get(RingObject *self, PyObject *args, PyObject *kwargs)
+{
+    int max = -1;
+    uint32_t size;
+    uint64_t head, tail, offset, length, value;
+    char *record;
+    PyObject *Plist = NULL, *Pargs = NULL;
+    PyTypeObject *cls = &MessageType;
+    MessageObject *Pmessage = NULL;
+    DBusError error = DBUS_ERROR_INIT;
+    static char *kwlist[] = { "max", "cls", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iO!:get", kwlist,
+                &max, &PyType_Type, &cls))
+        return NULL;
+    if (self->base == NULL)
+        RAISE_ERROR("uninitialized object");
+    if (!PyType_IsSubtype(cls, &MessageType))
+        RAISE_TYPE_ERROR("cls must be a subclass of MessageBase");
+    if ((Plist = PyList_New(0)) == NULL)
+        RETURN_ERROR();
+    if ((Pargs = PyTuple_New(0)) == NULL)
+        RETURN_ERROR();
+
+    /* Clear the eventfd before looking at the head, so that a put after
+     * this point is not missed. The eventfd must be non-blocking. */
+    if (self->data_fd >= 0 && read(self->data_fd, &value, sizeof(value)) < 0
+                && errno != EAGAIN && errno != EINTR)
+        RAISE_ERROR("could not read data_fd: %s", strerror(errno));
+
+    tail = __atomic_load_n(RING_PTR(self, RING_TAIL), __ATOMIC_RELAXED);
+    head = __atomic_load_n(RING_PTR(self, RING_HEAD), __ATOMIC_ACQUIRE);
+    while (tail != head && (max < 0 || PyList_GET_SIZE(Plist) < max)) {
+        offset = tail % self->capacity;
+        record = self->base + RING_DATA + offset;
+        size = *(uint32_t *) record;
+        if (size == RING_WRAP) {
+            tail += self->capacity - offset;
+            continue;
+        }
+        length = 8 + RING_ALIGN(size);
+        if (length > self->capacity - offset || length > head - tail)
+            RAISE_ERROR("ring is corrupt");
+        if ((Pmessage = (MessageObject *) cls->tp_new(cls, Pargs, NULL)) == NULL)
+            RETURN_ERROR();
+        Pmessage->message = dbus_message_demarshal(record + 8, size, &error);
+        if (Pmessage->message == NULL) {
+            if (dbus_error_is_set(&error))
+                RAISE_ERROR("dbus: %s", error.message);
+            RAISE_MEMORY_ERROR();
+        }
+        if (PyList_Append(Plist, (PyObject *) Pmessage) < 0)
+            RETURN_ERROR();
+        Py_DECREF(Pmessage); Pmessage = NULL;
+        tail += length;
+    }
+    __atomic_store_n(RING_PTR(self, RING_TAIL), tail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(RING_PTR(self, RING_WAITING), __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(RING_PTR(self, RING_WAITING), 0, __ATOMIC_RELAXED);
+        _ring_notify(self->space_fd);
+    }
+    Py_DECREF(Pargs);
+    return Plist;
+
+error:
+    if (dbus_error_is_set(&error))
+        dbus_error_free(&error);
+    Py_XDECREF(Pmessage);
+    Py_XDECREF(Pargs);
+    Py_XDECREF(Plist);
+    return NULL;
+}
+
+PyDoc_STRVAR(ring_capacity_doc,
+    "The number of bytes available for messages.\n");
+
+static PyObject *
+ring_get_capacity(RingObject *self, void *context)
+{
+    return PyLong_FromUnsignedLongLong(self->capacity);
+}
+
+PyDoc_STRVAR(ring_used_doc,
+    "The number of bytes in use by messages that were not taken yet.\n");
+
+static PyObject *
+ring_get_used(RingObject *self, void *context)
+{
+    uint64_t head, tail;
+
+    if (self->base == NULL)
+        return PyLong_FromLong(0);
+    head = __atomic_load_n(RING_PTR(self, RING_HEAD), __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(RING_PTR(self, RING_TAIL), __ATOMIC_ACQUIRE);
+    return PyLong_FromUnsignedLongLong(head - tail);
+}
+
+static PyGetSetDef ring_properties[] = \
+{
+    { "capacity", (getter) ring_get_capacity, NULL, ring_capacity_doc },
+    { "used", (getter) ring_get_used, NULL, ring_used_doc },
+    { NULL }
+};
+
+static PyMethodDef ring_methods[] = \
+{
+    { "put", (PyCFunction) ring_put, METH_VARARGS, ring_put_doc },
+    { "get", (PyCFunction) ring_get, METH_VARARGS|METH_KEYWORDS,
+            ring_get_doc },
+    { NULL }
+};
+
+static PyObject *
+ring_type_init()
+{
+    RingType.tp_doc = ring_doc;
+    RingType.tp_flags = Py_TPFLAGS_DEFAULT;
+    RingType.tp_new = PyType_GenericNew;
+    RingType.tp_init = (initproc) ring_init;
+    RingType.tp_dealloc = (destructor) ring_dealloc;
+    RingType.tp_methods = ring_methods;
+    RingType.tp_getset = ring_properties;
+    if (PyType_Ready(&RingType) < 0)
+        return NULL;
+    return (PyObject *) &RingType;
+}
+
+
+/**********************************************************************
+ * Relay object. Forwards messages from one connection to another without
+ * decoding their arguments, and routes the replies back.
+ */
+
+typedef struct
+{
+    int type;
+    char *sender;
+    char *destination;
+    char *path;
+    char *path_namespace;
+    char *interface;
+    char *member;
+} RelayRule;
+
+typedef struct
+{
+    PyObject_HEAD
+    ConnectionObject *source;
+    ConnectionObject *target;
+    char *destination;
+    RelayRule *rules;
+    int nrules;
+    PyObject *pending;
+    Py_ssize_t max_pending;
+    unsigned long relayed;
+    unsigned long dropped;
+} RelayObject;
+
+static PyTypeObject RelayType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "RelayBase",
+    sizeof(RelayObject)
+};
+
+PyDoc_STRVAR(relay_doc,
+    "RelayBase(source, target, destination=None, max_pending=65536)\n\n"
+    "Relay messages from the connection *source* to the connection *target*.\n"
+    "Messages are copied without decoding their arguments, so the cost of\n"
+    "relaying a message does not depend on its contents.\n\n"
+    "Install :meth:`forward` as a filter on *source*, and\n"
+    ":meth:`handle_reply` as a filter on *target*. Method calls and signals\n"
+    "that match a rule (see :meth:`add_rule`) are sent on *target*. If\n"
+    "*destination* is provided, method calls are sent to that name. Replies\n"
+    "to relayed method calls are sent back on *source* to the original\n"
+    "caller, with the original reply serial. At most *max_pending* calls\n"
+    "wait for a reply at any time. When there are more, the oldest one is\n"
+    "forgotten, and counted in :attr:`dropped`.\n\n"
+    "Relayed messages are sent like :meth:`ConnectionBase.send` sends them,\n"
+    "so relayed signals are staged once the outgoing queue of *target*\n"
+    "reaches its ``outgoing_limit``.\n");
+
+static void
+_relay_clear_rules(RelayObject *self)
+{
+    int i;
+    RelayRule *rule;
+
+    for (i=0; i<self->nrules; i++) {
+        rule = &self->rules[i];
+        free(rule->sender); free(rule->destination); free(rule->path);
+        free(rule->path_namespace); free(rule->interface); free(rule->member);
+    }
+    free(self->rules);
+    self->rules = NULL;
+    self->nrules = 0;
+}
+
+static int
+relay_init(RelayObject *self, PyObject *args, PyObject *kwargs)
+{
+    char *destination = NULL;
+    Py_ssize_t max_pending = 65536;
+    PyObject *Psource, *Ptarget;
+    static char *kwlist[] = { "source", "target", "destination",
+                              "max_pending", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O!|zn:RelayBase",
+                kwlist, &ConnectionType, &Psource, &ConnectionType, &Ptarget,
+                &destination, &max_pending))
+        return -1;
+    if (max_pending < 1)
+        RAISE_VALUE_ERROR("max_pending must be positive");
+    Py_INCREF(Psource); Py_XDECREF(self->source);
+    self->source = (ConnectionObject *) Psource;
+    Py_INCREF(Ptarget); Py_XDECREF(self->target);
+    self->target = (ConnectionObject *) Ptarget;
+    free(self->destination);
+    self->destination = NULL;
+    if (destination != NULL && (self->destination = strdup(destination)) == NULL)
+        RAISE_MEMORY_ERROR();
+    Py_XDECREF(self->pending);
+    if ((self->pending = PyDict_New()) == NULL)
+        RETURN_ERROR();
+    self->max_pending = max_pending;
+    return 0;
+
+error:
+    return -1;
+}
+
+static void
+relay_dealloc(RelayObject *self)
+{
+    Py_XDECREF(self->source);
+    Py_XDECREF(self->target);
+    Py_XDECREF(self->pending);
+    free(self->destination);
+    _relay_clear_rules(self);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int
+_relay_strdup(char **dst, const char *src)
+{
+    if (src == NULL) {
+        *dst = NULL;
+        return 0;
+    }
+    return (*dst = strdup(src)) == NULL ? -1 : 0;
+}
+
+PyDoc_STRVAR(relay_add_rule_doc,
+    "add_rule(type=None, sender=None, destination=None, path=None,\n"
+    "         path_namespace=None, interface=None, member=None)\n\n"
+    "Add a rule. A message is relayed if it matches any rule, or if there\n"
+    "are no rules. A message matches a rule if it matches all header fields\n"
+    "that are specified. The *path_namespace* matches the path itself and\n"
+    "all paths below it. The *type* is one of the ``MESSAGE_TYPE_*``\n"
+    "constants.\n");
+
+static PyObject *
+relay_add_rule(RelayObject *self, PyObject *args, PyObject *kwargs)
+{
+    int type = DBUS_MESSAGE_TYPE_INVALID;
+    char *sender = NULL, *destination = NULL, *path = NULL;
+    char *path_namespace = NULL, *interface = NULL, *member = NULL;
+    PyObject *Ptype = Py_None;
+    RelayRule *rules, *rule;
+    static char *kwlist[] = { "type", "sender", "destination", "path",
+                              "path_namespace", "interface", "member", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Ozzzzzz:add_rule", kwlist,
+                &Ptype, &sender, &destination, &path, &path_namespace,
+                &interface, &member))
+        return NULL;
+    if (Ptype != Py_None) {
+        if (!PyLong_Check(Ptype))
+            RAISE_TYPE_ERROR("expecting an integer or None");
+        type = PyLong_AsLong(Ptype);
+    }
+    if (type != DBUS_MESSAGE_TYPE_INVALID
+                && type != DBUS_MESSAGE_TYPE_METHOD_CALL
+                && type != DBUS_MESSAGE_TYPE_SIGNAL)
+        RAISE_VALUE_ERROR("only method calls and signals can be relayed");
+    rules = realloc(self->rules, (self->nrules + 1) * sizeof(RelayRule));
+    if (rules == NULL)
+        RAISE_MEMORY_ERROR();
+    self->rules = rules;
+    rule = &rules[self->nrules];
+    memset(rule, 0, sizeof(RelayRule));
+    self->nrules++;
+    rule->type = type;
+    if (_relay_strdup(&rule->sender, sender) < 0
+            || _relay_strdup(&rule->destination, destination) < 0
+            || _relay_strdup(&rule->path, path) < 0
+            || _relay_strdup(&rule->path_namespace, path_namespace) < 0
+            || _relay_strdup(&rule->interface, interface) < 0
+            || _relay_strdup(&rule->member, member) < 0)
+        RAISE_MEMORY_ERROR();
+    Py_RETURN_NONE;
+
+error:
+    return NULL;
+}
+
+PyDoc_STRVAR(relay_clear_rules_doc,
+    "clear_rules()\n\n"
+    "Remove all rules.\n");
+
+static PyObject *
+relay_clear_rules(RelayObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ":clear_rules"))
+        return NULL;
+    _relay_clear_rules(self);
+    Py_RETURN_NONE;
+}
+
+static int
+_relay_match_field(const char *want, const char *value)
+{
+    return want == NULL || (value != NULL && strcmp(want, value) == 0);
+}
+
+static int
+_relay_match(RelayObject *self, DBusMessage *message)
+{
+    int i;
+    size_t len;
+    const char *path;
+    RelayRule *rule;
+
+    if (self->nrules == 0)
+        return 1;
+    path = dbus_message_get_path(message);
+    for (i=0; i<self->nrules; i++) {
+        rule = &self->rules[i];
+        if (rule->type != DBUS_MESSAGE_TYPE_INVALID
+                    && rule->type != dbus_message_get_type(message))
+            continue;
+        if (!_relay_match_field(rule->sender, dbus_message_get_sender(message))
+                || !_relay_match_field(rule->destination,
+                            dbus_message_get_destination(message))
+                || !_relay_match_field(rule->path, path)
+                || !_relay_match_field(rule->interface,
+                            dbus_message_get_interface(message))
+                || !_relay_match_field(rule->member,
+                            dbus_message_get_member(message)))
+            continue;
+        if (rule->path_namespace != NULL) {
+            len = strlen(rule->path_namespace);
+            if (path == NULL)
+                continue;
+            if (strcmp(rule->path_namespace, "/") != 0
+                    && (strncmp(path, rule->path_namespace, len) != 0
+                        || (path[len] != '\0' && path[len] != '/')))
+                continue;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static PyObject *
+_relay_check_args(PyObject *args, DBusMessage **message)
+{
+    PyObject *Pconnection, *Pmessage;
+
+    if (!PyArg_ParseTuple(args, "OO!", &Pconnection, &MessageType, &Pmessage))
+        return NULL;
+    if ((*message = ((MessageObject *) Pmessage)->message) == NULL)
+        RAISE_ERROR("uninitialized message");
+    return Pconnection;
+
+error:
+    return NULL;
+}
+
+PyDoc_STRVAR(relay_forward_doc,
+    "forward(connection, message)\n\n"
+    "Filter for the source connection. Relay *message* if it is a method\n"
+    "call or a signal that matches the rules, and return whether it was\n"
+    "relayed. Messages from the bus driver, and messages sent by the target\n"
+    "connection itself, are never relayed.\n");
+
+static PyObject *
+relay_forward(RelayObject *self, PyObject *args)
+{
+    int type;
+    const char *sender, *self_name;
+    dbus_uint32_t serial;
+    DBusMessage *message, *copy = NULL;
+    PyObject *Pkey = NULL, *Pvalue = NULL, *Poldest;
+    Py_ssize_t pos = 0;
+
+    if (_relay_check_args(args, &message) == NULL)
+        return NULL;
+    if (self->target == NULL || self->pending == NULL)
+        RAISE_ERROR("uninitialized object");
+    if (self->target->connection == NULL)
+        RAISE_ERROR("target is not connected");
+
+    type = dbus_message_get_type(message);
+    sender = dbus_message_get_sender(message);
+    /* Signals that we relayed can come back to us if both connections are
+     * on the same bus. */
+    self_name = dbus_bus_get_unique_name(self->target->connection);
+    if ((type != DBUS_MESSAGE_TYPE_METHOD_CALL
+                && type != DBUS_MESSAGE_TYPE_SIGNAL)
+            || (sender != NULL && (strcmp(sender, DBUS_SERVICE_DBUS) == 0
+                    || (self_name != NULL && strcmp(sender, self_name) == 0)))
+            || !_relay_match(self, message))
+        Py_RETURN_FALSE;
+
+    /* The copy has no serial and is not locked. The target assigns a new
+     * serial, and the bus daemon on the target sets the sender. */
+    if ((copy = dbus_message_copy(message)) == NULL)
+        RAISE_MEMORY_ERROR();
+    if (!dbus_message_set_sender(copy, NULL))
+        RAISE_MEMORY_ERROR();
+    if (type == DBUS_MESSAGE_TYPE_METHOD_CALL && self->destination != NULL
+            && !dbus_message_set_destination(copy, self->destination))
+        RAISE_MEMORY_ERROR();
+    /* Method calls are high priority, so they are never staged and have a
+     * serial once this returns. Signals may be staged. */
+    if (_connection_send(self->target, copy, _message_priority(copy)) < 0)
+        RETURN_ERROR();
+    serial = dbus_message_get_serial(copy);
+    dbus_message_unref(copy); copy = NULL;
+    self->relayed++;
+
+    if (type == DBUS_MESSAGE_TYPE_METHOD_CALL
+                && !dbus_message_get_no_reply(message)) {
+        if (PyDict_Size(self->pending) >= self->max_pending) {
+            /* On Python 3.7+ this is the oldest call. */
+            if (PyDict_Next(self->pending, &pos, &Poldest, NULL)) {
+                if (PyDict_DelItem(self->pending, Poldest) < 0)
+                    RETURN_ERROR();
+                self->dropped++;
+            }
+        }
+        if ((Pkey = PyLong_FromUnsignedLong(serial)) == NULL)
+            RETURN_ERROR();
+        if ((Pvalue = Py_BuildValue("(kz)",
+                    (unsigned long) dbus_message_get_serial(message),
+                    sender)) == NULL)
+            RETURN_ERROR();
+        if (PyDict_SetItem(self->pending, Pkey, Pvalue) < 0)
+            RETURN_ERROR();
+        Py_DECREF(Pkey); Py_DECREF(Pvalue);
+    }
+    Py_RETURN_TRUE;
+
+error:
+    if (copy != NULL) dbus_message_unref(copy);
+    Py_XDECREF(Pkey);
+    Py_XDECREF(Pvalue);
+    return NULL;
+}
+
+PyDoc_STRVAR(relay_handle_reply_doc,
+    "handle_reply(connection, message)\n\n"
+    "Filter for the target connection. If *message* is a reply to a\n"
+    "relayed method call, send it to the original caller on the source\n"
+    "connection and return True. Otherwise return False.\n");
+
+static PyObject *
+relay_handle_reply(RelayObject *self, PyObject *args)
+{
+    int type;
+    unsigned long serial;
+    char *sender;
+    DBusMessage *message, *copy = NULL;
+    PyObject *Pkey = NULL, *Pvalue;
+
+    if (_relay_check_args(args, &message) == NULL)
+        return NULL;
+    if (self->source == NULL || self->pending == NULL)
+        RAISE_ERROR("uninitialized object");
+
+    type = dbus_message_get_type(message);
+    if (type != DBUS_MESSAGE_TYPE_METHOD_RETURN
+                && type != DBUS_MESSAGE_TYPE_ERROR)
+        Py_RETURN_FALSE;
+    Pkey = PyLong_FromUnsignedLong(dbus_message_get_reply_serial(message));
+    if (Pkey == NULL)
+        RETURN_ERROR();
+    if ((Pvalue = PyDict_GetItem(self->pending, Pkey)) == NULL) {
+        Py_DECREF(Pkey);
+        Py_RETURN_FALSE;
+    }
+    if (!PyArg_ParseTuple(Pvalue, "kz", &serial, &sender))
+        RETURN_ERROR();
+    if (self->source->connection == NULL)
+        RAISE_ERROR("source is not connected");
+
+    if ((copy = dbus_message_copy(message)) == NULL)
+        RAISE_MEMORY_ERROR();
+    if (!dbus_message_set_sender(copy, NULL)
+            || !dbus_message_set_destination(copy, sender)
+            || !dbus_message_set_reply_serial(copy, (dbus_uint32_t) serial))
+        RAISE_MEMORY_ERROR();
+    if (_connection_send(self->source, copy, PRIORITY_HIGH) < 0)
+        RETURN_ERROR();
+    dbus_message_unref(copy); copy = NULL;
+    /* This releases Pvalue and the sender string. */
+    if (PyDict_DelItem(self->pending, Pkey) < 0)
+        RETURN_ERROR();
+    Py_DECREF(Pkey);
+    self->relayed++;
+    Py_RETURN_TRUE;
 
 error:
-    Py_XDECREF(Pcallback);
-    PRINT_AND_CLEAR_ERROR("watch_toggled_callback()");
+    if (copy != NULL) dbus_message_unref(copy);
+    Py_XDECREF(Pkey);
+    return NULL;
 }
 
+PyDoc_STRVAR(relay_pending_doc,
+    "The number of relayed method calls that are waiting for a reply.\n");
 
-static dbus_bool_t
-add_timeout_callback(DBusTimeout *timeout, void *data)
+static PyObject *
+relay_get_pending(RelayObject *self, void *context)
 {
-    int enabled;
-    float interval;
-    TimeoutObject *Ptimeout;
-    PyObject *Pcallback = NULL, *Ptimer, *loop = (PyObject *) data;
+    return PyLong_FromSsize_t(self->pending ? PyDict_Size(self->pending) : 0);
+}
 
-    ASSERT(dbus_timeout_get_data(timeout) == NULL);
+PyDoc_STRVAR(relay_relayed_doc,
+    "The number of messages that were relayed, including replies.\n");
 
-    Ptimeout = (TimeoutObject *) TimeoutType.tp_new(&TimeoutType, NULL, NULL);
-    if (Ptimeout == NULL)
-        RETURN_ERROR();
-    Ptimeout->timeout = timeout;
-    /* Hand off Ptimeout reference to dbus. */
-    dbus_timeout_set_data(timeout, Ptimeout, decref);
+static PyObject *
+relay_get_relayed(RelayObject *self, void *context)
+{
+    return PyLong_FromUnsignedLong(self->relayed);
+}
 
-    enabled = dbus_timeout_get_enabled(timeout);
-    if (enabled) {
-        Pcallback = PyObject_GetAttrString((PyObject *) Ptimeout, "handle");
-        if (Pcallback == NULL)
-            RETURN_ERROR();
-        interval = (float) dbus_timeout_get_interval(timeout) / 1000.0;
-        Ptimer = PyObject_CallMethod(loop, "call_repeatedly", "fO", interval,
-                                     Pcallback);
-        if (Ptimer == NULL)
-            RETURN_ERROR();
-        Ptimeout->timer = Ptimer;
-        Py_DECREF(Pcallback);
-        Pcallback = NULL;
-    }
+PyDoc_STRVAR(relay_dropped_doc,
+    "The number of pending calls that were forgotten because there were\n"
+    "more than *max_pending*.\n");
 
-    return TRUE;
+static PyObject *
+relay_get_dropped(RelayObject *self, void *context)
+{
+    return PyLong_FromUnsignedLong(self->dropped);
+}
 
-error:
-    Py_XDECREF(Pcallback);
-    PRINT_AND_CLEAR_ERROR("add_timeout_callback()");
-    return FALSE;
+PyDoc_STRVAR(relay_source_doc, "The source connection.\n");
+
+static PyObject *
+relay_get_source(RelayObject *self, void *context)
+{
+    PyObject *Psource = self->source ? (PyObject *) self->source : Py_None;
+    Py_INCREF(Psource);
+    return Psource;
 }
 
+PyDoc_STRVAR(relay_target_doc, "The target connection.\n");
 
-static void
-remove_timeout_callback(DBusTimeout *timeout, void *data)
+static PyObject *
+relay_get_target(RelayObject *self, void *context)
 {
-    TimeoutObject *Ptimeout;
-    PyObject *Pret = NULL;
+    PyObject *Ptarget = self->target ? (PyObject *) self->target : Py_None;
+    Py_INCREF(Ptarget);
+    return Ptarget;
+}
 
-    Ptimeout = dbus_timeout_get_data(timeout);
-    ASSERT(Ptimeout != NULL);
-    Pret = PyObject_CallMethod(Ptimeout->timer, "cancel", NULL);
-    Py_XDECREF(Pret);  /* print error Pret == NULL below */
-    dbus_timeout_set_data(timeout, NULL, NULL);  /* drops ref to Ptimeout */
-    /* fallthrough */
+static PyGetSetDef relay_properties[] = \
+{
+    { "pending", (getter) relay_get_pending, NULL, relay_pending_doc },
+    { "relayed", (getter) relay_get_relayed, NULL, relay_relayed_doc },
+    { "dropped", (getter) relay_get_dropped, NULL, relay_dropped_doc },
+    { "source", (getter) relay_get_source, NULL, relay_source_doc },
+    { "target", (getter) relay_get_target, NULL, relay_target_doc },
+    { NULL }
+};
 
-error:
-    PRINT_AND_CLEAR_ERROR("remove_timeout_callback()");
+static PyMethodDef relay_methods[] = \
+{
+    { "add_rule", (PyCFunction) relay_add_rule, METH_VARARGS|METH_KEYWORDS,
+            relay_add_rule_doc },
+    { "clear_rules", (PyCFunction) relay_clear_rules, METH_VARARGS,
+            relay_clear_rules_doc },
+    { "forward", (PyCFunction) relay_forward, METH_VARARGS,
+            relay_forward_doc },
+    { "handle_reply", (PyCFunction) relay_handle_reply, METH_VARARGS,
+            relay_handle_reply_doc },
+    { NULL }
+};
+
+static PyObject *
+relay_type_init()
+{
+    RelayType.tp_doc = relay_doc;
+    RelayType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+    RelayType.tp_new = PyType_GenericNew;
+    RelayType.tp_init = (initproc) relay_init;
+    RelayType.tp_dealloc = (destructor) relay_dealloc;
+    RelayType.tp_methods = relay_methods;
+    RelayType.tp_getset = relay_properties;
+    if (PyType_Ready(&RelayType) < 0)
+        return NULL;
+    return (PyObject *) &RelayType;
 }
 
 
-static void
-timeout_toggled_callback(DBusTimeout *timeout, void *data)
+/**********************************************************************
+ * Emitter object. Sends one signal of one object. The signature is checked
+ * and split into its complete types once, when the emitter is created.
+ */
+
+typedef struct
 {
-    int enabled;
-    float interval;
-    TimeoutObject *Ptimeout;
-    PyObject *Ptimer, *Pret = NULL, *Pcallback = NULL;
-    PyObject *loop = (PyObject *) data;
+    PyObject_HEAD
+    char *path;
+    char *interface;
+    char *member;
+    char *signature;
+    char *types;
+    int ntypes;
+    unsigned long emitted;
+} EmitterObject;
 
-    Ptimeout = dbus_timeout_get_data(timeout);
-    ASSERT(Ptimeout != NULL);
-    ASSERT(Ptimeout->timer != NULL);
+static PyTypeObject EmitterType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "Emitter",
+    sizeof(EmitterObject)
+};
 
-    /* First disable the current timer... */
-    Pret = PyObject_CallMethod(Ptimeout->timer, "cancel", NULL);
-    if (Pret == NULL)
-        RETURN_ERROR();
-    Py_DECREF(Pret);
-    Pret = NULL;
-    Py_DECREF(Ptimeout->timer);
-    Ptimeout->timer = NULL;
+PyDoc_STRVAR(emitter_doc,
+    "Emitter(path, interface, member, signature=None)\n\n"
+    "Emit the signal *member* on *interface* from the object at *path*. The\n"
+    "arguments are marshalled with *signature*, which is checked once when\n"
+    "the emitter is created. :class:`dbusx.Signal` uses an emitter for\n"
+    "every object that it is bound to.\n");
 
-    /* And conditonally create a new one... */
-    enabled = dbus_timeout_get_enabled(timeout);
-    if (enabled) {
-        Pcallback = PyObject_GetAttrString((PyObject *) Ptimeout, "handle");
-        if (Pcallback == NULL)
-            RETURN_ERROR();
-        interval = (float) dbus_timeout_get_interval(timeout) / 1000.0;
-        Ptimer = PyObject_CallMethod(loop, "call_repeatedly", "fO",
-                                     interval, Pcallback);
-        if (Ptimer == NULL)
+/* Split the signature into its complete types. Each type is terminated by
+ * a NUL character, so that it can be passed to message_append_arg(). */
+
+static int
+_emitter_compile(EmitterObject *self)
+{
+    char *ptr, *end, *out;
+
+    free(self->types);
+    self->ntypes = 0;
+    if ((self->types = malloc(2 * strlen(self->signature) + 1)) == NULL)
+        RAISE_MEMORY_ERROR();
+    ptr = self->signature; out = self->types;
+    while (*ptr != '\000') {
+        if ((end = get_one_full_type(ptr)) == NULL)
             RETURN_ERROR();
-        Ptimeout->timer = Ptimer;  /* hand off reference */
-        Py_DECREF(Pcallback);
-        Pcallback = NULL;
+        memcpy(out, ptr, end - ptr);
+        out += end - ptr;
+        *out++ = '\000';
+        self->ntypes++;
+        ptr = end;
     }
-
-    return;
+    *out = '\000';
+    return 0;
 
 error:
-    Py_XDECREF(Pcallback);
-    Py_XDECREF(Pret);
-    PRINT_AND_CLEAR_ERROR("timeout_toggled_callback()");
+    return -1;
 }
 
-
-static void
-dispatch_status_callback(DBusConnection *connection, DBusDispatchStatus status,
-                         void *data)
+static int
+emitter_init(EmitterObject *self, PyObject *args, PyObject *kwargs)
 {
-    ConnectionObject *Pconn;
-    PyObject *Pcb = NULL;
-
-    Pconn = (ConnectionObject *) dbus_connection_get_data(connection, slot_self);
-    ASSERT(Pconn != NULL);
-    ASSERT(Pconn->loop != NULL);
-    if (Pconn->dispatch != NULL)
-        return;  /* Already dispatching. */
+    char *path, *interface, *member, *signature = NULL;
+    static char *kwlist[] = { "path", "interface", "member", "signature",
+                              NULL };
 
-    Pcb = PyObject_GetAttrString((PyObject *) Pconn, "dispatch_all");
-    if (Pcb == NULL)
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sss|z:Emitter", kwlist,
+                                     &path, &interface, &member, &signature))
+        return -1;
+    if (!_check_path(path))
+        RAISE_VALUE_ERROR("invalid path: %s", path);
+    if (!_check_interface(interface))
+        RAISE_VALUE_ERROR("invalid interface: %s", interface);
+    if (!_check_member(member))
+        RAISE_VALUE_ERROR("invalid member: %s", member);
+    if (signature == NULL)
+        signature = "";
+    if (!_check_signature(signature, 0, 0))
+        RAISE_VALUE_ERROR("illegal signature");
+    free(self->path); free(self->interface);
+    free(self->member); free(self->signature);
+    self->path = strdup(path);
+    self->interface = strdup(interface);
+    self->member = strdup(member);
+    self->signature = strdup(signature);
+    if (self->path == NULL || self->interface == NULL
+                || self->member == NULL || self->signature == NULL)
+        RAISE_MEMORY_ERROR();
+    if (_emitter_compile(self) < 0)
         RETURN_ERROR();
-    Pconn->dispatch = PyObject_CallMethod(Pconn->loop, "call_soon", "O", Pcb);
-    /* Reference to Pcb will be dropped by dispatch_all(). */
+    return 0;
 
 error:
-    Py_XDECREF(Pcb);
-    PRINT_AND_CLEAR_ERROR("dispatch_status_callback()");
+    return -1;
 }
 
+static void
+emitter_dealloc(EmitterObject *self)
+{
+    free(self->path); free(self->interface);
+    free(self->member); free(self->signature);
+    free(self->types);
+    Py_TYPE(self)->tp_free(self);
+}
 
-PyDoc_STRVAR(connection_set_loop_doc,
-    "set_loop(loop)\n\n"
-    "Enable event loop integration for this connection. The *loop*\n"
-    "parameter must be an :class:`looping.EventLoop` instance.\n");
+/* Create the signal message with the arguments in the sequence *Pargs*. */
 
-static PyObject *
-connection_set_loop(ConnectionObject *self, PyObject *args)
+static DBusMessage *
+_emitter_message(EmitterObject *self, PyObject *Pargs,
+                 const char *destination)
 {
-    PyObject *loop, *Pcb = NULL;
+    int i;
+    char *type;
+    DBusMessage *message;
+    DBusMessageIter iter;
+    PyObject *Pseq = NULL;
 
-    if (!PyArg_ParseTuple(args, "O:set_loop", &loop))
+    if (self->types == NULL)
+        RAISE_ERROR("uninitialized object");
+    if ((message = dbus_message_new_signal(self->path, self->interface,
+                                           self->member)) == NULL)
+        RAISE_MEMORY_ERROR();
+    if (destination != NULL
+                && !dbus_message_set_destination(message, destination)) {
+        dbus_message_unref(message);
+        RAISE_MEMORY_ERROR();
+    }
+    if ((Pseq = PySequence_Fast(Pargs, "expecting a sequence for the "
+                                "arguments")) == NULL) {
+        dbus_message_unref(message);
         RETURN_ERROR();
+    }
+    if (PySequence_Fast_GET_SIZE(Pseq) != self->ntypes) {
+        dbus_message_unref(message);
+        RAISE_TYPE_ERROR("expecting %d arguments for signature \"%s\"",
+                         self->ntypes, self->signature);
+    }
+    dbus_message_iter_init_append(message, &iter);
+    type = self->types;
+    for (i=0; i<self->ntypes; i++) {
+        if (!message_append_arg(&iter, type,
+                                PySequence_Fast_GET_ITEM(Pseq, i), 0)) {
+            dbus_message_unref(message);
+            /* A failed append may leave a type string modified. */
+            if (_emitter_compile(self) < 0)
+                PyErr_Clear();
+            RETURN_ERROR();
+        }
+        type += strlen(type) + 1;
+    }
+    Py_DECREF(Pseq);
+    return message;
 
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-    if (self->loop != NULL)
-        RAISE_ERROR("an event loop is already installed");
-    ASSERT(self->dispatch == NULL);
+error:
+    Py_XDECREF(Pseq);
+    return NULL;
+}
 
-    if (!PyObject_HasAttrString(loop, "add_reader") ||
-                !PyObject_HasAttrString(loop, "remove_reader") ||
-                !PyObject_HasAttrString(loop, "add_writer") ||
-                !PyObject_HasAttrString(loop, "remove_writer") ||
-                !PyObject_HasAttrString(loop, "call_soon") ||
-                !PyObject_HasAttrString(loop, "call_repeatedly"))
-        RAISE_ERROR("expecting a looping.EventLoop like object");
+/* Send *message* on a connection that is not a ConnectionBase, for example
+ * a WireConnection, by calling its send() method. */
 
-    Py_INCREF(loop);
-    self->loop = loop;
+static int
+_emitter_send_other(PyObject *Pconnection, DBusMessage *message)
+{
+    MessageObject *Pmessage;
+    PyObject *Pret;
 
-    if (!dbus_connection_set_watch_functions(self->connection,
-            add_watch_callback, remove_watch_callback,
-            watch_toggled_callback, self->loop, decref))
-        RAISE_ERROR("dbus_connection_set_watch_functions() failed");
-    Py_INCREF(self->loop);
+    Pmessage = (MessageObject *) MessageType.tp_new(&MessageType, NULL, NULL);
+    if (Pmessage == NULL)
+        return -1;
+    Pmessage->message = dbus_message_ref(message);
+    Pret = PyObject_CallMethod(Pconnection, "send", "O", Pmessage);
+    Py_DECREF(Pmessage);
+    if (Pret == NULL)
+        return -1;
+    Py_DECREF(Pret);
+    return 0;
+}
 
-    if (!dbus_connection_set_timeout_functions(self->connection,
-            add_timeout_callback, remove_timeout_callback,
-            timeout_toggled_callback, self->loop, decref))
-        RAISE_ERROR("dbus_connection_set_watch_functions() failed");
-    Py_INCREF(self->loop);
+/* Return a new list with the connections in the sequence *Pconnections*
+ * that broadcast signals. */
 
-    dbus_connection_set_dispatch_status_function(self->connection,
-                dispatch_status_callback, NULL, NULL);
-    
-    /* Schedule a call to dispatch_all() now if the current dispatch status
-     * is DBUS_DISPATCH_DATA_REMAINS. The DBUS dispatch status function API
-     * is edge trigered so it only fires on status changes. */
+static PyObject *
+_emitter_connections(PyObject *Pconnections)
+{
+    int broadcast;
+    Py_ssize_t i;
+    PyObject *Pseq, *Plist = NULL, *Pconn, *Pbroadcast;
 
-    if (dbus_connection_get_dispatch_status(self->connection)
-                == DBUS_DISPATCH_DATA_REMAINS) {
-        Pcb = PyObject_GetAttrString((PyObject *) self, "dispatch_all");
-        if (Pcb == NULL)
+    if ((Pseq = PySequence_Fast(Pconnections, "expecting a sequence of "
+                                "connections")) == NULL)
+        RETURN_ERROR();
+    if ((Plist = PyList_New(0)) == NULL)
+        RETURN_ERROR();
+    for (i=0; i<PySequence_Fast_GET_SIZE(Pseq); i++) {
+        Pconn = PySequence_Fast_GET_ITEM(Pseq, i);
+        if ((Pbroadcast = PyObject_GetAttrString(Pconn, "broadcast")) == NULL) {
+            if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+                RETURN_ERROR();
+            PyErr_Clear();
+            broadcast = 1;
+        } else {
+            broadcast = PyObject_IsTrue(Pbroadcast);
+            Py_DECREF(Pbroadcast);
+            if (broadcast < 0)
+                RETURN_ERROR();
+        }
+        if (broadcast && PyList_Append(Plist, Pconn) < 0)
             RETURN_ERROR();
-        self->dispatch = PyObject_CallMethod(self->loop, "call_soon",
-                                             "O", Pcb);
-        /* Reference to Pcb will be dropped by dispatch_all(). */
     }
+    Py_DECREF(Pseq);
+    return Plist;
 
-    Py_RETURN_NONE;
+error:
+    Py_XDECREF(Pseq);
+    Py_XDECREF(Plist);
+    return NULL;
+}
+
+/* Send *message* on all connections in the list *Plist*. A message is
+ * locked once it is queued, so all but the first connection get a copy,
+ * which has its own serial. */
+
+static int
+_emitter_send(EmitterObject *self, PyObject *Plist, DBusMessage *message)
+{
+    Py_ssize_t i;
+    DBusMessage *copy;
+    PyObject *Pconn;
+
+    for (i=0; i<PyList_GET_SIZE(Plist); i++) {
+        Pconn = PyList_GET_ITEM(Plist, i);
+        if (i == 0)
+            copy = dbus_message_ref(message);
+        else if ((copy = dbus_message_copy(message)) == NULL)
+            RAISE_MEMORY_ERROR();
+        if (PyObject_TypeCheck(Pconn, &ConnectionType)) {
+            if (_connection_send((ConnectionObject *) Pconn, copy,
+                                 PRIORITY_NORMAL) < 0) {
+                dbus_message_unref(copy);
+                RETURN_ERROR();
+            }
+        } else if (_emitter_send_other(Pconn, copy) < 0) {
+            dbus_message_unref(copy);
+            RETURN_ERROR();
+        }
+        dbus_message_unref(copy);
+        self->emitted++;
+    }
+    return 0;
 
 error:
-    Py_XDECREF(Pcb);
-    return NULL;
+    return -1;
 }
 
-
-PyDoc_STRVAR(connection_add_filter_doc,
-    "add_filter(filter)\n\n"
-    "Add a filter handler. The *filter* argument must be a Python callable.\n"
-    "The handler will be called with two arguments: the Connection and a\n"
-    "Message. It must return a boolean that indicates wether or not the\n"
-    "message was accepted.\n\n"
-    "Filter handlers are run in the order they were added, and the handler\n"
-    "that first accepts a message stops further dispatching.\n\n"
-    "Filter handlers are run after method replies are dispatched via the\n"
-    "PendingCall mechanism, but before object path handlers.\n");
+/* Return *message* marshalled as a bytes object. A message can not be
+ * demarshalled without a serial, so one that has none is given serial 1.
+ * If it was *sent*, it may be staged, and a copy is used instead, as the
+ * serial of a locked message can not be set. */
 
 static PyObject *
-connection_add_filter(ConnectionObject *self, PyObject *args)
+_emitter_marshal(DBusMessage *message, int sent)
 {
-    int found;
-    PyObject *filter;
-
-    if (!PyArg_ParseTuple(args, "O:add_filter", &filter))
-        RETURN_ERROR();
-    if (!PyCallable_Check(filter))
-        RAISE_ERROR("expecting a Python callable");
-
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-    if ((found = PySet_Contains(self->filters, filter)) < 0)
-        RETURN_ERROR();
-    if (!found) {
-        if (!dbus_connection_add_filter(self->connection, handler_callback,
-                                        filter, decref))
-            RAISE_ERROR("dbus_connection_add_filter() failed");
-        Py_INCREF(filter);
-        if (PySet_Add(self->filters, filter) < 0)
-            RETURN_ERROR();
+    int size;
+    char *data;
+    DBusMessage *copy = NULL;
+    PyObject *Pdata;
+
+    if (dbus_message_get_serial(message) == 0) {
+        if (sent) {
+            if ((copy = dbus_message_copy(message)) == NULL)
+                RAISE_MEMORY_ERROR();
+            message = copy;
+        }
+        dbus_message_set_serial(message, 1);
     }
-    Py_RETURN_NONE;
+    if (!dbus_message_marshal(message, &data, &size))
+        RAISE_MEMORY_ERROR();
+    if (copy != NULL)
+        dbus_message_unref(copy);
+    Pdata = PyBytes_FromStringAndSize(data, size);
+    dbus_free(data);
+    return Pdata;
 
 error:
+    if (copy != NULL)
+        dbus_message_unref(copy);
     return NULL;
 }
 
-
-PyDoc_STRVAR(connection_remove_filter_doc,
-    "remove_filter(filter)\n\n"
-    "Remove a filter that was previously added with :meth:`add_filter`.\n"
-    "It is an error to remove a filter that was not added.\n");
+PyDoc_STRVAR(emitter_emit_doc,
+    "emit(connections, args=(), destination=None, marshal=False)\n\n"
+    "Emit the signal with the arguments *args* on each connection in the\n"
+    "sequence *connections*, except on connections whose ``broadcast``\n"
+    "attribute is False. The message is created and marshalled once.\n"
+    "Connections that are not a ``ConnectionBase`` get a copy through their\n"
+    "``send()`` method.\n\n"
+    "If *marshal* is true, the message is also returned in marshalled form.\n"
+    "It has serial 1 if it was not sent. Pass no connections to only\n"
+    "marshal it.\n");
 
 static PyObject *
-connection_remove_filter(ConnectionObject *self, PyObject *args)
+emitter_emit(EmitterObject *self, PyObject *args, PyObject *kwargs)
 {
-    int found;
-    PyObject *filter;
-
-    if (!PyArg_ParseTuple(args, "O:remove_filter", &filter))
+    int marshal = 0;
+    char *destination = NULL;
+    DBusMessage *message = NULL;
+    PyObject *Pconnections, *Pargs = NULL, *Plist = NULL, *Pdata = NULL;
+    static char *kwlist[] = { "connections", "args", "destination",
+                              "marshal", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Ozi:emit", kwlist,
+                                     &Pconnections, &Pargs, &destination,
+                                     &marshal))
+        return NULL;
+    if ((Plist = _emitter_connections(Pconnections)) == NULL)
         RETURN_ERROR();
-    if (!PyCallable_Check(filter))
-        RAISE_ERROR("expecting a Python callable");
-
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-    if ((found = PySet_Contains(self->filters, filter)) < 0)
+    if (Pargs == NULL)
+        Pargs = PyTuple_New(0);
+    else
+        Py_INCREF(Pargs);
+    if (Pargs == NULL)
         RETURN_ERROR();
-    if (!found)
-        RAISE_ERROR("no such filter");
-    dbus_connection_remove_filter(self->connection, handler_callback, filter);
-    if (PySet_Discard(self->filters, filter) < 0)
+    if ((message = _emitter_message(self, Pargs, destination)) == NULL)
+        RETURN_ERROR();
+    if (_emitter_send(self, Plist, message) < 0)
+        RETURN_ERROR();
+    if (marshal && (Pdata = _emitter_marshal(message,
+                                    PyList_GET_SIZE(Plist) > 0)) == NULL)
         RETURN_ERROR();
 
+    dbus_message_unref(message);
+    Py_DECREF(Pargs);
+    Py_DECREF(Plist);
+    if (Pdata != NULL)
+        return Pdata;
     Py_RETURN_NONE;
 
 error:
+    if (message != NULL)
+        dbus_message_unref(message);
+    Py_XDECREF(Pargs);
+    Py_XDECREF(Plist);
     return NULL;
 }
 
-
-PyDoc_STRVAR(connection_register_object_path_doc,
-    "register_object_path(path, handler, fallback=False)\n\n"
-    "Register an object path handler. The *path* argument specifies the\n"
-    "path, and *handler* must be a Python callable. If *fallback* is true,\n"
-    "any path below the given path will also be handled by the handler\n"
-    "It is an error to register an object path handler for a path that\n"
-    "was already previously registered.\n\n"
-    "The handler will be called with two arguments: the Connection\n"
-    "and a Message. It must return a boolean whether or not the message\n"
-    "was accepted.\n\n"
-    "Object path handlers handle only method calls. Messages will be\n"
-    "dispatched to object path handlers after all registered filters\n"
-    "have been run. Once a filter or object path handler accepts a message,\n"
-    "the message is considered handled and dispatching will stop.\n");
-
-static void
-decref_vtable(DBusConnection *connection, void *data)
-{
-    Py_DECREF((PyObject *) data);
-}
+PyDoc_STRVAR(emitter_emit_many_doc,
+    "emit_many(connections, destinations, args=())\n\n"
+    "Emit the signal with the arguments *args* to each bus name in the\n"
+    "sequence *destinations*. The arguments are marshalled once. Each\n"
+    "destination gets a copy of the message with its own header. See\n"
+    ":meth:`emit` for *connections*. If a destination is invalid, nothing\n"
+    "is sent.\n");
 
 static PyObject *
-connection_register_object_path(ConnectionObject *self,
-                                      PyObject *args)
+emitter_emit_many(EmitterObject *self, PyObject *args, PyObject *kwargs)
 {
-    char *path;
-    int ret, fallback = 0;
-    PyObject *handler, *Ppath = NULL;
-    DBusError error = DBUS_ERROR_INIT;
-    DBusObjectPathVTable *vtable = NULL;
-
-    if (!PyArg_ParseTuple(args, "sO|i:register_object_path", &path, &handler,
-                          &fallback))
+    const char *destination;
+    Py_ssize_t i;
+    DBusMessage *message = NULL, *copy;
+    PyObject *Pconnections, *Pdestinations, *Pargs = NULL, *Plist = NULL;
+    PyObject *Pseq = NULL, *Pdest;
+    static char *kwlist[] = { "connections", "destinations", "args", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O:emit_many", kwlist,
+                                     &Pconnections, &Pdestinations, &Pargs))
         return NULL;
-    if (!_check_path(path))
-        RAISE_ERROR("invalid path");
-    if (!PyCallable_Check(handler))
-        RAISE_ERROR("expecting a Python callable");
-
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-    if ((vtable = calloc(1, sizeof (DBusObjectPathVTable))) == NULL)
-        RAISE_MEMORY_ERROR();
-    vtable->message_function = handler_callback;
-    vtable->unregister_function = decref_vtable;
-    if (fallback)
-        ret = dbus_connection_try_register_fallback(self->connection, path,
-                            vtable, handler, &error);
+    if ((Plist = _emitter_connections(Pconnections)) == NULL)
+        RETURN_ERROR();
+    if ((Pseq = PySequence_Fast(Pdestinations, "expecting a sequence of "
+                                "destinations")) == NULL)
+        RETURN_ERROR();
+    if (Pargs == NULL)
+        Pargs = PyTuple_New(0);
     else
-        ret = dbus_connection_try_register_object_path(self->connection, path,
-                            vtable, handler, &error);
-    if (!ret) {
-        if (dbus_error_is_set(&error))
-            RAISE_ERROR("dbus: %s", error.message);
-        else
-            RAISE_ERROR("Unknown error");
-    }
-    Py_INCREF(handler);
-    free(vtable); vtable = NULL;
-    if ((Ppath = PyUnicode_FromString(path)) == NULL)
+        Py_INCREF(Pargs);
+    if (Pargs == NULL)
         RETURN_ERROR();
-    if (PyDict_SetItem(self->object_paths, Ppath, handler) < 0)
+    if ((message = _emitter_message(self, Pargs, NULL)) == NULL)
         RETURN_ERROR();
-    Py_DECREF(Ppath); Ppath = NULL;
 
+    /* Check all destinations before anything is queued. */
+    for (i=0; i<PySequence_Fast_GET_SIZE(Pseq); i++) {
+        Pdest = PySequence_Fast_GET_ITEM(Pseq, i);
+        if (!PyUnicode_Check(Pdest))
+            RAISE_TYPE_ERROR("expecting str for destination");
+        if ((destination = PyUnicode_AsUTF8(Pdest)) == NULL)
+            RETURN_ERROR();
+        if (!_check_bus_name(destination))
+            RAISE_VALUE_ERROR("invalid destination: %s", destination);
+    }
+
+    for (i=0; i<PySequence_Fast_GET_SIZE(Pseq); i++) {
+        Pdest = PySequence_Fast_GET_ITEM(Pseq, i);
+        if ((destination = PyUnicode_AsUTF8(Pdest)) == NULL)
+            RETURN_ERROR();
+        if ((copy = dbus_message_copy(message)) == NULL)
+            RAISE_MEMORY_ERROR();
+        if (!dbus_message_set_destination(copy, destination)) {
+            dbus_message_unref(copy);
+            RAISE_MEMORY_ERROR();
+        }
+        if (_emitter_send(self, Plist, copy) < 0) {
+            dbus_message_unref(copy);
+            RETURN_ERROR();
+        }
+        dbus_message_unref(copy);
+    }
+
+    dbus_message_unref(message);
+    Py_DECREF(Pargs);
+    Py_DECREF(Pseq);
+    Py_DECREF(Plist);
     Py_RETURN_NONE;
 
 error:
-    if (vtable != NULL) free(vtable);
-    if (Ppath != NULL) Py_DECREF(Ppath);
+    if (message != NULL)
+        dbus_message_unref(message);
+    Py_XDECREF(Pargs);
+    Py_XDECREF(Pseq);
+    Py_XDECREF(Plist);
     return NULL;
 }
 
-
-PyDoc_STRVAR(connection_unregister_object_path_doc,
-    "unregister_object_path(path)\n\n"
-    "Unregister an object path handler. The *path* argument specifies\n"
-    "the path that will be removed. Both regular as well as fallback\n"
-    "handlers can be removed with this call.\n");
+PyDoc_STRVAR(emitter_emit_batch_doc,
+    "emit_batch(connections, batch, destination=None)\n\n"
+    "Emit the signal once for every argument tuple in the sequence\n"
+    "*batch*. See :meth:`emit`. If the arguments of one of the signals\n"
+    "are invalid, nothing is sent.\n");
 
 static PyObject *
-connection_unregister_object_path(ConnectionObject *self,
-                                        PyObject *args)
+emitter_emit_batch(EmitterObject *self, PyObject *args, PyObject *kwargs)
 {
-    char *path;
-    int found;
-    PyObject *Ppath = NULL;
-
-    if (!PyArg_ParseTuple(args, "s:unregister_object_path", &path))
+    char *destination = NULL;
+    Py_ssize_t i, size, count = 0;
+    DBusMessage **messages = NULL;
+    PyObject *Pconnections, *Pbatch, *Plist = NULL, *Pseq = NULL;
+    static char *kwlist[] = { "connections", "batch", "destination", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|z:emit_batch", kwlist,
+                                     &Pconnections, &Pbatch, &destination))
         return NULL;
-    if (!_check_path(path))
-        RAISE_ERROR("invalid path");
-
-    if (self->connection == NULL)
-        RAISE_ERROR("not connected");
-    if ((Ppath = PyUnicode_FromString(path)) == NULL)
+    if ((Plist = _emitter_connections(Pconnections)) == NULL)
         RETURN_ERROR();
-    if ((found = PyDict_Contains(self->object_paths, Ppath)) < 0)
-        RETURN_ERROR();
-    if (!found)
-        RAISE_ERROR("no such object path");
-    if (!dbus_connection_unregister_object_path(self->connection, path))
-        RAISE_ERROR("dbus_connection_unregister_object_path() failed");
-    if (PyDict_DelItem(self->object_paths, Ppath) < 0)
+    if ((Pseq = PySequence_Fast(Pbatch, "expecting a sequence of "
+                                "arguments")) == NULL)
         RETURN_ERROR();
-    Py_DECREF(Ppath);
 
+    /* Create all messages before anything is queued. */
+    size = PySequence_Fast_GET_SIZE(Pseq);
+    if (size > 0 && (messages = malloc(size * sizeof(DBusMessage *))) == NULL)
+        RAISE_MEMORY_ERROR();
+    for (count=0; count<size; count++) {
+        messages[count] = _emitter_message(self,
+                                PySequence_Fast_GET_ITEM(Pseq, count),
+                                destination);
+        if (messages[count] == NULL)
+            RETURN_ERROR();
+    }
+
+    for (i=0; i<count; i++) {
+        if (_emitter_send(self, Plist, messages[i]) < 0)
+            RETURN_ERROR();
+    }
+
+    for (i=0; i<count; i++)
+        dbus_message_unref(messages[i]);
+    free(messages);
+    Py_DECREF(Pseq);
+    Py_DECREF(Plist);
     Py_RETURN_NONE;
 
 error:
-    if (Ppath != NULL) Py_DECREF(Ppath);
+    for (i=0; i<count; i++)
+        dbus_message_unref(messages[i]);
+    free(messages);
+    Py_XDECREF(Pseq);
+    Py_XDECREF(Plist);
     return NULL;
 }
 
+PyDoc_STRVAR(emitter_path_doc, "The path of the object.");
 
-static PyMethodDef connection_methods[] = \
+static PyObject *
+emitter_get_path(EmitterObject *self, void *context)
 {
-    { "get", (PyCFunction) connection_get,
-            METH_VARARGS|METH_KEYWORDS|METH_CLASS, connection_get_doc },
-    { "close", (PyCFunction) connection_close, METH_VARARGS,
-            connection_close_doc },
-    { "send", (PyCFunction) connection_send, METH_VARARGS,
-            connection_send_doc },
-    { "send_with_reply", (PyCFunction) connection_send_with_reply,
-            METH_VARARGS, connection_send_with_reply_doc },
-    { "flush", (PyCFunction) connection_flush, METH_VARARGS,
-            connection_flush_doc },
-    { "dispatch", (PyCFunction) connection_dispatch, METH_VARARGS,
-            connection_dispatch_doc },
-    { "dispatch_all", (PyCFunction) connection_dispatch_all, METH_VARARGS,
-            connection_dispatch_all_doc },
-    { "read_write_dispatch", (PyCFunction) connection_read_write_dispatch,
-            METH_VARARGS, connection_read_write_dispatch_doc },
-    { "set_loop", (PyCFunction) connection_set_loop, METH_VARARGS,
-            connection_set_loop_doc },
-    { "add_filter", (PyCFunction) connection_add_filter, METH_VARARGS,
-            connection_add_filter_doc },
-    { "remove_filter", (PyCFunction) connection_remove_filter,
-            METH_VARARGS, connection_remove_filter_doc },
-    { "register_object_path", (PyCFunction)
-            connection_register_object_path, METH_VARARGS,
-            connection_register_object_path_doc },
-    { "unregister_object_path", (PyCFunction)
-            connection_unregister_object_path, METH_VARARGS,
-            connection_unregister_object_path_doc },
+    if (self->path == NULL)
+        Py_RETURN_NONE;
+    return PyUnicode_FromString(self->path);
+}
+
+PyDoc_STRVAR(emitter_signature_doc, "The signature of the signal.");
+
+static PyObject *
+emitter_get_signature(EmitterObject *self, void *context)
+{
+    if (self->signature == NULL)
+        Py_RETURN_NONE;
+    return PyUnicode_FromString(self->signature);
+}
+
+PyDoc_STRVAR(emitter_emitted_doc,
+    "The number of signal messages that were queued.");
+
+static PyObject *
+emitter_get_emitted(EmitterObject *self, void *context)
+{
+    return PyLong_FromUnsignedLong(self->emitted);
+}
+
+static PyGetSetDef emitter_properties[] = \
+{
+    { "path", (getter) emitter_get_path, NULL, emitter_path_doc },
+    { "signature", (getter) emitter_get_signature, NULL,
+            emitter_signature_doc },
+    { "emitted", (getter) emitter_get_emitted, NULL, emitter_emitted_doc },
     { NULL }
 };
 
+static PyMethodDef emitter_methods[] = \
+{
+    { "emit", (PyCFunction) emitter_emit, METH_VARARGS|METH_KEYWORDS,
+            emitter_emit_doc },
+    { "emit_many", (PyCFunction) emitter_emit_many,
+            METH_VARARGS|METH_KEYWORDS, emitter_emit_many_doc },
+    { "emit_batch", (PyCFunction) emitter_emit_batch,
+            METH_VARARGS|METH_KEYWORDS, emitter_emit_batch_doc },
+    { NULL }
+};
 
 static PyObject *
-connection_type_init()
+emitter_type_init()
 {
-    ConnectionType.tp_doc = connection_doc;
-    ConnectionType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE \
-                                    | Py_TPFLAGS_HAVE_GC ;
-    ConnectionType.tp_new = connection_new;
-    ConnectionType.tp_init = (initproc) connection_init;
-    ConnectionType.tp_dealloc = (destructor) connection_dealloc;
-    ConnectionType.tp_traverse = (traverseproc) connection_traverse;
-    ConnectionType.tp_clear = (inquiry) connection_clear;
-    ConnectionType.tp_methods = connection_methods;
-    ConnectionType.tp_getset = connection_properties;
-    if (PyType_Ready(&ConnectionType) < 0)
-        return NULL; 
-    return (PyObject *) &ConnectionType;
+    EmitterType.tp_doc = emitter_doc;
+    EmitterType.tp_flags = Py_TPFLAGS_DEFAULT;
+    EmitterType.tp_new = PyType_GenericNew;
+    EmitterType.tp_init = (initproc) emitter_init;
+    EmitterType.tp_dealloc = (destructor) emitter_dealloc;
+    EmitterType.tp_methods = emitter_methods;
+    EmitterType.tp_getset = emitter_properties;
+    if (PyType_Ready(&EmitterType) < 0)
+        return NULL;
+    return (PyObject *) &EmitterType;
 }
 
 
@@ -3118,6 +6900,10 @@ MOD_INITFUNC(_dbus)
         return MOD_ERROR;
     if ((Ptype = timeout_type_init()) == NULL)
         return MOD_ERROR;
+    if ((Ptype = unixfd_type_init()) == NULL)
+        return MOD_ERROR;
+    if ((PyDict_SetItemString(Pdict, "UnixFD", Ptype) < 0))
+        return MOD_ERROR;
     if ((Ptype = message_type_init()) == NULL)
         return MOD_ERROR;
     if ((PyDict_SetItemString(Pdict, "MessageBase", Ptype) < 0))
@@ -3126,6 +6912,22 @@ MOD_INITFUNC(_dbus)
         return MOD_ERROR;
     if ((PyDict_SetItemString(Pdict, "ConnectionBase", Ptype) < 0))
         return MOD_ERROR;
+    if ((Ptype = server_type_init()) == NULL)
+        return MOD_ERROR;
+    if ((PyDict_SetItemString(Pdict, "ServerBase", Ptype) < 0))
+        return MOD_ERROR;
+    if ((Ptype = ring_type_init()) == NULL)
+        return MOD_ERROR;
+    if ((PyDict_SetItemString(Pdict, "Ring", Ptype) < 0))
+        return MOD_ERROR;
+    if ((Ptype = relay_type_init()) == NULL)
+        return MOD_ERROR;
+    if ((PyDict_SetItemString(Pdict, "RelayBase", Ptype) < 0))
+        return MOD_ERROR;
+    if ((Ptype = emitter_type_init()) == NULL)
+        return MOD_ERROR;
+    if ((PyDict_SetItemString(Pdict, "Emitter", Ptype) < 0))
+        return MOD_ERROR;
 
     /* Add constants. */
 
@@ -3156,6 +6958,19 @@ MOD_INITFUNC(_dbus)
     
     EXPORT_INT_SYMBOL(DBUS_MAXIMUM_NAME_LENGTH);
 
+    #define EXPORT_CONSTANT(name) \
+        do { \
+            if ((Pint = PyLong_FromLong(name)) == NULL) return MOD_ERROR; \
+            PyDict_SetItemString(Pdict, #name, Pint); \
+            Py_DECREF(Pint); \
+        } while (0)
+
+    EXPORT_CONSTANT(PRIORITY_HIGH);
+    EXPORT_CONSTANT(PRIORITY_NORMAL);
+    EXPORT_CONSTANT(PRIORITY_LOW);
+    EXPORT_CONSTANT(CONFLATE_SIGNAL);
+    EXPORT_CONSTANT(CONFLATE_ARG0);
+
     #define EXPORT_STR_SYMBOL(name) \
         do { \
             if ((Pstr = PyUnicode_FromString(name)) == NULL) return MOD_ERROR; \
@@ -3173,6 +6988,7 @@ MOD_INITFUNC(_dbus)
     EXPORT_STR_SYMBOL(DBUS_INTERFACE_PROPERTIES);
     EXPORT_STR_SYMBOL(DBUS_INTERFACE_PEER);
     EXPORT_STR_SYMBOL(DBUS_INTERFACE_LOCAL);
+    EXPORT_STR_SYMBOL(DBUS_INTERFACE_MONITORING);
 
     EXPORT_STR_SYMBOL(DBUS_ERROR_FAILED);
     EXPORT_STR_SYMBOL(DBUS_ERROR_NO_MEMORY);
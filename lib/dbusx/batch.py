@@ -0,0 +1,125 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Batching of signals between dbusx peers.
+
+A signal that is defined with a *batch* window can be delivered in batches
+to dbusx receivers that ask for it::
+
+    class MyService(dbusx.Object):
+        Tick = dbusx.Signal('com.example.MyService', args='u', batch=0.01)
+
+    connection.connect_to_signal(service, path, 'com.example.MyService',
+                                 'Tick', callback, batch=True)
+
+The receiver calls ``Subscribe`` on :data:`INTERFACE_BATCH` at the path of
+the object. If the object agrees, it collects the signals that it emits
+during the window, and then sends them to the receiver as a single
+``Batch`` signal. This envelope contains the interface and member of the
+signals, and an array with the signals as marshalled messages. The
+receiving connection unpacks the envelope and calls its signal callbacks
+once for each signal, or once with all of them for callbacks that were
+connected with :meth:`Connection.connect_to_batch`.
+
+Other receivers are not affected. The object still emits every signal
+normally, and the bus only routes those to the receivers that did not
+subscribe to batches. The signal is marshalled once, for the normal
+emission and the batches. If the object does not support batches, the
+receiver adds a normal match rule instead.
+
+If all receivers of a signal are dbusx peers, define it with
+``batch_only=True``. While there are subscribers, a signal that is emitted
+without a destination is then only put in the batches, and not sent
+normally. This is off by default, because receivers that do not use dbusx
+would miss those signals.
+"""
+
+from __future__ import absolute_import
+
+import dbusx
+
+__all__ = ['INTERFACE_BATCH', 'Batcher', 'unpack']
+
+INTERFACE_BATCH = 'com.github.geertj.dbusx.Batch'
+
+
+def unpack(message, args=None):
+    """Return the signals that are contained in the ``Batch`` signal
+    *message*. They have the sender of the envelope. Pass the arguments of
+    *message* as *args* if they were already decoded."""
+    if args is None:
+        args = message.args
+    interface, member, payloads = args
+    messages = []
+    for data in payloads:
+        signal = dbusx.Message.demarshal(data)
+        if signal.type != dbusx.MESSAGE_TYPE_SIGNAL \
+                    or signal.interface != interface \
+                    or signal.member != member:
+            continue
+        if message.sender is not None:
+            signal.sender = message.sender
+        messages.append(signal)
+    return messages
+
+
+class Batcher(object):
+    """Collects the emissions of one signal of one object for the receivers
+    that subscribed to batches, and sends them once per batch window."""
+
+    def __init__(self, signal):
+        self.signal = signal
+        self.subscribers = {}
+        self.timer = None
+
+    def subscribe(self, connection, name):
+        self.subscribers.setdefault((connection, name), [])
+
+    def unsubscribe(self, connection, name):
+        self.subscribers.pop((connection, name), None)
+
+    def unsubscribe_all(self, connection, name=None):
+        """Remove the subscribers of *connection* with bus name *name*, or
+        all subscribers of *connection* if *name* is None."""
+        for key in list(self.subscribers):
+            if key[0] is connection and (name is None or key[1] == name):
+                del self.subscribers[key]
+
+    def targets(self, destination):
+        """Return the subscribers that a signal to *destination* is for."""
+        return [key for key in self.subscribers
+                if destination is None or key[1] == destination]
+
+    def add(self, targets, data):
+        """Add the marshalled signal *data* to the batches of the
+        subscribers in *targets*."""
+        for key in targets:
+            self.subscribers[key].append(data)
+        loop = self.signal._loop()
+        if loop is None:
+            self.flush()
+        elif self.timer is None:
+            self.timer = loop.call_later(self.signal.batch, self.flush)
+
+    def flush(self):
+        """Send the collected signals."""
+        self.timer = None
+        signal = self.signal
+        for key, payloads in list(self.subscribers.items()):
+            if not payloads:
+                continue
+            connection, name = key
+            envelope = dbusx.Message.signal(name, signal.instance.path,
+                                INTERFACE_BATCH, 'Batch', 'ssaay',
+                                (signal.interface, signal.name, payloads))
+            self.subscribers[key] = []
+            try:
+                connection.send(envelope)
+            except dbusx.Error:
+                # The connection was closed.
+                self.subscribers.pop(key, None)
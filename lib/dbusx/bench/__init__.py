@@ -0,0 +1,277 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Benchmarks for dbusx.
+
+This package contains benchmark suites and the helpers that they share.
+Results are emitted as JSON, one object per line, so that they can be
+stored and compared between releases.
+"""
+
+from __future__ import print_function
+
+import os
+import sys
+import json
+import time
+
+import dbusx
+import dbusx.util
+import dbusx.router
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+clock = getattr(time, 'perf_counter', time.time)
+
+#: The event loops that benchmarks can run on. "blocking" means no event
+#: loop: the connection is driven by :meth:`ConnectionBase.read_write_dispatch`.
+loops = ['blocking', 'builtin', 'tulip', 'pyuv', 'pyside']
+
+
+def create_loop(name):
+    """Create the event loop *name*, which must be one of :data:`loops`.
+
+    Return None for the "blocking" loop. Raise ImportError if the loop is
+    not available.
+    """
+    if name == 'blocking':
+        return None
+    elif name == 'builtin':
+        import dbusx.loop
+        return dbusx.loop.EventLoop()
+    elif name == 'tulip':
+        import tulip
+        return tulip.get_event_loop()
+    elif name in ('pyuv', 'pyside'):
+        import looping
+        cls = getattr(looping, 'PyUVEventLoop' if name == 'pyuv'
+                                    else 'PySideEventLoop', None)
+        if cls is None:
+            raise ImportError('looping does not support %s' % name)
+        return cls()
+    raise ValueError('unknown loop: %s' % name)
+
+
+def start_bus(router=False, process=False):
+    """Start a private message bus for a benchmark.
+
+    By default this starts a bus daemon using "dbus-launch". If *router* is
+    true, a :class:`dbusx.router.Router` is used instead. It runs in a
+    background thread, or in a child process if *process* is true. The
+    latter is required if the benchmark forks.
+
+    The return value is an (address, stop) tuple, where *stop* is a function
+    that stops the bus.
+    """
+    if not router:
+        address, pid = dbusx.util.start_bus_daemon()
+        return address, lambda: dbusx.util.stop_bus_daemon(pid)
+    if not process:
+        router = dbusx.router.Router()
+        router.start()
+        return router.address, router.stop
+    import multiprocessing
+    queue = multiprocessing.Queue()
+    child = multiprocessing.Process(target=_run_router, args=(queue,))
+    child.start()
+    address = queue.get(timeout=30)
+    def stop():
+        child.terminate()
+        child.join()
+    return address, stop
+
+
+def _run_router(queue):
+    """Entry point for a router process."""
+    import signal
+    router = dbusx.router.Router()
+    # Stop cleanly on terminate() so that the socket is removed.
+    signal.signal(signal.SIGTERM, lambda *args: router.stop())
+    queue.put(router.address)
+    router.run()
+
+
+def run_once(connection, secs=None):
+    """Run one iteration of the event loop of *connection*, waiting at most
+    *secs* seconds for events."""
+    if connection.loop:
+        if connection.dispatch_status == dbusx.DISPATCH_DATA_REMAINS:
+            connection.dispatch()
+        else:
+            connection.loop.run_once(secs)
+    else:
+        connection.read_write_dispatch(secs)
+
+
+def run_forever(connection):
+    """Run the event loop of *connection* until the process is terminated."""
+    if connection.loop:
+        connection.loop.run_forever()
+    else:
+        while True:
+            connection.read_write_dispatch(1)
+
+
+def timeit(func, min_time=0.2, repeat=3):
+    """Return the best time in seconds of a single call to *func*.
+
+    The number of calls per measurement is calibrated so that each
+    measurement takes at least *min_time* seconds. The best of *repeat*
+    measurements is returned.
+    """
+    number = 1
+    while True:
+        start = clock()
+        for i in range(number):
+            func()
+        elapsed = clock() - start
+        if elapsed >= min_time:
+            break
+        # Scale towards min_time, but at least double each round.
+        number = max(2*number, int(1.2 * number * min_time / max(elapsed, 1e-9)))
+    best = elapsed / number
+    for i in range(repeat-1):
+        start = clock()
+        for i in range(number):
+            func()
+        best = min(best, (clock() - start) / number)
+    return best
+
+
+def allocations(func, number=100):
+    """Measure the memory allocated by *func* using tracemalloc.
+
+    The return value is a dictionary with the peak memory in bytes that is
+    used by a single call (*peak_bytes*), and the memory retained per call
+    after *number* calls (*retained_bytes*). Both are None if tracemalloc
+    is not available.
+
+    Retained memory is measured as the growth between two rounds of
+    *number* calls, so that caches and free lists that are populated in the
+    first round do not show up as retained memory.
+    """
+    if tracemalloc is None:
+        return { 'peak_bytes': None, 'retained_bytes': None }
+    tracemalloc.start()
+    try:
+        base, peak = tracemalloc.get_traced_memory()
+        func()
+        current, peak = tracemalloc.get_traced_memory()
+        peak_bytes = peak - base
+        for i in range(number-1):
+            func()
+        base, peak = tracemalloc.get_traced_memory()
+        for i in range(number):
+            func()
+        current, peak = tracemalloc.get_traced_memory()
+        retained_bytes = (current - base) / float(number)
+    finally:
+        tracemalloc.stop()
+    return { 'peak_bytes': peak_bytes, 'retained_bytes': retained_bytes }
+
+
+def cpu_time(pid=None):
+    """Return the CPU time (user + system) in seconds used by the process
+    *pid*, or by the current process if *pid* is not provided.
+
+    The CPU time of other processes is read from /proc. None is returned if
+    it is not available.
+    """
+    if pid is None:
+        times = os.times()
+        return times[0] + times[1]
+    try:
+        with open('/proc/%d/stat' % pid) as fin:
+            stat = fin.read()
+    except IOError:
+        return None
+    # The command name may contain spaces, skip past it.
+    fields = stat[stat.rfind(')')+2:].split()
+    ticks = os.sysconf('SC_CLK_TCK')
+    return (int(fields[11]) + int(fields[12])) / float(ticks)
+
+
+def histogram(samples, scale=1e6):
+    """Return a histogram of *samples* with logarithmic (base 2) buckets.
+
+    The samples are multiplied by *scale* first. The return value is a list
+    of (upper_bound, count) tuples, with empty buckets at either end
+    removed.
+    """
+    counts = {}
+    for sample in samples:
+        bound = 1
+        value = sample * scale
+        while bound < value:
+            bound *= 2
+        counts[bound] = counts.get(bound, 0) + 1
+    if not counts:
+        return []
+    result = []
+    bound, last = min(counts), max(counts)
+    while bound <= last:
+        result.append((bound, counts.get(bound, 0)))
+        bound *= 2
+    return result
+
+
+def format_histogram(hist, width=50, unit='us'):
+    """Format a histogram as returned by :func:`histogram`."""
+    lines = []
+    peak = max([count for bound, count in hist] or [1])
+    for bound, count in hist:
+        bar = '#' * int(round(width * count / float(peak)))
+        lines.append(('%10d %s %8d %s' % (bound, unit, count, bar)).rstrip())
+    return '\n'.join(lines)
+
+
+def emit(result, stream=None):
+    """Write the dictionary *result* to *stream* as a line of JSON."""
+    stream = stream or sys.stdout
+    stream.write(json.dumps(result, sort_keys=True) + '\n')
+    stream.flush()
+
+
+def load_results(filename):
+    """Load results written by :func:`emit` into a dictionary keyed by
+    the result name."""
+    results = {}
+    with open(filename) as fin:
+        for line in fin:
+            line = line.strip()
+            if not line:
+                continue
+            result = json.loads(line)
+            results[result['name']] = result
+    return results
+
+
+def compare(results, baseline, key, threshold=0.1, higher_is_better=False):
+    """Compare *results* to *baseline* on the metric *key*.
+
+    Both arguments are dictionaries as returned by :func:`load_results`.
+    Return a list of (name, baseline_value, value) tuples for all results
+    that are worse than the baseline by more than *threshold* (a fraction).
+    """
+    regressions = []
+    for name in sorted(results):
+        if name not in baseline:
+            continue
+        value = results[name].get(key)
+        base = baseline[name].get(key)
+        if value is None or not base:
+            continue
+        change = (value - base) / float(base)
+        if higher_is_better:
+            change = -change
+        if change > threshold:
+            regressions.append((name, base, value))
+    return regressions
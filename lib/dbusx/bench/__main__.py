@@ -0,0 +1,11 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from dbusx.bench.loadgen import main
+
+main()
@@ -0,0 +1,297 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""End-to-end benchmarks.
+
+This suite measures throughput and latency through a bus daemon for
+synchronous method calls, pipelined asynchronous method calls, signal fan-out
+to multiple subscribers, and large payloads. Each benchmark is run on every
+available event loop. By default a private bus daemon is started. Run it
+with::
+
+  $ python -m dbusx.bench.endtoend [-o results.json] [-b baseline.json]
+
+The service and the signal subscribers run in separate processes, so that
+the numbers include the cost of the round trips through the daemon, but not
+contention on the GIL.
+"""
+
+from __future__ import print_function
+
+import sys
+import time
+import optparse
+import functools
+import multiprocessing
+
+import dbusx
+import dbusx.util
+import dbusx.bench
+import dbusx.wire
+
+IFACE_BENCH = 'com.github.geertj.dbusx.Bench'
+PATH_BENCH = '/com/github/geertj/dbusx/Bench'
+
+#: The latency percentiles that are reported.
+points = (50, 99, 99.9)
+
+
+class BenchService(dbusx.Object):
+
+    @dbusx.Method(IFACE_BENCH, args_in='s', args_out='s')
+    def Echo(self, s):
+        return s
+
+    @dbusx.Method(IFACE_BENCH, args_in='ay', args_out='u')
+    def Upload(self, data):
+        return len(data)
+
+
+def _connect(address, loop, wire=False):
+    if wire:
+        connection = dbusx.wire.WireConnection(address, register=True)
+    else:
+        connection = dbusx.Connection(address)
+    loop = dbusx.bench.create_loop(loop)
+    if loop is not None:
+        connection.set_loop(loop)
+    return connection
+
+
+def _serve(address, loop, queue):
+    """Entry point for the service process."""
+    connection = _connect(address, loop)
+    connection.publish(BenchService(), PATH_BENCH)
+    queue.put(connection.unique_name)
+    dbusx.bench.run_forever(connection)
+
+
+def _subscribe(address, loop, sender, count, queue):
+    """Entry point for a signal subscriber process. Receive *count* signals
+    and put the delivery latencies on *queue*."""
+    connection = _connect(address, loop)
+    latencies = []
+    def callback(message):
+        latencies.append(time.time() - message.args[0])
+    connection.connect_to_signal(sender, PATH_BENCH, IFACE_BENCH, 'Tick',
+                                 callback)
+    # The AddMatch is processed once a round trip to the daemon completes.
+    connection.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                           dbusx.INTERFACE_DBUS, 'GetId')
+    queue.put(None)
+    end_time = time.time() + 60
+    while len(latencies) < count and time.time() < end_time:
+        dbusx.bench.run_once(connection, 0.1)
+    queue.put(latencies)
+
+
+def _result(name, loop, count, elapsed, latencies, size=None):
+    result = { 'name': '%s.%s' % (name, loop), 'loop': loop,
+               'count': count, 'elapsed': elapsed,
+               'ops': count / elapsed if elapsed else 0.0 }
+    pct = dbusx.util.percentiles(latencies, points)
+    for point in points:
+        key = 'p%s' % str(point).replace('.', '')
+        result[key] = pct[point] * 1e6 if pct[point] is not None else None
+    if size is not None:
+        result['size'] = size
+        result['mbytes'] = size * result['ops'] / 1e6
+    return result
+
+
+def bench_sync_call(connection, service, loop, count):
+    """Synchronous method calls, one at a time."""
+    latencies = []
+    start = time.time()
+    for i in range(count):
+        t0 = time.time()
+        connection.call_method(service, PATH_BENCH, IFACE_BENCH, 'Echo',
+                               's', ('x',))
+        latencies.append(time.time() - t0)
+    elapsed = time.time() - start
+    return _result('sync_call', loop, count, elapsed, latencies)
+
+
+def bench_async_call(connection, service, loop, count, window=16):
+    """Asynchronous method calls with up to *window* calls outstanding."""
+    latencies = []
+    state = { 'outstanding': 0 }
+    def callback(sent, message):
+        latencies.append(time.time() - sent)
+        state['outstanding'] -= 1
+    start = time.time()
+    for i in range(count):
+        while state['outstanding'] >= window:
+            dbusx.bench.run_once(connection, 0.01)
+        connection.call_method(service, PATH_BENCH, IFACE_BENCH, 'Echo',
+                        's', ('x',), callback=functools.partial(callback,
+                                                                time.time()))
+        state['outstanding'] += 1
+    while state['outstanding']:
+        dbusx.bench.run_once(connection, 0.01)
+    elapsed = time.time() - start
+    return _result('async_call', loop, count, elapsed, latencies)
+
+
+def bench_large_payload(connection, service, loop, count, size=1<<20):
+    """Synchronous method calls with a payload of *size* bytes."""
+    data = b'x' * size
+    count = max(1, count // 100)
+    latencies = []
+    start = time.time()
+    for i in range(count):
+        t0 = time.time()
+        connection.call_method(service, PATH_BENCH, IFACE_BENCH, 'Upload',
+                               'ay', (data,))
+        latencies.append(time.time() - t0)
+    elapsed = time.time() - start
+    return _result('large_payload', loop, count, elapsed, latencies, size)
+
+
+def bench_signal_fanout(connection, service, loop, count, subscribers=4):
+    """Signals delivered to *subscribers* subscriber processes. The latency
+    is measured from emission to delivery."""
+    queue = multiprocessing.Queue()
+    processes = []
+    for i in range(subscribers):
+        process = multiprocessing.Process(target=_subscribe,
+                        args=(connection.address, loop,
+                              connection.unique_name, count, queue))
+        process.start()
+        processes.append(process)
+    try:
+        for i in range(subscribers):
+            queue.get(timeout=30)
+        start = time.time()
+        for i in range(count):
+            message = dbusx.Message.signal(None, PATH_BENCH, IFACE_BENCH,
+                                           'Tick', 'd', (time.time(),))
+            connection.send(message)
+            # Keep the outgoing queue short so that the latency measures
+            # delivery rather than queueing in our own process.
+            if i % 64 == 0:
+                connection.flush()
+        connection.flush()
+        latencies = []
+        for i in range(subscribers):
+            latencies.extend(queue.get(timeout=60))
+        elapsed = time.time() - start
+    finally:
+        for process in processes:
+            process.join(5)
+            if process.is_alive():
+                process.terminate()
+    result = _result('signal_fanout', loop, len(latencies), elapsed, latencies)
+    result['subscribers'] = subscribers
+    return result
+
+
+benchmarks = [('sync_call', bench_sync_call),
+              ('async_call', bench_async_call),
+              ('large_payload', bench_large_payload),
+              ('signal_fanout', bench_signal_fanout)]
+
+
+def run_loop(address, loop, count=1000, subscribers=4, filter=None,
+             wire=False):
+    """Run all benchmarks on the event loop *loop*. Return a list of result
+    dictionaries. If *wire* is true, the benchmark client uses a
+    :class:`dbusx.wire.WireConnection`."""
+    queue = multiprocessing.Queue()
+    server = multiprocessing.Process(target=_serve,
+                                     args=(address, loop, queue))
+    server.start()
+    results = []
+    try:
+        service = queue.get(timeout=30)
+        connection = _connect(address, loop, wire)
+        # Warm up the connections and caches on both sides.
+        for i in range(10):
+            connection.call_method(service, PATH_BENCH, IFACE_BENCH, 'Echo',
+                                   's', ('x',))
+        for name, func in benchmarks:
+            if filter and filter not in name:
+                continue
+            if name == 'signal_fanout':
+                result = func(connection, service, loop, count, subscribers)
+            else:
+                result = func(connection, service, loop, count)
+            results.append(result)
+        connection.close()
+    finally:
+        server.terminate()
+        server.join()
+    return results
+
+
+def available_loops(names=None):
+    """Return the names of the event loops in *names* that are available."""
+    loops = []
+    for name in names or dbusx.bench.loops:
+        try:
+            dbusx.bench.create_loop(name)
+        except ImportError:
+            continue
+        loops.append(name)
+    return loops
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('-a', '--address',
+                      help='use this bus instead of a private bus')
+    parser.add_option('-o', '--output', help='write results to this file')
+    parser.add_option('-b', '--baseline', help='compare to these results')
+    parser.add_option('-t', '--threshold', type='float', default=0.1,
+                      help='regression threshold (default: 0.1 = 10%)')
+    parser.add_option('-l', '--loops', help='comma separated list of loops')
+    parser.add_option('-k', '--filter', help='only run matching benchmarks')
+    parser.add_option('-n', '--count', type='int', default=1000,
+                      help='number of calls or signals per benchmark')
+    parser.add_option('-s', '--subscribers', type='int', default=4,
+                      help='number of signal subscribers')
+    parser.add_option('--router', action='store_true',
+                      help='use the in-process router instead of dbus-daemon')
+    parser.add_option('--wire', action='store_true',
+                      help='use the native wire protocol for the client')
+    opts, args = parser.parse_args()
+    loops = available_loops(opts.loops.split(',') if opts.loops else None)
+    stop = None
+    if opts.address:
+        address = opts.address
+    else:
+        address, stop = dbusx.bench.start_bus(opts.router)
+    output = open(opts.output, 'w') if opts.output else sys.stdout
+    results = {}
+    try:
+        for loop in loops:
+            for result in run_loop(address, loop, opts.count,
+                                   opts.subscribers, opts.filter, opts.wire):
+                dbusx.bench.emit(result, output)
+                results[result['name']] = result
+    finally:
+        if output is not sys.stdout:
+            output.close()
+        if stop is not None:
+            stop()
+    if opts.baseline:
+        baseline = dbusx.bench.load_results(opts.baseline)
+        failed = False
+        for key, higher in (('ops', True), ('p99', False)):
+            regressions = dbusx.bench.compare(results, baseline, key,
+                                              opts.threshold, higher)
+            for name, base, value in regressions:
+                sys.stderr.write('regression: %s: %s %.2f -> %.2f\n'
+                                 % (name, key, base, value))
+                failed = True
+        if failed:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,371 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""A configurable load generator.
+
+The load generator can act as a server, as a client, or as both. The server
+publishes an object with a method that returns a payload of a size that is
+specified by the caller, optionally after burning a configurable amount of
+CPU time. The client spawns a number of processes that call this method
+either in a closed loop, with a fixed number of calls outstanding, or at a
+target rate. With a target rate, the client can also run open loop: calls
+are sent at their scheduled time regardless of how many replies are
+outstanding, and latency is measured from the scheduled time. This avoids
+hiding queueing delays when the server cannot keep up.
+
+Examples::
+
+  $ python -m dbusx.bench -p 4 -c 8 -d 10         # private bus, closed loop
+  $ python -m dbusx.bench -a $ADDR server -w 50    # server only
+  $ python -m dbusx.bench -a $ADDR client -r 5000 -O -q 1024 -R 4096
+"""
+
+from __future__ import print_function
+
+import sys
+import time
+import optparse
+import functools
+import multiprocessing
+
+import dbusx
+import dbusx.util
+import dbusx.bench
+
+SERVICE_LOADGEN = 'com.github.geertj.dbusx.LoadGen'
+IFACE_LOADGEN = 'com.github.geertj.dbusx.LoadGen'
+PATH_LOADGEN = '/com/github/geertj/dbusx/LoadGen'
+
+#: The latency percentiles that are reported.
+points = (50, 90, 99, 99.9)
+
+
+class LoadService(dbusx.Object):
+    """The object published by the server."""
+
+    def __init__(self, work=0):
+        super(LoadService, self).__init__()
+        self.work = work
+        self.calls = 0
+        self._payloads = {}
+
+    def _payload(self, size):
+        payload = self._payloads.get(size)
+        if payload is None:
+            payload = self._payloads[size] = b'x' * size
+        return payload
+
+    @dbusx.Method(IFACE_LOADGEN, args_in='ayu', args_out='ay')
+    def Call(self, data, reply_size):
+        self.calls += 1
+        if self.work:
+            end = dbusx.bench.clock() + self.work
+            while dbusx.bench.clock() < end:
+                pass
+        return self._payload(reply_size)
+
+    @dbusx.Method(IFACE_LOADGEN, args_out='td')
+    def Stats(self):
+        return (self.calls, dbusx.bench.cpu_time())
+
+
+def _connect(address, loop):
+    connection = dbusx.Connection(address)
+    loop = dbusx.bench.create_loop(loop)
+    if loop is not None:
+        connection.set_loop(loop)
+    return connection
+
+
+def _call_bus(connection, method, signature=None, args=None):
+    reply = connection.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                   dbusx.INTERFACE_DBUS, method,
+                                   signature, args)
+    if reply.type == dbusx.MESSAGE_TYPE_ERROR:
+        raise dbusx.Error('%s: %s' % (reply.error_name, reply.args[0]))
+    return reply.args
+
+
+def serve(address, name=SERVICE_LOADGEN, work=0, loop='blocking',
+          ready=None):
+    """Run the server. This function does not return.
+
+    The server acquires the bus name *name* and handles calls using the
+    event loop *loop*. Each call burns *work* seconds of CPU time. If *ready*
+    is provided, it must be a queue on which None is put once the server is
+    ready to accept calls.
+    """
+    connection = _connect(address, loop)
+    # DBUS_NAME_FLAG_DO_NOT_QUEUE = 4, DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER = 1
+    result = _call_bus(connection, 'RequestName', 'su', (name, 4))
+    if result[0] != 1:
+        raise dbusx.Error('could not acquire bus name %s' % name)
+    connection.publish(LoadService(work), PATH_LOADGEN)
+    if ready is not None:
+        ready.put(None)
+    dbusx.bench.run_forever(connection)
+
+
+def _client(address, name, config, ready, go, results):
+    """Entry point for a client process."""
+    connection = _connect(address, config['loop'])
+    request = b'x' * config['request_size']
+    args = (request, config['reply_size'])
+    rate = config['rate']
+    interval = 1.0 / rate if rate else 0.0
+    concurrency = config['concurrency']
+    open_loop = config['open_loop']
+    timeout = config['timeout']
+    state = { 'outstanding': 0, 'replies': 0, 'errors': 0 }
+    latencies = []
+    def callback(due, message):
+        latencies.append(dbusx.bench.clock() - due)
+        state['outstanding'] -= 1
+        if message.type == dbusx.MESSAGE_TYPE_ERROR:
+            state['errors'] += 1
+        else:
+            state['replies'] += 1
+    ready.put(None)
+    go.wait()
+    clock = dbusx.bench.clock
+    cpu_start = dbusx.bench.cpu_time()
+    start = clock()
+    end = start + config['duration']
+    sent = 0
+    while True:
+        now = clock()
+        if now >= end:
+            break
+        due = now
+        if rate:
+            due = start + sent * interval
+            if due > now:
+                dbusx.bench.run_once(connection, min(due, end) - now)
+                continue
+        if not open_loop and state['outstanding'] >= concurrency:
+            dbusx.bench.run_once(connection, end - now)
+            continue
+        callback_due = due if open_loop else now
+        connection.call_method(name, PATH_LOADGEN, IFACE_LOADGEN, 'Call',
+                        'ayu', args, timeout=timeout,
+                        callback=functools.partial(callback, callback_due))
+        state['outstanding'] += 1
+        sent += 1
+    # Wait for the remaining replies, but do not count them in the elapsed
+    # time: they were all sent within the test duration.
+    elapsed = clock() - start
+    deadline = clock() + (timeout or 25)
+    while state['outstanding'] and clock() < deadline:
+        dbusx.bench.run_once(connection, 0.1)
+    results.put({ 'sent': sent, 'replies': state['replies'],
+                  'errors': state['errors'], 'lost': state['outstanding'],
+                  'elapsed': elapsed, 'latencies': latencies,
+                  'cpu': dbusx.bench.cpu_time() - cpu_start })
+    connection.close()
+
+
+class LoadGenerator(object):
+    """Run a load test against a server at bus name *name*.
+
+    The *config* argument is a dictionary with the keys *processes*,
+    *concurrency*, *rate* (total calls per second, or None for as fast as
+    possible), *open_loop*, *duration*, *request_size*, *reply_size*,
+    *timeout* and *loop*. Missing keys use the defaults from
+    :attr:`default_config`.
+    """
+
+    default_config = { 'processes': 1, 'concurrency': 1, 'rate': None,
+                       'open_loop': False, 'duration': 5.0,
+                       'request_size': 0, 'reply_size': 0, 'timeout': None,
+                       'loop': 'blocking' }
+
+    def __init__(self, address, name=SERVICE_LOADGEN, config=None):
+        self.address = address
+        self.name = name
+        self.config = self.default_config.copy()
+        self.config.update(config or {})
+        if self.config['open_loop'] and not self.config['rate']:
+            raise ValueError('open loop requires a rate')
+
+    def _stats(self, connection, daemon_pid):
+        reply = connection.call_method(self.name, PATH_LOADGEN,
+                                       IFACE_LOADGEN, 'Stats')
+        if reply.type == dbusx.MESSAGE_TYPE_ERROR:
+            calls = server_cpu = None
+        else:
+            calls, server_cpu = reply.args
+        return calls, server_cpu, dbusx.bench.cpu_time(daemon_pid)
+
+    def run(self):
+        """Run the load test. Return a dictionary with the results."""
+        config = self.config
+        nproc = config['processes']
+        client_config = config.copy()
+        if config['rate']:
+            client_config['rate'] = config['rate'] / float(nproc)
+        ready = multiprocessing.Queue()
+        results = multiprocessing.Queue()
+        go = multiprocessing.Event()
+        processes = []
+        for i in range(nproc):
+            process = multiprocessing.Process(target=_client,
+                        args=(self.address, self.name, client_config,
+                              ready, go, results))
+            process.start()
+            processes.append(process)
+        try:
+            for i in range(nproc):
+                ready.get(timeout=30)
+            connection = dbusx.Connection(self.address)
+            daemon_pid = _call_bus(connection, 'GetConnectionUnixProcessID',
+                                   's', (dbusx.SERVICE_DBUS,))[0]
+            before = self._stats(connection, daemon_pid)
+            go.set()
+            clients = [results.get(timeout=config['duration'] + 60)
+                       for i in range(nproc)]
+            after = self._stats(connection, daemon_pid)
+            connection.close()
+        finally:
+            for process in processes:
+                process.join(5)
+                if process.is_alive():
+                    process.terminate()
+        return self._summarize(clients, before, after)
+
+    def _summarize(self, clients, before, after):
+        latencies = []
+        result = { 'sent': 0, 'replies': 0, 'errors': 0, 'lost': 0 }
+        for client in clients:
+            for key in result:
+                result[key] += client[key]
+            latencies.extend(client['latencies'])
+        elapsed = max(client['elapsed'] for client in clients)
+        result['elapsed'] = elapsed
+        result['throughput'] = result['replies'] / elapsed if elapsed else 0.0
+        result['latency'] = dbusx.util.percentiles(latencies, points)
+        result['histogram'] = dbusx.bench.histogram(latencies)
+        # CPU time per reply, in seconds.
+        def per_reply(value):
+            return value / result['replies'] if result['replies'] else None
+        result['client_cpu'] = per_reply(sum(client['cpu']
+                                             for client in clients))
+        calls = server_cpu = None
+        if before[0] is not None and after[0] is not None:
+            calls = after[0] - before[0]
+            server_cpu = (after[1] - before[1]) / calls if calls else None
+        result['server_calls'] = calls
+        result['server_cpu'] = server_cpu
+        result['daemon_cpu'] = None
+        if before[2] is not None and after[2] is not None:
+            result['daemon_cpu'] = per_reply(after[2] - before[2])
+        result['config'] = self.config
+        return result
+
+
+def format_result(result):
+    """Format a load test result as a human readable string."""
+    lines = []
+    config = result['config']
+    if config['rate']:
+        mode = '%s loop at %.0f calls/s' % \
+                    ('open' if config['open_loop'] else 'closed',
+                     config['rate'])
+    else:
+        mode = 'closed loop with %d outstanding' % config['concurrency']
+    lines.append('%d client process(es), %s, %d/%d byte payloads, %s loop'
+                 % (config['processes'], mode, config['request_size'],
+                    config['reply_size'], config['loop']))
+    lines.append('sent %(sent)d calls in %(elapsed).2f seconds, received '
+                 '%(replies)d replies (%(throughput).1f/s), %(errors)d '
+                 'errors, %(lost)d lost' % result)
+    latency = result['latency']
+    if latency.get(50) is not None:
+        lines.append('latency: ' + ', '.join(['p%s=%.3fms' % (p, latency[p]*1e3)
+                                              for p in sorted(latency)]))
+        lines.append(dbusx.bench.format_histogram(result['histogram']))
+    cpu = []
+    for key in ('client', 'server', 'daemon'):
+        value = result['%s_cpu' % key]
+        if value is not None:
+            cpu.append('%s=%.1fus' % (key, value * 1e6))
+    if cpu:
+        lines.append('cpu per message: ' + ', '.join(cpu))
+    return '\n'.join(lines)
+
+
+def main():
+    """Run the load generator."""
+    parser = optparse.OptionParser(usage='%prog [options] [both|client|server]')
+    parser.add_option('-a', '--address',
+                      help='bus address (default: start a private bus)')
+    parser.add_option('-N', '--name', default=SERVICE_LOADGEN,
+                      help='bus name of the server')
+    parser.add_option('-l', '--loop', default='blocking',
+                      help='event loop: %s' % ', '.join(dbusx.bench.loops))
+    parser.add_option('-p', '--processes', type='int', default=1,
+                      help='number of client processes')
+    parser.add_option('-c', '--concurrency', type='int', default=1,
+                      help='outstanding calls per client process')
+    parser.add_option('-r', '--rate', type='float',
+                      help='target calls per second (total)')
+    parser.add_option('-O', '--open-loop', action='store_true',
+                      help='send at the target rate regardless of replies')
+    parser.add_option('-d', '--duration', type='float', default=5.0,
+                      help='test duration in seconds')
+    parser.add_option('-q', '--request-size', type='int', default=0,
+                      help='request payload size in bytes')
+    parser.add_option('-R', '--reply-size', type='int', default=0,
+                      help='reply payload size in bytes')
+    parser.add_option('-w', '--work', type='float', default=0,
+                      help='server CPU time per call in microseconds')
+    parser.add_option('-t', '--timeout', type='float',
+                      help='call timeout in seconds')
+    parser.add_option('-o', '--output', help='append JSON results to file')
+    parser.add_option('--router', action='store_true',
+                      help='use a router process instead of dbus-daemon')
+    opts, args = parser.parse_args()
+    mode = args[0] if args else 'both'
+    if len(args) > 1 or mode not in ('both', 'client', 'server'):
+        parser.error('specify one of "both", "client" or "server"')
+    if opts.open_loop and not opts.rate:
+        parser.error('--open-loop requires --rate')
+    if mode != 'both' and not opts.address:
+        parser.error('%s mode requires --address' % mode)
+    if mode == 'server':
+        serve(opts.address, opts.name, opts.work / 1e6, opts.loop)
+        return
+    stop = server = None
+    address = opts.address
+    try:
+        if address is None:
+            address, stop = dbusx.bench.start_bus(opts.router, process=True)
+        if mode == 'both':
+            ready = multiprocessing.Queue()
+            server = multiprocessing.Process(target=serve,
+                            args=(address, opts.name, opts.work / 1e6,
+                                  opts.loop, ready))
+            server.start()
+            ready.get(timeout=30)
+        config = dict((key, getattr(opts, key))
+                      for key in LoadGenerator.default_config)
+        generator = LoadGenerator(address, opts.name, config)
+        result = generator.run()
+    finally:
+        if server is not None:
+            server.terminate()
+            server.join()
+        if stop is not None:
+            stop()
+    print(format_result(result))
+    if opts.output:
+        with open(opts.output, 'a') as fout:
+            dbusx.bench.emit(result, fout)
+
+
+if __name__ == '__main__':
+    main()
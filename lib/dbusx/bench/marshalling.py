@@ -0,0 +1,152 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Marshalling microbenchmarks.
+
+This suite measures the throughput and memory allocations of
+:meth:`MessageBase.set_args` (marshalling) and :attr:`MessageBase.args`
+(demarshalling) for a corpus of realistic signatures and message sizes. It
+does not need a bus daemon. Run it with::
+
+  $ python -m dbusx.bench.marshalling [-o results.json] [-b baseline.json]
+
+The exit status is non-zero if any operation retains memory, or, when a
+baseline is provided, if any benchmark is slower than the baseline by more
+than the threshold.
+"""
+
+from __future__ import print_function
+
+import sys
+import optparse
+
+import dbusx
+import dbusx.bench
+
+
+def _properties(n):
+    values = [('s', 'value'), ('u', 42), ('b', True), ('d', 3.14),
+              ('as', ['a', 'b', 'c']), ('x', -1 << 40)]
+    return dict(('Property%d' % i, values[i % len(values)]) for i in range(n))
+
+def _managed_objects(nobjects, ninterfaces, nprops):
+    objects = {}
+    for i in range(nobjects):
+        path = '/org/example/Object%d' % i
+        objects[path] = dict(('org.example.Interface%d' % j, _properties(nprops))
+                             for j in range(ninterfaces))
+    return objects
+
+def _nested_struct(depth):
+    sig, value = 'i', 1
+    for i in range(depth):
+        sig, value = '(s%s)' % sig, ('level%d' % i, value)
+    return sig, value
+
+def _nested_variant(depth):
+    value = ('i', 1)
+    for i in range(depth):
+        value = ('v', value)
+    return value
+
+_deep_sig, _deep_value = _nested_struct(16)
+
+#: The corpus: (name, signature, args).
+corpus = [
+    ('string', 's', ('hello world',)),
+    ('string_4k', 's', ('x' * 4096,)),
+    ('integers', 'ybnqiuxt', (1, True, -2, 3, -4, 5, -6, 7)),
+    ('object_path', 'o', ('/org/freedesktop/DBus',)),
+    ('properties_10', 'a{sv}', (_properties(10),)),
+    ('properties_100', 'a{sv}', (_properties(100),)),
+    ('doubles_1k', 'ad', ([float(i) for i in range(1000)],)),
+    ('doubles_100k', 'ad', ([float(i) for i in range(100000)],)),
+    ('ints_10k', 'ai', (list(range(10000)),)),
+    ('strings_1k', 'as', (['string%d' % i for i in range(1000)],)),
+    ('bytes_1m', 'ay', (b'x' * (1 << 20),)),
+    ('managed_objects', 'a{oa{sa{sv}}}', (_managed_objects(50, 3, 5),)),
+    ('struct_flat', '(isdbxt)', ((1, 'foo', 2.5, True, -3, 4),)),
+    ('struct_array_1k', 'a(isd)', ([(i, 'item', i/2.0) for i in range(1000)],)),
+    ('struct_deep', _deep_sig, (_deep_value,)),
+    ('variants_100', 'av', ([('s', 'x'), ('i', 1), ('d', 1.0), ('as', ['y'])]
+                            * 25,)),
+    ('variant_nested', 'v', (_nested_variant(16),)),
+]
+
+
+def _new_message():
+    return dbusx.MessageBase(dbusx.MESSAGE_TYPE_METHOD_RETURN)
+
+
+def run_case(name, signature, args, min_time=0.2):
+    """Run the benchmarks for one corpus entry. Return a list of result
+    dictionaries."""
+    message = _new_message()
+    message.set_args(signature, args)
+    message.serial = 1
+    size = len(message.marshal())
+    message = _new_message()
+    message.set_args(signature, args)
+    def set_args():
+        _new_message().set_args(signature, args)
+    def get_args():
+        message.args
+    results = []
+    for op, func in (('set_args', set_args), ('args', get_args)):
+        secs = dbusx.bench.timeit(func, min_time)
+        result = { 'name': '%s.%s' % (name, op), 'signature': signature,
+                   'size': size, 'usecs': secs * 1e6, 'ops': 1.0 / secs,
+                   'mbytes': size / secs / 1e6 }
+        # Use enough calls for one-off allocations to average out.
+        number = int(min(100, max(10, 0.5 / secs)))
+        result.update(dbusx.bench.allocations(func, number))
+        results.append(result)
+    return results
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('-o', '--output', help='write results to this file')
+    parser.add_option('-b', '--baseline', help='compare to these results')
+    parser.add_option('-t', '--threshold', type='float', default=0.1,
+                      help='regression threshold (default: 0.1 = 10%)')
+    parser.add_option('-k', '--filter', help='only run matching benchmarks')
+    parser.add_option('-m', '--min-time', type='float', default=0.2,
+                      help='minimum time per measurement in seconds')
+    opts, args = parser.parse_args()
+    output = open(opts.output, 'w') if opts.output else sys.stdout
+    results = {}
+    for name, signature, args in corpus:
+        if opts.filter and opts.filter not in name:
+            continue
+        for result in run_case(name, signature, args, opts.min_time):
+            dbusx.bench.emit(result, output)
+            results[result['name']] = result
+    if output is not sys.stdout:
+        output.close()
+    # Marshalling should not retain any memory. Allow for some noise.
+    failed = False
+    for name in sorted(results):
+        retained = results[name]['retained_bytes']
+        if retained is not None and retained > 64:
+            sys.stderr.write('leak: %s: %.1f bytes/op\n' % (name, retained))
+            failed = True
+    if opts.baseline:
+        baseline = dbusx.bench.load_results(opts.baseline)
+        regressions = dbusx.bench.compare(results, baseline, 'usecs',
+                                          opts.threshold)
+        for name, base, value in regressions:
+            sys.stderr.write('regression: %s: %.2f -> %.2f usecs\n'
+                             % (name, base, value))
+            failed = True
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,348 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Memory footprint regression suite.
+
+This suite pushes a large number of messages through the code paths that
+hand references between Python and libdbus: sending and receiving, pending
+calls with timeouts, filters, object paths, and connections that are closed
+with calls outstanding. While doing so it tracks the memory allocated by
+Python (using tracemalloc) and the resident set size of the process. A
+workload fails if memory grows by more than a fixed slack plus a per-message
+allowance after an initial warm-up. Run it with::
+
+  $ python -m dbusx.bench.memory [-n 1000000] [-o results.json]
+
+The exit status is non-zero if any workload fails.
+"""
+
+from __future__ import print_function
+
+import os
+import gc
+import sys
+import time
+import optparse
+
+import dbusx
+import dbusx.bench
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+IFACE_MEMORY = 'com.github.geertj.dbusx.Memory'
+PATH_MEMORY = '/com/github/geertj/dbusx/Memory'
+
+
+def rss():
+    """Return the resident set size of the current process in bytes, or
+    None if it cannot be determined."""
+    try:
+        with open('/proc/self/statm') as fin:
+            pages = int(fin.read().split()[1])
+        return pages * os.sysconf('SC_PAGE_SIZE')
+    except (IOError, OSError):
+        return None
+
+
+class MemoryService(dbusx.Object):
+
+    @dbusx.Method(IFACE_MEMORY, args_in='s', args_out='s')
+    def Echo(self, s):
+        return s
+
+    @dbusx.Method(IFACE_MEMORY)
+    def Hang(self):
+        raise dbusx.NoReply()
+
+
+class Workload(object):
+    """Base class for workloads. A workload runs against a connection that
+    has a :class:`MemoryService` published at :data:`PATH_MEMORY`."""
+
+    name = None
+
+    def __init__(self, connection):
+        self.connection = connection
+        self.destination = connection.unique_name
+
+    def _call(self, method, signature=None, args=None):
+        return dbusx.Message.method_call(self.destination, PATH_MEMORY,
+                                         IFACE_MEMORY, method, signature, args)
+
+    def _pump(self, done):
+        while not done():
+            self.connection.read_write_dispatch(1)
+
+    def run(self, count):
+        """Process *count* messages."""
+        raise NotImplementedError
+
+    def close(self):
+        """Remove anything that was installed on the connection."""
+
+
+class SignalWorkload(Workload):
+    """Signals sent to ourselves and received by a filter."""
+
+    name = 'signals'
+
+    def __init__(self, connection):
+        super(SignalWorkload, self).__init__(connection)
+        self.received = 0
+        connection.add_filter(self._filter)
+
+    def _filter(self, connection, message):
+        if message.type != dbusx.MESSAGE_TYPE_SIGNAL \
+                    or message.interface != IFACE_MEMORY:
+            return False
+        message.args
+        self.received += 1
+        return True
+
+    def run(self, count):
+        target = self.received + count
+        for i in range(count):
+            message = dbusx.Message.signal(self.destination, PATH_MEMORY,
+                                           IFACE_MEMORY, 'Tick', 's', ('x',))
+            self.connection.send(message)
+            if i % 64 == 63:
+                self.connection.flush()
+        self._pump(lambda: self.received >= target)
+
+    def close(self):
+        self.connection.remove_filter(self._filter)
+
+
+class CallWorkload(Workload):
+    """Synchronous method calls to an object path handler."""
+
+    name = 'calls'
+
+    def run(self, count):
+        for i in range(count):
+            self.connection.call_method(self.destination, PATH_MEMORY,
+                                        IFACE_MEMORY, 'Echo', 's', ('x',))
+
+
+class PendingCallWorkload(Workload):
+    """Asynchronous method calls with a timeout and a callback that returns
+    a value. The timeout is never hit, but it is installed and removed for
+    every call."""
+
+    name = 'pending_calls'
+    window = 32
+
+    def __init__(self, connection):
+        super(PendingCallWorkload, self).__init__(connection)
+        self.outstanding = 0
+
+    def _callback(self, message):
+        self.outstanding -= 1
+        return [message.args]
+
+    def run(self, count):
+        for i in range(count):
+            if self.outstanding >= self.window:
+                self._pump(lambda: self.outstanding < self.window)
+            self.connection.send_with_reply(self._call('Echo', 's', ('x',)),
+                                            self._callback, 30)
+            self.outstanding += 1
+        self._pump(lambda: self.outstanding == 0)
+
+
+class FilterWorkload(Workload):
+    """Filters that are added, called and removed again."""
+
+    name = 'filters'
+
+    def __init__(self, connection):
+        super(FilterWorkload, self).__init__(connection)
+        self.received = 0
+
+    def run(self, count):
+        for i in range(count):
+            def filter(connection, message):
+                if message.type != dbusx.MESSAGE_TYPE_SIGNAL \
+                            or message.interface != IFACE_MEMORY:
+                    return False
+                self.received += 1
+                # Remove ourselves while being dispatched.
+                connection.remove_filter(filter)
+                return True
+            self.connection.add_filter(filter)
+            target = self.received + 1
+            self.connection.send(dbusx.Message.signal(self.destination,
+                                    PATH_MEMORY, IFACE_MEMORY, 'Tick'))
+            self._pump(lambda: self.received >= target)
+
+
+class ObjectPathWorkload(Workload):
+    """Object paths that are registered, called and unregistered again."""
+
+    name = 'object_paths'
+
+    def run(self, count):
+        connection = self.connection
+        for i in range(count):
+            path = PATH_MEMORY + '/Child'
+            connection.publish(MemoryService(), path)
+            connection.call_method(self.destination, path, IFACE_MEMORY,
+                                   'Echo', 's', ('x',))
+            connection.remove(path)
+
+
+class CloseWorkload(Workload):
+    """Connections that are closed with method calls outstanding. Each
+    connection sends 10 calls."""
+
+    name = 'close_pending'
+    calls = 10
+
+    def run(self, count):
+        address = self.connection.address
+        for i in range(max(1, count // self.calls)):
+            connection = dbusx.Connection(address)
+            for j in range(self.calls):
+                message = self._call('Hang')
+                connection.send_with_reply(message, lambda m: None, 30)
+            connection.flush()
+            connection.close()
+
+
+workloads = [SignalWorkload, CallWorkload, PendingCallWorkload,
+             FilterWorkload, ObjectPathWorkload, CloseWorkload]
+
+
+def _sample():
+    gc.collect()
+    python = tracemalloc.get_traced_memory()[0] if tracemalloc \
+                        and tracemalloc.is_tracing() else None
+    return python, rss()
+
+
+def measure(workload, count, samples=10, warmup=0.1):
+    """Run *workload* for *count* messages and track memory usage.
+
+    The first *warmup* fraction of the messages is not measured. The rest is
+    run in *samples* steps, after each of which the Python allocations and
+    the RSS are sampled. Return a dictionary with the samples and the
+    growth in bytes from the first sample.
+    """
+    workload.run(max(1, int(count * warmup)))
+    step = max(1, count // samples)
+    start = time.time()
+    series = [(0,) + _sample()]
+    done = 0
+    while done < count:
+        workload.run(step)
+        done += step
+        series.append((done,) + _sample())
+    elapsed = time.time() - start
+    first, last = series[0], series[-1]
+    def growth(index):
+        if first[index] is None or last[index] is None:
+            return None
+        return last[index] - first[index]
+    return { 'name': workload.name, 'count': done, 'elapsed': elapsed,
+             'python_growth': growth(1), 'rss_growth': growth(2),
+             'series': series }
+
+
+def check(result, python_slack=64*1024, python_per_op=0.5,
+          rss_slack=4*1024*1024, rss_per_op=2.0):
+    """Check a result from :func:`measure` against the thresholds. Return a
+    list of error messages. The allowed growth is the slack in bytes, plus
+    the per-message allowance times the number of messages."""
+    errors = []
+    for key, slack, per_op in (('python', python_slack, python_per_op),
+                               ('rss', rss_slack, rss_per_op)):
+        growth = result['%s_growth' % key]
+        if growth is None:
+            continue
+        limit = slack + per_op * result['count']
+        if growth > limit:
+            errors.append('%s: %s memory grew by %d bytes (limit %d)'
+                          % (result['name'], key, growth, limit))
+    return errors
+
+
+def run(address, count, samples=10, filter=None, trace=True):
+    """Run all workloads against the bus at *address*. Return a list of
+    results."""
+    connection = dbusx.Connection(address)
+    connection.publish(MemoryService(), PATH_MEMORY)
+    results = []
+    if trace and tracemalloc:
+        tracemalloc.start()
+    try:
+        for cls in workloads:
+            if filter and filter not in cls.name:
+                continue
+            workload = cls(connection)
+            results.append(measure(workload, count, samples))
+            workload.close()
+    finally:
+        if trace and tracemalloc:
+            tracemalloc.stop()
+        connection.close()
+    return results
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('-a', '--address',
+                      help='use this bus instead of a private bus')
+    parser.add_option('-n', '--count', type='int', default=100000,
+                      help='number of messages per workload')
+    parser.add_option('-s', '--samples', type='int', default=10,
+                      help='number of memory samples per workload')
+    parser.add_option('-k', '--filter', help='only run matching workloads')
+    parser.add_option('-o', '--output', help='write results to this file')
+    parser.add_option('-T', '--no-tracemalloc', action='store_true',
+                      help='track RSS only (faster)')
+    parser.add_option('--python-slack', type='int', default=64*1024,
+                      help='allowed Python memory growth in bytes')
+    parser.add_option('--rss-slack', type='int', default=4*1024*1024,
+                      help='allowed RSS growth in bytes')
+    parser.add_option('--router', action='store_true',
+                      help='use a router process instead of dbus-daemon')
+    opts, args = parser.parse_args()
+    stop = None
+    if opts.address:
+        address = opts.address
+    else:
+        address, stop = dbusx.bench.start_bus(opts.router, process=True)
+    try:
+        results = run(address, opts.count, opts.samples, opts.filter,
+                      not opts.no_tracemalloc)
+    finally:
+        if stop is not None:
+            stop()
+    output = open(opts.output, 'w') if opts.output else None
+    errors = []
+    for result in results:
+        if output:
+            dbusx.bench.emit(result, output)
+        print('%-16s %8d messages in %6.1fs, python %+9s bytes, rss %+9s bytes'
+              % (result['name'], result['count'], result['elapsed'],
+                 result['python_growth'], result['rss_growth']))
+        errors.extend(check(result, python_slack=opts.python_slack,
+                            rss_slack=opts.rss_slack))
+    if output:
+        output.close()
+    for error in errors:
+        sys.stderr.write('%s\n' % error)
+    if errors:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,81 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+import time
+
+import dbusx
+from dbusx.server import Server
+
+
+class Broadcaster(Server):
+    """A publish/subscribe broadcaster for peer-to-peer subscribers.
+
+    Subscribers connect directly to the broadcaster with
+    ``Connection(address, register=False)`` and receive every signal that is
+    sent with :meth:`emit` or :meth:`send`. They do not need to call
+    AddMatch. Signals do not go through the bus daemon, which does not need
+    to match them against its rules or copy them for every subscriber. The
+    broadcaster marshals a signal once and queues the same message on all
+    subscriber connections.
+
+    A subscriber that does not keep up builds up an outgoing queue in the
+    broadcaster. If the queue is larger than *max_queue* bytes, new signals
+    are dropped for that subscriber. If the queue stays over the limit for
+    *grace* seconds, the subscriber is evicted: its connection is closed.
+    With a *grace* of 0, slow subscribers are evicted straight away.
+    """
+
+    def __init__(self, address, loop=None, max_queue=1024*1024, grace=1.0):
+        super(Broadcaster, self).__init__(address, loop)
+        self.max_queue = max_queue
+        self.grace = grace
+        self.sent = 0
+        self.dropped = 0
+        self.evicted = 0
+        self._slow = {}
+
+    def emit(self, path, interface, signal, signature=None, args=None):
+        """Create a signal and send it to all subscribers. Return the number
+        of subscribers the signal was queued for."""
+        message = dbusx.Message.signal(None, path, interface, signal,
+                                       signature, args)
+        return self.send(message)
+
+    def send(self, message):
+        """Send *message* to all subscribers. Return the number of
+        subscribers the message was queued for.
+
+        The message is shared between the subscribers. It cannot be changed
+        after it has been sent.
+        """
+        now = time.time()
+        queued = 0
+        for connection in self.connections[:]:
+            if connection.outgoing_size > self.max_queue:
+                since = self._slow.setdefault(connection, now)
+                if now - since >= self.grace:
+                    self.evict(connection)
+                else:
+                    self.dropped += 1
+                continue
+            self._slow.pop(connection, None)
+            connection.send(message)
+            queued += 1
+        self.sent += queued
+        return queued
+
+    def evict(self, connection):
+        """Disconnect a subscriber."""
+        self.logger.debug('evicting slow subscriber')
+        self._slow.pop(connection, None)
+        self.evicted += 1
+        self._close_connection(connection)
+
+    def _close_connection(self, connection):
+        self._slow.pop(connection, None)
+        super(Broadcaster, self)._close_connection(connection)
@@ -0,0 +1,99 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Bulk payloads in shared memory.
+
+A large buffer that is sent as an "ay" argument is copied into the message,
+through the socket to the bus daemon, through the socket to the receiver,
+and out of the message again. This module avoids those copies. The sender
+copies the buffer into a sealed memfd once with :func:`pack`, and sends the
+file descriptor as an "h" argument. The receiver maps it with
+:func:`unpack`::
+
+    connection.call_method(service, path, interface, 'Upload', 'h',
+                           (dbusx.bulk.pack(data),))
+
+    @dbusx.Method(interface, args_in='h')
+    def Upload(self, fd):
+        data = dbusx.bulk.unpack(fd)
+
+The memfd is sealed against writing, growing and shrinking, so the receiver
+can rely on the contents not changing under its feet. This requires Linux
+and Python 3.8 or later, and a connection that can pass file descriptors
+(see :attr:`ConnectionBase.can_send_fds`).
+"""
+
+from __future__ import absolute_import
+
+import os
+import mmap
+
+try:
+    import fcntl
+except ImportError:
+    fcntl = None
+
+import dbusx
+
+__all__ = ['available', 'pack', 'unpack']
+
+if hasattr(fcntl, 'F_ADD_SEALS'):
+    SEALS = fcntl.F_SEAL_SEAL | fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW \
+                | fcntl.F_SEAL_WRITE
+
+
+def available():
+    """Return whether sealed memfds are supported on this platform."""
+    return hasattr(os, 'memfd_create') and hasattr(fcntl, 'F_ADD_SEALS')
+
+
+def pack(data, name='dbusx-bulk'):
+    """Copy *data* into a new sealed memfd.
+
+    The *data* argument can be any object that supports the buffer
+    protocol. The return value is a :class:`dbusx.UnixFD` that can be passed
+    as an "h" argument.
+    """
+    if not available():
+        raise dbusx.Error('sealed memfds are not supported')
+    view = memoryview(data).cast('B')
+    fd = os.memfd_create(name, os.MFD_CLOEXEC | os.MFD_ALLOW_SEALING)
+    try:
+        os.ftruncate(fd, len(view))
+        if len(view):
+            # The mapping must be gone before the memfd can be sealed.
+            with mmap.mmap(fd, len(view)) as buf:
+                buf[:] = view
+        fcntl.fcntl(fd, fcntl.F_ADD_SEALS, SEALS)
+        return dbusx.UnixFD(fd)
+    finally:
+        os.close(fd)
+
+
+def unpack(fd):
+    """Map the payload in *fd* and return it as a read-only memoryview.
+
+    The *fd* argument is a :class:`dbusx.UnixFD` or an integer file
+    descriptor, typically a "h" argument. It remains owned by the caller,
+    and may be closed once this function returns. An error is raised if the
+    payload was not created by :func:`pack`, i.e. if it is not sealed.
+    """
+    if not available():
+        raise dbusx.Error('sealed memfds are not supported')
+    if isinstance(fd, dbusx.UnixFD):
+        fd = fd.fileno()
+    try:
+        seals = fcntl.fcntl(fd, fcntl.F_GET_SEALS)
+    except (IOError, OSError):
+        seals = 0
+    if seals & SEALS != SEALS:
+        raise dbusx.Error('payload is not a sealed memfd')
+    size = os.fstat(fd).st_size
+    if size == 0:
+        return memoryview(b'')
+    return memoryview(mmap.mmap(fd, size, prot=mmap.PROT_READ))
@@ -0,0 +1,397 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Lossless capture of D-BUS traffic.
+
+Messages are stored in their marshalled wire format in an append-only capture
+file. The file layout is as follows (all integers are little endian):
+
+ * A 16 byte file header: magic "DBUSXCAP", version (u16), flags (u16) and
+   the index interval (u32).
+ * A sequence of records. Each record starts with a 16 byte record header:
+   type (u32), payload length (u32), timestamp in microseconds (u64). The
+   payload follows and is padded to a multiple of 8 bytes.
+ * Message records (type 1) contain a single marshalled message.
+ * Index records (type 2) are written every *index_interval* messages. The
+   payload contains the offset of the previous index record (u64, 0 if
+   none), followed by a (timestamp, offset) pair (u64, u64) for each message
+   record since the previous index record.
+ * An optional 16 byte trailer: magic "DBUSXEND" and the offset of the last
+   index record (u64). It is written when a capture is closed cleanly.
+
+A reader uses the trailer and the chain of index records to locate messages
+without scanning the file. Captures that were not closed cleanly (and
+therefore have no trailer) are still readable; the index is then rebuilt by
+walking the record headers.
+"""
+
+from __future__ import print_function
+
+import os
+import sys
+import mmap
+import time
+import struct
+import bisect
+
+import six
+import dbusx
+
+__all__ = ['CaptureWriter', 'CaptureReader', 'Capture']
+
+
+MAGIC = b'DBUSXCAP'
+TRAILER_MAGIC = b'DBUSXEND'
+VERSION = 1
+
+RECORD_MESSAGE = 1
+RECORD_INDEX = 2
+
+_file_header = struct.Struct('<8sHHI')
+_record_header = struct.Struct('<IIQ')
+_index_header = struct.Struct('<Q')
+_index_entry = struct.Struct('<QQ')
+_trailer = struct.Struct('<8sQ')
+
+_padding = b'\0' * 8
+
+
+def _padded(size):
+    return (size + 7) & ~7
+
+
+class CaptureWriter(object):
+    """Write marshalled messages to a capture file."""
+
+    def __init__(self, output, index_interval=1024):
+        """Create a new capture file.
+
+        The *output* argument is either a file name or a file object opened in
+        binary mode. The *index_interval* argument specifies the number of
+        messages between index records.
+        """
+        if isinstance(output, six.string_types):
+            self.file = open(output, 'wb')
+        else:
+            self.file = output
+        self.index_interval = index_interval
+        self.offset = 0
+        self.nmessages = 0
+        self._last_index = 0
+        self._entries = []
+        self._write(_file_header.pack(MAGIC, VERSION, 0, index_interval))
+
+    def _write(self, data):
+        self.file.write(data)
+        self.offset += len(data)
+
+    def _write_record(self, rtype, payload, timestamp):
+        size = len(payload)
+        self._write(_record_header.pack(rtype, size, timestamp))
+        self._write(payload)
+        if size & 7:
+            self._write(_padding[:8 - (size & 7)])
+
+    def _write_index(self):
+        offset = self.offset
+        payload = [_index_header.pack(self._last_index)]
+        payload += [_index_entry.pack(*entry) for entry in self._entries]
+        self._write_record(RECORD_INDEX, b''.join(payload), int(time.time()*1e6))
+        self._last_index = offset
+        self._entries = []
+
+    def write(self, data, timestamp=None):
+        """Write a single marshalled message.
+
+        The *data* argument must be a message in D-BUS wire format, as
+        returned by :meth:`dbusx.MessageBase.marshal`. The *timestamp*, if
+        provided, is the time the message was seen in seconds since the
+        epoch. It defaults to the current time.
+        """
+        if timestamp is None:
+            timestamp = time.time()
+        timestamp = int(timestamp * 1e6)
+        self._entries.append((timestamp, self.offset))
+        self._write_record(RECORD_MESSAGE, data, timestamp)
+        self.nmessages += 1
+        if len(self._entries) >= self.index_interval:
+            self._write_index()
+
+    def write_message(self, message, timestamp=None):
+        """Write the :class:`dbusx.MessageBase` *message*."""
+        self.write(message.marshal(), timestamp)
+
+    def flush(self):
+        """Flush buffered records to the file."""
+        self.file.flush()
+
+    def close(self):
+        """Write the final index and the trailer, and close the file."""
+        if self.file is None:
+            return
+        if self._entries or not self._last_index:
+            self._write_index()
+        self._write(_trailer.pack(TRAILER_MAGIC, self._last_index))
+        self.file.close()
+        self.file = None
+
+
+class CaptureReader(object):
+    """Read a capture file.
+
+    The file is memory mapped and messages are demarshalled lazily, only
+    when they are returned.
+    """
+
+    def __init__(self, filename):
+        self.filename = filename
+        self.file = open(filename, 'rb')
+        size = os.fstat(self.file.fileno()).st_size
+        if size < _file_header.size:
+            self.file.close()
+            raise ValueError('not a capture file: %s' % filename)
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        self.buffer = memoryview(self.map)
+        magic, version, flags, interval = _file_header.unpack_from(self.map, 0)
+        if magic != MAGIC:
+            self.close()
+            raise ValueError('not a capture file: %s' % filename)
+        if version != VERSION:
+            self.close()
+            raise ValueError('unsupported capture file version: %d' % version)
+        self.index_interval = interval
+        self.timestamps = []
+        self.offsets = []
+        self._load_index()
+
+    def _load_index(self):
+        """Load the index using the trailer, or rebuild it if there is no
+        trailer."""
+        size = len(self.map)
+        entries = []
+        if size >= _file_header.size + _trailer.size:
+            magic, offset = _trailer.unpack_from(self.map, size - _trailer.size)
+        else:
+            magic = None
+        if magic == TRAILER_MAGIC:
+            chunks = []
+            while offset:
+                rtype, length, timestamp = \
+                        _record_header.unpack_from(self.map, offset)
+                if rtype != RECORD_INDEX:
+                    raise ValueError('corrupt index at offset %d' % offset)
+                pos = offset + _record_header.size
+                previous, = _index_header.unpack_from(self.map, pos)
+                pos += _index_header.size
+                count = (length - _index_header.size) // _index_entry.size
+                chunks.append([_index_entry.unpack_from(self.map,
+                                            pos + i*_index_entry.size)
+                               for i in range(count)])
+                offset = previous
+            for chunk in reversed(chunks):
+                entries.extend(chunk)
+        else:
+            # No trailer: walk the record headers. A partially written record
+            # at the end of the file is ignored.
+            offset = _file_header.size
+            while offset + _record_header.size <= size:
+                rtype, length, timestamp = \
+                        _record_header.unpack_from(self.map, offset)
+                end = offset + _record_header.size + _padded(length)
+                if end > size:
+                    break
+                if rtype == RECORD_MESSAGE:
+                    entries.append((timestamp, offset))
+                offset = end
+        self.timestamps = [entry[0] for entry in entries]
+        self.offsets = [entry[1] for entry in entries]
+
+    def __len__(self):
+        return len(self.offsets)
+
+    def __iter__(self):
+        return self.messages()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def _range(self, start, end):
+        first = 0 if start is None \
+                    else bisect.bisect_left(self.timestamps, int(start*1e6))
+        last = len(self.timestamps) if end is None \
+                    else bisect.bisect_left(self.timestamps, int(end*1e6))
+        return first, last
+
+    def records(self, start=None, end=None):
+        """Iterate over the raw message records.
+
+        This yields (timestamp, data) tuples, where *data* is a memoryview
+        referencing the marshalled message in the memory map. No copies are
+        made. The *start* and *end* arguments can be used to select a range of
+        messages by timestamp, specified in seconds since the epoch.
+        """
+        first, last = self._range(start, end)
+        buf = self.buffer
+        for ix in range(first, last):
+            offset = self.offsets[ix]
+            rtype, length, timestamp = _record_header.unpack_from(self.map, offset)
+            offset += _record_header.size
+            yield timestamp / 1e6, buf[offset:offset+length]
+
+    def messages(self, start=None, end=None, type=None, cls=None, **headers):
+        """Iterate over the messages in the capture.
+
+        This yields (timestamp, message) tuples. Messages are demarshalled
+        only when they are yielded, as instances of *cls* which defaults to
+        :class:`dbusx.Message`. The *start* and *end* arguments select a
+        range of messages by timestamp. The *type* argument filters on message
+        type, which is done without demarshalling the message. Any further
+        keyword arguments filter on the corresponding message attribute, e.g.
+        ``member='NameAcquired'``.
+        """
+        if cls is None:
+            cls = dbusx.Message
+        for timestamp, data in self.records(start, end):
+            # The message type is the second byte of the fixed header.
+            if type is not None and bytearray(data[1:2])[0] != type:
+                continue
+            message = cls.demarshal(data)
+            for name in headers:
+                if getattr(message, name) != headers[name]:
+                    break
+            else:
+                yield timestamp, message
+
+    def close(self):
+        """Close the capture file."""
+        if self.buffer is not None:
+            self.buffer.release()
+            self.buffer = None
+        if self.map is not None:
+            self.map.close()
+            self.map = None
+        self.file.close()
+
+
+class Capture(object):
+    """A capture engine.
+
+    A capture opens a dedicated connection to a message bus and turns it into
+    a monitor by calling "BecomeMonitor" on the bus. All messages that match
+    the monitor's match rules are written unchanged to a capture file.
+    """
+
+    def __init__(self, address, output, rules=None, index_interval=1024):
+        """Create a new capture.
+
+        The *address* argument specifies the bus to capture, and *output*
+        the capture file name or file object. The *rules* argument, if
+        provided, is a list of match rules that select which messages are
+        captured. By default all messages are captured.
+        """
+        self.address = address
+        self.rules = rules or []
+        self.writer = CaptureWriter(output, index_interval)
+        self.connection = None
+        self.unique_name = None
+
+    def start(self, loop=None):
+        """Start the capture.
+
+        If *loop* is provided, the capture connection is integrated with that
+        event loop. Otherwise, you need to call :meth:`run`.
+        """
+        self.connection = dbusx.Connection(self.address)
+        self.unique_name = self.connection.unique_name
+        self.connection.add_filter(self._capture)
+        reply = self.connection.call_method(dbusx.SERVICE_DBUS,
+                        dbusx.PATH_DBUS, dbusx.INTERFACE_MONITORING,
+                        'BecomeMonitor', 'asu', (self.rules, 0))
+        if reply.type == dbusx.MESSAGE_TYPE_ERROR:
+            self.connection.close()
+            self.connection = None
+            raise dbusx.RemoteError(reply.error_name)
+        if loop is not None:
+            self.connection.set_loop(loop)
+
+    def _capture(self, connection, message):
+        # Skip messages to ourselves. This is the "NameLost" signal that is
+        # sent when we become a monitor.
+        if message.destination != self.unique_name:
+            self.writer.write(message.marshal())
+        # A monitor may not send anything on the bus so prevent libdbus from
+        # generating error replies for method calls not addressed to us.
+        return True
+
+    @property
+    def nmessages(self):
+        """The number of messages captured so far."""
+        return self.writer.nmessages
+
+    def run(self, timeout=None, count=None):
+        """Run the capture using the built-in, blocking event loop.
+
+        The capture runs until *timeout* seconds have passed or *count*
+        messages have been captured. If neither is provided, it runs until
+        the connection is closed.
+        """
+        if timeout is not None:
+            end_time = time.time() + timeout
+        while count is None or self.writer.nmessages < count:
+            secs = None
+            if timeout is not None:
+                secs = end_time - time.time()
+                if secs <= 0:
+                    break
+            if not self.connection.read_write_dispatch(secs or 0.1):
+                break
+
+    def stop(self):
+        """Stop the capture and close the capture file."""
+        if self.connection is not None:
+            self.connection.close()
+            self.connection = None
+        self.writer.close()
+
+
+def main():
+    """Capture messages on a bus (the session bus by default) to a file."""
+    import optparse
+    parser = optparse.OptionParser(usage='%prog [options] output [rule]...')
+    parser.add_option('-a', '--address', help='bus address to capture')
+    parser.add_option('--system', action='store_true',
+                      help='capture the system bus')
+    parser.add_option('-t', '--timeout', type='float',
+                      help='stop after this many seconds')
+    parser.add_option('-c', '--count', type='int',
+                      help='stop after this many messages')
+    opts, args = parser.parse_args()
+    if not args:
+        parser.error('no output file specified')
+    if opts.address:
+        address = opts.address
+    elif opts.system:
+        address = dbusx.BUS_SYSTEM
+    else:
+        address = dbusx.BUS_SESSION
+    capture = Capture(address, args[0], args[1:])
+    capture.start()
+    try:
+        capture.run(opts.timeout, opts.count)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        capture.stop()
+    sys.stderr.write('captured %d messages\n' % capture.nmessages)
+
+
+if __name__ == '__main__':
+    main()
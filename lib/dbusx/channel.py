@@ -0,0 +1,377 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Message channels over shared memory.
+
+A channel is a bidirectional stream of messages between two peers. It is
+negotiated with a normal method call, after which messages go through a pair
+of :class:`dbusx.Ring` buffers in a shared memfd instead of through the
+socket and the bus daemon. Eventfds signal when there are messages to take,
+and when there is space again for a sender that filled its ring.
+
+The accepting side publishes a :class:`ChannelService`::
+
+    service = ChannelService(accept)
+    connection.publish(service, dbusx.channel.PATH_CHANNEL)
+
+and the other side opens a channel to it::
+
+    channel = Channel.open(connection, service_name, callback=callback)
+    channel.send(message)
+
+When shared memory can not be used, because the platform does not support
+memfds or eventfds, or because the connection can not pass file
+descriptors, the channel falls back to sending batches of marshalled
+messages as method calls. This is transparent to the user.
+"""
+
+from __future__ import absolute_import
+
+import os
+import mmap
+import time
+import uuid
+import select
+
+import dbusx
+import dbusx.util
+import dbusx.bulk
+
+__all__ = ['INTERFACE_CHANNEL', 'PATH_CHANNEL', 'available', 'Channel',
+           'ChannelService']
+
+INTERFACE_CHANNEL = 'com.github.geertj.dbusx.Channel'
+PATH_CHANNEL = '/com/github/geertj/dbusx/Channel'
+
+#: The maximum number of messages that are taken from a ring at once.
+BATCH_SIZE = 1024
+
+
+def available():
+    """Return whether shared memory channels are supported on this
+    platform."""
+    return dbusx.bulk.available() and hasattr(os, 'eventfd')
+
+
+def _eventfd():
+    return os.eventfd(0, os.EFD_NONBLOCK | os.EFD_CLOEXEC)
+
+
+class Channel(object):
+    """One end of a message channel.
+
+    Use :meth:`open` to open a channel. Messages sent with :meth:`send` are
+    delivered to the peer. Received messages are passed to *callback* if
+    the connection has an event loop, and are returned by :meth:`receive`
+    otherwise.
+
+    When the connection has an event loop, messages that are sent in the
+    same loop iteration are put in the ring as one batch, and the peer is
+    woken up once for the batch. If the ring is full, messages are kept in
+    a backlog that is sent once the peer has made room.
+    """
+
+    def __init__(self, connection, id, peer=None, callback=None):
+        self.connection = connection
+        self.id = id
+        self.peer = peer
+        self.callback = callback
+        self.shared = False
+        self.closed = False
+        self._pending = []
+        self._inbox = []
+        self._scheduled = False
+        self._map = None
+        self._fds = []
+        self._tx = self._rx = None
+        self._data_fd = self._space_fd = -1
+        self._path = PATH_CHANNEL
+        self.size = 1024*1024
+        self._service = None
+        self.logger = dbusx.util.getLogger('dbusx.Channel')
+
+    @classmethod
+    def open(cls, connection, service, path=PATH_CHANNEL, size=1024*1024,
+             callback=None, shared=True):
+        """Open a channel to the :class:`ChannelService` that is published
+        by *service* at *path*.
+
+        The *size* argument is the size in bytes of the ring buffer in each
+        direction. If *shared* is False, or if shared memory is not
+        available, the channel uses the connection instead.
+        """
+        shared = shared and available() and connection.can_send_fds
+        reply = connection.call_method(service, path, INTERFACE_CHANNEL,
+                                       'Open', 'bu', (shared, size))
+        if reply.type == dbusx.MESSAGE_TYPE_ERROR:
+            raise dbusx.Error(reply.error_name)
+        id, size, fds = reply.args
+        self = cls(connection, id, reply.sender or service, callback)
+        self._path = path
+        self.size = size
+        # The peer closes the channel and, without shared memory, sends its
+        # messages with method calls to our own service.
+        local = getattr(connection, '_channel_service', None)
+        if local is None:
+            local = ChannelService()
+            connection.publish(local, path)
+        local._add(self)
+        if fds:
+            fds = [fd.take() for fd in fds]
+            self._attach(fds[0], fds[1:], size, False)
+        return self
+
+    def _attach(self, memfd, fds, size, accepted):
+        """Map the two rings in *memfd*. The first ring carries messages to
+        the acceptor. Takes ownership of the file descriptors."""
+        self._fds = fds
+        try:
+            self._map = mmap.mmap(memfd, 2*size)
+        finally:
+            os.close(memfd)
+        view = memoryview(self._map)
+        first = (dbusx.Ring(view[:size], fds[0], fds[1]), fds[0], fds[1])
+        second = (dbusx.Ring(view[size:], fds[2], fds[3]), fds[2], fds[3])
+        if accepted:
+            first, second = second, first
+        self._tx, _, self._space_fd = first
+        self._rx, self._data_fd, _ = second
+        self.shared = True
+        loop = self.connection.loop
+        if loop is not None:
+            loop.add_reader(self._data_fd, self._on_data)
+
+    @property
+    def backlog(self):
+        """The number of messages that were sent but that did not go into
+        the ring yet."""
+        return len(self._pending)
+
+    def send(self, message):
+        """Send *message* to the peer.
+
+        The message should not be changed after it has been sent.
+        """
+        if self.closed:
+            raise dbusx.Error('channel is closed')
+        self._pending.append(message)
+        loop = self.connection.loop
+        if loop is None:
+            self._flush()
+        elif not self._scheduled:
+            self._scheduled = True
+            loop.call_soon(self._flush)
+
+    def _flush(self):
+        self._scheduled = False
+        if not self._pending or self.closed:
+            return
+        if self.shared:
+            count = self._tx.put(self._pending)
+        else:
+            count = self._send_data(self._pending)
+        del self._pending[:count]
+        loop = self.connection.loop
+        if self._pending and loop is not None:
+            if self.shared:
+                loop.add_reader(self._space_fd, self._on_space)
+            else:
+                loop.call_later(0.01, self._flush)
+
+    def _send_data(self, messages):
+        """Send messages as a method call. Stops sending once more than
+        one ring worth of data is queued on the connection."""
+        if self.connection.outgoing_size > self.size:
+            return 0
+        batch = []
+        for message in messages:
+            # A message can not be demarshalled without a serial. Give one
+            # to a copy, so the caller's message can still be sent later.
+            if not message.serial:
+                message = message.copy()
+                message.serial = 1
+            batch.append(message.marshal())
+        call = dbusx.Message.method_call(self.peer, self._path,
+                                         INTERFACE_CHANNEL, 'Data', 'saay',
+                                         (self.id, batch))
+        call.no_reply = True
+        self.connection.send(call)
+        return len(messages)
+
+    def flush(self, timeout=None):
+        """Wait until the backlog has been sent, or until *timeout* seconds
+        have passed. Return whether the backlog is empty. This is for use
+        without an event loop."""
+        end_time = None if timeout is None else time.time() + timeout
+        self._flush()
+        while self._pending and not self.closed:
+            secs = None if end_time is None else end_time - time.time()
+            if secs is not None and secs <= 0:
+                break
+            if self.shared:
+                select.select([self._space_fd], [], [], secs)
+                self._clear(self._space_fd)
+            else:
+                self.connection.flush()
+            self._flush()
+        if not self.shared:
+            self.connection.flush()
+        return not self._pending
+
+    def _clear(self, fd):
+        try:
+            os.eventfd_read(fd)
+        except (IOError, OSError):
+            pass
+
+    def _on_space(self):
+        self._clear(self._space_fd)
+        self.connection.loop.remove_reader(self._space_fd)
+        self._flush()
+
+    def _on_data(self):
+        if self.closed:
+            return
+        messages = self._rx.get(BATCH_SIZE, dbusx.Message)
+        self._deliver(messages)
+        if len(messages) == BATCH_SIZE:
+            # Give other event sources a chance before taking more.
+            self.connection.loop.call_soon(self._on_data)
+
+    def _deliver(self, messages):
+        if self.callback is None or self.connection.loop is None:
+            self._inbox.extend(messages)
+            return
+        for message in messages:
+            try:
+                self.callback(message)
+            except Exception:
+                self.logger.error('uncaught exception in channel callback',
+                                  exc_info=True)
+
+    def receive(self, timeout=None):
+        """Wait for messages for at most *timeout* seconds and return a
+        list of received messages. This is for use without an event loop.
+        Without shared memory, this dispatches the connection."""
+        end_time = None if timeout is None else time.time() + timeout
+        while not self._inbox and not self.closed:
+            if self.shared:
+                self._inbox.extend(self._rx.get(-1, dbusx.Message))
+                if self._inbox:
+                    break
+            secs = None if end_time is None else end_time - time.time()
+            if secs is not None and secs <= 0:
+                break
+            if self.shared:
+                select.select([self._data_fd], [], [], secs)
+            else:
+                self.connection.read_write_dispatch(-1 if secs is None
+                                                    else secs)
+        messages, self._inbox = self._inbox, []
+        return messages
+
+    def close(self):
+        """Close the channel, and tell the peer that it was closed."""
+        if self.closed:
+            return
+        self._closed()
+        if self._service is not None:
+            self._service.channels.pop(self.id, None)
+        call = dbusx.Message.method_call(self.peer, self._path,
+                                         INTERFACE_CHANNEL, 'Close', 's',
+                                         (self.id,))
+        call.no_reply = True
+        try:
+            self.connection.send(call)
+        except dbusx.Error:
+            pass
+
+    def _closed(self):
+        self.closed = True
+        loop = self.connection.loop
+        if self.shared:
+            if loop is not None:
+                loop.remove_reader(self._data_fd)
+                loop.remove_reader(self._space_fd)
+            # Release the exported buffers before closing the mapping.
+            self._tx = self._rx = None
+            self._map.close()
+            for fd in self._fds:
+                os.close(fd)
+            self._fds = []
+        self._pending = []
+
+
+class ChannelService(dbusx.Object):
+    """Accepts channels opened with :meth:`Channel.open`.
+
+    Publish this object at :data:`PATH_CHANNEL`. For every new channel,
+    *accept* is called with the :class:`Channel` as its argument. It can
+    set the channel's callback. The service creates the shared memory and
+    the eventfds for the channels it accepts.
+    """
+
+    def __init__(self, accept=None):
+        super(ChannelService, self).__init__()
+        self.accept = accept
+        self.channels = {}
+
+    def register(self, connection, path):
+        super(ChannelService, self).register(connection, path)
+        connection._channel_service = self
+
+    def unregister(self, connection):
+        super(ChannelService, self).unregister(connection)
+        if getattr(connection, '_channel_service', None) is self:
+            del connection._channel_service
+
+    def _add(self, channel):
+        self.channels[channel.id] = channel
+        channel._service = self
+
+    @dbusx.Method(INTERFACE_CHANNEL, args_in='bu', args_out='suah')
+    def Open(self, shared, size):
+        if size < 4096:
+            self.error(dbusx.ERROR_INVALID_ARGS)
+        message = self.message
+        channel = Channel(self.connection, uuid.uuid4().hex, message.sender)
+        channel._path = message.path
+        fds = []
+        if shared and available() and self.connection.can_send_fds:
+            size = (size + mmap.PAGESIZE - 1) // mmap.PAGESIZE * mmap.PAGESIZE
+            memfd = os.memfd_create('dbusx-channel', os.MFD_CLOEXEC)
+            os.ftruncate(memfd, 2*size)
+            eventfds = [_eventfd() for i in range(4)]
+            fds = [dbusx.UnixFD(fd) for fd in [memfd] + eventfds]
+            channel._attach(memfd, eventfds, size, True)
+        channel.size = size
+        self._add(channel)
+        if self.accept is not None:
+            self.accept(channel)
+        return channel.id, size, fds
+
+    @dbusx.Method(INTERFACE_CHANNEL, args_in='saay')
+    def Data(self, id, batch):
+        channel = self._lookup(id)
+        channel._deliver([dbusx.Message.demarshal(data) for data in batch])
+        if self.message.no_reply:
+            raise dbusx.NoReply
+
+    @dbusx.Method(INTERFACE_CHANNEL, args_in='s')
+    def Close(self, id):
+        channel = self._lookup(id)
+        del self.channels[id]
+        channel._closed()
+        if self.message.no_reply:
+            raise dbusx.NoReply
+
+    def _lookup(self, id):
+        channel = self.channels.get(id)
+        if channel is None:
+            self.error(dbusx.ERROR_INVALID_ARGS)
+        return channel
@@ -8,8 +8,11 @@
 
 import dbusx
 import dbusx.util
+import dbusx.batch
 import time
+import tempfile
 import threading
+import functools
 
 
 class Connection(dbusx.ConnectionBase):
@@ -36,18 +39,44 @@ class Connection(dbusx.ConnectionBase):
 
     You can also use an event loop that is external to dbusx. In this case, you
     need to specify the parameter `install_event_loop=False` toathe constructor.
+
+    A service that uses dbusx can offer direct peer-to-peer connections to its
+    clients with :meth:`advertise`. When :attr:`upgrade` is set,
+    :meth:`call_method` asks every service it calls for such an address, and
+    uses a direct connection for the service once one is established and
+    the calls that went through the bus have been replied to, so that calls
+    are not reordered. If that is not possible, calls go through the bus. A
+    service that does not advertise an address is not asked again until its
+    name changes owner.
     """
 
-    def __init__(self, address):
+    #: Whether to upgrade method calls to direct connections when a service
+    #: advertises a peer-to-peer address.
+    upgrade = False
+
+    #: Seconds after which a name that had no owner is asked again.
+    upgrade_retry = 60
+
+    def __init__(self, address, register=True):
         """Create a new private connection.
 
         If *address* is provided, the connection will opened to the specified
-        address.
+        address. Set *register* to False to create a peer-to-peer connection
+        to a :class:`dbusx.Server` rather than to a message bus.
         """
-        super(Connection, self).__init__(address)
+        super(Connection, self).__init__(address, register)
         self.context = None
         self._registered = False
-        self._signal_handlers = []
+        self._signal_handlers = {}
+        self._batch_handlers = {}
+        self._batches = {}
+        self._objects = {}
+        self._owners = {}
+        self._peers = {}
+        self._bus_calls = {}
+        self._watched = {}
+        self._upgrade_server = None
+        self.broadcast = True
         self.logger = dbusx.util.getLogger('dbusx.Connection',
                                            context=str(self))
         self.local = self._local()
@@ -81,8 +110,11 @@ class Connection(dbusx.ConnectionBase):
             instance = dbusx.Object.wrap(instance)
         instance.register(self, path)
         fallback = path.endswith('*')
-        path = path.rstrip('/*')
-        self.register_object_path(path, instance._process, fallback)
+        stripped = path.rstrip('/*')
+        self.register_object_path(stripped, instance._process, fallback)
+        self._objects[stripped] = (instance, path)
+        if self._upgrade_server is not None:
+            self._upgrade_server.publish(instance, path)
 
     def remove(self, path):
         """Remove a published Python object.
@@ -92,6 +124,221 @@ class Connection(dbusx.ConnectionBase):
         """
         path = path.rstrip('/*')
         self.unregister_object_path(path)
+        instance, path = self._objects.pop(path, (None, path))
+        if instance is not None and instance not in \
+                    [instance for instance, _ in self._objects.values()]:
+            instance.unregister(self)
+        if self._upgrade_server is not None:
+            self._upgrade_server.remove(path)
+
+    def close(self):
+        """Close the connection. Published objects are removed, and direct
+        connections to and from peers are closed."""
+        for instance, path in self._objects.values():
+            instance.unregister(self)
+        self._objects.clear()
+        if self._upgrade_server is not None:
+            self._upgrade_server.close()
+            self._upgrade_server = None
+        for peer in self._peers.values():
+            if isinstance(peer, dbusx.ConnectionBase):
+                peer.close()
+        self._peers.clear()
+        self._owners.clear()
+        super(Connection, self).close()
+
+    def advertise(self, address=None):
+        """Offer direct peer-to-peer connections to the objects that are
+        published on this connection.
+
+        This listens on *address*, by default a Unix socket in the temporary
+        directory, and publishes a method that returns the address. Clients
+        that use dbusx call this method and then send their method calls
+        over a direct connection, skipping the bus daemon. Signals are still
+        sent on the bus only. Method calls that arrive over a direct
+        connection have no sender.
+
+        An event loop is required. The return value is the address.
+        """
+        import dbusx.server
+        if self.loop is None:
+            raise dbusx.Error('advertise() requires an event loop')
+        if self._upgrade_server is not None:
+            raise dbusx.Error('already advertised')
+        if address is None:
+            address = 'unix:tmpdir=%s' % tempfile.gettempdir()
+        server = dbusx.server.UpgradeServer(address, self.loop)
+        for instance, path in self._objects.values():
+            server.publish(instance, path)
+        self._upgrade_server = server
+        self.publish(dbusx.server.UpgradeService(server),
+                     dbusx.server.PATH_UPGRADE)
+        return server.address
+
+    def _get_peer(self, service, callback=None):
+        """Return a direct connection to *service*, or None if the call
+        should go through the bus."""
+        if not self.upgrade or not service or service == dbusx.SERVICE_DBUS \
+                    or service == self.unique_name or self.unique_name is None:
+            return None
+        # Without an event loop, only we drive our own connection, so the
+        # callback of an asynchronous call on a peer would never be called.
+        if callback is not None and self.loop is None:
+            return None
+        # Peers are kept by unique name, so that a new owner of a well-known
+        # name does not get the connection to the old one. A time means that
+        # the owner is not known yet.
+        owner = self._owners.get(service)
+        if owner is None or isinstance(owner, float) and time.time() > owner:
+            self._probe_peer(service)
+            return None
+        if isinstance(owner, float):
+            return None
+        peer = self._peers.get(owner)
+        if isinstance(peer, dbusx.ConnectionBase):
+            return None if self._bus_calls.get(service) else peer
+        if peer is None:
+            self._probe_peer(service)
+        return None
+
+    def _probe_peer(self, service):
+        """Ask *service* for its peer-to-peer address. Calls go through the
+        bus until the reply arrives, and after that until the calls that
+        were sent over the bus have been replied to. Otherwise the service
+        could handle later calls on the direct connection before earlier
+        ones that are still queued in the bus. See :meth:`_track_call`."""
+        import dbusx.server
+        self._owners[service] = time.time() + self.upgrade_retry
+        self._watch_name(service)
+        message = dbusx.Message.method_call(service, dbusx.server.PATH_UPGRADE,
+                        dbusx.server.INTERFACE_UPGRADE, 'GetPeerAddress')
+        self.send_with_reply(message, functools.partial(self._peer_reply,
+                                                        service))
+
+    def _track_call(self, service, callback=None, no_reply=False):
+        """Count a call to *service* that is sent over the bus while the
+        service may be upgraded, and return the callback to use for its
+        reply. A call without a reply is followed by a ping, which the
+        service answers only after it has handled the call."""
+        if not self.upgrade or service not in self._owners:
+            return callback
+        owner = self._owners[service]
+        if not isinstance(owner, float) and self._peers.get(owner) is False:
+            return callback
+        self._bus_calls[service] = self._bus_calls.get(service, 0) + 1
+        callback = functools.partial(self._call_done, service, callback)
+        if no_reply:
+            message = dbusx.Message.method_call(service, '/',
+                                        dbusx.INTERFACE_PEER, 'Ping')
+            self.send_with_reply(message, callback)
+        return callback
+
+    def _call_done(self, service, callback, message):
+        count = self._bus_calls.get(service, 0) - 1
+        if count > 0:
+            self._bus_calls[service] = count
+        else:
+            self._bus_calls.pop(service, None)
+        if callback is not None:
+            callback(message)
+
+    def _peer_reply(self, service, message):
+        owner = message.sender
+        if not owner or owner == dbusx.SERVICE_DBUS \
+                    or not isinstance(self._owners.get(service), float):
+            # The name has no owner, or it changed owner in the meantime.
+            return
+        self._owners[service] = owner
+        self._watch_name(owner)
+        if isinstance(self._peers.get(owner), dbusx.ConnectionBase):
+            return
+        # The owner is not asked again until it goes away.
+        self._peers[owner] = False
+        if message.type != dbusx.MESSAGE_TYPE_METHOD_RETURN \
+                    or message.signature != 's' \
+                    or self.address is None:
+            return
+        address = message.args[0]
+        try:
+            peer = dbusx.Connection(address, register=False)
+            if self.loop is not None:
+                peer.set_loop(self.loop)
+        except dbusx.Error as e:
+            self.logger.debug('could not connect to %s at %s: %s',
+                              service, address, str(e))
+            return
+        peer.upgrade = False
+        peer.add_filter(functools.partial(self._peer_filter, owner))
+        self._peers[owner] = peer
+        self.logger.debug('using direct connection for %s', service)
+
+    def _watch_name(self, name, callback=None):
+        """Get the "NameOwnerChanged" signal for *name*. The first time that
+        *name* changes owner, *callback* is called with this connection and
+        the name as its arguments."""
+        callbacks = self._watched.get(name)
+        if callbacks is None:
+            if not self._watched:
+                self.add_filter(self._owner_filter)
+            callbacks = self._watched[name] = []
+            self._send_match('AddMatch', name)
+        if callback is not None and callback not in callbacks:
+            callbacks.append(callback)
+
+    def _send_match(self, method, name):
+        message = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL, no_reply=True,
+                          destination=dbusx.SERVICE_DBUS, path=dbusx.PATH_DBUS,
+                          interface=dbusx.INTERFACE_DBUS, member=method)
+        rule = "type='signal',sender='%s',path='%s',interface='%s'," \
+               "member='NameOwnerChanged',arg0='%s'" \
+               % (dbusx.SERVICE_DBUS, dbusx.PATH_DBUS, dbusx.INTERFACE_DBUS,
+                  name)
+        message.set_args('s', (rule,))
+        self.send(message)
+
+    def _owner_filter(self, connection, message):
+        """Forget what we know about a name when it changes owner."""
+        if message.type != dbusx.MESSAGE_TYPE_SIGNAL \
+                    or message.sender != dbusx.SERVICE_DBUS \
+                    or message.interface != dbusx.INTERFACE_DBUS \
+                    or message.member != 'NameOwnerChanged' \
+                    or message.signature != 'sss':
+            return False
+        name = message.args[0]
+        callbacks = self._watched.pop(name, None)
+        if callbacks is None:
+            return False
+        self._send_match('RemoveMatch', name)
+        self._owners.pop(name, None)
+        peer = self._peers.pop(name, None)
+        if isinstance(peer, dbusx.ConnectionBase):
+            self._close_peer(peer)
+        for callback in callbacks:
+            try:
+                callback(self, name)
+            except Exception as e:
+                self.logger.error('exception in name owner callback',
+                                  exc_info=True)
+        return False
+
+    def _peer_filter(self, owner, connection, message):
+        if message.type != dbusx.MESSAGE_TYPE_SIGNAL \
+                    or message.path != dbusx.PATH_LOCAL \
+                    or message.interface != dbusx.INTERFACE_LOCAL \
+                    or message.member != 'Disconnected':
+            return False
+        self.logger.debug('direct connection for %s lost', owner)
+        if self._peers.get(owner) is connection:
+            del self._peers[owner]
+        self._close_peer(connection)
+        return True
+
+    def _close_peer(self, connection):
+        # Do not close the connection while it is dispatching.
+        if connection.loop is not None:
+            connection.loop.call_soon(connection.close)
+        else:
+            connection.close()
 
     def call_method(self, service, path, interface, method, signature=None,
                     args=None, no_reply=False, callback=None, timeout=None):
@@ -128,7 +375,14 @@ class Connection(dbusx.ConnectionBase):
         reply. The timeout may be an int or float. If no timeout is provided, a
         suitable default timeout is used. If no response is received within the
         timeout, a "org.freedesktop.DBus.Error.Timeout" error is generated.
+
+        If *service* advertised a peer-to-peer address, the call is sent over
+        a direct connection. See :meth:`advertise`.
         """
+        peer = self._get_peer(service, callback)
+        if peer is not None:
+            return peer.call_method(None, path, interface, method, signature,
+                                    args, no_reply, callback, timeout)
         message = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL,
                         no_reply=no_reply, destination=service,
                         path=path, interface=interface, member=method)
@@ -137,10 +391,12 @@ class Connection(dbusx.ConnectionBase):
         if callback is not None:
             # Fire a callback for the reply. Note that this requires event
             # loop integration otherwise the callback will never be called.
-            self.send_with_reply(message, callback, timeout)
+            self.send_with_reply(message, self._track_call(service, callback),
+                                 timeout)
         elif no_reply:
             # No reply needed but block until flushed
             self.send(message)
+            self._track_call(service, no_reply=True)
             if not self.loop:
                 self.flush()
         else:
@@ -148,7 +404,8 @@ class Connection(dbusx.ConnectionBase):
             replies = []
             def callback(message):
                 replies.append(message)
-            self.send_with_reply(message, callback, timeout)
+            self.send_with_reply(message, self._track_call(service, callback),
+                                 timeout)
             if timeout is not None:
                 end_time = time.time() + timeout
             while not replies:
@@ -167,7 +424,8 @@ class Connection(dbusx.ConnectionBase):
             assert reply.reply_serial == message.serial
             return reply
 
-    def connect_to_signal(self, service, path, interface, signal, callback):
+    def connect_to_signal(self, service, path, interface, signal, callback,
+                          conflate=None, args=False, batch=False):
         """Install a signal handler for the signal *signal* that is raised on
         *interface* by the remote object at bus name *service* and path *path*.
 
@@ -175,19 +433,77 @@ class Connection(dbusx.ConnectionBase):
         matching signal arrives, the callback is called with two arguments:
         the connection on which the signal was received, and the D-BUS message
         containing the signal.
+
+        If *conflate* is ``CONFLATE_SIGNAL`` or ``CONFLATE_ARG0``, signals
+        that arrive faster than they are dispatched are conflated, and only
+        the newest one is passed to the callback. See
+        :meth:`set_conflation`.
+
+        If *args* is True, the callback is passed the decoded arguments of
+        the signal as a tuple after the message. The arguments are decoded
+        once for all callbacks of a signal.
+
+        If *batch* is True, the signal is received in batches if the remote
+        object supports it. See :mod:`dbusx.batch`. The callback is still
+        called once for every signal.
+        """
+        if conflate is not None:
+            self.set_conflation(interface, signal, conflate)
+        if not self._registered:
+            self.add_filter(self._signal_handler)
+            self._registered = True
+        key = (service, path, interface, signal)
+        self._signal_handlers.setdefault(key, []).append((callback, args))
+        if batch:
+            self._subscribe_batch(key)
+        else:
+            self._add_match(service, path, interface, signal)
+
+    def connect_to_batch(self, service, path, interface, signal, callback):
+        """Install a handler that receives the signal *signal* in batches.
+
+        The arguments are the same as for :meth:`connect_to_signal`. The
+        *callback* is called with a list of signal messages: the signals in
+        a batch, or a single signal if the remote object does not support
+        batches.
         """
         if not self._registered:
             self.add_filter(self._signal_handler)
             self._registered = True
-        self._signal_handlers.append((service, path, interface,
-                                      signal, callback))
+        key = (service, path, interface, signal)
+        self._batch_handlers.setdefault(key, []).append(callback)
+        self._subscribe_batch(key)
+
+    def disconnect_from_batch(self, service, path, interface, signal):
+        """Stop receiving the signal *signal* in batches.
+
+        This removes the handlers that were installed for the signal with
+        :meth:`connect_to_batch`, and tells the remote object to stop
+        sending batches. Handlers that were installed with
+        :meth:`connect_to_signal` receive the signal normally from then on.
+        """
+        key = (service, path, interface, signal)
+        self._batch_handlers.pop(key, None)
+        if self._batches.pop(key, None) is None:
+            return
+        message = dbusx.Message.method_call(service, path,
+                        dbusx.batch.INTERFACE_BATCH, 'Unsubscribe', 'ss',
+                        (interface, signal))
+        message.no_reply = True
+        self.send(message)
+        self._add_match(service, path, dbusx.batch.INTERFACE_BATCH, 'Batch',
+                        'RemoveMatch')
+        if self._signal_handlers.get(key):
+            self._add_match(service, path, interface, signal)
+
+    def _add_match(self, service, path, interface, signal, method='AddMatch'):
         # Call the "AddMatch" method on the D-BUS so that the signal specified
         # will get routed to us. Signals are normally sent out as multicast
         # messages and therefore an explicit route is required.
         # NOTE: It is OK to do this multiple times for the same signal.
         message = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL, no_reply=True,
                           destination=dbusx.SERVICE_DBUS, path=dbusx.PATH_DBUS,
-                          interface=dbusx.INTERFACE_DBUS, member='AddMatch')
+                          interface=dbusx.INTERFACE_DBUS, member=method)
         rule = "type='signal'"
         rule += ",sender='%s'" % service
         rule += ",path='%s'" % path
@@ -196,6 +512,31 @@ class Connection(dbusx.ConnectionBase):
         message.set_args('s', (rule,))
         self.send(message)
 
+    def _subscribe_batch(self, key):
+        """Ask the object to send the signal *key* in batches."""
+        if key in self._batches:
+            return
+        service, path, interface, signal = key
+        self._batches[key] = False
+        self._add_match(service, path, dbusx.batch.INTERFACE_BATCH, 'Batch')
+        message = dbusx.Message.method_call(service, path,
+                        dbusx.batch.INTERFACE_BATCH, 'Subscribe', 'ss',
+                        (interface, signal))
+        self.send_with_reply(message, functools.partial(self._batch_reply,
+                                                        key))
+
+    def _batch_reply(self, key, message):
+        if key not in self._batches:
+            # Unsubscribed in the mean time.
+            return
+        if message.type == dbusx.MESSAGE_TYPE_METHOD_RETURN:
+            self._batches[key] = True
+            return
+        # The object does not do batches. Receive the signal normally.
+        self.logger.debug('no batches for %s: %s', repr(key),
+                          message.error_name)
+        self._add_match(*key)
+
     def _signal_handler(self, connection, message):
         """Filter handler that is used to call signal handlers that are
         registered with connect_to_signal().
@@ -206,19 +547,49 @@ class Connection(dbusx.ConnectionBase):
             return False
         if message.type != dbusx.MESSAGE_TYPE_SIGNAL:
             return False
-        for service,path,interface,signal,callback in self._signal_handlers:
-            if message.sender != service \
-                    or message.path != path \
-                    or message.interface != interface \
-                    or message.member != signal:
-                continue
-            try:
-                self._spawn(callback, message)
-            except Exception as e:
-                log.error('exception in signal handler', exc_info=True)
+        if message.interface == dbusx.batch.INTERFACE_BATCH \
+                    and message.member == 'Batch':
+            if message.signature != 'ssaay':
+                return False
+            args = message.args
+            key = (message.sender, message.path, args[0], args[1])
+            if self._batches.get(key):
+                self._dispatch_signals(key, dbusx.batch.unpack(message, args))
+            return True
+        key = (message.sender, message.path, message.interface,
+               message.member)
+        # Once the object sends batches, a copy that was routed to us for
+        # another subscription is ignored.
+        if not self._batches.get(key):
+            self._dispatch_signals(key, [message])
         # Allow others to see this signal as well
         return False
 
+    def _dispatch_signals(self, key, messages):
+        """Call the signal and batch handlers for *key*."""
+        log = self.logger
+        handlers = self._signal_handlers.get(key)
+        if handlers is not None:
+            for message in messages:
+                args = None
+                # Copy the list, a callback may connect another one.
+                for callback, with_args in handlers[:]:
+                    try:
+                        if not with_args:
+                            self._spawn(callback, message)
+                            continue
+                        if args is None:
+                            args = message.args
+                        self._spawn(callback, message, args)
+                    except Exception as e:
+                        log.error('exception in signal handler',
+                                  exc_info=True)
+        for callback in self._batch_handlers.get(key, ())[:]:
+            try:
+                self._spawn(callback, messages)
+            except Exception as e:
+                log.error('exception in batch handler', exc_info=True)
+
     def _spawn(self, function, *args):
         """Helper to spawn a function in a new context.
 
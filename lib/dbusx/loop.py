@@ -0,0 +1,159 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""A minimal event loop.
+
+This module contains a small event loop based on :func:`select.select` that
+implements the subset of the PEP 3156 `EventLoop` interface that dbusx
+needs. It has no dependencies, which makes it useful for servers, tests and
+benchmarks when no other event loop is available. For anything else, use a
+full featured event loop, e.g. from the `looping` package.
+"""
+
+from __future__ import absolute_import
+
+import time
+import heapq
+import select
+import errno
+
+__all__ = ['EventLoop']
+
+
+class Handler(object):
+    """A callback that is scheduled on the event loop."""
+
+    def __init__(self, callback, args):
+        self.callback = callback
+        self.args = args
+        self.cancelled = False
+
+    def cancel(self):
+        self.cancelled = True
+
+    def __call__(self):
+        if not self.cancelled:
+            self.callback(*self.args)
+
+
+class Timer(Handler):
+    """A callback that is scheduled at a certain time."""
+
+    def __init__(self, when, interval, callback, args):
+        super(Timer, self).__init__(callback, args)
+        self.when = when
+        self.interval = interval
+
+    def __lt__(self, other):
+        return self.when < other.when
+
+
+class EventLoop(object):
+    """A minimal event loop based on :func:`select.select`."""
+
+    def __init__(self):
+        self._readers = {}
+        self._writers = {}
+        self._ready = []
+        self._timers = []
+        self._stopped = False
+
+    def add_reader(self, fd, callback, *args):
+        handler = Handler(callback, args)
+        self._readers[fd] = handler
+        return handler
+
+    def remove_reader(self, fd):
+        handler = self._readers.pop(fd, None)
+        if handler is not None:
+            handler.cancel()
+        return handler is not None
+
+    def add_writer(self, fd, callback, *args):
+        handler = Handler(callback, args)
+        self._writers[fd] = handler
+        return handler
+
+    def remove_writer(self, fd):
+        handler = self._writers.pop(fd, None)
+        if handler is not None:
+            handler.cancel()
+        return handler is not None
+
+    def call_soon(self, callback, *args):
+        handler = Handler(callback, args)
+        self._ready.append(handler)
+        return handler
+
+    def call_later(self, delay, callback, *args):
+        timer = Timer(time.time() + delay, None, callback, args)
+        heapq.heappush(self._timers, timer)
+        return timer
+
+    def call_repeatedly(self, interval, callback, *args):
+        timer = Timer(time.time() + interval, interval, callback, args)
+        heapq.heappush(self._timers, timer)
+        return timer
+
+    def _run_timers(self):
+        now = time.time()
+        while self._timers and self._timers[0].when <= now:
+            timer = heapq.heappop(self._timers)
+            if timer.cancelled:
+                continue
+            self._ready.append(timer)
+            if timer.interval is not None:
+                # Reschedule the same object so that cancel() keeps working.
+                timer.when = max(now, timer.when + timer.interval)
+                heapq.heappush(self._timers, timer)
+
+    def run_once(self, timeout=None):
+        """Run one iteration of the event loop. Wait at most *timeout*
+        seconds for events, or forever if *timeout* is None."""
+        while self._timers and self._timers[0].cancelled:
+            heapq.heappop(self._timers)
+        if self._ready:
+            timeout = 0
+        elif self._timers:
+            delay = max(0, self._timers[0].when - time.time())
+            timeout = delay if timeout is None else min(timeout, delay)
+        readers, writers = list(self._readers), list(self._writers)
+        if readers or writers:
+            try:
+                readable, writable, _ = select.select(readers, writers, [],
+                                                      timeout)
+            except (select.error, OSError) as e:
+                if e.args[0] != errno.EINTR:
+                    raise
+                readable = writable = []
+        else:
+            if timeout:
+                time.sleep(timeout)
+            readable = writable = []
+        for fd in readable:
+            handler = self._readers.get(fd)
+            if handler is not None:
+                self._ready.append(handler)
+        for fd in writable:
+            handler = self._writers.get(fd)
+            if handler is not None:
+                self._ready.append(handler)
+        self._run_timers()
+        ready, self._ready = self._ready, []
+        for handler in ready:
+            handler()
+
+    def run_forever(self):
+        """Run the event loop until :meth:`stop` is called."""
+        self._stopped = False
+        while not self._stopped:
+            self.run_once()
+
+    def stop(self):
+        """Stop the event loop."""
+        self._stopped = True
@@ -63,7 +63,7 @@ class Message(dbusx.MessageBase):
         message = cls(dbusx.MESSAGE_TYPE_METHOD_CALL, destination=service,
                       path=path, interface=interface, member=method)
         if signature is not None:
-            message.set_args(signature, messge)
+            message.set_args(signature, args)
         return message
 
     @classmethod
@@ -8,8 +8,12 @@
 
 from __future__ import print_function
 
+import time
+import weakref
+
 import dbusx
 import dbusx.util
+import dbusx.batch
 from xml.etree import ElementTree as etree
 
 
@@ -86,33 +90,289 @@ class Signal(object):
 
     It is not required to define signals that are raised. However, by defining
     them, dbusx can include them in introspection requests.
+
+    Signals can be shaped on the sending side. If *coalesce* is set, a
+    signal that is emitted is held back for up to *coalesce* seconds. If it is
+    emitted again in the meantime, only the latest arguments are sent, or
+    the result of *merge(old_args, new_args)* if *merge* is given.
+    Emissions are coalesced per destination and per *key*, which is the
+    index of an argument or a function of the arguments. If *rate* is set,
+    at most *rate* signals per second are sent, with bursts of up to
+    *burst* signals. Emissions above the rate are coalesced until they can
+    be sent. Shaping needs an event loop on the connection. Without one,
+    signals are sent right away.
+
+    If *batch* is set, dbusx receivers can subscribe to batches of this
+    signal. The signals that are emitted within *batch* seconds are then
+    sent to them as one message. If *batch_only* is also set, signals are
+    not sent normally while there are subscribers. See :mod:`dbusx.batch`.
+
+    A signal is bound to an object once, on first access. The bound signal
+    refers to the object weakly, so it cannot be emitted once the object is
+    gone.
     """
 
-    def __init__(self, interface, name=None, args=None, instance=None):
+    def __init__(self, interface, name=None, args=None, instance=None,
+                 coalesce=None, key=None, merge=None, rate=None, burst=1,
+                 batch=None, batch_only=False):
         self.interface = interface
         self.name = name
         self.args = args
-        self.instance = instance
+        self._ref = None if instance is None else weakref.ref(instance)
+        self.coalesce = coalesce
+        self.key = key
+        self.merge = merge
+        self.rate = rate
+        self.burst = burst
+        self.batch = batch
+        self.batch_only = batch_only
+        self._attr = None
+        self._plain = coalesce is None and rate is None and batch is None
+        self._emitter = None
+        self._path = None
+
+    def __set_name__(self, owner, name):
+        self._attr = name
+        if self.name is None:
+            self.name = name
 
     def __get__(self, obj, typ=None):
-        # Find out our name..
-        if self.name is None:
+        if self._attr is None:
+            # Python 2 does not call __set_name__. Find out our name once.
             for name in typ.__dict__:
                 if typ.__dict__[name] is self:
+                    self.__set_name__(typ, name)
                     break
             else:
                 raise AttributeError('could not bind name')
-        else:
-            name = self.name
-        return Signal(self.interface, name, self.args, instance=obj)
+        if obj is None:
+            return self
+        signal = Signal(self.interface, self.name, self.args, obj,
+                        self.coalesce, self.key, self.merge, self.rate,
+                        self.burst, self.batch, self.batch_only)
+        # The bound signal shadows us in the instance dictionary, so that
+        # later lookups do not create a new one. It refers to the object
+        # weakly, so this is not a reference cycle.
+        instance_dict = getattr(obj, '__dict__', None)
+        if instance_dict is not None:
+            instance_dict[self._attr] = signal
+        return signal
+
+    @property
+    def instance(self):
+        """The object that this signal is bound to, or None."""
+        ref = self._ref
+        return None if ref is None else ref()
+
+    @property
+    def shaped(self):
+        """Whether this signal is coalesced or rate limited."""
+        return self.coalesce is not None or self.rate is not None
 
     def emit(self, *args, **kwargs):
+        instance = self.instance
+        if instance is None:
+            raise TypeError('cannot emit unbound signal')
+        destination = kwargs.pop('destination', None) if kwargs else None
+        # A signal without a signature has no arguments.
+        if self.args is None:
+            args = ()
+        if self._plain:
+            if instance.connections:
+                self.emitter.emit(instance.connections, args, destination)
+            return
+        shaper = self._shaper()
+        if shaper is not None:
+            shaper.emit(args, destination)
+            return
+        self._send(args, destination)
+
+    def emit_many(self, destinations, *args):
+        """Emit the signal to each bus name in *destinations*. The
+        arguments are marshalled once for all destinations."""
+        if self.instance is None:
+            raise TypeError('cannot emit unbound signal')
+        if self.args is None:
+            args = ()
+        shaper = self._shaper()
+        if shaper is not None:
+            for destination in destinations:
+                shaper.emit(args, destination)
+        elif self._batcher() is not None:
+            for destination in destinations:
+                self._send(args, destination)
+        elif self.instance.connections:
+            self.emitter.emit_many(self.instance.connections, destinations,
+                                   args)
+
+    def emit_batch(self, batch, destination=None):
+        """Emit the signal once for each tuple of arguments in
+        *batch*."""
         if self.instance is None:
             raise TypeError('cannot emit unbound signal')
-        destination = kwargs.pop('destination', None)
-        message = dbusx.Message.signal(destination, self.instance.path,
-                        self.interface, self.name, self.args, args)
-        self.instance.connection.send(message)
+        if self.args is None:
+            batch = [() for args in batch]
+        shaper = self._shaper()
+        if shaper is not None:
+            for args in batch:
+                shaper.emit(tuple(args), destination)
+        elif self._batcher() is not None:
+            for args in batch:
+                self._send(tuple(args), destination)
+        elif self.instance.connections:
+            self.emitter.emit_batch(self.instance.connections, batch,
+                                    destination)
+
+    def _shaper(self):
+        """Return the shaper of the bound object, or None if the signal is
+        not shaped or if there is no event loop."""
+        if not self.shaped:
+            return
+        loop = self._loop()
+        if loop is None:
+            return
+        shapers = self.instance.__dict__.setdefault('_shapers', {})
+        shaper = shapers.get((self.interface, self.name))
+        if shaper is None:
+            shaper = _Shaper(self, loop)
+            shapers[(self.interface, self.name)] = shaper
+        return shaper
+
+    def _batcher(self):
+        """Return the batcher of the bound object, or None if no receiver
+        subscribed to batches of this signal."""
+        if self.batch is None:
+            return
+        batchers = self.instance.__dict__.get('_batchers')
+        if batchers:
+            return batchers.get((self.interface, self.name))
+
+    def _loop(self):
+        for connection in self.instance.connections:
+            loop = getattr(connection, 'loop', None)
+            if loop is not None:
+                return loop
+
+    @property
+    def emitter(self):
+        """The :class:`dbusx.Emitter` for the path of the bound object."""
+        path = self.instance.path
+        if self._emitter is None or self._path != path:
+            self._emitter = dbusx.Emitter(path, self.interface, self.name,
+                                          self.args)
+            self._path = path
+        return self._emitter
+
+    def _send(self, args, destination):
+        # An object that is published on multiple connections (e.g. by a
+        # peer-to-peer server) emits the signal on all of them, except on
+        # connections that only carry method calls.
+        connections = self.instance.connections
+        batcher = self._batcher()
+        targets = batcher.targets(destination) if batcher else None
+        if not targets:
+            if connections:
+                self.emitter.emit(connections, args, destination)
+            return
+        # The message is marshalled once for the emission and the batches.
+        # A signal to a subscriber is only sent in its batch.
+        if destination is not None or self.batch_only:
+            connections = ()
+        data = self.emitter.emit(connections, args, destination, True)
+        batcher.add(targets, data)
+
+
+class _Shaper(object):
+    """Coalesces and rate limits the emissions of one signal of one
+    object."""
+
+    def __init__(self, signal, loop):
+        self.signal = signal
+        self.loop = loop
+        self.pending = {}
+        self.order = []
+        self.tokens = signal.burst
+        self.stamp = time.time()
+        self.timer = None
+        self.due = None
+
+    def _key(self, args, destination):
+        key = self.signal.key
+        if key is None:
+            return destination
+        elif callable(key):
+            return destination, key(args)
+        return destination, args[key]
+
+    def emit(self, args, destination):
+        key = self._key(args, destination)
+        if key in self.pending:
+            old = self.pending[key][0]
+            if self.signal.merge is not None:
+                args = self.signal.merge(old, args)
+            self.pending[key] = (args, destination)
+            return
+        if self.signal.coalesce is None and not self.pending \
+                    and self._take():
+            self.signal._send(args, destination)
+            return
+        self.pending[key] = (args, destination)
+        self.order.append(key)
+        if self.signal.coalesce is not None:
+            self._schedule(time.time() + self.signal.coalesce)
+        else:
+            self._schedule(self._next_token())
+
+    def _take(self):
+        """Take a token from the bucket, if there is one."""
+        rate = self.signal.rate
+        if rate is None:
+            return True
+        now = time.time()
+        self.tokens = min(self.signal.burst,
+                          self.tokens + (now - self.stamp) * rate)
+        self.stamp = now
+        if self.tokens < 1:
+            return False
+        self.tokens -= 1
+        return True
+
+    def _next_token(self):
+        return self.stamp + (1 - self.tokens) / self.signal.rate
+
+    def _schedule(self, when):
+        if self.timer is not None and self.due <= when:
+            return
+        if self.timer is not None:
+            self.timer.cancel()
+        self.due = when
+        self.timer = self.loop.call_later(max(0, when - time.time()),
+                                          self._flush)
+
+    def _flush(self):
+        self.timer = None
+        while self.order:
+            if not self._take():
+                self._schedule(self._next_token())
+                return
+            key = self.order.pop(0)
+            args, destination = self.pending.pop(key)
+            self.signal._send(args, destination)
+
+
+def merge_properties_changed(old, new):
+    """Merge the arguments of two ``PropertiesChanged`` signals. Use this as
+    the *merge* function of a coalesced ``PropertiesChanged`` signal with
+    *key* 0."""
+    interface, changed, invalidated = old
+    changed = dict(changed)
+    changed.update(new[1])
+    invalidated = [name for name in invalidated if name not in new[1]]
+    for name in new[2]:
+        changed.pop(name, None)
+        if name not in invalidated:
+            invalidated.append(name)
+    return interface, changed, invalidated
 
 
 class Object(object):
@@ -124,10 +384,15 @@ class Object(object):
     Signals should be decorated with the ``@Signal`` decorator. This is not
     strictly necessary but allows dbusx to include them in introspection
     replies.
+
+    An object may be published on more than one connection. In that case
+    :attr:`connection` refers to the connection of the method call that is
+    currently being dispatched.
     """
 
     def __init__(self):
-        self.connection = None
+        self.connections = []
+        self._context = None
         self.wrapped = None
         self.logger = dbusx.util.getLogger('dbusx.Object')
 
@@ -147,9 +412,30 @@ class Object(object):
         """Register an object with a connection. This is done automatically by
         a connection when an object is published.
         """
-        self.connection = connection
+        if connection not in self.connections:
+            self.connections.append(connection)
+        if self._context is None:
+            self._context = connection._local()
         self.path = path
 
+    def unregister(self, connection):
+        """Unregister an object from a connection. This is done automatically
+        by a connection when an object is removed or when it is closed.
+        """
+        if connection in self.connections:
+            self.connections.remove(connection)
+        for batcher in self.__dict__.get('_batchers', {}).values():
+            batcher.unsubscribe_all(connection)
+
+    @property
+    def connection(self):
+        """The connection of the method call that is being dispatched, or
+        the first connection that the object is registered with."""
+        connection = getattr(self._context, 'connection', None)
+        if connection is None and self.connections:
+            connection = self.connections[0]
+        return connection
+
     def methods(self):
         """Iterate over all methods."""
         if self.wrapped:
@@ -176,31 +462,81 @@ class Object(object):
 
     def _process(self, connection, message):
         """Callback to process incoming messages."""
-        if connection is not self.connection:
+        if connection not in self.connections:
             return
         assert message.type == dbusx.MESSAGE_TYPE_METHOD_CALL
+        if message.interface == dbusx.batch.INTERFACE_BATCH:
+            return self._batch_request(connection, message)
         for method in self.methods():
             if method.name != message.member or \
                         message.interface and \
                         method.interface != message.interface:
                 continue
-            self.connection._spawn(self._dispatch, method, message)
+            connection._spawn(self._dispatch, method, message, connection)
             return True
         return False
 
-    def _dispatch(self, method, message):
+    def _batch_request(self, connection, message):
+        """Handle a request to subscribe to or unsubscribe from batches of
+        a signal. See :mod:`dbusx.batch`."""
+        if message.member not in ('Subscribe', 'Unsubscribe'):
+            return False
+        if message.signature != 'ss':
+            self._batch_error(connection, message, dbusx.ERROR_INVALID_ARGS)
+            return True
+        interface, name = message.args
+        for signal in self.signals():
+            if signal.instance is self and signal.interface == interface \
+                        and signal.name == name and signal.batch is not None:
+                break
+        else:
+            self._batch_error(connection, message, dbusx.ERROR_NOT_SUPPORTED)
+            return True
+        batchers = self.__dict__.setdefault('_batchers', {})
+        batcher = batchers.get((interface, name))
+        if batcher is None:
+            batcher = batchers[(interface, name)] = dbusx.batch.Batcher(signal)
+        if message.member == 'Subscribe':
+            batcher.subscribe(connection, message.sender)
+            # Forget the receiver when it leaves the bus.
+            if message.sender is not None \
+                        and isinstance(connection, dbusx.Connection):
+                connection._watch_name(message.sender, self._batch_gone)
+        else:
+            batcher.unsubscribe(connection, message.sender)
+        if not message.no_reply:
+            connection.send(dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_RETURN,
+                                          reply_serial=message.serial,
+                                          destination=message.sender))
+        return True
+
+    def _batch_gone(self, connection, name):
+        for batcher in self.__dict__.get('_batchers', {}).values():
+            batcher.unsubscribe_all(connection, name)
+
+    def _batch_error(self, connection, message, error_name):
+        if message.no_reply:
+            return
+        reply = dbusx.Message(dbusx.MESSAGE_TYPE_ERROR, error_name=error_name,
+                              reply_serial=message.serial,
+                              destination=message.sender)
+        connection.send(reply)
+
+    def _dispatch(self, method, message, connection=None):
         """Dispatch a method call."""
+        if connection is not None:
+            self._context.connection = connection
         log = self.logger
         context = 'methodcall %s:%s.%s' % \
                         (message.path, method.interface, method.name)
         log.setContext(context, store=self.connection.local)
+        self.method = method
+        self.message = message
         if method.args_in is not None and method.args_in != message.signature:
             log.error('invalid call signature (got: %s, expecting: %s)',
                       repr(message.signature), repr(method.args_in))
             self._error(dbusx.ERROR_INVALID_ARGS)
             return
-        self.method = method
-        self.message = message
         try:
             result = method(*message.args)
         except dbusx.NoReply:
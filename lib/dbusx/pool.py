@@ -0,0 +1,267 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""A pool of worker processes behind a single bus name.
+
+A bus name is owned by a single connection, so normally a single process
+serves it. A :class:`WorkerPool` forks a number of worker processes, and
+then connects to the bus and acquires the name in the front process. The
+front forwards every method call for the name to a worker, as the raw
+marshalled message, and relays the reply back to the bus::
+
+    def setup(connection):
+        connection.publish(MyService(), '/my/service')
+
+    pool = WorkerPool('com.example.MyService', setup, workers=4)
+    pool.run()
+
+The *setup* function is called in every worker with a
+:class:`dbusx.wire.WireConnection` to the front. Objects published on it
+see the original sender and serial of the method call, so their replies go
+to the caller unchanged. Signals and method calls sent by a worker are
+relayed to the bus as well, and the replies to its method calls are routed
+back to it.
+
+A call goes to the worker with the fewest outstanding calls. If a worker
+exits, its outstanding calls get an error reply and a new worker is forked.
+"""
+
+from __future__ import absolute_import
+
+import os
+import errno
+import socket
+import multiprocessing
+
+import dbusx
+import dbusx.loop
+import dbusx.util
+import dbusx.wire
+
+__all__ = ['WorkerPool']
+
+#: Flag for RequestName: fail if the name is already owned.
+NAME_FLAG_DO_NOT_QUEUE = 4
+
+
+class Worker(object):
+    """The front's view of a worker process."""
+
+    def __init__(self, pid, sock):
+        self.pid = pid
+        self.sock = sock
+        self.calls = set()
+        self.outgoing = set()
+        self.wbuf = b''
+        self.rbuf = bytearray()
+
+    def fileno(self):
+        return self.sock.fileno()
+
+
+def _serve(sock, setup):
+    """Main function of a worker process."""
+    connection = dbusx.wire.WireConnection(sock=sock)
+    setup(connection)
+    while connection.read_write_dispatch(-1):
+        pass
+
+
+class WorkerPool(object):
+    """Serve the bus name *name* with *workers* worker processes.
+
+    The *setup* function is called in each worker to publish its objects.
+    The front connects to the bus at *address* and runs on *loop*, which
+    defaults to a new :class:`dbusx.loop.EventLoop`.
+    """
+
+    def __init__(self, name, setup, workers=None, address=dbusx.BUS_SESSION,
+                 loop=None):
+        self.name = name
+        self.setup = setup
+        self.size = workers or multiprocessing.cpu_count()
+        self.address = address
+        self.loop = loop if loop is not None else dbusx.loop.EventLoop()
+        self.connection = None
+        self.workers = []
+        self.outgoing = {}
+        self.forwarded = 0
+        self.respawned = 0
+        self._stopping = False
+        self.logger = dbusx.util.getLogger('dbusx.WorkerPool')
+
+    def start(self):
+        """Fork the workers, connect to the bus and acquire the name."""
+        # Fork before connecting so that the workers do not inherit any
+        # libdbus state. Workers that replace one that exited are forked
+        # later, and close the socket of the front instead.
+        for i in range(self.size):
+            self._spawn()
+        self.connection = dbusx.Connection(self.address)
+        self.connection.set_loop(self.loop)
+        self.connection.add_filter(self._forward)
+        reply = self.connection.call_method(dbusx.SERVICE_DBUS,
+                        dbusx.PATH_DBUS, dbusx.INTERFACE_DBUS, 'RequestName',
+                        'su', (self.name, NAME_FLAG_DO_NOT_QUEUE))
+        if reply.type == dbusx.MESSAGE_TYPE_ERROR or reply.args[0] != 1:
+            self.stop()
+            raise dbusx.Error('could not acquire name %s' % self.name)
+
+    def run(self):
+        """Start the pool and run the event loop until :meth:`stop` is
+        called."""
+        self.start()
+        self.loop.run_forever()
+
+    def stop(self):
+        """Stop the workers and close the connection to the bus."""
+        self._stopping = True
+        if self.connection is not None:
+            self.connection.close()
+            self.connection = None
+        for worker in self.workers[:]:
+            self._close_worker(worker)
+        self.loop.stop()
+
+    def _spawn(self):
+        parent, child = socket.socketpair()
+        pid = os.fork()
+        if pid == 0:
+            status = 1
+            try:
+                parent.close()
+                for worker in self.workers:
+                    worker.sock.close()
+                # These are the only file descriptors that the front
+                # watches with its event loop.
+                if self.connection is not None:
+                    fd = self.connection.fileno()
+                    if fd >= 0:
+                        os.close(fd)
+                _serve(child, self.setup)
+                status = 0
+            except BaseException:
+                self.logger.error('uncaught exception in worker',
+                                  exc_info=True)
+            finally:
+                os._exit(status)
+        child.close()
+        parent.setblocking(False)
+        worker = Worker(pid, parent)
+        self.workers.append(worker)
+        self.loop.add_reader(worker.fileno(), self._read, worker)
+        return worker
+
+    def _forward(self, connection, message):
+        """Filter that forwards method calls to a worker, and replies to
+        the method calls that a worker made."""
+        if message.type in (dbusx.MESSAGE_TYPE_METHOD_RETURN,
+                            dbusx.MESSAGE_TYPE_ERROR):
+            return self._forward_reply(message)
+        if message.type != dbusx.MESSAGE_TYPE_METHOD_CALL \
+                    or message.destination not in (self.name,
+                                                   connection.unique_name):
+            return False
+        if not self.workers:
+            self._error(message.sender, message.serial, 'No workers')
+            return True
+        worker = min(self.workers, key=lambda worker: len(worker.calls))
+        if not message.no_reply:
+            worker.calls.add((message.sender, message.serial))
+        worker.wbuf += message.marshal()
+        self._write(worker)
+        self.forwarded += 1
+        return True
+
+    def _forward_reply(self, message):
+        call = self.outgoing.pop(message.reply_serial, None)
+        if call is None:
+            return False
+        worker, serial = call
+        worker.outgoing.discard(message.reply_serial)
+        # A received message can not be changed, so send a copy with the
+        # serial of the worker's call.
+        reply = message.copy()
+        reply.serial = message.serial
+        reply.reply_serial = serial
+        worker.wbuf += reply.marshal()
+        self._write(worker)
+        return True
+
+    def _write(self, worker):
+        while worker.wbuf:
+            try:
+                sent = worker.sock.send(worker.wbuf)
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    self.loop.add_writer(worker.fileno(), self._write, worker)
+                    return
+                if e.errno == errno.EINTR:
+                    continue
+                self._close_worker(worker)
+                return
+            worker.wbuf = worker.wbuf[sent:]
+        self.loop.remove_writer(worker.fileno())
+
+    def _read(self, worker):
+        try:
+            data = worker.sock.recv(dbusx.wire.READ_SIZE)
+        except socket.error as e:
+            if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                return
+            data = b''
+        if not data:
+            self._close_worker(worker)
+            return
+        worker.rbuf += data
+        messages, size = dbusx.Message.demarshal_many(worker.rbuf)
+        del worker.rbuf[:size]
+        for message in messages:
+            if message.type in (dbusx.MESSAGE_TYPE_METHOD_RETURN,
+                                dbusx.MESSAGE_TYPE_ERROR):
+                worker.calls.discard((message.destination,
+                                      message.reply_serial))
+            # The copy has no serial, so the connection assigns one of its
+            # own. The reply serial and the destination are unchanged.
+            if self.connection is None:
+                continue
+            copy = message.copy()
+            self.connection.send(copy)
+            if message.type == dbusx.MESSAGE_TYPE_METHOD_CALL \
+                        and not message.no_reply:
+                self.outgoing[copy.serial] = (worker, message.serial)
+                worker.outgoing.add(copy.serial)
+
+    def _error(self, destination, serial, text):
+        reply = dbusx.Message(dbusx.MESSAGE_TYPE_ERROR,
+                              error_name=dbusx.ERROR_FAILED,
+                              reply_serial=serial, destination=destination)
+        reply.set_args('s', (text,))
+        self.connection.send(reply)
+
+    def _close_worker(self, worker):
+        if worker not in self.workers:
+            return
+        self.workers.remove(worker)
+        for serial in worker.outgoing:
+            self.outgoing.pop(serial, None)
+        self.loop.remove_reader(worker.fileno())
+        self.loop.remove_writer(worker.fileno())
+        worker.sock.close()
+        try:
+            os.waitpid(worker.pid, 0)
+        except OSError:
+            pass
+        if self._stopping:
+            return
+        self.logger.error('worker %d exited with %d outstanding calls',
+                          worker.pid, len(worker.calls))
+        for destination, serial in worker.calls:
+            self._error(destination, serial, 'Worker exited')
+        self._spawn()
+        self.respawned += 1
@@ -138,7 +138,7 @@ class SignalStub(object):
                 raise dbusx.Error('could not determine interface')
         return interface
 
-    def connect(self, callback, interface=None):
+    def connect(self, callback, interface=None, conflate=None, batch=False):
         """Connect a signal to a callback.
 
         If the signal is raised, *callback* will be called. The callback will
@@ -151,14 +151,18 @@ class SignalStub(object):
         and furthermore the interface search path on the proxy does not resolve
         which interface to use. In this case, you need to specify the
         interface. If you don't, an exception will be raised.
+
+        The *conflate* and *batch* arguments are passed to
+        :meth:`Connection.connect_to_signal`.
         """
         if interface is None:
             interface = self._get_interface()
-        def call_handler(message):
+        def call_handler(message, args):
             self.proxy.message = message
-            callback(*message.args)
+            callback(*args)
         self.proxy.connection.connect_to_signal(self.proxy.service,
-                    self.proxy.path, interface, self.signal, call_handler)
+                    self.proxy.path, interface, self.signal, call_handler,
+                    conflate, args=True, batch=batch)
 
 
 class Proxy(object):
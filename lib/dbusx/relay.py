@@ -0,0 +1,81 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Relay messages between connections.
+
+A :class:`Relay` forwards method calls and signals that arrive on one
+connection to another connection, and routes the replies back to the
+original caller. The messages are copied in C, without decoding their
+arguments into Python objects::
+
+    relay = Relay(system, session, destination='com.example.Service')
+    relay.add_rule(interface='com.example.Service')
+    relay.start()
+
+A relay is unidirectional. Use a second relay with the connections swapped
+to bridge in both directions.
+"""
+
+from __future__ import absolute_import
+
+import dbusx
+
+__all__ = ['Relay']
+
+
+class Relay(dbusx.RelayBase):
+    """Relay messages from *source* to *target*.
+
+    If *destination* is provided, relayed method calls are sent to that bus
+    name on *target*. Otherwise they keep their original destination.
+    """
+
+    def __init__(self, source, target, destination=None, max_pending=65536):
+        super(Relay, self).__init__(source, target, destination, max_pending)
+        self.started = False
+
+    def add_rule(self, type=None, sender=None, destination=None, path=None,
+                 path_namespace=None, interface=None, member=None):
+        """Add a rule. See :meth:`dbusx.RelayBase.add_rule`.
+
+        If the source is a bus connection and the rule can match signals, a
+        match rule is added on the bus so that the signals are routed to us.
+        """
+        super(Relay, self).add_rule(type, sender, destination, path,
+                                    path_namespace, interface, member)
+        if type not in (None, dbusx.MESSAGE_TYPE_SIGNAL) \
+                    or self.source.unique_name is None:
+            return
+        rule = ["type='signal'"]
+        for key, value in (('sender', sender), ('path', path),
+                           ('path_namespace', path_namespace),
+                           ('interface', interface), ('member', member)):
+            if value is not None:
+                rule.append("%s='%s'" % (key, value))
+        message = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL, no_reply=True,
+                          destination=dbusx.SERVICE_DBUS, path=dbusx.PATH_DBUS,
+                          interface=dbusx.INTERFACE_DBUS, member='AddMatch')
+        message.set_args('s', (','.join(rule),))
+        self.source.send(message)
+
+    def start(self):
+        """Start relaying."""
+        if self.started:
+            return
+        self.source.add_filter(self.forward)
+        self.target.add_filter(self.handle_reply)
+        self.started = True
+
+    def stop(self):
+        """Stop relaying. Calls that are waiting for a reply will not get
+        one."""
+        if not self.started:
+            return
+        self.source.remove_filter(self.forward)
+        self.target.remove_filter(self.handle_reply)
+        self.started = False
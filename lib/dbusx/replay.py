@@ -0,0 +1,258 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""Replay captured D-BUS traffic.
+
+This module replays the method calls and signals from a capture file (see
+:mod:`dbusx.capture`) on a connection. It can be used to reproduce production
+traffic against a staging service, and doubles as a load generator.
+"""
+
+from __future__ import print_function
+
+import os
+import sys
+import time
+import functools
+import subprocess
+
+import dbusx
+import dbusx.util
+import dbusx.capture
+
+__all__ = ['Replay']
+
+
+class Replay(object):
+    """Replay messages from a capture file on a connection.
+
+    Messages are copied before they are sent. This gives them a new serial,
+    and allows their destination to be rewritten. Method calls that expect
+    a reply are sent with :meth:`dbusx.ConnectionBase.send_with_reply`, and
+    the time until their reply arrives is recorded.
+    """
+
+    default_types = (dbusx.MESSAGE_TYPE_METHOD_CALL, dbusx.MESSAGE_TYPE_SIGNAL)
+
+    def __init__(self, connection, reader, destinations=None,
+                 destination=None, speed=1.0, concurrency=1, timeout=None,
+                 types=None):
+        """Create a new replay.
+
+        The *connection* argument is the connection to send the messages on,
+        and *reader* is a :class:`dbusx.capture.CaptureReader`.
+
+        Destinations are rewritten using the *destinations* mapping, which
+        maps original destinations to new ones. Messages with a destination
+        that is not in this mapping are sent to *destination*, if provided.
+
+        The *speed* argument specifies the replay speed relative to the
+        original pace. A speed of None replays as fast as possible. The
+        *concurrency* argument limits the number of outstanding method calls,
+        and *timeout* specifies the timeout for each call. The *types*
+        argument specifies the message types to replay. By default method
+        calls and signals are replayed.
+        """
+        self.connection = connection
+        self.reader = reader
+        self.destinations = destinations or {}
+        self.destination = destination
+        self.speed = speed
+        self.concurrency = concurrency
+        self.timeout = timeout
+        self.types = types or self.default_types
+        self.outstanding = 0
+        self.sent = 0
+        self.replies = 0
+        self.errors = 0
+        self.latencies = []
+        self.elapsed = None
+
+    def _pump(self, secs=None):
+        """Run one iteration of the event loop."""
+        conn = self.connection
+        if secs is None or secs > 0.01:
+            secs = 0.01
+        if conn.loop:
+            if conn.dispatch_status == dbusx.DISPATCH_DATA_REMAINS:
+                conn.dispatch()
+            else:
+                conn.loop.run_once(secs)
+        else:
+            conn.read_write_dispatch(secs)
+
+    def _wait(self, due):
+        """Process replies until *due*."""
+        while True:
+            secs = due - time.time()
+            if secs <= 0:
+                break
+            self._pump(secs)
+
+    def _reply(self, sent, message):
+        self.latencies.append(time.time() - sent)
+        self.outstanding -= 1
+        if message.type == dbusx.MESSAGE_TYPE_ERROR:
+            self.errors += 1
+        else:
+            self.replies += 1
+
+    def _send(self, message):
+        message = message.copy()
+        destination = message.destination
+        if destination in self.destinations:
+            message.destination = self.destinations[destination]
+        elif destination is not None and self.destination is not None:
+            message.destination = self.destination
+        if message.type == dbusx.MESSAGE_TYPE_METHOD_CALL \
+                    and not message.no_reply:
+            callback = functools.partial(self._reply, time.time())
+            self.connection.send_with_reply(message, callback, self.timeout)
+            self.outstanding += 1
+        else:
+            self.connection.send(message)
+        self.sent += 1
+
+    def run(self, start=None, end=None):
+        """Run the replay. Only messages captured between *start* and *end*
+        are replayed, if specified. This method blocks until all replies have
+        been received. The return value is a dictionary with statistics, see
+        :meth:`stats`.
+        """
+        t0 = None
+        start_time = time.time()
+        for timestamp, message in self.reader.messages(start, end):
+            if message.type not in self.types:
+                continue
+            if self.speed:
+                if t0 is None:
+                    t0 = timestamp
+                self._wait(start_time + (timestamp - t0) / self.speed)
+            while self.outstanding >= self.concurrency:
+                self._pump()
+            self._send(message)
+        while self.outstanding:
+            self._pump()
+        if not self.connection.loop:
+            self.connection.flush()
+        self.elapsed = time.time() - start_time
+        return self.stats()
+
+    def stats(self):
+        """Return a dictionary with the replay statistics.
+
+        The dictionary contains the number of messages *sent*, the number of
+        *replies* and *errors* received, the *elapsed* time, the achieved
+        *throughput* in messages per second, and the reply *latency* as a
+        dictionary mapping percentiles to values in seconds.
+        """
+        elapsed = self.elapsed or 0.0
+        return { 'sent': self.sent, 'replies': self.replies,
+                 'errors': self.errors, 'elapsed': elapsed,
+                 'throughput': self.sent / elapsed if elapsed else 0.0,
+                 'latency': dbusx.util.percentiles(self.latencies) }
+
+
+def wait_for_names(connection, names, timeout=10):
+    """Wait until all bus names in *names* have an owner."""
+    end_time = time.time() + timeout
+    for name in names:
+        while True:
+            reply = connection.call_method(dbusx.SERVICE_DBUS,
+                            dbusx.PATH_DBUS, dbusx.INTERFACE_DBUS,
+                            'NameHasOwner', 's', (name,))
+            if reply.type == dbusx.MESSAGE_TYPE_METHOD_RETURN \
+                        and reply.args[0]:
+                break
+            if time.time() > end_time:
+                raise dbusx.TimeoutError('name %s did not appear' % name)
+            time.sleep(0.05)
+
+
+def format_stats(stats):
+    """Format replay statistics as a human readable string."""
+    lines = []
+    lines.append('sent %(sent)d messages in %(elapsed).2f seconds '
+                 '(%(throughput).1f msg/s)' % stats)
+    lines.append('received %(replies)d replies and %(errors)d errors' % stats)
+    latency = stats['latency']
+    if latency.get(50) is not None:
+        lines.append('latency: ' + ', '.join(['p%s=%.3fms' % (p, latency[p]*1e3)
+                                              for p in sorted(latency)]))
+    return '\n'.join(lines)
+
+
+def main():
+    """Replay a capture file."""
+    import optparse
+    parser = optparse.OptionParser(usage='%prog [options] capture')
+    parser.add_option('-a', '--address', help='bus address to replay on')
+    parser.add_option('-p', '--private-bus', action='store_true',
+                      help='replay on a private bus daemon')
+    parser.add_option('--service', metavar='COMMAND',
+                      help='start the service under test on the private bus')
+    parser.add_option('-d', '--destination', action='append', default=[],
+                      metavar='OLD=NEW', help='rewrite destination OLD to NEW')
+    parser.add_option('-D', '--default-destination', metavar='NAME',
+                      help='send all other method calls to NAME')
+    parser.add_option('-s', '--speed', type='float', default=1.0,
+                      help='replay speed relative to the original pace')
+    parser.add_option('-f', '--fast', action='store_true',
+                      help='replay as fast as possible')
+    parser.add_option('-c', '--concurrency', type='int', default=1,
+                      help='maximum number of outstanding method calls')
+    parser.add_option('-t', '--timeout', type='float',
+                      help='timeout for method calls in seconds')
+    opts, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('specify exactly one capture file')
+    destinations = {}
+    for spec in opts.destination:
+        old, sep, new = spec.partition('=')
+        if not sep:
+            parser.error('illegal destination: %s' % spec)
+        destinations[old] = new
+    pid = process = None
+    if opts.private_bus:
+        address, pid = dbusx.util.start_bus_daemon()
+        sys.stderr.write('started private bus at %s\n' % address)
+    elif opts.address:
+        address = opts.address
+    else:
+        address = dbusx.BUS_SESSION
+    try:
+        connection = dbusx.Connection(address)
+        if opts.service:
+            if not opts.private_bus:
+                parser.error('--service requires --private-bus')
+            env = os.environ.copy()
+            env['DBUS_SESSION_BUS_ADDRESS'] = address
+            process = subprocess.Popen(opts.service, shell=True, env=env)
+            names = list(destinations.values())
+            if opts.default_destination:
+                names.append(opts.default_destination)
+            wait_for_names(connection, names)
+        reader = dbusx.capture.CaptureReader(args[0])
+        replay = Replay(connection, reader, destinations,
+                        opts.default_destination,
+                        None if opts.fast else opts.speed,
+                        opts.concurrency, opts.timeout)
+        stats = replay.run()
+        reader.close()
+        connection.close()
+        print(format_stats(stats))
+    finally:
+        if process is not None:
+            process.terminate()
+            process.wait()
+        if pid is not None:
+            dbusx.util.stop_bus_daemon(pid)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,710 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""A minimal in-process message bus.
+
+This module contains :class:`Router`, a message bus that is implemented on
+top of :class:`dbusx.Server`. It implements the parts of the bus daemon that
+dbusx itself uses: the "Hello" handshake, bus name ownership, match rules,
+unicast and multicast routing, and monitors. There is no security policy,
+no service activation and no resource limits.
+
+The router is meant for tests and benchmarks. It does not need an external
+"dbus-launch" or "dbus-daemon", and its performance does not depend on the
+system's bus daemon and its configuration. It can also be run as a separate
+process with ``python -m dbusx.router``.
+"""
+
+from __future__ import print_function
+
+import os
+import sys
+import tempfile
+import threading
+import optparse
+
+import dbusx
+import dbusx.loop
+from dbusx.server import Server
+
+__all__ = ['Router', 'MatchRule']
+
+# Flags and return values for RequestName and ReleaseName.
+NAME_FLAG_ALLOW_REPLACEMENT = 1
+NAME_FLAG_REPLACE_EXISTING = 2
+NAME_FLAG_DO_NOT_QUEUE = 4
+
+REQUEST_NAME_REPLY_PRIMARY_OWNER = 1
+REQUEST_NAME_REPLY_IN_QUEUE = 2
+REQUEST_NAME_REPLY_EXISTS = 3
+REQUEST_NAME_REPLY_ALREADY_OWNER = 4
+
+RELEASE_NAME_REPLY_RELEASED = 1
+RELEASE_NAME_REPLY_NON_EXISTENT = 2
+RELEASE_NAME_REPLY_NOT_OWNER = 3
+
+START_REPLY_ALREADY_RUNNING = 2
+
+_message_types = { 'method_call': dbusx.MESSAGE_TYPE_METHOD_CALL,
+                   'method_return': dbusx.MESSAGE_TYPE_METHOD_RETURN,
+                   'error': dbusx.MESSAGE_TYPE_ERROR,
+                   'signal': dbusx.MESSAGE_TYPE_SIGNAL }
+
+_introspection = """\
+<!DOCTYPE node PUBLIC "-//freedesktop//DTD D-BUS Object Introspection 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd">
+<node>
+  <interface name="org.freedesktop.DBus">
+    <method name="Hello"><arg direction="out" type="s"/></method>
+    <method name="RequestName"><arg direction="in" type="s"/>
+      <arg direction="in" type="u"/><arg direction="out" type="u"/></method>
+    <method name="ReleaseName"><arg direction="in" type="s"/>
+      <arg direction="out" type="u"/></method>
+    <method name="StartServiceByName"><arg direction="in" type="s"/>
+      <arg direction="in" type="u"/><arg direction="out" type="u"/></method>
+    <method name="NameHasOwner"><arg direction="in" type="s"/>
+      <arg direction="out" type="b"/></method>
+    <method name="ListNames"><arg direction="out" type="as"/></method>
+    <method name="ListActivatableNames"><arg direction="out" type="as"/>
+      </method>
+    <method name="AddMatch"><arg direction="in" type="s"/></method>
+    <method name="RemoveMatch"><arg direction="in" type="s"/></method>
+    <method name="GetNameOwner"><arg direction="in" type="s"/>
+      <arg direction="out" type="s"/></method>
+    <method name="ListQueuedOwners"><arg direction="in" type="s"/>
+      <arg direction="out" type="as"/></method>
+    <method name="GetConnectionUnixUser"><arg direction="in" type="s"/>
+      <arg direction="out" type="u"/></method>
+    <method name="GetConnectionUnixProcessID"><arg direction="in" type="s"/>
+      <arg direction="out" type="u"/></method>
+    <method name="GetId"><arg direction="out" type="s"/></method>
+    <signal name="NameOwnerChanged"><arg type="s"/><arg type="s"/>
+      <arg type="s"/></signal>
+    <signal name="NameLost"><arg type="s"/></signal>
+    <signal name="NameAcquired"><arg type="s"/></signal>
+  </interface>
+  <interface name="org.freedesktop.DBus.Monitoring">
+    <method name="BecomeMonitor"><arg direction="in" type="as"/>
+      <arg direction="in" type="u"/></method>
+  </interface>
+  <interface name="org.freedesktop.DBus.Introspectable">
+    <method name="Introspect"><arg direction="out" type="s"/></method>
+  </interface>
+  <interface name="org.freedesktop.DBus.Peer">
+    <method name="Ping"/>
+    <method name="GetMachineId"><arg direction="out" type="s"/></method>
+  </interface>
+</node>
+"""
+
+
+class DriverError(Exception):
+    """An error reply from the bus driver."""
+
+    def __init__(self, name, message):
+        super(DriverError, self).__init__(message)
+        self.name = name
+        self.message = message
+
+
+class MatchRule(object):
+    """A match rule, as used by "AddMatch" and "BecomeMonitor".
+
+    The rule is parsed when it is created. A ValueError is raised if the
+    rule is not valid.
+    """
+
+    def __init__(self, rule):
+        self.rule = rule
+        self.keys = self._parse(rule)
+        self.type = None
+        self.args = []
+        for key, value in self.keys.items():
+            if key == 'type':
+                if value not in _message_types:
+                    raise ValueError('unknown message type: %s' % value)
+                self.type = _message_types[value]
+            elif key in ('sender', 'interface', 'member', 'path',
+                         'path_namespace', 'destination', 'eavesdrop'):
+                pass
+            elif key.startswith('arg'):
+                self.args.append(self._parse_arg(key, value))
+            else:
+                raise ValueError('unknown key: %s' % key)
+        if 'path' in self.keys and 'path_namespace' in self.keys:
+            raise ValueError('path and path_namespace are exclusive')
+        self.args.sort()
+
+    def _parse(self, rule):
+        keys = {}
+        pos, length = 0, len(rule)
+        while pos < length:
+            equals = rule.find('=', pos)
+            if equals == -1:
+                raise ValueError('expecting "key=value" at %d' % pos)
+            key = rule[pos:equals].strip()
+            pos = equals + 1
+            value = []
+            while pos < length and rule[pos] != ',':
+                if rule[pos] == "'":
+                    end = rule.find("'", pos+1)
+                    if end == -1:
+                        raise ValueError('unterminated quote')
+                    value.append(rule[pos+1:end])
+                    pos = end + 1
+                elif rule.startswith("\\'", pos):
+                    value.append("'")
+                    pos += 2
+                else:
+                    value.append(rule[pos])
+                    pos += 1
+            pos += 1
+            if not key or key in keys:
+                raise ValueError('empty or duplicate key: %r' % key)
+            keys[key] = ''.join(value)
+        return keys
+
+    def _parse_arg(self, key, value):
+        for suffix in ('path', 'namespace', ''):
+            if key.endswith(suffix):
+                index = key[3:len(key)-len(suffix)]
+                break
+        if not index.isdigit() or int(index) > 63:
+            raise ValueError('illegal argument key: %s' % key)
+        if suffix == 'namespace' and index != '0':
+            raise ValueError('only arg0 supports namespace matching')
+        return (int(index), suffix, value)
+
+    def __eq__(self, other):
+        return isinstance(other, MatchRule) and self.keys == other.keys
+
+    def __ne__(self, other):
+        return not self.__eq__(other)
+
+    def matches(self, message, owner=None):
+        """Return whether *message* matches this rule.
+
+        The *owner* argument, if provided, must be a function that returns
+        the unique name of the owner of a bus name. It is used to match
+        rules with a well-known name as the sender.
+        """
+        keys = self.keys
+        if self.type is not None and message.type != self.type:
+            return False
+        if 'sender' in keys:
+            sender = keys['sender']
+            if message.sender != sender and (owner is None or
+                        sender.startswith(':') or
+                        message.sender != owner(sender)):
+                return False
+        if 'interface' in keys and message.interface != keys['interface']:
+            return False
+        if 'member' in keys and message.member != keys['member']:
+            return False
+        if 'path' in keys and message.path != keys['path']:
+            return False
+        if 'path_namespace' in keys:
+            namespace, path = keys['path_namespace'], message.path
+            if path is None or not (namespace == '/' or path == namespace
+                                    or path.startswith(namespace + '/')):
+                return False
+        if 'destination' in keys \
+                    and message.destination != keys['destination']:
+            return False
+        if self.args:
+            args = message.args or ()
+            for index, suffix, value in self.args:
+                if index >= len(args) or not isinstance(args[index], str):
+                    return False
+                arg = args[index]
+                if suffix == 'path':
+                    if arg != value and not \
+                            (value.endswith('/') and arg.startswith(value)) \
+                            and not (arg.endswith('/') and
+                                     value.startswith(arg)):
+                        return False
+                elif suffix == 'namespace':
+                    if arg != value and not arg.startswith(value + '.'):
+                        return False
+                elif arg != value:
+                    return False
+        return True
+
+
+class Client(object):
+    """Router state for a connection."""
+
+    def __init__(self, connection):
+        self.connection = connection
+        self.unique_name = None
+        self.rules = []
+        self.names = set()
+        self.monitor = False
+
+
+class Router(Server):
+    """A minimal message bus.
+
+    The router listens on *address*, which defaults to a new socket in the
+    temporary directory, and routes messages between the connections that
+    are made to it. Clients use it like any other bus, e.g. using
+    ``Connection(router.address)``.
+
+    The router needs an event loop to run. By default it creates a
+    :class:`dbusx.loop.EventLoop` that can be run in a background thread
+    using :meth:`start`, or in the current thread using :meth:`run`.
+    """
+
+    def __init__(self, address=None, loop=None):
+        if address is None:
+            address = 'unix:tmpdir=%s' % tempfile.gettempdir()
+        if loop is None:
+            loop = dbusx.loop.EventLoop()
+        super(Router, self).__init__(address, loop)
+        self.clients = {}
+        self._unique_names = {}
+        self._names = {}
+        self._monitors = []
+        self._next_id = 1
+        self._thread = None
+        self._stopped = True
+        self.driver = { dbusx.INTERFACE_DBUS: {
+                            'Hello': ('', self._Hello),
+                            'RequestName': ('su', self._RequestName),
+                            'ReleaseName': ('s', self._ReleaseName),
+                            'StartServiceByName': ('su',
+                                    self._StartServiceByName),
+                            'NameHasOwner': ('s', self._NameHasOwner),
+                            'ListNames': ('', self._ListNames),
+                            'ListActivatableNames': ('',
+                                    self._ListActivatableNames),
+                            'AddMatch': ('s', self._AddMatch),
+                            'RemoveMatch': ('s', self._RemoveMatch),
+                            'GetNameOwner': ('s', self._GetNameOwner),
+                            'ListQueuedOwners': ('s', self._ListQueuedOwners),
+                            'GetConnectionUnixUser': ('s',
+                                    self._GetConnectionUnixUser),
+                            'GetConnectionUnixProcessID': ('s',
+                                    self._GetConnectionUnixProcessID),
+                            'GetId': ('', self._GetId) },
+                        dbusx.INTERFACE_MONITORING: {
+                            'BecomeMonitor': ('asu', self._BecomeMonitor) },
+                        dbusx.INTERFACE_INTROSPECTABLE: {
+                            'Introspect': ('', self._Introspect) },
+                        dbusx.INTERFACE_PEER: {
+                            'Ping': ('', self._Ping),
+                            'GetMachineId': ('', self._GetMachineId) } }
+
+    def __str__(self):
+        return 'Router(address=%s)' % self.address
+
+    def start(self):
+        """Run the router in a background thread."""
+        if self._thread is not None:
+            raise RuntimeError('router already started')
+        self._stopped = False
+        self._thread = threading.Thread(target=self.run, name=str(self))
+        self._thread.daemon = True
+        self._thread.start()
+
+    def run(self):
+        """Run the router in the current thread until :meth:`stop` is
+        called. The router is closed when this method returns."""
+        self._stopped = False
+        try:
+            while not self._stopped:
+                self.loop.run_once(0.1)
+        finally:
+            self.close()
+
+    def stop(self):
+        """Stop the router and close all connections."""
+        self._stopped = True
+        if self._thread is not None \
+                    and self._thread is not threading.current_thread():
+            self._thread.join()
+            self._thread = None
+
+    def owner(self, name):
+        """Return the unique name of the owner of bus name *name*, or None
+        if the name has no owner."""
+        if name == dbusx.SERVICE_DBUS:
+            return name
+        if name.startswith(':'):
+            return name if name in self._unique_names else None
+        queue = self._names.get(name)
+        return queue[0][0].unique_name if queue else None
+
+    def _lookup(self, name):
+        if name.startswith(':'):
+            return self._unique_names.get(name)
+        queue = self._names.get(name)
+        return queue[0][0] if queue else None
+
+    # Connection management
+
+    def handle_connection(self, connection):
+        """Called when a new connection is accepted."""
+        connection.set_route_peer_messages(True)
+        self.clients[connection] = Client(connection)
+        super(Router, self).handle_connection(connection)
+        connection.add_filter(self._route)
+
+    def _close_connection(self, connection):
+        client = self.clients.pop(connection, None)
+        if client is not None:
+            if client.monitor:
+                self._monitors.remove(client)
+            elif client.unique_name is not None:
+                for name in list(client.names):
+                    self._release_name(client, name)
+                del self._unique_names[client.unique_name]
+                self._name_owner_changed(client.unique_name,
+                                         client.unique_name, '')
+        super(Router, self)._close_connection(connection)
+
+    # Routing
+
+    def _route(self, connection, message):
+        client = self.clients.get(connection)
+        if client is None or client.monitor:
+            # Monitors are not allowed to send anything.
+            return True
+        if client.unique_name is None:
+            if message.destination != dbusx.SERVICE_DBUS \
+                        or message.member != 'Hello':
+                self.logger.debug('client did not send Hello first')
+                self.loop.call_soon(self._close_connection, connection)
+                return True
+        else:
+            message.sender = client.unique_name
+        self.deliver(message, client)
+        return True
+
+    def deliver(self, message, origin=None):
+        """Deliver *message* to its destination. A message without a
+        destination is delivered to all clients that have a match rule that
+        matches it. The *origin* argument is the client that sent the
+        message, if any."""
+        for monitor in self._monitors:
+            if not monitor.rules or self._matches(monitor, message):
+                monitor.connection.send(message)
+        destination = message.destination
+        if destination is None:
+            for client in list(self.clients.values()):
+                if client.unique_name is not None and not client.monitor \
+                            and self._matches(client, message):
+                    client.connection.send(message)
+        elif destination == dbusx.SERVICE_DBUS:
+            if origin is not None:
+                self._dispatch(origin, message)
+        else:
+            client = self._lookup(destination)
+            if client is not None:
+                client.connection.send(message)
+            elif origin is not None \
+                        and message.type == dbusx.MESSAGE_TYPE_METHOD_CALL:
+                self._error(origin, message, dbusx.ERROR_SERVICE_UNKNOWN,
+                            'The name %s was not provided by any .service '
+                            'files' % destination)
+
+    def _matches(self, client, message):
+        for rule in client.rules:
+            if rule.matches(message, self.owner):
+                return True
+        return False
+
+    def _dispatch(self, client, message):
+        if message.type != dbusx.MESSAGE_TYPE_METHOD_CALL:
+            return
+        interface, member = message.interface, message.member
+        if interface is None:
+            for methods in self.driver.values():
+                if member in methods:
+                    break
+        else:
+            methods = self.driver.get(interface, {})
+        if member not in methods:
+            self._error(client, message, dbusx.ERROR_UNKNOWN_METHOD,
+                        '%s does not understand message %s'
+                        % (dbusx.SERVICE_DBUS, member))
+            return
+        signature, method = methods[member]
+        if (message.signature or '') != signature:
+            self._error(client, message, dbusx.ERROR_INVALID_ARGS,
+                        'Call to %s has wrong args (%s, expected %s)'
+                        % (member, message.signature or '', signature))
+            return
+        try:
+            result = method(client, *(message.args or ()))
+        except DriverError as e:
+            self._error(client, message, e.name, e.message)
+            return
+        if not message.no_reply:
+            reply = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_RETURN,
+                                  reply_serial=message.serial,
+                                  destination=client.unique_name)
+            if result is not None:
+                reply.set_args(*result)
+            self._send(client, reply)
+        if member == 'Hello':
+            self._name_owner_changed(client.unique_name, '',
+                                     client.unique_name)
+            self._signal(client, 'NameAcquired', client.unique_name)
+
+    def _send(self, client, message):
+        message.sender = dbusx.SERVICE_DBUS
+        for monitor in self._monitors:
+            if not monitor.rules or self._matches(monitor, message):
+                monitor.connection.send(message)
+        client.connection.send(message)
+
+    def _error(self, client, message, name, text):
+        if message.no_reply or client.unique_name is None:
+            return
+        reply = dbusx.Message(dbusx.MESSAGE_TYPE_ERROR, error_name=name,
+                              reply_serial=message.serial,
+                              destination=client.unique_name)
+        reply.set_args('s', (text,))
+        self._send(client, reply)
+
+    def _signal(self, client, name, *args):
+        message = dbusx.Message.signal(None, dbusx.PATH_DBUS,
+                        dbusx.INTERFACE_DBUS, name, 's'*len(args), args)
+        if client is None:
+            message.sender = dbusx.SERVICE_DBUS
+            self.deliver(message)
+        else:
+            message.destination = client.unique_name
+            self._send(client, message)
+
+    def _name_owner_changed(self, name, old_owner, new_owner):
+        self._signal(None, 'NameOwnerChanged', name, old_owner, new_owner)
+
+    def _check_name(self, name):
+        try:
+            dbusx.check_bus_name(name)
+        except ValueError:
+            raise DriverError(dbusx.ERROR_INVALID_ARGS,
+                              'Requested bus name "%s" is not valid' % name)
+        if name.startswith(':'):
+            raise DriverError(dbusx.ERROR_INVALID_ARGS,
+                              'Cannot acquire a name starting with ":"')
+        if name == dbusx.SERVICE_DBUS:
+            raise DriverError(dbusx.ERROR_INVALID_ARGS,
+                              'Cannot acquire the bus name %s' % name)
+
+    def _check_owner(self, name):
+        client = self._lookup(name) if name != dbusx.SERVICE_DBUS else None
+        if client is None and name != dbusx.SERVICE_DBUS:
+            raise DriverError(dbusx.ERROR_NAME_HAS_NO_OWNER,
+                    'Could not get owner of name \'%s\': no such name' % name)
+        return client
+
+    def _release_name(self, client, name):
+        queue = self._names[name]
+        owner = queue[0][0]
+        queue[:] = [entry for entry in queue if entry[0] is not client]
+        client.names.discard(name)
+        if owner is not client:
+            return
+        if queue:
+            new_owner = queue[0][0]
+            self._name_owner_changed(name, client.unique_name,
+                                     new_owner.unique_name)
+            self._signal(client, 'NameLost', name)
+            self._signal(new_owner, 'NameAcquired', name)
+        else:
+            del self._names[name]
+            self._name_owner_changed(name, client.unique_name, '')
+            self._signal(client, 'NameLost', name)
+
+    # Driver methods
+
+    def _Hello(self, client):
+        if client.unique_name is not None:
+            raise DriverError(dbusx.ERROR_FAILED,
+                              'Already handled an Hello message')
+        client.unique_name = ':1.%d' % self._next_id
+        self._next_id += 1
+        self._unique_names[client.unique_name] = client
+        return ('s', (client.unique_name,))
+
+    def _RequestName(self, client, name, flags):
+        self._check_name(name)
+        queue = self._names.get(name)
+        if not queue:
+            self._names[name] = [[client, flags]]
+            client.names.add(name)
+            self._name_owner_changed(name, '', client.unique_name)
+            self._signal(client, 'NameAcquired', name)
+            return ('u', (REQUEST_NAME_REPLY_PRIMARY_OWNER,))
+        owner, owner_flags = queue[0]
+        if owner is client:
+            queue[0][1] = flags
+            return ('u', (REQUEST_NAME_REPLY_ALREADY_OWNER,))
+        replace = (owner_flags & NAME_FLAG_ALLOW_REPLACEMENT) \
+                        and (flags & NAME_FLAG_REPLACE_EXISTING)
+        entries = [entry for entry in queue if entry[0] is client]
+        if not replace:
+            if flags & NAME_FLAG_DO_NOT_QUEUE:
+                if entries:
+                    queue.remove(entries[0])
+                    client.names.discard(name)
+                return ('u', (REQUEST_NAME_REPLY_EXISTS,))
+            if entries:
+                entries[0][1] = flags
+            else:
+                queue.append([client, flags])
+                client.names.add(name)
+            return ('u', (REQUEST_NAME_REPLY_IN_QUEUE,))
+        if entries:
+            queue.remove(entries[0])
+        del queue[0]
+        if owner_flags & NAME_FLAG_DO_NOT_QUEUE:
+            owner.names.discard(name)
+        else:
+            queue.insert(0, [owner, owner_flags])
+        queue.insert(0, [client, flags])
+        client.names.add(name)
+        self._name_owner_changed(name, owner.unique_name, client.unique_name)
+        self._signal(owner, 'NameLost', name)
+        self._signal(client, 'NameAcquired', name)
+        return ('u', (REQUEST_NAME_REPLY_PRIMARY_OWNER,))
+
+    def _ReleaseName(self, client, name):
+        self._check_name(name)
+        if name not in self._names:
+            return ('u', (RELEASE_NAME_REPLY_NON_EXISTENT,))
+        if name not in client.names:
+            return ('u', (RELEASE_NAME_REPLY_NOT_OWNER,))
+        self._release_name(client, name)
+        return ('u', (RELEASE_NAME_REPLY_RELEASED,))
+
+    def _StartServiceByName(self, client, name, flags):
+        if self.owner(name) is None:
+            raise DriverError(dbusx.ERROR_SERVICE_UNKNOWN,
+                    'The name %s was not provided by any .service files'
+                    % name)
+        return ('u', (START_REPLY_ALREADY_RUNNING,))
+
+    def _NameHasOwner(self, client, name):
+        return ('b', (self.owner(name) is not None,))
+
+    def _ListNames(self, client):
+        names = [dbusx.SERVICE_DBUS] + sorted(self._unique_names) \
+                    + sorted(self._names)
+        return ('as', (names,))
+
+    def _ListActivatableNames(self, client):
+        return ('as', ([dbusx.SERVICE_DBUS],))
+
+    def _AddMatch(self, client, rule):
+        try:
+            client.rules.append(MatchRule(rule))
+        except ValueError as e:
+            raise DriverError(dbusx.ERROR_MATCH_RULE_INVALID, str(e))
+
+    def _RemoveMatch(self, client, rule):
+        try:
+            client.rules.remove(MatchRule(rule))
+        except ValueError:
+            raise DriverError(dbusx.ERROR_MATCH_RULE_NOT_FOUND,
+                              'The given match rule wasn\'t found and '
+                              'can\'t be removed')
+
+    def _GetNameOwner(self, client, name):
+        owner = self.owner(name)
+        if owner is None:
+            raise DriverError(dbusx.ERROR_NAME_HAS_NO_OWNER,
+                    'Could not get owner of name \'%s\': no such name' % name)
+        return ('s', (owner,))
+
+    def _ListQueuedOwners(self, client, name):
+        if name == dbusx.SERVICE_DBUS:
+            return ('as', ([name],))
+        self._check_owner(name)
+        if name.startswith(':'):
+            return ('as', ([name],))
+        return ('as', ([entry[0].unique_name
+                        for entry in self._names[name]],))
+
+    def _GetConnectionUnixUser(self, client, name):
+        owner = self._check_owner(name)
+        uid = os.getuid() if owner is None else owner.connection.unix_user
+        if uid is None:
+            raise DriverError(dbusx.ERROR_FAILED,
+                              'Could not determine UID for \'%s\'' % name)
+        return ('u', (uid,))
+
+    def _GetConnectionUnixProcessID(self, client, name):
+        owner = self._check_owner(name)
+        pid = os.getpid() if owner is None \
+                    else owner.connection.unix_process_id
+        if pid is None:
+            raise DriverError(dbusx.ERROR_UNIX_PROCESS_ID_UNKNOWN,
+                              'Could not determine PID for \'%s\'' % name)
+        return ('u', (pid,))
+
+    def _GetId(self, client):
+        return ('s', (self.id,))
+
+    def _BecomeMonitor(self, client, rules, flags):
+        try:
+            rules = [MatchRule(rule) for rule in rules]
+        except ValueError as e:
+            raise DriverError(dbusx.ERROR_MATCH_RULE_INVALID, str(e))
+        # Reply before the client loses its name, like the bus daemon.
+        self.loop.call_soon(self._become_monitor, client, rules)
+
+    def _become_monitor(self, client, rules):
+        if client.connection not in self.clients:
+            return
+        for name in list(client.names):
+            self._release_name(client, name)
+        unique_name = client.unique_name
+        del self._unique_names[unique_name]
+        self._name_owner_changed(unique_name, unique_name, '')
+        self._signal(client, 'NameLost', unique_name)
+        client.monitor = True
+        client.rules = rules
+        self._monitors.append(client)
+
+    def _Introspect(self, client):
+        return ('s', (_introspection,))
+
+    def _Ping(self, client):
+        pass
+
+    def _GetMachineId(self, client):
+        for fname in ('/etc/machine-id', '/var/lib/dbus/machine-id'):
+            try:
+                with open(fname) as fin:
+                    return ('s', (fin.read().strip(),))
+            except IOError:
+                pass
+        return ('s', (self.id,))
+
+
+def main():
+    """Run a router until it is interrupted."""
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('-a', '--address',
+                      help='listen on this address (default: unix:tmpdir)')
+    opts, args = parser.parse_args()
+    router = Router(opts.address)
+    print('DBUS_SESSION_BUS_ADDRESS=%s' % router.address)
+    sys.stdout.flush()
+    try:
+        router.run()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,121 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+import dbusx
+import dbusx.util
+
+#: The interface and path of the service that returns the address for
+#: direct connections. See :meth:`Connection.advertise`.
+INTERFACE_UPGRADE = 'com.github.geertj.dbusx.Upgrade'
+PATH_UPGRADE = '/com/github/geertj/dbusx/Upgrade'
+
+
+class Server(dbusx.ServerBase):
+    """A D-BUS server for peer-to-peer connections.
+
+    A server listens on an address, for example "unix:path=/tmp/socket" or
+    "tcp:host=localhost,port=0", and accepts connections from clients
+    directly, without a message bus in between. This avoids the extra hop
+    through the bus daemon. Clients connect using ``Connection(address,
+    register=False)``.
+
+    Objects that are published on a server with :meth:`publish` are published
+    on all current and future connections. Because there is no message bus,
+    signals are sent to every connected peer.
+
+    A server requires an event loop, which can be passed as the *loop*
+    argument or installed later using :meth:`set_loop`. Accepted connections
+    use the same event loop.
+    """
+
+    connection_class = dbusx.Connection
+
+    def __init__(self, address, loop=None):
+        super(Server, self).__init__(address)
+        self.connections = []
+        self._objects = []
+        self.logger = dbusx.util.getLogger('dbusx.Server',
+                                           context=str(self))
+        if loop is not None:
+            self.set_loop(loop)
+
+    def __str__(self):
+        return 'Server(address=%s)' % self.address
+
+    def publish(self, instance, path):
+        """Publish a Python object instance on all connections.
+
+        The arguments are the same as for :meth:`Connection.publish`.
+        """
+        if not isinstance(instance, dbusx.Object):
+            instance = dbusx.Object.wrap(instance)
+        self._objects.append((instance, path))
+        for connection in self.connections:
+            connection.publish(instance, path)
+
+    def remove(self, path):
+        """Remove an object that was published with :meth:`publish`."""
+        self._objects = [(instance, p) for instance, p in self._objects
+                         if p != path]
+        for connection in self.connections:
+            connection.remove(path)
+
+    def handle_connection(self, connection):
+        """Called when a new connection is accepted."""
+        self.logger.debug('new connection')
+        connection.add_filter(self._disconnect_filter)
+        self.connections.append(connection)
+        for instance, path in self._objects:
+            connection.publish(instance, path)
+
+    def _disconnect_filter(self, connection, message):
+        if message.type != dbusx.MESSAGE_TYPE_SIGNAL \
+                    or message.path != dbusx.PATH_LOCAL \
+                    or message.interface != dbusx.INTERFACE_LOCAL \
+                    or message.member != 'Disconnected':
+            return False
+        self.logger.debug('peer disconnected')
+        # Do not close the connection while it is dispatching.
+        if self.loop is not None:
+            self.loop.call_soon(self._close_connection, connection)
+        else:
+            self._close_connection(connection)
+        return True
+
+    def _close_connection(self, connection):
+        if connection in self.connections:
+            self.connections.remove(connection)
+        connection.close()
+
+    def close(self):
+        """Stop listening and close all connections."""
+        self.disconnect()
+        for connection in self.connections[:]:
+            self._close_connection(connection)
+
+
+class UpgradeServer(Server):
+    """A server for the direct connections that are advertised by
+    :meth:`Connection.advertise`. Its connections carry method calls only:
+    signals are emitted on the bus."""
+
+    def handle_connection(self, connection):
+        connection.broadcast = False
+        super(UpgradeServer, self).handle_connection(connection)
+
+
+class UpgradeService(dbusx.Object):
+    """Returns the address of an :class:`UpgradeServer`."""
+
+    def __init__(self, server):
+        super(UpgradeService, self).__init__()
+        self.server = server
+
+    @dbusx.Method(INTERFACE_UPGRADE, args_out='s')
+    def GetPeerAddress(self):
+        return self.server.address
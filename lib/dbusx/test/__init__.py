@@ -9,14 +9,12 @@
 from __future__ import print_function
 
 import os
-import re
 import gc
-import subprocess
-import signal
-import tempfile
 import logging.config
 
 import dbusx
+import dbusx.util
+import dbusx.router
 from nose import SkipTest
 
 
@@ -31,25 +29,12 @@ def assert_raises(exc, func, *args, **kwargs):
     raise AssertionError('%s not raised' % exc.__name__)
 
 
-def check_output(command):
-    """Python 2.6 does not have a subprocess.check_output()."""
-    process = subprocess.Popen(command, stdout=subprocess.PIPE)
-    output, err = process.communicate()
-    status = process.poll()
-    if status:
-        raise RuntimeError('"%s" exited with status %s', (command, status))
-    return output
-
-
 class UnitTest(object):
     """Test infrastructure for dbusx tests."""
 
     # Set to false if test doesn't require a bus daemon
     need_dbus = True
 
-    _re_assign = re.compile(r'^([a-zA-Z_][a-zA-Z0-9_]*)=' \
-                            r'''([^"']*?|'[^']*'|"([^"\\]|\\.)*");?$''')
-
     @classmethod
     def setup_class(cls):
         cls._have_bus_daemon = False
@@ -58,37 +43,34 @@ class UnitTest(object):
 
     @classmethod
     def _start_bus_daemon(cls):
-        # Launch a session bus for our tests
+        # Launch a session bus for our tests. Use the in-process router if
+        # dbus-launch is not available or if $DBUSX_TEST_ROUTER is set.
         abspath = os.path.abspath(__file__)
         cfgname = os.path.join(os.path.dirname(abspath), 'dbus.conf')
+        cls._bus_router = None
         try:
-            output = check_output(['dbus-launch', '--config-file', cfgname,
-                                   '--sh-syntax'])
+            if os.environ.get('DBUSX_TEST_ROUTER'):
+                raise OSError('router requested')
+            address, pid = dbusx.util.start_bus_daemon(cfgname)
         except OSError:
-            raise SkipTest('dbus-launch is required for running this test')
-        except subprocess.CalledProcessError as e:
-            raise SkipTest('dbus-launch exited with error %s' % e.returncode)
-        for line in output.splitlines():
-            line = line.decode('utf-8')  # assume for now.. could parse $LANG
-            mobj = cls._re_assign.match(line)
-            if not mobj:
-                continue
-            key = mobj.group(1)
-            value = mobj.group(2)
-            if value.startswith('"') or value.startswith("'"):
-                value = value[1:-1]
-            if key == 'DBUS_SESSION_BUS_ADDRESS':
-                dbusx.BUS_SESSION = value
-                os.environ['DBUS_SESSION_BUS_ADDRESS'] = value
-            elif key == 'DBUS_SESSION_BUS_PID':
-                cls._bus_daemon_pid = int(value)
+            cls._bus_router = dbusx.router.Router()
+            cls._bus_router.start()
+            address, pid = cls._bus_router.address, None
+        except RuntimeError as e:
+            raise SkipTest('dbus-launch failed: %s' % e)
+        dbusx.BUS_SESSION = address
+        os.environ['DBUS_SESSION_BUS_ADDRESS'] = address
+        cls._bus_daemon_pid = pid
         cls._have_bus_daemon = True
 
     @classmethod
     def teardown_class(cls):
         if not cls._have_bus_daemon:
             return
-        os.kill(cls._bus_daemon_pid, signal.SIGTERM)
+        if cls._bus_router is not None:
+            cls._bus_router.stop()
+        else:
+            dbusx.util.stop_bus_daemon(cls._bus_daemon_pid)
         gc.collect()
 
 
@@ -0,0 +1,169 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import os
+import sys
+import tempfile
+import multiprocessing
+
+import dbusx
+import dbusx.bench
+import dbusx.bench.memory
+import dbusx.bench.loadgen
+import dbusx.bench.endtoend
+import dbusx.bench.marshalling
+from dbusx.test import UnitTest, assert_raises
+
+
+class TestCompare(object):
+
+    def test_compare(self):
+        baseline = { 'a': {'usecs': 10.0}, 'b': {'usecs': 10.0} }
+        results = { 'a': {'usecs': 10.5}, 'b': {'usecs': 12.0},
+                    'c': {'usecs': 1.0} }
+        regressions = dbusx.bench.compare(results, baseline, 'usecs', 0.1)
+        assert regressions == [('b', 10.0, 12.0)]
+
+    def test_compare_higher_is_better(self):
+        baseline = { 'a': {'ops': 100.0} }
+        results = { 'a': {'ops': 80.0} }
+        regressions = dbusx.bench.compare(results, baseline, 'ops', 0.1, True)
+        assert regressions == [('a', 100.0, 80.0)]
+
+    def test_histogram(self):
+        hist = dbusx.bench.histogram([1e-6, 3e-6, 100e-6, 150e-6])
+        assert hist == [(1, 1), (2, 0), (4, 1), (8, 0), (16, 0), (32, 0),
+                        (64, 0), (128, 1), (256, 1)]
+        assert dbusx.bench.histogram([]) == []
+
+
+class TestStartBus(object):
+
+    def check_bus(self, router=True, process=False):
+        address, stop = dbusx.bench.start_bus(router=router, process=process)
+        try:
+            connection = dbusx.Connection(address)
+            reply = connection.call_method(dbusx.SERVICE_DBUS,
+                            dbusx.PATH_DBUS, dbusx.INTERFACE_DBUS,
+                            'GetConnectionUnixProcessID', 's',
+                            (dbusx.SERVICE_DBUS,))
+            connection.close()
+        finally:
+            stop()
+        return reply.args[0]
+
+    def test_daemon(self):
+        assert self.check_bus(router=False) != os.getpid()
+
+    def test_router_thread(self):
+        assert self.check_bus() == os.getpid()
+
+    def test_router_process(self):
+        assert self.check_bus(process=True) != os.getpid()
+
+
+class TestMarshalling(object):
+
+    def test_run_case(self):
+        results = dbusx.bench.marshalling.run_case('integers', 'iu', (1, 2),
+                                                   min_time=0.01)
+        names = [result['name'] for result in results]
+        assert names == ['integers.set_args', 'integers.args']
+        for result in results:
+            assert result['signature'] == 'iu'
+            assert result['size'] > 8
+            assert result['usecs'] > 0
+            assert result['ops'] > 0
+            assert result['mbytes'] > 0
+            assert 'peak_bytes' in result
+            assert 'retained_bytes' in result
+
+    def test_main(self):
+        fd, fname = tempfile.mkstemp()
+        os.close(fd)
+        argv = sys.argv
+        sys.argv = ['marshalling', '-k', 'object_path', '-m', '0.01',
+                    '-o', fname]
+        try:
+            dbusx.bench.marshalling.main()
+            results = dbusx.bench.load_results(fname)
+        finally:
+            sys.argv = argv
+            os.unlink(fname)
+        assert sorted(results) == ['object_path.args', 'object_path.set_args']
+
+
+class TestEndToEnd(UnitTest):
+
+    def test_blocking(self):
+        results = dbusx.bench.endtoend.run_loop(dbusx.BUS_SESSION, 'blocking',
+                                                count=20, subscribers=2)
+        names = [result['name'] for result in results]
+        assert names == ['sync_call.blocking', 'async_call.blocking',
+                         'large_payload.blocking', 'signal_fanout.blocking']
+        for result in results:
+            assert result['ops'] > 0
+            assert result['p50'] is not None
+        assert results[-1]['count'] == 40
+
+
+class TestLoadGenerator(UnitTest):
+
+    def run_load(self, **config):
+        ready = multiprocessing.Queue()
+        server = multiprocessing.Process(target=dbusx.bench.loadgen.serve,
+                            args=(dbusx.BUS_SESSION,), kwargs={'ready': ready})
+        server.start()
+        try:
+            ready.get(timeout=30)
+            generator = dbusx.bench.loadgen.LoadGenerator(dbusx.BUS_SESSION,
+                                                          config=config)
+            return generator.run()
+        finally:
+            server.terminate()
+            server.join()
+
+    def test_closed_loop(self):
+        result = self.run_load(processes=2, concurrency=2, duration=0.2,
+                               reply_size=100)
+        assert result['sent'] > 0
+        assert result['replies'] == result['sent']
+        assert result['errors'] == 0
+        assert result['server_calls'] == result['sent']
+        assert result['client_cpu'] > 0
+        assert result['latency'][50] is not None
+
+    def test_open_loop(self):
+        result = self.run_load(rate=200, open_loop=True, duration=0.2)
+        # Calls are sent on a schedule that is fixed at the start, so the
+        # rate is an upper bound however late the client gets to run.
+        assert 0 < result['sent'] <= 200 * 0.2 + 1
+        assert result['replies'] == result['sent']
+
+    def test_open_loop_requires_rate(self):
+        assert_raises(ValueError, dbusx.bench.loadgen.LoadGenerator,
+                      dbusx.BUS_SESSION, config={'open_loop': True})
+
+
+class TestMemory(UnitTest):
+
+    def test_workloads(self):
+        results = dbusx.bench.memory.run(dbusx.BUS_SESSION, 500, samples=2)
+        names = [result['name'] for result in results]
+        assert names == [cls.name for cls in dbusx.bench.memory.workloads]
+        for result in results:
+            assert dbusx.bench.memory.check(result) == []
+
+    def test_check(self):
+        result = { 'name': 'foo', 'count': 1000, 'python_growth': 10000,
+                   'rss_growth': None }
+        assert dbusx.bench.memory.check(result, python_slack=1000,
+                                        python_per_op=1.0) != []
+        assert dbusx.bench.memory.check(result, python_slack=10000) == []
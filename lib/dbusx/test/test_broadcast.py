@@ -0,0 +1,138 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import time
+import shutil
+import tempfile
+
+import dbusx
+import dbusx.loop
+from dbusx.test import UnitTest, assert_raises
+
+PATH_TELEMETRY = '/telemetry'
+IFACE_TELEMETRY = 'org.example.Telemetry'
+
+
+class TestBroadcaster(UnitTest):
+
+    need_dbus = False
+
+    @classmethod
+    def setup_class(cls):
+        super(TestBroadcaster, cls).setup_class()
+        cls.tmpdir = tempfile.mkdtemp()
+
+    @classmethod
+    def teardown_class(cls):
+        shutil.rmtree(cls.tmpdir)
+        super(TestBroadcaster, cls).teardown_class()
+
+    def setup_method(self, method=None):
+        self.loop = dbusx.loop.EventLoop()
+        self.broadcaster = dbusx.Broadcaster('unix:tmpdir=%s' % self.tmpdir,
+                                             self.loop, max_queue=64*1024,
+                                             grace=0)
+        self.subscribers = []
+
+    def teardown_method(self, method=None):
+        for subscriber in self.subscribers:
+            subscriber.close()
+        self.broadcaster.close()
+
+    def run_until(self, condition, timeout=5):
+        end_time = time.time() + timeout
+        while not condition() and time.time() < end_time:
+            self.loop.run_once(0.1)
+        assert condition()
+
+    def subscribe(self, loop=True):
+        subscriber = dbusx.Connection(self.broadcaster.address, register=False)
+        received = []
+        def filter(connection, message):
+            if message.type == dbusx.MESSAGE_TYPE_SIGNAL \
+                        and message.interface == IFACE_TELEMETRY:
+                received.append(message.args)
+                return True
+            return False
+        subscriber.add_filter(filter)
+        if loop:
+            subscriber.set_loop(self.loop)
+        self.subscribers.append(subscriber)
+        # Complete the authentication with a round trip.
+        replies = []
+        message = dbusx.Message.method_call(None, '/', dbusx.INTERFACE_PEER,
+                                            'Ping')
+        subscriber.send_with_reply(message, replies.append)
+        while not replies:
+            if not loop:
+                subscriber.read_write_dispatch(0.01)
+            self.loop.run_once(0.01)
+        return subscriber, received
+
+    def test_fanout(self):
+        subscribers = [self.subscribe() for i in range(3)]
+        assert self.broadcaster.emit(PATH_TELEMETRY, IFACE_TELEMETRY,
+                                     'Sample', 'd', (1.5,)) == 3
+        self.run_until(lambda: all(received for _, received in subscribers))
+        for subscriber, received in subscribers:
+            assert received == [(1.5,)]
+        assert self.broadcaster.sent == 3
+
+    def test_shared_message(self):
+        subscribers = [self.subscribe() for i in range(2)]
+        message = dbusx.Message.signal(None, PATH_TELEMETRY, IFACE_TELEMETRY,
+                                       'Sample', 'd', (2.5,))
+        for i in range(10):
+            self.broadcaster.send(message)
+        self.run_until(lambda: all(len(received) == 10
+                                   for _, received in subscribers))
+
+    def test_no_subscribers(self):
+        assert self.broadcaster.emit(PATH_TELEMETRY, IFACE_TELEMETRY,
+                                     'Sample') == 0
+
+    def test_evict_slow_subscriber(self):
+        fast, fast_received = self.subscribe()
+        slow, slow_received = self.subscribe(loop=False)
+        payload = b'x' * 16384
+        count = 0
+        while self.broadcaster.evicted == 0 and count < 1000:
+            self.broadcaster.emit(PATH_TELEMETRY, IFACE_TELEMETRY, 'Data',
+                                  'ay', (payload,))
+            count += 1
+            self.loop.run_once(0)
+        assert self.broadcaster.evicted == 1
+        assert len(self.broadcaster.connections) == 1
+        self.run_until(lambda: len(fast_received) == count)
+
+    def test_drop_before_evict(self):
+        self.broadcaster.grace = 60
+        slow, slow_received = self.subscribe(loop=False)
+        payload = b'x' * 16384
+        for i in range(200):
+            self.broadcaster.emit(PATH_TELEMETRY, IFACE_TELEMETRY, 'Data',
+                                  'ay', (payload,))
+            self.loop.run_once(0)
+        assert self.broadcaster.dropped > 0
+        assert self.broadcaster.evicted == 0
+        # Once the subscriber catches up, it receives signals again.
+        def catch_up(count):
+            end_time = time.time() + 5
+            while len(slow_received) + self.broadcaster.dropped < count \
+                        and time.time() < end_time:
+                slow.read_write_dispatch(0.01)
+                self.loop.run_once(0)
+            assert len(slow_received) + self.broadcaster.dropped == count
+        catch_up(200)
+        self.broadcaster.emit(PATH_TELEMETRY, IFACE_TELEMETRY, 'Data',
+                              'ay', (payload,))
+        dropped = self.broadcaster.dropped
+        catch_up(201)
+        assert self.broadcaster.dropped == dropped
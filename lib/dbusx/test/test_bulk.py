@@ -0,0 +1,84 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import os
+import threading
+
+import dbusx
+import dbusx.bulk
+from dbusx.test import UnitTest, assert_raises
+from nose import SkipTest
+
+IFACE_BULK = 'org.example.Bulk'
+
+
+class BulkService(dbusx.Object):
+
+    @dbusx.Method(IFACE_BULK, args_in='h', args_out='ut')
+    def Checksum(self, fd):
+        data = dbusx.bulk.unpack(fd)
+        return len(data), sum(bytearray(data[::4096]))
+
+    @dbusx.Method(IFACE_BULK, args_in='u', args_out='h')
+    def Download(self, size):
+        return dbusx.bulk.pack(b'x' * size)
+
+
+class TestBulk(UnitTest):
+
+    @classmethod
+    def setup_class(cls):
+        if not dbusx.bulk.available():
+            raise SkipTest('sealed memfds are not supported')
+        super(TestBulk, cls).setup_class()
+
+    def test_pack_unpack(self):
+        data = os.urandom(100000)
+        fd = dbusx.bulk.pack(data)
+        assert isinstance(fd, dbusx.UnixFD)
+        view = dbusx.bulk.unpack(fd)
+        fd.close()
+        assert view.readonly
+        assert view.tobytes() == data
+        assert dbusx.bulk.unpack(dbusx.bulk.pack(b'')).tobytes() == b''
+
+    def test_sealed(self):
+        fd = dbusx.bulk.pack(b'foo')
+        assert_raises(OSError, os.write, fd.fileno(), b'bar')
+        assert_raises(OSError, os.ftruncate, fd.fileno(), 0)
+        rfd, wfd = os.pipe()
+        try:
+            assert_raises(dbusx.Error, dbusx.bulk.unpack, rfd)
+        finally:
+            os.close(rfd)
+            os.close(wfd)
+
+    def test_call(self):
+        service = dbusx.Connection(dbusx.BUS_SESSION)
+        service.publish(BulkService(), '/bulk')
+        client = dbusx.Connection(dbusx.BUS_SESSION)
+        assert client.can_send_fds
+        stopped = []
+        def serve():
+            while not stopped:
+                service.read_write_dispatch(0.05)
+        thread = threading.Thread(target=serve)
+        thread.start()
+        try:
+            data = b'\x01' * (4*1024*1024)
+            proxy = client.proxy(service.unique_name, '/bulk')
+            assert proxy.Checksum(dbusx.bulk.pack(data)) == (len(data), 1024)
+            fd = proxy.Download(1000)
+            assert dbusx.bulk.unpack(fd).tobytes() == b'x' * 1000
+        finally:
+            stopped.append(True)
+            thread.join()
+            client.close()
+            service.close()
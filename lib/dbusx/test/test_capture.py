@@ -0,0 +1,162 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import os
+import shutil
+import tempfile
+
+import dbusx
+import dbusx.capture
+from dbusx.test import UnitTest, assert_raises
+
+
+def make_signal(member, serial, args=('foo',)):
+    message = dbusx.Message(dbusx.MESSAGE_TYPE_SIGNAL, path='/foo',
+                            interface='org.example.Foo', member=member)
+    message.serial = serial
+    message.set_args('s', args)
+    return message
+
+
+class TestMarshal(UnitTest):
+
+    need_dbus = False
+
+    def test_round_trip(self):
+        message = make_signal('Foo', 10)
+        data = message.marshal()
+        assert isinstance(data, bytes)
+        copy = dbusx.Message.demarshal(data)
+        assert isinstance(copy, dbusx.Message)
+        assert copy.type == dbusx.MESSAGE_TYPE_SIGNAL
+        assert copy.serial == 10
+        assert copy.member == 'Foo'
+        assert copy.args == ('foo',)
+
+    def test_demarshal_buffer(self):
+        data = make_signal('Foo', 10).marshal()
+        copy = dbusx.MessageBase.demarshal(memoryview(data))
+        assert type(copy) is dbusx.MessageBase
+        assert copy.args == ('foo',)
+
+    def test_demarshal_invalid(self):
+        data = make_signal('Foo', 10).marshal()
+        assert_raises(ValueError, dbusx.Message.demarshal, data[:10])
+        assert_raises(ValueError, dbusx.Message.demarshal, b'x' * 100)
+
+
+class CaptureTest(UnitTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(CaptureTest, cls).setup_class()
+        cls.tmpdir = tempfile.mkdtemp()
+
+    @classmethod
+    def teardown_class(cls):
+        super(CaptureTest, cls).teardown_class()
+        shutil.rmtree(cls.tmpdir)
+
+    def tempname(self):
+        fd, filename = tempfile.mkstemp(dir=self.tmpdir)
+        os.close(fd)
+        return filename
+
+
+class TestCaptureFile(CaptureTest):
+
+    need_dbus = False
+
+    def write_capture(self, count, index_interval=4, close=True):
+        self.filename = self.tempname()
+        writer = dbusx.capture.CaptureWriter(self.filename, index_interval)
+        for i in range(count):
+            message = make_signal('Foo%d' % (i % 2), i+1, ('msg%d' % i,))
+            writer.write_message(message, timestamp=1000.0 + i)
+        if close:
+            writer.close()
+        else:
+            writer.flush()
+
+    def test_read(self):
+        self.write_capture(10)
+        reader = dbusx.capture.CaptureReader(self.filename)
+        assert len(reader) == 10
+        messages = list(reader)
+        assert len(messages) == 10
+        for i, (timestamp, message) in enumerate(messages):
+            assert timestamp == 1000.0 + i
+            assert message.serial == i+1
+            assert message.args == ('msg%d' % i,)
+        reader.close()
+
+    def test_read_empty(self):
+        self.write_capture(0)
+        reader = dbusx.capture.CaptureReader(self.filename)
+        assert len(reader) == 0
+        assert list(reader) == []
+        reader.close()
+
+    def test_read_without_trailer(self):
+        self.write_capture(10, close=False)
+        with open(self.filename, 'ab') as fout:
+            fout.write(b'\1\0\0')  # partial record
+        reader = dbusx.capture.CaptureReader(self.filename)
+        assert len(reader) == 10
+        assert [m.serial for t, m in reader] == list(range(1, 11))
+        reader.close()
+
+    def test_time_range(self):
+        self.write_capture(10)
+        reader = dbusx.capture.CaptureReader(self.filename)
+        messages = list(reader.messages(start=1002.0, end=1005.0))
+        assert [m.serial for t, m in messages] == [3, 4, 5]
+        reader.close()
+
+    def test_filter(self):
+        self.write_capture(10)
+        reader = dbusx.capture.CaptureReader(self.filename)
+        messages = list(reader.messages(member='Foo1'))
+        assert [m.serial for t, m in messages] == [2, 4, 6, 8, 10]
+        assert len(list(reader.messages(type=dbusx.MESSAGE_TYPE_SIGNAL))) == 10
+        assert len(list(reader.messages(type=dbusx.MESSAGE_TYPE_ERROR))) == 0
+        reader.close()
+
+    def test_not_a_capture(self):
+        self.filename = self.tempname()
+        with open(self.filename, 'wb') as fout:
+            fout.write(b'x' * 100)
+        assert_raises(ValueError, dbusx.capture.CaptureReader, self.filename)
+
+
+class TestCapture(CaptureTest):
+
+    def test_capture(self):
+        self.filename = self.tempname()
+        capture = dbusx.capture.Capture(dbusx.BUS_SESSION, self.filename,
+                        rules=["type='signal',interface='org.example.Foo'"])
+        capture.start()
+        conn = dbusx.Connection(dbusx.BUS_SESSION)
+        sender = conn.unique_name
+        for i in range(5):
+            message = dbusx.Message(dbusx.MESSAGE_TYPE_SIGNAL, path='/foo',
+                            interface='org.example.Foo', member='Bar')
+            message.set_args('i', (i,))
+            conn.send(message)
+        conn.flush()
+        capture.run(timeout=5, count=5)
+        capture.stop()
+        conn.close()
+        reader = dbusx.capture.CaptureReader(self.filename)
+        messages = [m for t, m in reader]
+        assert len(messages) == 5
+        assert [m.args for m in messages] == [(i,) for i in range(5)]
+        assert all(m.sender == sender for m in messages)
+        reader.close()
@@ -0,0 +1,225 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import mmap
+import time
+import threading
+
+import dbusx
+import dbusx.channel
+import dbusx.loop
+from dbusx.channel import Channel, ChannelService
+from dbusx.test import UnitTest, assert_raises
+from nose import SkipTest
+
+
+def signal(i, data=''):
+    return dbusx.Message.signal(None, '/foo', 'com.example.Foo', 'Bar',
+                                'us', (i, data))
+
+
+class TestRing(UnitTest):
+
+    need_dbus = False
+
+    def test_put_get(self):
+        buf = bytearray(4096)
+        tx, rx = dbusx.Ring(buf), dbusx.Ring(buf)
+        assert tx.capacity == 4096 - 192
+        assert tx.put([signal(i) for i in range(10)]) == 10
+        assert rx.used == tx.used > 0
+        messages = rx.get(4)
+        assert [m.args[0] for m in messages] == [0, 1, 2, 3]
+        assert isinstance(messages[0], dbusx.MessageBase)
+        assert not isinstance(messages[0], dbusx.Message)
+        messages = rx.get(cls=dbusx.Message)
+        assert [m.args[0] for m in messages] == list(range(4, 10))
+        assert isinstance(messages[0], dbusx.Message)
+        assert messages[0].serial > 0
+        assert rx.used == 0
+        assert rx.get() == []
+
+    def test_wrap(self):
+        buf = bytearray(4096)
+        tx, rx = dbusx.Ring(buf), dbusx.Ring(buf)
+        received = []
+        for i in range(100):
+            assert tx.put([signal(i, 'x' * (i * 7 % 500))]) == 1
+            received += rx.get()
+        assert [m.args[0] for m in received] == list(range(100))
+
+    def test_wrap_empty(self):
+        # A record that does not fit before the end of an empty ring must
+        # still be put, even if it does not fit together with the wrap.
+        buf = bytearray(192 + 1024)
+        tx, rx = dbusx.Ring(buf), dbusx.Ring(buf)
+        assert tx.put([signal(0, 'x' * 287)]) == 1
+        assert tx.used == 384
+        assert len(rx.get()) == 1
+        # The record is 784 bytes. It only fits once the consumer has moved
+        # past the wrap marker, which get() does without returning anything.
+        second = signal(1, 'x' * 687)
+        assert tx.put([second]) == 0
+        assert rx.get() == []
+        assert tx.put([second]) == 1
+        assert tx.used == 784
+        messages = rx.get()
+        assert [m.args[0] for m in messages] == [1]
+
+    def test_full(self):
+        buf = bytearray(4096)
+        tx, rx = dbusx.Ring(buf), dbusx.Ring(buf)
+        count = tx.put([signal(i, 'x' * 100) for i in range(100)])
+        assert 0 < count < 100
+        assert tx.put([signal(0, 'x' * 100)]) == 0
+        assert len(rx.get()) == count
+        assert tx.put([signal(0, 'x' * 100)]) == 1
+
+    def test_errors(self):
+        assert_raises(ValueError, dbusx.Ring, bytearray(100))
+        assert_raises(BufferError, dbusx.Ring, b'x' * 4096)
+        ring = dbusx.Ring(bytearray(4096))
+        assert_raises(ValueError, ring.put, [signal(0, 'x' * 5000)])
+        assert_raises(TypeError, ring.put, [None])
+        assert_raises(TypeError, ring.get, 1, int)
+        buf = bytearray(4096)
+        buf[0] = 16
+        assert_raises(dbusx.Error, dbusx.Ring(buf).get)
+
+
+class TestChannel(UnitTest):
+
+    def setup_method(self, method=None):
+        self.accepted = []
+        self.service = dbusx.Connection(dbusx.BUS_SESSION)
+        self.service.publish(ChannelService(self.accepted.append),
+                             dbusx.channel.PATH_CHANNEL)
+        self.client = dbusx.Connection(dbusx.BUS_SESSION)
+        self.stopped = []
+        self.thread = threading.Thread(target=self.serve)
+        self.thread.start()
+
+    def teardown_method(self, method=None):
+        self.stopped.append(True)
+        self.thread.join()
+        self.client.close()
+        self.service.close()
+
+    def serve(self):
+        while not self.stopped:
+            self.service.read_write_dispatch(0.05)
+
+    def open(self, **kwargs):
+        return Channel.open(self.client, self.service.unique_name, **kwargs)
+
+    def exchange(self, channel):
+        peer = self.accepted[0]
+        for i in range(1000):
+            channel.send(signal(i))
+        assert channel.flush(5)
+        received = []
+        while len(received) < 1000:
+            messages = peer.receive(5)
+            assert messages
+            received += messages
+        assert [m.args[0] for m in received] == list(range(1000))
+        peer.send(signal(1000))
+        assert peer.flush(5)
+        messages = channel.receive(5)
+        assert messages[0].args == (1000, '')
+        assert messages[0].member == 'Bar'
+
+    def test_shared(self):
+        if not dbusx.channel.available():
+            raise SkipTest('shared memory channels are not supported')
+        channel = self.open(size=200000)
+        assert channel.shared
+        assert channel.size % mmap.PAGESIZE == 0
+        assert 200000 <= channel.size < 200000 + mmap.PAGESIZE
+        assert self.accepted[0].shared
+        assert self.accepted[0].id == channel.id
+        self.exchange(channel)
+
+    def test_fallback(self):
+        channel = self.open(shared=False)
+        assert not channel.shared
+        assert not self.accepted[0].shared
+        self.exchange(channel)
+
+    def test_shared_serial(self):
+        if not dbusx.channel.available():
+            raise SkipTest('shared memory channels are not supported')
+        channel = self.open()
+        assert channel.shared
+        message = signal(0)
+        channel.send(message)
+        assert channel.flush(5)
+        assert self.accepted[0].receive(5)[0].args == (0, '')
+        assert not message.serial
+
+    def test_fallback_serial(self):
+        channel = self.open(shared=False)
+        message = signal(0)
+        channel.send(message)
+        assert channel.flush(5)
+        assert self.accepted[0].receive(5)[0].args == (0, '')
+        assert not message.serial
+
+    def test_backpressure(self):
+        if not dbusx.channel.available():
+            raise SkipTest('shared memory channels are not supported')
+        channel = self.open(size=4096)
+        for i in range(200):
+            channel.send(signal(i, 'x' * 100))
+        assert channel.backlog > 0
+        assert not channel.flush(0.1)
+        received = []
+        while len(received) < 200:
+            received += self.accepted[0].receive(5)
+            channel.flush(0)
+        assert channel.backlog == 0
+        assert [m.args[0] for m in received] == list(range(200))
+
+    def test_close(self):
+        channel = self.open()
+        peer = self.accepted[0]
+        channel.close()
+        assert channel.closed
+        assert_raises(dbusx.Error, channel.send, signal(0))
+        end_time = time.time() + 5
+        while not peer.closed and time.time() < end_time:
+            time.sleep(0.01)
+        assert peer.closed
+
+    def test_event_loop(self):
+        loop = dbusx.loop.EventLoop()
+        accepted, received = [], []
+        service = dbusx.Connection(dbusx.BUS_SESSION)
+        service.set_loop(loop)
+        service.publish(ChannelService(accepted.append),
+                        dbusx.channel.PATH_CHANNEL)
+        client = dbusx.Connection(dbusx.BUS_SESSION)
+        client.set_loop(loop)
+        try:
+            channel = Channel.open(client, service.unique_name,
+                                   callback=received.append)
+            accepted[0].callback = lambda message: \
+                        accepted[0].send(signal(message.args[0] + 1))
+            for i in range(100):
+                channel.send(signal(2*i))
+            end_time = time.time() + 5
+            while len(received) < 100 and time.time() < end_time:
+                loop.run_once(0.1)
+            assert [m.args[0] for m in received] == \
+                        [2*i + 1 for i in range(100)]
+            channel.close()
+        finally:
+            client.close()
+            service.close()
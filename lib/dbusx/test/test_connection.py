@@ -8,10 +8,14 @@
 
 from __future__ import print_function
 
+import gc
+import sys
 import six
 import time
+import weakref
 import dbusx
 import dbusx.test
+from nose import SkipTest
 
 
 class TestConnection(dbusx.test.UnitTest):
@@ -126,3 +130,343 @@ class TestConnection(dbusx.test.UnitTest):
         assert len(replies) == 1
         reply = replies[0]
         assert reply.args == (name,)
+
+    def test_connect_to_signal_args(self):
+        # The arguments are decoded once and shared by all callbacks.
+        conn = self.Connection(dbusx.BUS_SESSION)
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        received = []
+        def callback(message, args):
+            received.append(args)
+        for i in range(3):
+            conn.connect_to_signal(other.unique_name, '/foo',
+                                   'org.example.Foo', 'Changed', callback,
+                                   args=True)
+        conn.connect_to_signal(other.unique_name, '/foo', 'org.example.Foo',
+                               'Changed', received.append)
+        msg = dbusx.Message.signal(conn.unique_name, '/foo',
+                                   'org.example.Foo', 'Changed')
+        msg.set_args('su', ('foo', 10))
+        other.send(msg)
+        other.flush()
+        end_time = time.time() + 5.0
+        while len(received) < 4 and time.time() < end_time:
+            if conn.loop:
+                conn.loop.run_once(0.1)
+            else:
+                conn.read_write_dispatch(0.1)
+        assert len(received) == 4
+        assert received[0] == ('foo', 10)
+        assert received[1] is received[0]
+        assert received[2] is received[0]
+        assert received[3].member == 'Changed'
+        other.close()
+        conn.close()
+
+    def test_remove_filter_equal(self):
+        # A bound method is a new object every time it is accessed, but
+        # compares equal. Removing it must remove the filter that was added.
+        class Handler(object):
+            def filter(self, connection, message):
+                return False
+        conn = self.Connection(dbusx.BUS_SESSION)
+        handler = Handler()
+        conn.add_filter(handler.filter)
+        conn.remove_filter(handler.filter)
+        assert dbusx.test.assert_raises(dbusx.Error, conn.remove_filter,
+                                        handler.filter)
+        conn.close()
+
+    def test_send_with_reply_result_refcount(self):
+        # The value returned by a reply callback must not be leaked.
+        conn = self.Connection(dbusx.BUS_SESSION)
+        result = object()
+        refcount = sys.getrefcount(result)
+        replies = []
+        def callback(message):
+            replies.append(message)
+            return result
+        for i in range(10):
+            msg = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL,
+                            destination=dbusx.SERVICE_DBUS, path=dbusx.PATH_DBUS,
+                            interface=dbusx.INTERFACE_DBUS, member='GetId')
+            conn.send_with_reply(msg, callback)
+        end_time = time.time() + 5.0
+        while len(replies) < 10 and time.time() < end_time:
+            if conn.loop:
+                if conn.dispatch_status == dbusx.DISPATCH_DATA_REMAINS:
+                    conn.dispatch()
+                else:
+                    conn.loop.run_once(0.1)
+            else:
+                conn.read_write_dispatch(0.1)
+        assert len(replies) == 10
+        assert sys.getrefcount(result) == refcount
+        conn.close()
+
+    def test_close_with_pending_call(self):
+        # Closing a connection cancels outstanding pending calls and
+        # releases their callbacks.
+        class Callback(object):
+            def __call__(self, message):
+                pass
+        conn = self.Connection(dbusx.BUS_SESSION)
+        callback = Callback()
+        ref = weakref.ref(callback)
+        # Call a method on ourselves that is never replied to.
+        msg = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL,
+                            destination=conn.unique_name, path='/foo',
+                            interface='org.example.Foo', member='Bar')
+        conn.send_with_reply(msg, callback)
+        del callback
+        conn.close()
+        gc.collect()
+        assert ref() is None
+
+    def test_send_with_reply_timeout(self):
+        # Calls that are not replied to get a locally generated error when
+        # their timeout expires. The timeouts are kept by the connection and
+        # share a single event loop timer. The built-in libdbus loop does
+        # not expire the timeouts of asynchronous calls.
+        conn = self.Connection(dbusx.BUS_SESSION)
+        if not conn.loop:
+            conn.close()
+            raise SkipTest('needs an event loop')
+        # This connection never reads its messages.
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        replies = []
+        def callback(message):
+            replies.append(message)
+        for i in range(100):
+            msg = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL,
+                                destination=other.unique_name, path='/foo',
+                                interface='org.example.Foo', member='Bar')
+            conn.send_with_reply(msg, callback, 0.1 + i/1000.0)
+        assert conn.timeouts == 100
+        end_time = time.time() + 5.0
+        while len(replies) < 100 and time.time() < end_time:
+            if conn.dispatch_status == dbusx.DISPATCH_DATA_REMAINS:
+                conn.dispatch()
+            else:
+                conn.loop.run_once(0.1)
+        assert len(replies) == 100
+        for reply in replies:
+            assert reply.type == dbusx.MESSAGE_TYPE_ERROR
+            assert reply.error_name == dbusx.ERROR_NO_REPLY
+        assert conn.timeouts == 0
+        other.close()
+        conn.close()
+
+    def test_dispatch_budget(self):
+        # With a dispatch budget, a burst of messages is dispatched in
+        # slices, and other event loop callbacks run in between.
+        conn = self.Connection(dbusx.BUS_SESSION)
+        if not conn.loop:
+            conn.close()
+            raise SkipTest('needs an event loop')
+        assert conn.dispatch_budget == 0
+        conn.dispatch_budget = 10
+        dbusx.test.assert_raises(ValueError, setattr, conn,
+                                 'dispatch_budget', -1)
+        received = []
+        delay = []
+        def filter(connection, message):
+            if message.member == 'Burst':
+                received.append(message)
+                if delay:
+                    time.sleep(delay[0])
+                return True
+            return False
+        conn.add_filter(filter)
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        def burst(count):
+            del received[:]
+            for i in range(count):
+                msg = dbusx.Message.signal(conn.unique_name, '/foo',
+                                           'org.example.Foo', 'Burst')
+                other.send(msg)
+            other.flush()
+            slices = []
+            end_time = time.time() + 5.0
+            while len(received) < count and time.time() < end_time:
+                count_before = len(received)
+                conn.loop.run_once(0.1)
+                slices.append(len(received) - count_before)
+            assert len(received) == count
+            return [size for size in slices if size]
+        slices = burst(100)
+        assert max(slices) <= 10
+        # With a time budget, a slice stops once the time is used up, and
+        # the rest is dispatched in later slices.
+        conn.dispatch_budget = 0
+        conn.dispatch_time = 0.02
+        assert conn.dispatch_time == 0.02
+        delay.append(0.01)
+        slices = burst(20)
+        assert max(slices) <= 2
+        assert len(slices) >= 10
+        conn.remove_filter(filter)
+        other.close()
+        conn.close()
+
+    def test_prioritize(self):
+        # Replies overtake signals that arrived before them.
+        conn = self.Connection(dbusx.BUS_SESSION)
+        assert not conn.prioritize
+        conn.prioritize = True
+        conn.dispatch_budget = 1
+        events = []
+        def filter(connection, message):
+            if message.member == 'Burst':
+                events.append('signal')
+                return True
+            return False
+        def callback(message):
+            events.append('reply')
+        conn.add_filter(filter)
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        for i in range(200):
+            msg = dbusx.Message.signal(conn.unique_name, '/foo',
+                                       'org.example.Foo', 'Burst')
+            other.send(msg)
+        other.flush()
+        time.sleep(0.2)
+        msg = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL,
+                            destination=dbusx.SERVICE_DBUS, path=dbusx.PATH_DBUS,
+                            interface=dbusx.INTERFACE_DBUS, member='GetId')
+        conn.send_with_reply(msg, callback)
+        conn.flush()
+        time.sleep(0.2)
+        end_time = time.time() + 5.0
+        while len(events) < 201 and time.time() < end_time:
+            if conn.loop:
+                conn.loop.run_once(0.1)
+            else:
+                conn.read_write_dispatch(0.1)
+        assert len(events) == 201
+        assert events.index('reply') < 200
+        assert conn.deferred == 0
+        # High priority signals are not held back.
+        conn.set_priority('org.example.Foo', dbusx.PRIORITY_HIGH)
+        dbusx.test.assert_raises(ValueError, conn.set_priority,
+                                 'org.example.Foo', 10)
+        other.send(dbusx.Message.signal(conn.unique_name, '/foo',
+                                        'org.example.Foo', 'Burst'))
+        other.flush()
+        end_time = time.time() + 5.0
+        while len(events) < 202 and time.time() < end_time:
+            if conn.loop:
+                conn.loop.run_once(0.1)
+            else:
+                conn.read_write_dispatch(0.1)
+        assert len(events) == 202
+        conn.set_priority('org.example.Foo', None)
+        conn.remove_filter(filter)
+        other.close()
+        conn.close()
+
+    def test_conflation(self):
+        # Only the newest of the undispatched signals is delivered.
+        conn = self.Connection(dbusx.BUS_SESSION)
+        conn.set_conflation('org.example.Foo', 'Level', dbusx.CONFLATE_ARG0)
+        dbusx.test.assert_raises(ValueError, conn.set_conflation,
+                                 'org.example.Foo', 'Level', 10)
+        events = []
+        members = []
+        def filter(connection, message):
+            if message.member in ('Level', 'Done'):
+                events.append(message.args)
+                members.append(message.member)
+                return True
+            return False
+        conn.add_filter(filter)
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        def wait(count):
+            end_time = time.time() + 5.0
+            while len(events) + conn.conflated < count \
+                        and time.time() < end_time:
+                if conn.loop:
+                    conn.loop.run_once(0.1)
+                else:
+                    conn.read_write_dispatch(0.1)
+        for i in range(100):
+            for name in ('a', 'b'):
+                msg = dbusx.Message.signal(conn.unique_name, '/foo',
+                                           'org.example.Foo', 'Level')
+                msg.set_args('su', (name, i))
+                other.send(msg)
+        msg = dbusx.Message.signal(conn.unique_name, '/foo',
+                                   'org.example.Foo', 'Done')
+        other.send(msg)
+        other.flush()
+        time.sleep(0.2)
+        wait(201)
+        assert len(events) + conn.conflated == 201
+        assert conn.conflated > 0
+        assert conn.deferred == 0
+        assert [args for args in events if args[:1] == ('a',)][-1] == ('a', 99)
+        assert [args for args in events if args[:1] == ('b',)][-1] == ('b', 99)
+        # Signals from the same sender are still delivered in order.
+        assert members[-1] == 'Done'
+        # A signal does not replace one that came before a signal that is
+        # still held back.
+        conflated = conn.conflated
+        del events[:], members[:]
+        for i, name in enumerate(('Level', 'Done', 'Level')):
+            msg = dbusx.Message.signal(conn.unique_name, '/foo',
+                                       'org.example.Foo', name)
+            if name == 'Level':
+                msg.set_args('su', ('a', 100 + i))
+            other.send(msg)
+        other.flush()
+        time.sleep(0.2)
+        wait(conflated + 3)
+        assert members == ['Level', 'Done', 'Level']
+        assert conn.deferred == 0
+        conn.set_conflation('org.example.Foo', 'Level', None)
+        conn.remove_filter(filter)
+        other.close()
+        conn.close()
+
+    def test_outgoing_limit(self):
+        # High priority messages overtake staged messages.
+        conn = self.Connection(dbusx.BUS_SESSION)
+        assert conn.outgoing_limit == 0
+        conn.outgoing_limit = 8192
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        received = []
+        def filter(connection, message):
+            if message.member in ('Bulk', 'Urgent'):
+                received.append(message.member)
+                return True
+            return False
+        other.add_filter(filter)
+        # libdbus writes right away if it can, so the queue only grows once
+        # the socket buffer is full.
+        count = 0
+        while count < 200 or not conn.staged and count < 10000:
+            msg = dbusx.Message.signal(other.unique_name, '/foo',
+                                       'org.example.Foo', 'Bulk', 's',
+                                       ('x' * 1024,))
+            conn.send(msg)
+            count += 1
+        assert conn.staged > 0
+        msg = dbusx.Message.signal(other.unique_name, '/foo',
+                                   'org.example.Foo', 'Urgent')
+        conn.send(msg, dbusx.PRIORITY_HIGH)
+        dbusx.test.assert_raises(ValueError, conn.send, msg, 10)
+        if conn.loop:
+            # The event loop queues staged messages as the queue drains.
+            end_time = time.time() + 5.0
+            while conn.staged and time.time() < end_time:
+                conn.loop.run_once(0.1)
+        conn.flush()
+        assert conn.staged == 0
+        end_time = time.time() + 5.0
+        while len(received) < count + 1 and time.time() < end_time:
+            other.read_write_dispatch(0.1)
+        assert len(received) == count + 1
+        assert received.index('Urgent') < count
+        other.remove_filter(filter)
+        other.close()
+        conn.close()
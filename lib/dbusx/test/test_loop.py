@@ -46,6 +46,22 @@ class UseLoop(object):
         super(UseLoop, cls).setup_class()
 
 
+# dbusx.loop (built-in) event loop
+
+def create_builtin_loop():
+    import dbusx.loop
+    return dbusx.loop.EventLoop()
+
+class TestConnectionWithBuiltinLoop(UseLoop, TestConnection):
+    create_loop = staticmethod(create_builtin_loop)
+
+class TestObjectWithBuiltinLoop(UseLoop, TestObject):
+    create_loop = staticmethod(create_builtin_loop)
+
+class TestWrappedObjectWithBuiltinLoop(UseLoop, TestWrappedObject):
+    create_loop = staticmethod(create_builtin_loop)
+
+
 # tulip (=pure Python) event loop
 
 def create_tulip_loop():
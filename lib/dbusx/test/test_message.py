@@ -6,6 +6,7 @@
 # Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
 # for a complete list.
 
+import os
 import six
 import math
 
@@ -506,6 +507,31 @@ class TestMessage(UnitTest):
                       nested_tuple(33,1))
         self._illegal_arg_value_test('a'*33+'i', nested_tuple(33,1))
 
+    def test_arg_unix_fd(self):
+        rfd, wfd = os.pipe()
+        try:
+            msg = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL)
+            msg.set_args('hh', (rfd, dbusx.UnixFD(wfd)))
+            args = msg.args
+            assert len(args) == 2
+            assert all(isinstance(arg, dbusx.UnixFD) for arg in args)
+            assert args[0].fileno() not in (rfd, wfd)
+            os.write(args[1].fileno(), b'foo')
+            assert os.read(rfd, 3) == b'foo'
+            fd = args[0].take()
+            assert_raises(ValueError, args[0].fileno)
+            os.close(fd)
+            args[1].close()
+            assert_raises(ValueError, msg.set_args, 'h', (args[1],))
+        finally:
+            os.close(rfd)
+            os.close(wfd)
+
+    def test_arg_unix_fd_invalid_type(self):
+        self._illegal_arg_type_test('h', (None,))
+        self._illegal_arg_type_test('h', ('foo',))
+        self._illegal_arg_type_test('h', (1.0,))
+
     def test_arg_variant(self):
         self._arg_test('v', (('i', 10),))
         self._arg_test('v', (('ai', [1,2,3]),))
@@ -8,8 +8,11 @@
 
 from __future__ import print_function
 
+import gc
 import time
+import weakref
 import dbusx
+import dbusx.object
 from dbusx.test import UnitTest, assert_raises
 
 SERVICE_FOO = 'org.example.FooService'
@@ -104,6 +107,11 @@ class TestObject(UnitTest):
         assert reply.signature == 's'
         assert reply.args == ('foo',)
 
+    def test_invalid_signature(self):
+        reply = self.conn.call_method(self.conn.unique_name, PATH_FOO,
+                                      IFACE_FOO, 'EchoString', 'i', (1,))
+        assert reply.error_name == dbusx.ERROR_INVALID_ARGS
+
     def test_call_method_no_signatures(self):
         proxy = self.proxy
         assert proxy.EchoAnything() == None
@@ -223,3 +231,371 @@ class TestWrappedObject(UnitTest):
     def test_call_method(self):
         proxy = self.proxy
         assert proxy.EchoString('foo') == 'foo'
+
+
+class ShapedService(dbusx.Object):
+
+    Level = dbusx.Signal(IFACE_FOO, args='su', coalesce=0.1, key=0)
+    Tick = dbusx.Signal(IFACE_FOO, args='u', rate=20, burst=2)
+    PropertiesChanged = dbusx.Signal(dbusx.INTERFACE_PROPERTIES,
+                            args='sa{sv}as', coalesce=0.1, key=0,
+                            merge=dbusx.object.merge_properties_changed)
+    Reset = dbusx.Signal(IFACE_FOO)
+
+
+class TestSignalShaping(UnitTest):
+
+    def setup_method(self, method=None):
+        import dbusx.loop
+        self.loop = dbusx.loop.EventLoop()
+        self.conn = dbusx.Connection(dbusx.BUS_SESSION)
+        self.conn.set_loop(self.loop)
+        self.obj = ShapedService()
+        self.conn.publish(self.obj, PATH_FOO)
+        self.client = dbusx.Connection(dbusx.BUS_SESSION)
+        self.received = []
+        self.client.add_filter(self.filter)
+
+    def teardown_method(self, method=None):
+        self.client.close()
+        self.conn.close()
+
+    def filter(self, connection, message):
+        if message.type == dbusx.MESSAGE_TYPE_SIGNAL \
+                    and message.sender == self.conn.unique_name:
+            self.received.append((time.time(), message.member, message.args))
+            return True
+        return False
+
+    def run(self, secs, count=None):
+        end_time = time.time() + secs
+        while time.time() < end_time:
+            self.loop.run_once(0.01)
+            self.client.read_write_dispatch(0.01)
+            if count is not None and len(self.received) >= count:
+                break
+
+    def test_coalesce(self):
+        for i in range(100):
+            self.obj.Level.emit('a', i, destination=self.client.unique_name)
+            self.obj.Level.emit('b', i, destination=self.client.unique_name)
+        self.run(0.5)
+        args = [args for _, member, args in self.received]
+        assert args == [('a', 99), ('b', 99)]
+
+    def test_merge_properties_changed(self):
+        dest = self.client.unique_name
+        self.obj.PropertiesChanged.emit(IFACE_FOO, {'x': ('u', 1)}, ['y'],
+                                        destination=dest)
+        self.obj.PropertiesChanged.emit(IFACE_FOO, {'y': ('u', 2)}, ['z'],
+                                        destination=dest)
+        self.run(0.5, 1)
+        assert len(self.received) == 1
+        interface, changed, invalidated = self.received[0][2]
+        assert interface == IFACE_FOO
+        assert sorted(changed) == ['x', 'y']
+        assert invalidated == ['z']
+
+    def test_rate(self):
+        start = time.time()
+        for i in range(10):
+            self.obj.Tick.emit(i, destination=self.client.unique_name)
+        self.run(2.0, 1)
+        self.run(0.3)
+        # Two in the initial burst, then emissions are coalesced until the
+        # next token, so only the latest one is sent.
+        args = [args for _, member, args in self.received]
+        assert args == [(0,), (1,), (9,)]
+        assert self.received[-1][0] - start >= 0.04
+
+    def test_no_loop(self):
+        obj = ShapedService()
+        self.client.publish(obj, '/bar')
+        obj.Level.emit('a', 1, destination=self.conn.unique_name)
+        obj.Level.emit('a', 2, destination=self.conn.unique_name)
+        assert '_shapers' not in obj.__dict__
+        self.client.remove('/bar')
+
+
+class TestEmitter(UnitTest):
+
+    def test_emit_many(self):
+        sender = dbusx.Connection(dbusx.BUS_SESSION)
+        obj = ShapedService()
+        sender.publish(obj, PATH_FOO)
+        receivers = [dbusx.Connection(dbusx.BUS_SESSION) for i in range(3)]
+        received = []
+        def filter(connection, message):
+            if message.member == 'Level':
+                received.append((connection, message.args))
+                return True
+            return False
+        for receiver in receivers:
+            receiver.add_filter(filter)
+        # Without an event loop, shaped signals are sent right away.
+        obj.Level.emit_many([receiver.unique_name for receiver in receivers],
+                            'x', 1)
+        obj.Level.emit_batch([('y', 2), ('z', 3)], receivers[0].unique_name)
+        sender.flush()
+        end_time = time.time() + 5.0
+        while len(received) < 5 and time.time() < end_time:
+            for receiver in receivers:
+                receiver.read_write_dispatch(0.05)
+        assert len(received) == 5
+        for receiver in receivers:
+            assert (receiver, ('x', 1)) in received
+        assert [args for conn, args in received if conn is receivers[0]] \
+                    == [('x', 1), ('y', 2), ('z', 3)]
+        for receiver in receivers:
+            receiver.close()
+        sender.close()
+
+    def test_signal_binding(self):
+        obj = ShapedService()
+        assert ShapedService.Level.name == 'Level'
+        assert ShapedService.Level.instance is None
+        level = obj.Level
+        assert level.instance is obj
+        assert obj.Level is level
+        connection = dbusx.Connection(dbusx.BUS_SESSION)
+        connection.publish(obj, PATH_FOO)
+        assert obj.Level.emitter is level.emitter
+        other = ShapedService()
+        connection.publish(other, '/bar')
+        assert other.Level is not level
+        assert other.Level.emitter is not level.emitter
+        # A signal without a signature ignores its arguments.
+        obj.Reset.emit('foo')
+        obj.Reset.emit_batch([('foo',)])
+        connection.close()
+        # Binding a signal does not keep the object alive.
+        ref = weakref.ref(obj)
+        reset = obj.Reset
+        gc.disable()
+        try:
+            del obj, level
+            assert ref() is None
+        finally:
+            gc.enable()
+        assert reset.instance is None
+        assert_raises(TypeError, reset.emit)
+
+    def test_emit(self):
+        sender = dbusx.Connection(dbusx.BUS_SESSION)
+        receiver = dbusx.Connection(dbusx.BUS_SESSION)
+        received = []
+        def filter(connection, message):
+            if message.member == 'Changed':
+                received.append(message)
+                return True
+            return False
+        receiver.add_filter(filter)
+        emitter = dbusx.Emitter(PATH_FOO, IFACE_FOO, 'Changed', 'sa{su}')
+        assert emitter.path == PATH_FOO
+        assert emitter.signature == 'sa{su}'
+        assert_raises(TypeError, emitter.emit, [sender], ('foo',))
+        assert_raises(TypeError, emitter.emit, [sender], (1, {}))
+        # A failed call does not break the emitter.
+        assert_raises(TypeError, emitter.emit, [sender], ('foo', {'x': 'y'}))
+        emitter.emit([sender], ('foo', {'x': 1}), receiver.unique_name)
+        assert emitter.emitted == 1
+        sender.flush()
+        end_time = time.time() + 5.0
+        while not received and time.time() < end_time:
+            receiver.read_write_dispatch(0.1)
+        assert len(received) == 1
+        assert received[0].path == PATH_FOO
+        assert received[0].interface == IFACE_FOO
+        assert received[0].args == ('foo', {'x': 1})
+        del received[:]
+        emitter.emit_many([sender], [receiver.unique_name] * 3, ('a', {}))
+        emitter.emit_batch([sender], [('b', {}), ('c', {})],
+                           receiver.unique_name)
+        assert emitter.emitted == 6
+        assert_raises(ValueError, emitter.emit_many, [sender], ['-'],
+                      ('a', {}))
+        # Nothing is sent if one of the destinations is invalid.
+        assert_raises(ValueError, emitter.emit_many, [sender],
+                      [receiver.unique_name, '-'], ('x', {}))
+        assert emitter.emitted == 6
+        # Nothing is sent if one of the argument tuples is invalid.
+        assert_raises(TypeError, emitter.emit_batch, [sender],
+                      [('x', {}), ('y', 1)], receiver.unique_name)
+        assert emitter.emitted == 6
+        # The message can be returned marshalled, with or without sending.
+        data = emitter.emit([], ('m', {}), marshal=True)
+        message = dbusx.Message.demarshal(data)
+        assert message.args == ('m', {}) and message.serial == 1
+        assert emitter.emitted == 6
+        data = emitter.emit([sender], ('n', {}), None, True)
+        assert dbusx.Message.demarshal(data).args == ('n', {})
+        assert emitter.emitted == 7
+        sender.flush()
+        end_time = time.time() + 5.0
+        while len(received) < 5 and time.time() < end_time:
+            receiver.read_write_dispatch(0.1)
+        assert [message.args[0] for message in received] == \
+                    ['a', 'a', 'a', 'b', 'c']
+        assert len(set(message.serial for message in received)) == 5
+        assert_raises(ValueError, dbusx.Emitter, 'foo', IFACE_FOO, 'Changed')
+        assert_raises(ValueError, dbusx.Emitter, PATH_FOO, IFACE_FOO,
+                      'Changed', 'a')
+        receiver.close()
+        sender.close()
+
+
+class BatchService(dbusx.Object):
+
+    Tick = dbusx.Signal(IFACE_FOO, args='u', batch=0.05)
+    Other = dbusx.Signal(IFACE_FOO, args='u')
+    Only = dbusx.Signal(IFACE_FOO, args='u', batch=0.05, batch_only=True)
+
+
+class TestSignalBatching(UnitTest):
+
+    def setup_method(self, method=None):
+        import dbusx.loop
+        self.loop = dbusx.loop.EventLoop()
+        self.conn = dbusx.Connection(dbusx.BUS_SESSION)
+        self.conn.set_loop(self.loop)
+        self.obj = BatchService()
+        self.conn.publish(self.obj, PATH_FOO)
+        self.client = dbusx.Connection(dbusx.BUS_SESSION)
+        self.client.upgrade = False
+        self.envelopes = 0
+        self.client.add_filter(self.count)
+
+    def teardown_method(self, method=None):
+        self.client.close()
+        self.conn.close()
+
+    def count(self, connection, message):
+        if message.interface == dbusx.batch.INTERFACE_BATCH:
+            self.envelopes += 1
+        return False
+
+    def run(self, secs, done=None):
+        end_time = time.time() + secs
+        while time.time() < end_time:
+            self.loop.run_once(0.01)
+            self.client.read_write_dispatch(0.01)
+            if done is not None and done():
+                break
+
+    def test_batch(self):
+        name = self.conn.unique_name
+        ticks = []
+        batches = []
+        self.client.connect_to_signal(name, PATH_FOO, IFACE_FOO, 'Tick',
+                        lambda message: ticks.append(message.args[0]),
+                        batch=True)
+        self.client.connect_to_batch(name, PATH_FOO, IFACE_FOO, 'Tick',
+                                     batches.append)
+        key = (name, PATH_FOO, IFACE_FOO, 'Tick')
+        self.run(2.0, lambda: self.client._batches[key])
+        assert self.client._batches[key]
+        # A receiver that does not ask for batches gets normal signals.
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        plain = []
+        other.connect_to_signal(name, PATH_FOO, IFACE_FOO, 'Tick',
+                                lambda message: plain.append(message.args[0]))
+        other.flush()
+        self.run(0.2)
+        for i in range(20):
+            self.obj.Tick.emit(i)
+        self.run(2.0, lambda: len(ticks) == 20)
+        assert ticks == list(range(20))
+        assert sum(len(batch) for batch in batches) == 20
+        assert len(batches) == self.envelopes < 20
+        assert batches[0][0].sender == name
+        assert batches[0][0].member == 'Tick'
+        end_time = time.time() + 2.0
+        while len(plain) < 20 and time.time() < end_time:
+            other.read_write_dispatch(0.05)
+        assert plain == list(range(20))
+        other.close()
+
+    def test_batch_only(self):
+        name = self.conn.unique_name
+        batches = []
+        self.client.connect_to_batch(name, PATH_FOO, IFACE_FOO, 'Only',
+                                     batches.append)
+        key = (name, PATH_FOO, IFACE_FOO, 'Only')
+        self.run(2.0, lambda: self.client._batches[key])
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        plain = []
+        other.connect_to_signal(name, PATH_FOO, IFACE_FOO, 'Only',
+                                lambda message: plain.append(message.args[0]))
+        other.flush()
+        self.run(0.2)
+        for i in range(10):
+            self.obj.Only.emit(i)
+        self.run(2.0, lambda: sum(len(batch) for batch in batches) == 10)
+        assert [m.args[0] for batch in batches for m in batch] == \
+                    list(range(10))
+        # The signals are not sent normally while there are subscribers.
+        end_time = time.time() + 0.5
+        while time.time() < end_time:
+            other.read_write_dispatch(0.05)
+        assert plain == []
+        other.close()
+
+    def test_not_supported(self):
+        name = self.conn.unique_name
+        ticks = []
+        batches = []
+        self.client.connect_to_signal(name, PATH_FOO, IFACE_FOO, 'Other',
+                        lambda message: ticks.append(message.args[0]),
+                        batch=True)
+        self.client.connect_to_batch(name, PATH_FOO, IFACE_FOO, 'Other',
+                                     batches.append)
+        key = (name, PATH_FOO, IFACE_FOO, 'Other')
+        self.run(1.0)
+        assert self.client._batches[key] is False
+        for i in range(5):
+            self.obj.Other.emit(i)
+        self.run(2.0, lambda: len(ticks) == 5)
+        assert ticks == list(range(5))
+        assert [len(batch) for batch in batches] == [1] * 5
+        assert self.envelopes == 0
+
+    def test_disconnect_from_batch(self):
+        name = self.conn.unique_name
+        ticks = []
+        batches = []
+        self.client.connect_to_signal(name, PATH_FOO, IFACE_FOO, 'Tick',
+                        lambda message: ticks.append(message.args[0]),
+                        batch=True)
+        self.client.connect_to_batch(name, PATH_FOO, IFACE_FOO, 'Tick',
+                                     batches.append)
+        key = (name, PATH_FOO, IFACE_FOO, 'Tick')
+        self.run(2.0, lambda: self.client._batches[key])
+        batcher = self.obj._batchers[(IFACE_FOO, 'Tick')]
+        assert len(batcher.subscribers) == 1
+        self.client.disconnect_from_batch(*key)
+        assert key not in self.client._batches
+        self.run(2.0, lambda: not batcher.subscribers)
+        assert not batcher.subscribers
+        # The signal handler now gets the signals normally.
+        for i in range(5):
+            self.obj.Tick.emit(i)
+        self.run(2.0, lambda: len(ticks) == 5)
+        assert ticks == list(range(5))
+        assert batches == []
+        assert self.envelopes == 0
+
+    def test_subscriber_gone(self):
+        name = self.conn.unique_name
+        self.client.connect_to_batch(name, PATH_FOO, IFACE_FOO, 'Tick',
+                                     lambda messages: None)
+        key = (name, PATH_FOO, IFACE_FOO, 'Tick')
+        self.run(2.0, lambda: self.client._batches[key])
+        batcher = self.obj._batchers[(IFACE_FOO, 'Tick')]
+        assert len(batcher.subscribers) == 1
+        # A receiver that leaves the bus is forgotten.
+        self.client.close()
+        end_time = time.time() + 2.0
+        while batcher.subscribers and time.time() < end_time:
+            self.loop.run_once(0.01)
+        assert not batcher.subscribers
+        self.client = dbusx.Connection(dbusx.BUS_SESSION)
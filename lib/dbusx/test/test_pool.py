@@ -0,0 +1,144 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import os
+import time
+import multiprocessing
+
+import dbusx
+from dbusx.pool import WorkerPool
+from dbusx.test import UnitTest
+
+SERVICE_POOL = 'org.example.Pool'
+IFACE_POOL = 'org.example.Pool'
+PATH_POOL = '/pool'
+
+
+class PoolService(dbusx.Object):
+
+    @dbusx.Method(IFACE_POOL, args_in='d', args_out='u')
+    def Pid(self, delay):
+        time.sleep(delay)
+        return os.getpid()
+
+    @dbusx.Method(IFACE_POOL)
+    def Exit(self):
+        os._exit(1)
+
+    @dbusx.Method(IFACE_POOL, args_in='d', args_out='uu')
+    def Sockets(self, delay):
+        time.sleep(delay)
+        fds = os.listdir('/proc/self/fd')
+        links = []
+        for fd in fds:
+            try:
+                links.append(os.readlink('/proc/self/fd/%s' % fd))
+            except OSError:
+                pass
+        return os.getpid(), len([link for link in links
+                                 if link.startswith('socket:')])
+
+    @dbusx.Method(IFACE_POOL, args_out='s')
+    def BusId(self):
+        reply = self.connection.call_method(dbusx.SERVICE_DBUS,
+                        dbusx.PATH_DBUS, dbusx.INTERFACE_DBUS, 'GetId')
+        return reply.args[0]
+
+
+def _setup(connection):
+    connection.publish(PoolService(), PATH_POOL)
+
+
+def _run_pool(address, queue):
+    pool = WorkerPool(SERVICE_POOL, _setup, workers=3, address=address)
+    pool.start()
+    queue.put([worker.pid for worker in pool.workers])
+    pool.loop.run_forever()
+
+
+class TestWorkerPool(UnitTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(TestWorkerPool, cls).setup_class()
+        # Spawn rather than fork the front, because the test process may
+        # have a router thread.
+        context = multiprocessing.get_context('spawn')
+        queue = context.Queue()
+        cls.front = context.Process(target=_run_pool,
+                                    args=(dbusx.BUS_SESSION, queue))
+        cls.front.start()
+        cls.pids = queue.get(timeout=30)
+
+    @classmethod
+    def teardown_class(cls):
+        cls.front.terminate()
+        cls.front.join()
+        super(TestWorkerPool, cls).teardown_class()
+
+    def setup_method(self, method=None):
+        self.client = dbusx.Connection(dbusx.BUS_SESSION)
+
+    def teardown_method(self, method=None):
+        self.client.close()
+
+    def call(self, method, signature=None, args=None):
+        return self.client.call_method(SERVICE_POOL, PATH_POOL, IFACE_POOL,
+                                       method, signature, args)
+
+    def test_calls(self):
+        replies = []
+        for i in range(30):
+            message = dbusx.Message.method_call(SERVICE_POOL, PATH_POOL,
+                                        IFACE_POOL, 'Pid', 'd', (0.02,))
+            self.client.send_with_reply(message, replies.append)
+        end_time = time.time() + 10
+        while len(replies) < 30 and time.time() < end_time:
+            self.client.read_write_dispatch(0.1)
+        assert len(replies) == 30
+        pids = set(reply.args[0] for reply in replies)
+        assert len(pids) > 1
+        assert self.front.pid not in pids
+        owner = self.client.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                        dbusx.INTERFACE_DBUS, 'GetNameOwner',
+                                        's', (SERVICE_POOL,)).args[0]
+        assert set(reply.sender for reply in replies) == set([owner])
+
+    def test_errors(self):
+        reply = self.call('Foo')
+        assert reply.error_name == dbusx.ERROR_UNKNOWN_METHOD
+        reply = self.call('Pid', 's', ('foo',))
+        assert reply.error_name == dbusx.ERROR_INVALID_ARGS
+
+    def test_worker_exit(self):
+        reply = self.call('Exit')
+        assert reply.error_name == dbusx.ERROR_FAILED
+        for i in range(10):
+            reply = self.call('Pid', 'd', (0,))
+            assert reply.type == dbusx.MESSAGE_TYPE_METHOD_RETURN
+        # A replacement worker does not inherit the socket of the front.
+        if not os.path.isdir('/proc/self/fd'):
+            return
+        replies = []
+        for i in range(9):
+            message = dbusx.Message.method_call(SERVICE_POOL, PATH_POOL,
+                                        IFACE_POOL, 'Sockets', 'd', (0.05,))
+            self.client.send_with_reply(message, replies.append)
+        end_time = time.time() + 10
+        while len(replies) < 9 and time.time() < end_time:
+            self.client.read_write_dispatch(0.1)
+        assert len(set(reply.args[0] for reply in replies)) == 3
+        assert set(reply.args[1] for reply in replies) == set([1])
+
+    def test_worker_calls(self):
+        busid = self.client.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                        dbusx.INTERFACE_DBUS, 'GetId').args
+        for i in range(5):
+            assert self.call('BusId').args == busid
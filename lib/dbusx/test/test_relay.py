@@ -0,0 +1,158 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import time
+import threading
+
+import dbusx
+from dbusx.relay import Relay
+from dbusx.test import UnitTest, assert_raises
+
+IFACE_RELAY = 'org.example.Relay'
+PATH_RELAY = '/relay'
+
+
+class RelayService(dbusx.Object):
+
+    @dbusx.Method(IFACE_RELAY, args_in='s', args_out='ss')
+    def Echo(self, value):
+        return value, self.message.sender
+
+    @dbusx.Method(IFACE_RELAY)
+    def Fail(self):
+        self.error(dbusx.ERROR_NOT_SUPPORTED)
+
+    Tick = dbusx.Signal(IFACE_RELAY, args='u')
+
+
+class TestRelay(UnitTest):
+
+    def setup_method(self, method=None):
+        self.service = dbusx.Connection(dbusx.BUS_SESSION)
+        self.object = RelayService()
+        self.service.publish(self.object, PATH_RELAY)
+        self.front = dbusx.Connection(dbusx.BUS_SESSION)
+        self.back = dbusx.Connection(dbusx.BUS_SESSION)
+        self.client = dbusx.Connection(dbusx.BUS_SESSION)
+        # Do not probe the front for a direct connection.
+        self.client.upgrade = False
+        self.relay = Relay(self.front, self.back, self.service.unique_name)
+        self.stopped = []
+        self.thread = threading.Thread(target=self.serve)
+        self.thread.start()
+
+    def teardown_method(self, method=None):
+        self.stopped.append(True)
+        self.thread.join()
+        for connection in (self.client, self.back, self.front, self.service):
+            connection.close()
+
+    def serve(self):
+        while not self.stopped:
+            for connection in (self.service, self.front, self.back):
+                connection.read_write_dispatch(0.01)
+
+    def call(self, method, signature=None, args=None):
+        return self.client.call_method(self.front.unique_name, PATH_RELAY,
+                                       IFACE_RELAY, method, signature, args)
+
+    def test_call(self):
+        self.relay.start()
+        reply = self.call('Echo', 's', ('foo',))
+        assert reply.type == dbusx.MESSAGE_TYPE_METHOD_RETURN
+        # The service sees the relay as the caller.
+        assert reply.args == ('foo', self.back.unique_name)
+        assert reply.sender == self.front.unique_name
+        reply = self.call('Fail')
+        assert reply.type == dbusx.MESSAGE_TYPE_ERROR
+        assert reply.error_name == dbusx.ERROR_NOT_SUPPORTED
+        assert self.relay.relayed == 4
+        assert self.relay.pending == 0
+
+    def test_stop(self):
+        self.relay.start()
+        self.relay.stop()
+        reply = self.call('Echo', 's', ('foo',))
+        assert reply.type == dbusx.MESSAGE_TYPE_ERROR
+        assert self.relay.relayed == 0
+
+    def test_rules(self):
+        self.relay.add_rule(type=dbusx.MESSAGE_TYPE_METHOD_CALL,
+                            path_namespace='/relay', member='Echo')
+        self.relay.start()
+        reply = self.call('Echo', 's', ('foo',))
+        assert reply.type == dbusx.MESSAGE_TYPE_METHOD_RETURN
+        reply = self.call('Fail')
+        assert reply.type == dbusx.MESSAGE_TYPE_ERROR
+        assert reply.error_name != dbusx.ERROR_NOT_SUPPORTED
+        self.relay.clear_rules()
+        reply = self.call('Fail')
+        assert reply.error_name == dbusx.ERROR_NOT_SUPPORTED
+        assert_raises(ValueError, self.relay.add_rule,
+                      dbusx.MESSAGE_TYPE_METHOD_RETURN)
+
+    def test_signal(self):
+        self.relay.add_rule(type=dbusx.MESSAGE_TYPE_SIGNAL,
+                            interface=IFACE_RELAY)
+        self.check_signal()
+
+    def test_signal_without_type(self):
+        self.relay.add_rule(interface=IFACE_RELAY)
+        self.check_signal()
+        reply = self.call('Echo', 's', ('foo',))
+        assert reply.args == ('foo', self.back.unique_name)
+
+    def check_signal(self):
+        self.relay.start()
+        received = []
+        def callback(message):
+            received.append((message.sender, message.args))
+        self.client.connect_to_signal(self.back.unique_name, PATH_RELAY,
+                                      IFACE_RELAY, 'Tick', callback)
+        self.client.flush()
+        time.sleep(0.1)
+        self.object.Tick.emit(10)
+        end_time = time.time() + 5
+        while not received and time.time() < end_time:
+            self.client.read_write_dispatch(0.05)
+        assert received == [(self.back.unique_name, (10,))]
+        assert self.relay.relayed == 1
+
+    def test_staging(self):
+        # Relayed signals are staged on the target, and relayed calls
+        # overtake them.
+        target = dbusx.Connection(dbusx.BUS_SESSION)
+        target.outgoing_limit = 8192
+        relay = Relay(self.front, target)
+        try:
+            count = 0
+            while count < 200 or not target.staged and count < 10000:
+                signal = dbusx.Message.signal(None, PATH_RELAY, IFACE_RELAY,
+                                              'Bulk', 's', ('x' * 1024,))
+                assert relay.forward(self.front, signal)
+                count += 1
+            assert target.staged > 0
+            staged = target.staged
+            call = dbusx.Message.method_call(self.service.unique_name,
+                                PATH_RELAY, IFACE_RELAY, 'Echo', 's', ('foo',))
+            call.serial = 1
+            assert relay.forward(self.front, call)
+            assert target.staged == staged
+            assert relay.pending == 1
+            target.flush()
+            assert target.staged == 0
+        finally:
+            target.close()
+
+    def test_max_pending(self):
+        relay = Relay(self.front, self.back, max_pending=1)
+        assert relay.source is self.front
+        assert relay.target is self.back
+        assert_raises(ValueError, Relay, self.front, self.back, None, 0)
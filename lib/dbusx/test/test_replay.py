@@ -0,0 +1,103 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import os
+import time
+import shutil
+import tempfile
+
+import dbusx
+import dbusx.util
+import dbusx.replay
+import dbusx.capture
+from dbusx.test import UnitTest
+
+IFACE_FOO = 'org.example.Foo'
+
+
+class EchoService(dbusx.Object):
+
+    def __init__(self):
+        super(EchoService, self).__init__()
+        self.calls = []
+
+    @dbusx.Method(IFACE_FOO, args_in='s', args_out='s')
+    def EchoString(self, s):
+        self.calls.append(s)
+        return s
+
+
+class TestPercentiles(object):
+
+    def test_percentiles(self):
+        samples = list(range(1, 101))
+        result = dbusx.util.percentiles(samples, (50, 99, 100))
+        assert result == {50: 50, 99: 99, 100: 100}
+
+    def test_empty(self):
+        assert dbusx.util.percentiles([], (50,)) == {50: None}
+
+
+class TestReplay(UnitTest):
+
+    @classmethod
+    def setup_class(cls):
+        super(TestReplay, cls).setup_class()
+        cls.tmpdir = tempfile.mkdtemp()
+        cls.filename = os.path.join(cls.tmpdir, 'capture')
+        writer = dbusx.capture.CaptureWriter(cls.filename)
+        for i in range(10):
+            message = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL,
+                            serial=i+1, destination='org.example.Production',
+                            path='/foo', interface=IFACE_FOO,
+                            member='EchoString')
+            message.set_args('s', ('foo%d' % i,))
+            writer.write_message(message, 1000.0 + i*0.01)
+            reply = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_RETURN,
+                                  serial=100+i, reply_serial=i+1)
+            writer.write_message(reply, 1000.0 + i*0.01 + 0.005)
+        writer.close()
+
+    @classmethod
+    def teardown_class(cls):
+        super(TestReplay, cls).teardown_class()
+        shutil.rmtree(cls.tmpdir)
+
+    def replay(self, **kwargs):
+        conn = dbusx.Connection(dbusx.BUS_SESSION)
+        service = EchoService()
+        conn.publish(service, '/foo')
+        reader = dbusx.capture.CaptureReader(self.filename)
+        destinations = { 'org.example.Production': conn.unique_name }
+        replay = dbusx.replay.Replay(conn, reader, destinations, **kwargs)
+        stats = replay.run()
+        reader.close()
+        conn.close()
+        return service, stats
+
+    def test_replay(self):
+        service, stats = self.replay()
+        assert service.calls == ['foo%d' % i for i in range(10)]
+        assert stats['sent'] == 10
+        assert stats['replies'] == 10
+        assert stats['errors'] == 0
+        # The original capture spans 90ms
+        assert stats['elapsed'] >= 0.09
+        assert stats['latency'][50] is not None
+
+    def test_replay_fast(self):
+        service, stats = self.replay(speed=None, concurrency=4)
+        assert sorted(service.calls) == ['foo%d' % i for i in range(10)]
+        assert stats['replies'] == 10
+
+    def test_replay_speedup(self):
+        service, stats = self.replay(speed=100.0)
+        assert stats['replies'] == 10
+        assert stats['elapsed'] < 0.09
@@ -0,0 +1,255 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import os
+import time
+
+import dbusx
+from dbusx.router import Router, MatchRule
+from dbusx.test import UnitTest, assert_raises
+
+
+class TestMatchRule(UnitTest):
+
+    need_dbus = False
+
+    def signal(self, sender=':1.1', path='/foo/bar', args=()):
+        message = dbusx.Message.signal(None, path, 'com.example.Foo', 'Bar',
+                                       's' * len(args), args)
+        message.sender = sender
+        return message
+
+    def test_parse(self):
+        rule = MatchRule("type='signal',interface='com.example.Foo'")
+        assert rule.keys == {'type': 'signal', 'interface': 'com.example.Foo'}
+        rule = MatchRule("arg0='it'\\''s'")
+        assert rule.keys == {'arg0': "it's"}
+        assert MatchRule('').keys == {}
+        assert MatchRule('type=signal').keys == {'type': 'signal'}
+
+    def test_parse_error(self):
+        assert_raises(ValueError, MatchRule, "type='foo'")
+        assert_raises(ValueError, MatchRule, "foo='bar'")
+        assert_raises(ValueError, MatchRule, "type='signal")
+        assert_raises(ValueError, MatchRule, "type='signal',type='error'")
+        assert_raises(ValueError, MatchRule, "path='/',path_namespace='/'")
+        assert_raises(ValueError, MatchRule, "arg64='foo'")
+        assert_raises(ValueError, MatchRule, "arg1namespace='foo'")
+
+    def test_equal(self):
+        assert MatchRule("type='signal',member='Bar'") == \
+                    MatchRule("member='Bar',type='signal'")
+        assert MatchRule("type='signal'") != MatchRule("type='error'")
+
+    def test_matches(self):
+        message = self.signal()
+        assert MatchRule('').matches(message)
+        assert MatchRule("type='signal',member='Bar'").matches(message)
+        assert not MatchRule("type='method_call'").matches(message)
+        assert MatchRule("sender=':1.1'").matches(message)
+        assert not MatchRule("sender=':1.2'").matches(message)
+        assert MatchRule("sender='com.example'").matches(message,
+                                                lambda name: ':1.1')
+        assert not MatchRule("sender='com.example'").matches(message,
+                                                lambda name: None)
+        assert MatchRule("path_namespace='/foo'").matches(message)
+        assert MatchRule("path_namespace='/'").matches(message)
+        assert not MatchRule("path_namespace='/fo'").matches(message)
+        assert not MatchRule("path='/foo'").matches(message)
+
+    def test_matches_args(self):
+        message = self.signal(args=('com.example.Foo', '/foo/bar'))
+        assert MatchRule("arg0='com.example.Foo'").matches(message)
+        assert not MatchRule("arg0='com.example'").matches(message)
+        assert MatchRule("arg0namespace='com.example'").matches(message)
+        assert MatchRule("arg1path='/foo/'").matches(message)
+        assert not MatchRule("arg1path='/foo'").matches(message)
+        assert not MatchRule("arg2='foo'").matches(message)
+
+
+class TestRouter(UnitTest):
+
+    need_dbus = False
+
+    def setup_method(self, method=None):
+        self.router = Router()
+        self.router.start()
+        self.connections = []
+
+    def teardown_method(self, method=None):
+        for connection in self.connections:
+            connection.close()
+        self.router.stop()
+
+    def connect(self):
+        connection = dbusx.Connection(self.router.address)
+        self.connections.append(connection)
+        return connection
+
+    def call_bus(self, connection, method, signature=None, args=None,
+                 interface=dbusx.INTERFACE_DBUS):
+        reply = connection.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                       interface, method, signature, args)
+        if reply.type == dbusx.MESSAGE_TYPE_ERROR:
+            return reply.error_name
+        return reply.args
+
+    def collect(self, connection, member, count, timeout=5):
+        messages = []
+        def filter(connection, message):
+            if message.type == dbusx.MESSAGE_TYPE_SIGNAL \
+                        and message.member == member:
+                messages.append(message)
+            return False
+        connection.add_filter(filter)
+        end_time = time.time() + timeout
+        while len(messages) < count and time.time() < end_time:
+            connection.read_write_dispatch(0.1)
+        connection.remove_filter(filter)
+        return messages
+
+    def test_hello(self):
+        client = self.connect()
+        assert client.unique_name.startswith(':')
+        assert self.call_bus(client, 'Hello') == dbusx.ERROR_FAILED
+        names = self.call_bus(client, 'ListNames')[0]
+        assert dbusx.SERVICE_DBUS in names
+        assert client.unique_name in names
+        assert self.call_bus(client, 'GetId') == (self.router.id,)
+
+    def test_driver_errors(self):
+        client = self.connect()
+        assert self.call_bus(client, 'Foo') == dbusx.ERROR_UNKNOWN_METHOD
+        assert self.call_bus(client, 'NameHasOwner') \
+                    == dbusx.ERROR_INVALID_ARGS
+        assert self.call_bus(client, 'RequestName', 'su', (':1.1', 0)) \
+                    == dbusx.ERROR_INVALID_ARGS
+        assert self.call_bus(client, 'AddMatch', 's', ("type='foo'",)) \
+                    == dbusx.ERROR_MATCH_RULE_INVALID
+        assert self.call_bus(client, 'RemoveMatch', 's', ("type='signal'",)) \
+                    == dbusx.ERROR_MATCH_RULE_NOT_FOUND
+        assert self.call_bus(client, 'Ping', interface=dbusx.INTERFACE_PEER) \
+                    == ()
+
+    def test_credentials(self):
+        client = self.connect()
+        assert self.call_bus(client, 'GetConnectionUnixProcessID', 's',
+                             (client.unique_name,)) == (os.getpid(),)
+        assert self.call_bus(client, 'GetConnectionUnixProcessID', 's',
+                             (dbusx.SERVICE_DBUS,)) == (os.getpid(),)
+        assert self.call_bus(client, 'GetConnectionUnixUser', 's',
+                             (client.unique_name,)) == (os.getuid(),)
+
+    def test_request_name(self):
+        first, second = self.connect(), self.connect()
+        name = 'com.example.Router'
+        assert self.call_bus(first, 'RequestName', 'su', (name, 0)) == (1,)
+        assert self.call_bus(first, 'RequestName', 'su', (name, 0)) == (4,)
+        assert self.call_bus(second, 'RequestName', 'su', (name, 4)) == (3,)
+        assert self.call_bus(second, 'RequestName', 'su', (name, 0)) == (2,)
+        assert self.call_bus(first, 'ListQueuedOwners', 's', (name,)) \
+                    == ([first.unique_name, second.unique_name],)
+        assert self.call_bus(first, 'GetNameOwner', 's', (name,)) \
+                    == (first.unique_name,)
+        assert self.call_bus(second, 'ReleaseName', 's', ('com.example.X',)) \
+                    == (2,)
+        assert self.call_bus(first, 'ReleaseName', 's', (name,)) == (1,)
+        assert self.call_bus(first, 'GetNameOwner', 's', (name,)) \
+                    == (second.unique_name,)
+        second.close()
+        end_time = time.time() + 5
+        while self.call_bus(first, 'NameHasOwner', 's', (name,))[0] \
+                    and time.time() < end_time:
+            time.sleep(0.01)
+        assert self.call_bus(first, 'GetNameOwner', 's', (name,)) \
+                    == dbusx.ERROR_NAME_HAS_NO_OWNER
+
+    def test_replace_name(self):
+        first, second = self.connect(), self.connect()
+        name = 'com.example.Router'
+        assert self.call_bus(first, 'RequestName', 'su', (name, 1)) == (1,)
+        assert self.call_bus(second, 'RequestName', 'su', (name, 2)) == (1,)
+        lost = self.collect(first, 'NameLost', 1)
+        assert lost[0].args == (name,)
+        assert self.call_bus(second, 'ListQueuedOwners', 's', (name,)) \
+                    == ([second.unique_name, first.unique_name],)
+
+    def test_name_owner_changed(self):
+        watcher, owner = self.connect(), self.connect()
+        rule = "type='signal',sender='%s',member='NameOwnerChanged'" \
+                    % dbusx.SERVICE_DBUS
+        self.call_bus(watcher, 'AddMatch', 's', (rule,))
+        name = 'com.example.Router'
+        self.call_bus(owner, 'RequestName', 'su', (name, 0))
+        unique_name = owner.unique_name
+        owner.close()
+        signals = self.collect(watcher, 'NameOwnerChanged', 3)
+        assert [m.args for m in signals] == \
+                    [(name, '', unique_name), (name, unique_name, ''),
+                     (unique_name, unique_name, '')]
+
+    def test_unicast(self):
+        class Echo(dbusx.Object):
+            @dbusx.Method('com.example.Echo', args_in='s', args_out='s')
+            def Echo(self, s):
+                return s
+        service, client = self.connect(), self.connect()
+        service.publish(Echo(), '/echo')
+        message = dbusx.Message.method_call(service.unique_name, '/echo',
+                                'com.example.Echo', 'Echo', 's', ('foo',))
+        replies = []
+        client.send_with_reply(message, replies.append)
+        end_time = time.time() + 5
+        while not replies and time.time() < end_time:
+            service.read_write_dispatch(0.01)
+            client.read_write_dispatch(0.01)
+        assert replies[0].args == ('foo',)
+        assert replies[0].sender == service.unique_name
+        reply = client.call_method('com.example.None', '/echo',
+                                   'com.example.Echo', 'Echo', 's', ('foo',))
+        assert reply.error_name == dbusx.ERROR_SERVICE_UNKNOWN
+
+    def test_multicast(self):
+        sender = self.connect()
+        receivers = [self.connect() for i in range(3)]
+        rule = "type='signal',interface='com.example.Foo'"
+        for receiver in receivers[:2]:
+            self.call_bus(receiver, 'AddMatch', 's', (rule,))
+        self.call_bus(receivers[0], 'RemoveMatch', 's', (rule,))
+        message = dbusx.Message.signal(None, '/foo', 'com.example.Foo',
+                                       'Bar', 's', ('bar',))
+        sender.send(message)
+        sender.flush()
+        assert len(self.collect(receivers[1], 'Bar', 1)) == 1
+        assert not self.collect(receivers[0], 'Bar', 1, 0.2)
+        assert not self.collect(receivers[2], 'Bar', 1, 0.2)
+
+    def test_monitor(self):
+        monitor, client = self.connect(), self.connect()
+        unique_name = monitor.unique_name
+        assert self.call_bus(monitor, 'BecomeMonitor', 'asu',
+                             (["member='ListNames'"], 0),
+                             interface=dbusx.INTERFACE_MONITORING) == ()
+        lost = self.collect(monitor, 'NameLost', 1)
+        assert lost[0].args == (unique_name,)
+        self.call_bus(client, 'GetId')
+        self.call_bus(client, 'ListNames')
+        messages = []
+        def filter(connection, message):
+            messages.append(message)
+            return True
+        monitor.add_filter(filter)
+        end_time = time.time() + 5
+        while not messages and time.time() < end_time:
+            monitor.read_write_dispatch(0.1)
+        assert messages[0].member == 'ListNames'
+        assert messages[0].sender == client.unique_name
+        assert self.call_bus(client, 'NameHasOwner', 's', (unique_name,)) \
+                    == (False,)
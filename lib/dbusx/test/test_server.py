@@ -0,0 +1,395 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import time
+import shutil
+import tempfile
+
+import dbusx
+import dbusx.loop
+from dbusx.test import UnitTest, assert_raises
+
+PATH_PEER = '/peer'
+IFACE_PEER = 'org.example.Peer'
+
+
+class PeerService(dbusx.Object):
+
+    def __init__(self, server):
+        super(PeerService, self).__init__()
+        self.server = server
+
+    @dbusx.Method(IFACE_PEER, args_in='s', args_out='s')
+    def Echo(self, s):
+        return s
+
+    @dbusx.Method(IFACE_PEER, args_out='u')
+    def Index(self):
+        return self.server.connections.index(self.connection)
+
+    Ping = dbusx.Signal(IFACE_PEER, args='s')
+
+
+class TestServer(UnitTest):
+
+    need_dbus = False
+
+    @classmethod
+    def setup_class(cls):
+        super(TestServer, cls).setup_class()
+        cls.tmpdir = tempfile.mkdtemp()
+
+    @classmethod
+    def teardown_class(cls):
+        shutil.rmtree(cls.tmpdir)
+        super(TestServer, cls).teardown_class()
+
+    def setup_method(self, method=None):
+        self.loop = dbusx.loop.EventLoop()
+        self.server = dbusx.Server('unix:tmpdir=%s' % self.tmpdir, self.loop)
+        self.service = PeerService(self.server)
+        self.server.publish(self.service, PATH_PEER)
+        self.clients = []
+
+    def teardown_method(self, method=None):
+        for client in self.clients:
+            client.close()
+        self.server.close()
+
+    def connect(self):
+        client = dbusx.Connection(self.server.address, register=False)
+        client.set_loop(self.loop)
+        self.clients.append(client)
+        return client
+
+    def run_until(self, condition, timeout=5):
+        end_time = time.time() + timeout
+        while not condition() and time.time() < end_time:
+            self.loop.run_once(0.1)
+        assert condition()
+
+    def test_properties(self):
+        server = self.server
+        assert server.connected
+        assert server.address.startswith('unix:')
+        assert isinstance(server.id, str) and server.id
+        assert server.loop is self.loop
+        server.disconnect()
+        assert not server.connected
+        assert server.address is None
+        assert server.id is None
+
+    def test_listen_error(self):
+        assert_raises(dbusx.Error, dbusx.Server, 'bogus:')
+
+    def test_call_method(self):
+        client = self.connect()
+        reply = client.call_method(None, PATH_PEER, IFACE_PEER, 'Echo',
+                                   's', ('foo',))
+        assert reply.type == dbusx.MESSAGE_TYPE_METHOD_RETURN
+        assert reply.args == ('foo',)
+        assert client.unique_name is None
+        assert len(self.server.connections) == 1
+
+    def test_multiple_clients(self):
+        clients = [self.connect() for i in range(3)]
+        for client in clients:
+            client.call_method(None, PATH_PEER, IFACE_PEER, 'Echo',
+                               's', ('foo',))
+        assert len(self.server.connections) == 3
+        for ix, client in enumerate(clients):
+            reply = client.call_method(None, PATH_PEER, IFACE_PEER, 'Index')
+            assert reply.args == (ix,)
+
+    def test_signal(self):
+        clients = [self.connect() for i in range(2)]
+        received = []
+        def filter(connection, message):
+            if message.type == dbusx.MESSAGE_TYPE_SIGNAL \
+                        and message.interface == IFACE_PEER:
+                received.append((connection, message.args))
+            return False
+        for client in clients:
+            client.add_filter(filter)
+            client.call_method(None, PATH_PEER, IFACE_PEER, 'Echo',
+                               's', ('foo',))
+        self.service.Ping.emit('bar')
+        self.run_until(lambda: len(received) == 2)
+        assert set(conn for conn, args in received) == set(clients)
+        assert all(args == ('bar',) for conn, args in received)
+
+    def test_client_disconnect(self):
+        client = self.connect()
+        client.call_method(None, PATH_PEER, IFACE_PEER, 'Echo', 's', ('foo',))
+        assert len(self.server.connections) == 1
+        connection = self.server.connections[0]
+        client.close()
+        self.run_until(lambda: not self.server.connections)
+        assert connection.address is None
+        assert connection not in self.service.connections
+
+    def test_server_close(self):
+        client = self.connect()
+        client.call_method(None, PATH_PEER, IFACE_PEER, 'Echo', 's', ('foo',))
+        self.server.close()
+        assert not self.server.connections
+        assert not self.service.connections
+        # A call that is outstanding when the peer disconnects fails.
+        replies = []
+        message = dbusx.Message.method_call(None, PATH_PEER, IFACE_PEER,
+                                            'Echo', 's', ('foo',))
+        client.send_with_reply(message, replies.append)
+        self.run_until(lambda: replies)
+        assert replies[0].type == dbusx.MESSAGE_TYPE_ERROR
+        assert replies[0].error_name == dbusx.ERROR_DISCONNECTED
+        assert replies[0].reply_serial == message.serial
+        assert_raises(dbusx.Error, client.call_method, None, PATH_PEER,
+                      IFACE_PEER, 'Echo', 's', ('foo',))
+
+    def test_connection_class(self):
+        class MyConnection(dbusx.Connection):
+            pass
+        class MyServer(dbusx.Server):
+            connection_class = MyConnection
+        server = MyServer('unix:tmpdir=%s' % self.tmpdir, self.loop)
+        try:
+            client = dbusx.Connection(server.address, register=False)
+            client.set_loop(self.loop)
+            self.clients.append(client)
+            self.run_until(lambda: server.connections)
+            assert isinstance(server.connections[0], MyConnection)
+        finally:
+            server.close()
+
+
+class RouteService(dbusx.Object):
+
+    def __init__(self, bus):
+        super(RouteService, self).__init__()
+        self.bus = bus
+        self.calls = []
+
+    @dbusx.Method(IFACE_PEER, args_out='s')
+    def Route(self):
+        return 'bus' if self.connection is self.bus else 'direct'
+
+    @dbusx.Method(IFACE_PEER, args_in='u', args_out='s')
+    def Record(self, i):
+        self.calls.append(i)
+        return self.Route()
+
+
+class TestUpgrade(UnitTest):
+
+    def setup_method(self, method=None):
+        self.loop = dbusx.loop.EventLoop()
+        self.service = dbusx.Connection(dbusx.BUS_SESSION)
+        self.service.set_loop(self.loop)
+        self.object = RouteService(self.service)
+        self.service.publish(self.object, PATH_PEER)
+        self.client = dbusx.Connection(dbusx.BUS_SESSION)
+        self.client.set_loop(self.loop)
+        self.client.upgrade = True
+        self.probes = 0
+        self.service.add_filter(self.count_probes)
+
+    def teardown_method(self, method=None):
+        self.client.close()
+        self.service.close()
+
+    def count_probes(self, connection, message):
+        if message.member == 'GetPeerAddress':
+            self.probes += 1
+        return False
+
+    def route(self):
+        reply = self.client.call_method(self.service.unique_name, PATH_PEER,
+                                        IFACE_PEER, 'Route')
+        return reply.args[0]
+
+    def run_until(self, condition, timeout=5):
+        end_time = time.time() + timeout
+        while not condition() and time.time() < end_time:
+            self.loop.run_once(0.1)
+        assert condition()
+
+    def peer(self):
+        return self.client._get_peer(self.service.unique_name)
+
+    def test_upgrade(self):
+        address = self.service.advertise()
+        assert address.startswith('unix:')
+        assert self.route() == 'bus'
+        self.run_until(lambda: self.peer() is not None)
+        assert self.route() == 'direct'
+        proxy = self.client.proxy(self.service.unique_name, PATH_PEER)
+        assert proxy.Route() == 'direct'
+
+    def test_upgrade_async(self):
+        self.service.advertise()
+        self.route()
+        self.run_until(lambda: self.peer() is not None)
+        replies = []
+        self.client.call_method(self.service.unique_name, PATH_PEER,
+                                IFACE_PEER, 'Route', callback=replies.append)
+        self.run_until(lambda: replies)
+        assert replies[0].args == ('direct',)
+
+    def test_upgrade_ordered(self):
+        # The service runs its own loop, so that calls can be left queued
+        # in the bus while the client switches to the direct connection.
+        loop = dbusx.loop.EventLoop()
+        service = dbusx.Connection(dbusx.BUS_SESSION)
+        service.set_loop(loop)
+        instance = RouteService(service)
+        service.publish(instance, PATH_PEER)
+        service.add_filter(self.count_probes)
+        service.advertise()
+        name = service.unique_name
+        replies = []
+        def call(i):
+            no_reply = i % 3 == 1
+            self.client.call_method(name, PATH_PEER, IFACE_PEER, 'Record',
+                            'u', (i,), no_reply=no_reply,
+                            callback=None if no_reply else replies.append)
+        def run_until(condition, timeout=5):
+            end_time = time.time() + timeout
+            while not condition() and time.time() < end_time:
+                loop.run_once(0.01)
+                self.loop.run_once(0.01)
+            assert condition()
+        try:
+            # Let the service answer the probe, but not the calls after it.
+            self.client._probe_peer(name)
+            self.client.flush()
+            self.probes = 0
+            while not self.probes:
+                loop.run_once(0.1)
+            service.flush()
+            for i in range(3):
+                call(i)
+            self.client.flush()
+            self.run_until(lambda: isinstance(self.client._peers.get(name),
+                                              dbusx.ConnectionBase))
+            for i in range(3, 6):
+                call(i)
+            run_until(lambda: len(instance.calls) == 6 and len(replies) == 4)
+            assert instance.calls == list(range(6))
+            assert [reply.args[0] for reply in replies] == ['bus'] * 4
+            run_until(lambda: self.client._get_peer(name) is not None)
+            call(6)
+            run_until(lambda: len(replies) == 5)
+            assert replies[4].args == ('direct',)
+        finally:
+            service.close()
+
+    def test_no_advertise(self):
+        assert self.route() == 'bus'
+        # Wait for the probe to fail.
+        self.client.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                dbusx.INTERFACE_DBUS, 'GetId')
+        self.loop.run_once(0.1)
+        assert self.route() == 'bus'
+        assert self.peer() is None
+
+    def test_no_advertise_cached(self):
+        self.client.upgrade_retry = 0
+        for i in range(5):
+            assert self.route() == 'bus'
+            self.loop.run_once(0.01)
+        assert self.probes == 1
+        assert self.client._peers[self.service.unique_name] is False
+
+    def test_upgrade_default(self):
+        client = dbusx.Connection(dbusx.BUS_SESSION)
+        assert not client.upgrade
+        client.close()
+
+    def test_upgrade_disabled(self):
+        self.service.advertise()
+        self.client.upgrade = False
+        for i in range(5):
+            assert self.route() == 'bus'
+            self.loop.run_once(0.01)
+        assert not self.client._peers
+
+    def test_fallback_on_disconnect(self):
+        self.service.advertise()
+        self.route()
+        self.run_until(lambda: self.peer() is not None)
+        self.service._upgrade_server.close()
+        self.run_until(lambda: self.service.unique_name
+                                    not in self.client._peers)
+        assert self.route() == 'bus'
+
+    def test_name_owner_changed(self):
+        name = 'com.github.geertj.dbusx.TestUpgrade'
+        def request_name(connection):
+            reply = connection.call_method(dbusx.SERVICE_DBUS,
+                            dbusx.PATH_DBUS, dbusx.INTERFACE_DBUS,
+                            'RequestName', 'su', (name, 4))
+            assert reply.args[0] == 1
+        request_name(self.service)
+        self.service.advertise()
+        route = lambda: self.client.call_method(name, PATH_PEER, IFACE_PEER,
+                                                'Route').args[0]
+        assert route() == 'bus'
+        self.run_until(lambda: self.client._get_peer(name) is not None)
+        assert route() == 'direct'
+        # A new owner of the name that does not advertise gets its calls
+        # over the bus.
+        self.service.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                 dbusx.INTERFACE_DBUS, 'ReleaseName', 's',
+                                 (name,))
+        other = dbusx.Connection(dbusx.BUS_SESSION)
+        other.set_loop(self.loop)
+        other.publish(RouteService(other), PATH_PEER)
+        try:
+            request_name(other)
+            # The first probe may be dropped when the name changes owner
+            # again, so keep calling.
+            self.run_until(lambda: route() == 'bus' and
+                           isinstance(self.client._owners.get(name), str))
+            assert self.client._owners[name] == other.unique_name
+            assert route() == 'bus'
+        finally:
+            other.close()
+
+    def test_publish_after_advertise(self):
+        self.service.advertise()
+        self.route()
+        self.run_until(lambda: self.peer() is not None)
+        self.service.publish(RouteService(self.service), '/peer2')
+        reply = self.client.call_method(self.service.unique_name, '/peer2',
+                                        IFACE_PEER, 'Route')
+        assert reply.args == ('direct',)
+        self.service.remove('/peer2')
+        reply = self.client.call_method(self.service.unique_name, '/peer2',
+                                        IFACE_PEER, 'Route')
+        assert reply.type == dbusx.MESSAGE_TYPE_ERROR
+
+    def test_signals_on_bus_only(self):
+        class Emitter(dbusx.Object):
+            Tick = dbusx.Signal(IFACE_PEER, args='s')
+        emitter = Emitter()
+        self.service.publish(emitter, '/emitter')
+        self.service.advertise()
+        self.route()
+        self.run_until(lambda: self.peer() is not None)
+        received = []
+        self.client.connect_to_signal(self.service.unique_name, '/emitter',
+                        IFACE_PEER, 'Tick', lambda m: received.append(m))
+        self.client.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                dbusx.INTERFACE_DBUS, 'GetId')
+        emitter.Tick.emit('x')
+        self.run_until(lambda: received)
+        for i in range(5):
+            self.loop.run_once(0.01)
+        assert len(received) == 1
@@ -0,0 +1,237 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+from __future__ import print_function
+
+import time
+import threading
+
+import dbusx
+import dbusx.loop
+from dbusx.wire import WireConnection, parse_address
+from dbusx.test import UnitTest, assert_raises
+
+IFACE_ECHO = 'org.example.Echo'
+
+
+class EchoService(dbusx.Object):
+
+    Echoed = dbusx.Signal(IFACE_ECHO, args='s')
+
+    @dbusx.Method(IFACE_ECHO, args_in='s', args_out='s')
+    def Echo(self, s):
+        self.Echoed.emit(s)
+        return s
+
+    @dbusx.Method(IFACE_ECHO, args_in='u', args_out='ay')
+    def Blob(self, size):
+        return b'x' * size
+
+    @dbusx.Method(IFACE_ECHO)
+    def Ignore(self):
+        raise dbusx.NoReply
+
+
+class TestWireMessages(UnitTest):
+
+    need_dbus = False
+
+    def test_marshal_many(self):
+        messages = []
+        for i in range(10):
+            message = dbusx.Message.signal(None, '/foo', 'com.example.Foo',
+                                           'Bar', 'u', (i,))
+            message.serial = i + 1
+            messages.append(message)
+        data = dbusx.Message.marshal_many(messages)
+        assert data == b''.join(m.marshal() for m in messages)
+        parsed, size = dbusx.Message.demarshal_many(data + data[:20])
+        assert size == len(data)
+        assert [m.args[0] for m in parsed] == list(range(10))
+        assert isinstance(parsed[0], dbusx.Message)
+        assert dbusx.Message.demarshal_many(data[:10]) == ([], 0)
+        assert_raises(ValueError, dbusx.Message.demarshal_many, b'x' * 16)
+        message = dbusx.Message.signal(None, '/foo', 'com.example.Foo', 'Bar')
+        assert_raises(ValueError, dbusx.Message.marshal_many, [message])
+        assert_raises(TypeError, dbusx.Message.marshal_many, [None])
+
+    def test_parse_address(self):
+        assert parse_address('unix:path=/tmp/foo%2cbar,guid=1234') == \
+                    [('unix', {'path': '/tmp/foo,bar', 'guid': '1234'})]
+        assert parse_address('unix:abstract=foo;tcp:host=a,port=1') == \
+                    [('unix', {'abstract': 'foo'}),
+                     ('tcp', {'host': 'a', 'port': '1'})]
+        assert_raises(ValueError, parse_address, 'foo')
+
+
+class TestWirePeer(UnitTest):
+
+    need_dbus = False
+
+    def setup_method(self, method=None):
+        # The server runs its own loop: authentication blocks the client.
+        self.server_loop = dbusx.loop.EventLoop()
+        self.server = dbusx.Server('unix:tmpdir=/tmp', self.server_loop)
+        self.server.publish(EchoService(), '/echo')
+        self.stopped = []
+        self.thread = threading.Thread(target=self.serve)
+        self.thread.start()
+        self.loop = dbusx.loop.EventLoop()
+        self.client = None
+
+    def teardown_method(self, method=None):
+        if self.client is not None:
+            self.client.close()
+        self.stopped.append(True)
+        self.thread.join()
+        self.server.close()
+
+    def serve(self):
+        while not self.stopped:
+            self.server_loop.run_once(0.05)
+
+    def connect(self, loop=True):
+        if self.client is not None:
+            self.client.close()
+        self.client = WireConnection(self.server.address)
+        if loop:
+            self.client.set_loop(self.loop)
+        return self.client
+
+    def test_call(self):
+        client = self.connect()
+        assert client.guid
+        assert client.unique_name is None
+        reply = client.call_method(None, '/echo', IFACE_ECHO, 'Echo', 's',
+                                   ('foo',))
+        assert reply.args == ('foo',)
+        reply = client.call_method(None, '/echo', IFACE_ECHO, 'Blob', 'u',
+                                   (1000000,))
+        assert reply.args == (b'x' * 1000000,)
+        reply = client.call_method(None, '/echo', IFACE_ECHO, 'Foo')
+        assert reply.error_name == dbusx.ERROR_UNKNOWN_METHOD
+
+    def test_call_without_loop(self):
+        client = self.connect(loop=False)
+        reply = client.call_method(None, '/echo', IFACE_ECHO, 'Echo', 's',
+                                   ('foo',))
+        assert reply.args == ('foo',)
+        # Without a timeout, read_write_dispatch() does not wait.
+        start = time.time()
+        assert client.read_write_dispatch()
+        assert time.time() - start < 1
+        reply = client.call_method(None, '/echo', IFACE_ECHO, 'Blob', 'u',
+                                   (1000000,))
+        assert reply.args == (b'x' * 1000000,)
+
+    def test_batch(self):
+        client = self.connect()
+        replies = []
+        for i in range(1000):
+            message = dbusx.Message.method_call(None, '/echo', IFACE_ECHO,
+                                                'Echo', 's', (str(i),))
+            client.send_with_reply(message, replies.append)
+        end_time = time.time() + 10
+        while len(replies) < 1000 and time.time() < end_time:
+            self.loop.run_once(0.1)
+        assert [r.args[0] for r in replies] == [str(i) for i in range(1000)]
+
+    def test_timeout(self):
+        client = self.connect()
+        reply = client.call_method(None, '/echo', IFACE_ECHO, 'Ignore',
+                                   timeout=0.2)
+        assert reply.error_name == dbusx.ERROR_NO_REPLY
+        client = self.connect(loop=False)
+        reply = client.call_method(None, '/echo', IFACE_ECHO, 'Ignore',
+                                   timeout=0.2)
+        assert reply.error_name == dbusx.ERROR_NO_REPLY
+
+    def test_proxy(self):
+        client = self.connect()
+        received = []
+        proxy = client.proxy(None, '/echo')
+        proxy.Echoed.connect(received.append)
+        assert proxy.Echo('foo') == 'foo'
+        end_time = time.time() + 5
+        while not received and time.time() < end_time:
+            self.loop.run_once(0.1)
+        assert received == ['foo']
+
+    def test_disconnect(self):
+        client = self.connect()
+        replies = []
+        message = dbusx.Message.method_call(None, '/echo', IFACE_ECHO, 'Echo',
+                                            's', ('foo',))
+        client.send_with_reply(message, replies.append)
+        client.close()
+        assert replies[0].error_name == dbusx.ERROR_DISCONNECTED
+        assert_raises(dbusx.Error, client.send, message.copy())
+
+
+class TestWireBus(UnitTest):
+
+    def serve(self, connection):
+        stopped = []
+        def serve():
+            while not stopped:
+                connection.read_write_dispatch(0.05)
+        thread = threading.Thread(target=serve)
+        thread.start()
+        def stop():
+            stopped.append(True)
+            thread.join()
+        return stop
+
+    def test_client(self):
+        service = dbusx.Connection(dbusx.BUS_SESSION)
+        service.publish(EchoService(), '/echo')
+        stop = self.serve(service)
+        client = WireConnection(dbusx.BUS_SESSION)
+        try:
+            assert client.unique_name.startswith(':')
+            reply = client.call_method(service.unique_name, '/echo',
+                                       IFACE_ECHO, 'Echo', 's', ('foo',))
+            assert reply.args == ('foo',)
+            assert reply.sender == service.unique_name
+            reply = client.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                       dbusx.INTERFACE_DBUS, 'ListNames')
+            assert client.unique_name in reply.args[0]
+            received = []
+            def callback(message, args):
+                received.append(args)
+            client.connect_to_signal(service.unique_name, '/echo',
+                                     IFACE_ECHO, 'Echoed', callback, args=True)
+            client.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                               dbusx.INTERFACE_DBUS, 'GetId')
+            client.call_method(service.unique_name, '/echo', IFACE_ECHO,
+                               'Echo', 's', ('bar',))
+            end_time = time.time() + 5
+            while not received and time.time() < end_time:
+                client.read_write_dispatch(0.1)
+            assert received == [('bar',)]
+        finally:
+            stop()
+            client.close()
+            service.close()
+
+    def test_service(self):
+        service = WireConnection(dbusx.BUS_SESSION)
+        service.publish(EchoService(), '/echo')
+        stop = self.serve(service)
+        client = dbusx.Connection(dbusx.BUS_SESSION)
+        try:
+            reply = client.call_method(service.unique_name, '/echo',
+                                       IFACE_ECHO, 'Echo', 's', ('foo',))
+            assert reply.args == ('foo',)
+            reply = client.call_method(service.unique_name, '/echo/foo',
+                                       IFACE_ECHO, 'Echo', 's', ('foo',))
+            assert reply.error_name == dbusx.ERROR_UNKNOWN_METHOD
+        finally:
+            stop()
+            client.close()
+            service.close()
@@ -6,7 +6,12 @@
 # Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
 # for a complete list.
 
+import os
+import re
+import math
+import signal
 import logging
+import subprocess
 
 
 def etree_indent(node, level=0):
@@ -63,3 +68,69 @@ def getLogger(name, context=None):
     logger = logging.getLogger(name)
     adapter = ContextLogger(logger, context)
     return adapter
+
+
+def check_output(command):
+    """Python 2.6 does not have a subprocess.check_output()."""
+    process = subprocess.Popen(command, stdout=subprocess.PIPE)
+    output, err = process.communicate()
+    status = process.poll()
+    if status:
+        raise RuntimeError('"%s" exited with status %s' % (command, status))
+    return output
+
+
+_re_assign = re.compile(r'^([a-zA-Z_][a-zA-Z0-9_]*)=' \
+                        r'''([^"']*?|'[^']*'|"([^"\\]|\\.)*");?$''')
+
+def start_bus_daemon(config_file=None):
+    """Start a private bus daemon using "dbus-launch".
+
+    The *config_file* argument specifies the daemon configuration. It
+    defaults to the permissive configuration that is used by the dbusx test
+    suite. The return value is an (address, pid) tuple.
+
+    An OSError is raised if dbus-launch is not available, and a RuntimeError
+    if it fails.
+    """
+    if config_file is None:
+        dirname = os.path.dirname(os.path.abspath(__file__))
+        config_file = os.path.join(dirname, 'test', 'dbus.conf')
+    output = check_output(['dbus-launch', '--config-file', config_file,
+                           '--sh-syntax'])
+    address = pid = None
+    for line in output.splitlines():
+        line = line.decode('utf-8')  # assume for now.. could parse $LANG
+        mobj = _re_assign.match(line)
+        if not mobj:
+            continue
+        key = mobj.group(1)
+        value = mobj.group(2)
+        if value.startswith('"') or value.startswith("'"):
+            value = value[1:-1]
+        if key == 'DBUS_SESSION_BUS_ADDRESS':
+            address = value
+        elif key == 'DBUS_SESSION_BUS_PID':
+            pid = int(value)
+    if address is None or pid is None:
+        raise RuntimeError('could not parse dbus-launch output')
+    return address, pid
+
+
+def stop_bus_daemon(pid):
+    """Stop a bus daemon that was started with :func:`start_bus_daemon`."""
+    os.kill(pid, signal.SIGTERM)
+
+
+def percentiles(samples, points=(50, 90, 99, 99.9)):
+    """Return a dictionary mapping each percentile in *points* to its value
+    in *samples*, using the nearest-rank method."""
+    samples = sorted(samples)
+    result = {}
+    for point in points:
+        if not samples:
+            result[point] = None
+            continue
+        rank = int(math.ceil(point / 100.0 * len(samples))) - 1
+        result[point] = samples[max(0, min(rank, len(samples)-1))]
+    return result
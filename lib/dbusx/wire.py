@@ -0,0 +1,550 @@
+#
+# This file is part of python-dbusx. Python-dbusx is free software
+# available under the terms of the MIT license. See the file "LICENSE" that
+# was provided together with this source file for the licensing terms.
+#
+# Copyright (c) 2012-2013 the python-dbusx authors. See the file "AUTHORS"
+# for a complete list.
+
+"""A connection that speaks the D-BUS wire protocol itself.
+
+:class:`WireConnection` does the authentication handshake and the message
+framing on its own socket, and only uses libdbus to marshal and demarshal
+messages. It does not take the connection lock, allocate a list node or
+run the validation of libdbus for every message that goes through the
+connection. Messages that are sent in the same loop iteration, or between
+two calls to :meth:`WireConnection.flush`, are marshalled into a single
+buffer and written with one system call. Reads fill a large buffer, and all
+complete messages in it are demarshalled in one go.
+
+The connection can be used with a :class:`dbusx.Server` or with a bus
+daemon. It supports the subset of the :class:`dbusx.Connection` API that is
+needed to call methods, publish objects, receive signals and use proxies:
+:meth:`~WireConnection.send`, :meth:`~WireConnection.send_with_reply`,
+:meth:`~WireConnection.call_method`, filters, object paths,
+:meth:`~WireConnection.publish`, :meth:`~WireConnection.connect_to_signal`
+and :meth:`~WireConnection.proxy`. It is not a :class:`dbusx.ConnectionBase`,
+because there is no libdbus connection behind it. It does not do
+
+* file descriptor passing: :attr:`~WireConnection.can_send_fds` is always
+  False;
+* message priorities, dispatch budgets and conflation, because messages are
+  dispatched as soon as they are read;
+* signal batches (:mod:`dbusx.batch`), peer upgrades and advertising.
+"""
+
+from __future__ import absolute_import
+
+import os
+import time
+import errno
+import socket
+import select
+import binascii
+import threading
+
+import dbusx
+import dbusx.util
+
+__all__ = ['WireConnection']
+
+#: The default timeout for method calls, in seconds. This is the same as
+#: the libdbus default.
+DEFAULT_TIMEOUT = 25
+
+#: The number of bytes to read at once.
+READ_SIZE = 65536
+
+
+def parse_address(address):
+    """Parse a D-BUS server address into a list of (transport, params)
+    tuples."""
+    result = []
+    for entry in address.split(';'):
+        if not entry:
+            continue
+        transport, sep, rest = entry.partition(':')
+        if not sep:
+            raise ValueError('invalid address: %s' % entry)
+        params = {}
+        for param in rest.split(','):
+            if not param:
+                continue
+            key, sep, value = param.partition('=')
+            if not sep:
+                raise ValueError('invalid address: %s' % entry)
+            params[key] = _unescape(value)
+        result.append((transport, params))
+    return result
+
+
+def _unescape(value):
+    """Unescape a %-escaped address value."""
+    parts = value.split('%')
+    result = [parts[0]]
+    for part in parts[1:]:
+        result.append(chr(int(part[:2], 16)) + part[2:])
+    return ''.join(result)
+
+
+def _connect(address):
+    """Connect a socket to the first reachable address."""
+    error = None
+    for transport, params in parse_address(address):
+        try:
+            if transport == 'unix':
+                sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                if 'path' in params:
+                    path = params['path']
+                elif 'abstract' in params:
+                    path = '\0' + params['abstract']
+                else:
+                    continue
+                try:
+                    sock.connect(path)
+                except socket.error:
+                    sock.close()
+                    raise
+            elif transport == 'tcp':
+                sock = socket.create_connection((params.get('host',
+                            'localhost'), int(params['port'])))
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            else:
+                continue
+        except (socket.error, KeyError, ValueError) as e:
+            error = e
+            continue
+        return sock
+    raise dbusx.Error('could not connect to %s: %s' % (address, error))
+
+
+class WireConnection(object):
+    """A connection to a D-BUS server or bus daemon at *address*.
+
+    The *address* argument is a D-BUS address string, or one of
+    ``dbusx.BUS_SESSION`` and ``dbusx.BUS_SYSTEM``. If *register* is true,
+    the connection registers with the bus daemon by calling Hello. By
+    default, it does so for the session and system bus only.
+
+    Alternatively, *sock* is a connected stream socket. There is no
+    authentication in this case, so the other end must be a
+    :class:`WireConnection` that was created the same way, e.g. with the
+    other socket from ``socket.socketpair()``.
+    """
+
+    def __init__(self, address=None, register=None, sock=None):
+        if sock is not None:
+            register = False
+        elif register is None:
+            register = address in (dbusx.BUS_SESSION, dbusx.BUS_SYSTEM)
+        if address == dbusx.BUS_SESSION:
+            address = os.environ.get('DBUS_SESSION_BUS_ADDRESS')
+            if address is None:
+                raise dbusx.Error('DBUS_SESSION_BUS_ADDRESS is not set')
+        elif address == dbusx.BUS_SYSTEM:
+            address = os.environ.get('DBUS_SYSTEM_BUS_ADDRESS',
+                            'unix:path=/var/run/dbus/system_bus_socket')
+        self.address = address
+        self.unique_name = None
+        self.loop = None
+        self.guid = None
+        self.can_send_fds = False
+        self.logger = dbusx.util.getLogger('dbusx.WireConnection')
+        self.local = self._local()
+        self._serial = 0
+        self._outgoing = []
+        self._wbuf = bytearray()
+        self._rbuf = bytearray()
+        self._pending = {}
+        self._filters = []
+        self._paths = {}
+        self._objects = {}
+        self._signal_handlers = {}
+        self._scheduled = False
+        self._timer = None
+        if sock is not None:
+            self._sock = sock
+        else:
+            self._sock = _connect(address)
+            try:
+                self._authenticate()
+            except Exception:
+                self._sock.close()
+                self._sock = None
+                raise
+        self._sock.setblocking(False)
+        if register:
+            reply = self.call_method(dbusx.SERVICE_DBUS, dbusx.PATH_DBUS,
+                                     dbusx.INTERFACE_DBUS, 'Hello')
+            if reply.type == dbusx.MESSAGE_TYPE_ERROR:
+                raise dbusx.Error(reply.error_name)
+            self.unique_name = reply.args[0]
+
+    def __str__(self):
+        return 'WireConnection(address=%s)' % self.address
+
+    def _readline(self):
+        while b'\r\n' not in self._rbuf:
+            data = self._sock.recv(4096)
+            if not data:
+                raise dbusx.Error('connection closed during authentication')
+            self._rbuf += data
+        line, _, rest = bytes(self._rbuf).partition(b'\r\n')
+        self._rbuf = bytearray(rest)
+        return line.decode('ascii')
+
+    def _authenticate(self):
+        uid = str(os.getuid()).encode('ascii')
+        self._sock.sendall(b'\0AUTH EXTERNAL ' + binascii.hexlify(uid)
+                           + b'\r\n')
+        line = self._readline()
+        if not line.startswith('OK '):
+            raise dbusx.Error('authentication failed: %s' % line)
+        self.guid = line[3:]
+        self._sock.sendall(b'BEGIN\r\n')
+
+    @property
+    def outgoing_size(self):
+        """The number of bytes that were marshalled but not written yet.
+        Messages that were queued since the last write are not included."""
+        return len(self._wbuf)
+
+    @property
+    def dispatch_status(self):
+        """Always ``DISPATCH_COMPLETE``: messages are dispatched as soon as
+        they are read."""
+        return dbusx.DISPATCH_COMPLETE
+
+    def dispatch(self):
+        """Does nothing. Provided for compatibility with
+        :class:`dbusx.ConnectionBase`."""
+        return dbusx.DISPATCH_COMPLETE
+
+    def fileno(self):
+        return self._sock.fileno()
+
+    def set_loop(self, loop):
+        """Integrate with the event loop *loop*."""
+        if self.loop is not None:
+            self.loop.remove_reader(self.fileno())
+            self.loop.remove_writer(self.fileno())
+        self.loop = loop
+        if loop is not None:
+            loop.add_reader(self.fileno(), self._on_readable)
+            if self._outgoing or self._wbuf:
+                self._schedule()
+
+    def _local(self):
+        return threading.local()
+
+    def _spawn(self, function, *args):
+        return function(*args)
+
+    # Sending
+
+    def send(self, message):
+        """Queue *message* for sending, and return its serial.
+
+        Messages are written out when the event loop runs. Without an event
+        loop, they are written by :meth:`flush` and
+        :meth:`read_write_dispatch`.
+        """
+        if self._sock is None:
+            raise dbusx.Error('not connected')
+        if not message.serial:
+            self._serial = self._serial % 0xffffffff + 1
+            message.serial = self._serial
+        self._outgoing.append(message)
+        if self.loop is not None:
+            self._schedule()
+        return message.serial
+
+    def send_with_reply(self, message, callback, timeout=None):
+        """Send a method call *message*, and call *callback* with the
+        reply. If there is no reply within *timeout* seconds, *callback* is
+        called with a locally generated error."""
+        if message.type != dbusx.MESSAGE_TYPE_METHOD_CALL:
+            raise dbusx.Error('expecting a METHOD_CALL message')
+        serial = self.send(message)
+        if timeout is None:
+            timeout = DEFAULT_TIMEOUT
+        self._pending[serial] = (callback, time.time() + timeout)
+        if self.loop is not None and self._timer is None:
+            self._timer = self.loop.call_repeatedly(0.5, self._expire)
+
+    def _schedule(self):
+        if not self._scheduled:
+            self._scheduled = True
+            self.loop.call_soon(self._on_writable)
+
+    def _write(self):
+        """Write as much as possible without blocking. Return whether
+        everything was written."""
+        if self._outgoing:
+            self._wbuf += dbusx.Message.marshal_many(self._outgoing)
+            del self._outgoing[:]
+        while self._wbuf:
+            try:
+                sent = self._sock.send(self._wbuf)
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                    return False
+                self._disconnected()
+                return True
+            del self._wbuf[:sent]
+        return True
+
+    def _on_writable(self):
+        self._scheduled = False
+        if self._sock is None:
+            return
+        if self._write():
+            self.loop.remove_writer(self.fileno())
+        else:
+            self.loop.add_writer(self.fileno(), self._on_writable)
+
+    def flush(self):
+        """Block until all queued messages are written."""
+        while self._sock is not None and not self._write():
+            select.select([], [self._sock], [])
+
+    # Receiving
+
+    def _read(self):
+        """Read what is available and return the complete messages."""
+        while True:
+            try:
+                data = self._sock.recv(READ_SIZE)
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                    break
+                data = b''
+            if not data:
+                self._disconnected()
+                break
+            self._rbuf += data
+            if len(data) < READ_SIZE:
+                break
+        messages, size = dbusx.Message.demarshal_many(self._rbuf)
+        del self._rbuf[:size]
+        return messages
+
+    def _on_readable(self):
+        if self._sock is None:
+            return
+        for message in self._read():
+            self._dispatch(message)
+
+    def read_write_dispatch(self, timeout=None):
+        """Write queued messages, wait at most *timeout* seconds for
+        incoming messages, and dispatch them. A negative timeout waits
+        forever, and no timeout does not wait. Return whether the connection
+        is still open. This is for use without an event loop."""
+        if self._sock is None:
+            return False
+        if timeout is None:
+            timeout = 0
+        elif timeout < 0:
+            timeout = None
+        if self._pending:
+            expires = min(deadline for _, deadline in self._pending.values())
+            secs = max(0, expires - time.time())
+            timeout = secs if timeout is None else min(timeout, secs)
+        self._write()
+        writers = [self._sock] if self._wbuf else []
+        readable, _, _ = select.select([self._sock], writers, [], timeout)
+        if readable:
+            for message in self._read():
+                self._dispatch(message)
+        self._expire()
+        return self._sock is not None
+
+    def _expire(self):
+        now = time.time()
+        for serial, (callback, deadline) in list(self._pending.items()):
+            if deadline <= now:
+                self._reply_error(serial, dbusx.ERROR_NO_REPLY,
+                                  'Did not receive a reply')
+        if not self._pending and self._timer is not None:
+            self._timer.cancel()
+            self._timer = None
+
+    def _reply_error(self, serial, error_name, text):
+        reply = dbusx.Message(dbusx.MESSAGE_TYPE_ERROR, error_name=error_name,
+                              reply_serial=serial)
+        reply.set_args('s', (text,))
+        self._dispatch(reply)
+
+    def _dispatch(self, message):
+        if message.type in (dbusx.MESSAGE_TYPE_METHOD_RETURN,
+                            dbusx.MESSAGE_TYPE_ERROR):
+            pending = self._pending.pop(message.reply_serial, None)
+            if pending is not None:
+                self._call(pending[0], message)
+                return
+        for filter in self._filters[:]:
+            if self._call(filter, self, message):
+                return
+        if message.type != dbusx.MESSAGE_TYPE_METHOD_CALL:
+            return
+        path = message.path
+        while True:
+            handler = self._paths.get(path)
+            if handler is not None and (path == message.path or handler[1]):
+                if self._call(handler[0], self, message):
+                    return
+                break
+            if path == '/':
+                break
+            path = path.rpartition('/')[0] or '/'
+        if not message.no_reply:
+            reply = dbusx.Message(dbusx.MESSAGE_TYPE_ERROR,
+                                  error_name=dbusx.ERROR_UNKNOWN_METHOD,
+                                  reply_serial=message.serial,
+                                  destination=message.sender)
+            self.send(reply)
+
+    def _call(self, callback, *args):
+        try:
+            return callback(*args)
+        except Exception:
+            self.logger.error('uncaught exception in callback', exc_info=True)
+
+    def add_filter(self, filter):
+        """Add a filter. See :meth:`dbusx.ConnectionBase.add_filter`."""
+        self._filters.append(filter)
+
+    def remove_filter(self, filter):
+        """Remove a filter."""
+        self._filters.remove(filter)
+
+    def register_object_path(self, path, handler, fallback=False):
+        """Register an object path handler. See
+        :meth:`dbusx.ConnectionBase.register_object_path`."""
+        if path in self._paths:
+            raise dbusx.Error('path already registered')
+        self._paths[path] = (handler, fallback)
+
+    def unregister_object_path(self, path):
+        """Unregister an object path handler."""
+        if self._paths.pop(path, None) is None:
+            raise dbusx.Error('path not registered')
+
+    # Convenience API, as in dbusx.Connection
+
+    def proxy(self, service, path, interfaces=None):
+        """Return a proxy for a remote object. See
+        :meth:`dbusx.Connection.proxy`."""
+        return dbusx.Proxy(self, service, path, interfaces)
+
+    def connect_to_signal(self, service, path, interface, signal, callback,
+                          conflate=None, args=False, batch=False):
+        """Install a signal handler. See
+        :meth:`dbusx.Connection.connect_to_signal`. The *conflate* and
+        *batch* arguments are accepted for compatibility, and ignored."""
+        if not self._signal_handlers:
+            self.add_filter(self._signal_handler)
+        key = (service, path, interface, signal)
+        self._signal_handlers.setdefault(key, []).append((callback, args))
+        if self.unique_name is None:
+            return
+        rule = "type='signal',sender='%s',path='%s',interface='%s'," \
+               "member='%s'" % key
+        message = dbusx.Message.method_call(dbusx.SERVICE_DBUS,
+                        dbusx.PATH_DBUS, dbusx.INTERFACE_DBUS, 'AddMatch', 's',
+                        (rule,))
+        message.no_reply = True
+        self.send(message)
+
+    def _signal_handler(self, connection, message):
+        if message.type != dbusx.MESSAGE_TYPE_SIGNAL:
+            return False
+        handlers = self._signal_handlers.get((message.sender, message.path,
+                                              message.interface,
+                                              message.member))
+        if handlers is None:
+            return False
+        args = None
+        for callback, with_args in handlers[:]:
+            if not with_args:
+                self._call(callback, message)
+                continue
+            if args is None:
+                args = message.args
+            self._call(callback, message, args)
+        return False
+
+    def publish(self, instance, path):
+        """Publish a Python object. See :meth:`dbusx.Connection.publish`."""
+        if not isinstance(instance, dbusx.Object):
+            instance = dbusx.Object.wrap(instance)
+        instance.register(self, path)
+        stripped = path.rstrip('/*') or '/'
+        self.register_object_path(stripped, instance._process,
+                                  path.endswith('*'))
+        self._objects[stripped] = instance
+
+    def remove(self, path):
+        """Remove a published Python object."""
+        path = path.rstrip('/*') or '/'
+        self.unregister_object_path(path)
+        instance = self._objects.pop(path, None)
+        if instance is not None:
+            instance.unregister(self)
+
+    def call_method(self, service, path, interface, method, signature=None,
+                    args=None, no_reply=False, callback=None, timeout=None):
+        """Call a method. See :meth:`dbusx.Connection.call_method`."""
+        message = dbusx.Message(dbusx.MESSAGE_TYPE_METHOD_CALL,
+                        no_reply=no_reply, destination=service,
+                        path=path, interface=interface, member=method)
+        if signature is not None:
+            message.set_args(signature, args)
+        if callback is not None:
+            self.send_with_reply(message, callback, timeout)
+            return
+        elif no_reply:
+            self.send(message)
+            if not self.loop:
+                self.flush()
+            return
+        replies = []
+        self.send_with_reply(message, replies.append, timeout)
+        while not replies:
+            if self._sock is None:
+                raise dbusx.Error('not connected')
+            if self.loop:
+                self.loop.run_once(0.5)
+                self._expire()
+            else:
+                self.read_write_dispatch(-1)
+        return replies[0]
+
+    def close(self):
+        """Close the connection."""
+        for instance in self._objects.values():
+            instance.unregister(self)
+        self._objects.clear()
+        self._paths.clear()
+        if self._sock is not None:
+            try:
+                self._write()
+            except dbusx.Error:
+                pass
+        self._disconnected()
+
+    def _disconnected(self):
+        if self._sock is None:
+            return
+        if self.loop is not None:
+            self.loop.remove_reader(self.fileno())
+            self.loop.remove_writer(self.fileno())
+        self._sock.close()
+        self._sock = None
+        if self._timer is not None:
+            self._timer.cancel()
+            self._timer = None
+        for serial in list(self._pending):
+            self._reply_error(serial, dbusx.ERROR_DISCONNECTED,
+                              'Connection was disconnected before a reply '
+                              'was received')